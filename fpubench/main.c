@@ -0,0 +1,90 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/* Measures what context switches cost once the FPU gets involved.
+ * Each workload runs once alone and once in two processes at the same time, and
+ * whatever the pair takes beyond twice the single run went into switching. The
+ * integer workload never touches the FPU, while with the SSE one every switch goes
+ * through #NM and a save/restore of the FPU state, so the gap between the two is
+ * what the lazy switching costs per run.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERATIONS	50000000UL
+
+static volatile unsigned long int_sink;
+static volatile double fp_sink;
+
+static void spin_int(unsigned long iterations)
+{
+	unsigned long x = 1;
+	for(unsigned long i = 0; i < iterations; i++)
+		x = x * 6364136223846793005UL + i;
+	int_sink = x;
+}
+static void spin_sse(unsigned long iterations)
+{
+	double x = 1.0;
+	for(unsigned long i = 0; i < iterations; i++)
+		x = x * 0.999999 + 1.0;
+	fp_sink = x;
+}
+static long elapsed_us(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+/* Runs fn in one process, or in two at once, returns the wall clock time in microseconds */
+static long run(void (*fn)(unsigned long), unsigned long iterations, int pair)
+{
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	pid_t pid = 1;
+	if(pair)
+	{
+		pid = fork();
+		if(pid < 0)
+		{
+			perror("fork");
+			exit(1);
+		}
+	}
+	fn(iterations);
+	if(pid == 0)
+		exit(0);
+	if(pair)
+	{
+		int status;
+		wait(&status);
+	}
+	gettimeofday(&end, NULL);
+	return elapsed_us(&start, &end);
+}
+/* Two processes sharing the CPU should take twice as long as one, the rest is switching */
+static void report(const char *name, void (*fn)(unsigned long), unsigned long iterations)
+{
+	long single = run(fn, iterations, 0);
+	long pair = run(fn, iterations, 1);
+	printf("%s: %ld us alone, %ld us in pairs, %ld us spent switching\n", name, single, pair, pair - 2 * single);
+}
+int main(int argc, char **argv)
+{
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	if(argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+	printf("fpubench: %lu iterations per process\n", iterations);
+	report("integer", spin_int, iterations);
+	report("sse", spin_sse, iterations);
+	return 0;
+}
@@ -23,10 +23,16 @@ rm -f sysroot/boot/vmspartix
 tar -cvf $ROOTDIR/isodir/boot/initrd.tar sysroot
 echo "Compressing kernel and initrd images"
 xz -9 -e -f isodir/boot/vmspartix
-xz -9 -e -f isodir/boot/initrd.tar
+# The kernel decompresses LZ4 initrds itself, while it indexes them. xz is left to GRUB.
+if command -v lz4 > /dev/null 2>&1; then
+	lz4 -9 --content-size -f isodir/boot/initrd.tar isodir/boot/initrd.img
+	rm -f isodir/boot/initrd.tar
+else
+	xz -9 -e -f isodir/boot/initrd.tar
+	mv isodir/boot/initrd.tar.xz isodir/boot/initrd.img
+fi
 echo "Testing the initrd and kernel integrity"
 xz -t isodir/boot/vmspartix.xz
-xz -t isodir/boot/initrd.tar.xz
 cat > isodir/boot/grub/grub.cfg << EOF
 menuentry "Spartix" {
 	set timeout=10
@@ -42,7 +48,7 @@ menuentry "Spartix" {
 	echo "done."
 	set gfxpayload=1024x768x32
 	echo "Loading the initrd"
-	module2 /boot/initrd.tar.xz
+	module2 /boot/initrd.img
 	echo "done."
 	boot
 }
@@ -12,6 +12,9 @@
 #include <kernel/idt.h>
 #include <acpi.h>
 #include <kernel/panic.h>
+#include <kernel/spinlock.h>
+#include <kernel/paging.h>
+#include <errno.h>
 
 volatile uint32_t *lapic = NULL;
 uint32_t volatile *lapic_eoi = NULL;
@@ -50,6 +53,20 @@ void lapic_init()
 	lapic_ipiid = (uint32_t volatile*)((char *)lapic + 0x310);
 	lapic_icr = (uint32_t volatile*)((char *)lapic + 0x300);
 }
+/* The APs are never started, so the BSP is the only CPU that can take interrupts */
+unsigned int apic_get_cpu_count()
+{
+	return 1;
+}
+unsigned int apic_get_current_cpu()
+{
+	return 0;
+}
+uint32_t apic_get_lapic_id(unsigned int cpu)
+{
+	(void) cpu;
+	return lapic[0x20 / 4] >> 24;
+}
 void send_ipi(uint8_t id, uint32_t type, uint32_t page)
 {
 	*lapic_ipiid |= (uint32_t)id << 24;
@@ -70,6 +87,12 @@ void wake_up_processor(uint8_t lapicid)
 
 volatile char *ioapic_base = NULL;
 ACPI_TABLE_MADT *madt = NULL;
+static uint32_t ioapic_gsi_base = 0;
+static unsigned int ioapic_pins = 0;
+/* Where each ISA IRQ ends up after the MADT's overrides, and how it's signalled there */
+static uint32_t isa_gsi[16];
+static uint64_t isa_flags[16];
+static spinlock_t ioapic_spl;
 uint32_t read_io_apic(uint32_t reg)
 {
 	uint32_t volatile *ioapic = (uint32_t volatile*)ioapic_base;
@@ -94,62 +117,138 @@ void write_redirection_entry(uint32_t pin, uint64_t value)
 	write_io_apic(0x10 + pin * 2, value & 0x00000000FFFFFFFF);
 	write_io_apic(0x10 + pin * 2 + 1, value >> 32);
 }
+/* Programs the redirection table. ISA IRQs without an override are identity mapped, active high
+ * and edge triggered; each one gets its usual vector and is left masked, going to the BSP.
+*/
 void set_pin_handlers()
 {
-	// The MADT's signature is "APIC"
-	ACPI_STATUS st = AcpiGetTable((ACPI_STRING)"APIC", 0, (ACPI_TABLE_HEADER**)&madt);
-	if(ACPI_FAILURE(st))
-		panic("Failed to get the MADT");
-	printf("MADT: %p\n", madt);
-	ACPI_SUBTABLE_HEADER *first = (ACPI_SUBTABLE_HEADER *)madt+1;
-	for(int i = 0; i < 24; i++)
+	uint16_t overridden = 0;
+	for(int i = 0; i < 16; i++)
 	{
-		if(i <= 15)
-		{
-			// ISA Interrupt, set it like a standard ISA interrupt
-			/*
-			* ISA Interrupts have the following attributes:
-			* - Active High
-			* - Edge triggered
-			* - Fixed delivery mode
-			* They might be overwriten by the ISO descriptors in the MADT
-			*/
-			uint64_t entry = 0;
-			entry |= 32 + i;
-			write_redirection_entry(i, entry);
-		}
-		if(i > 15 && i <= 19)
-		{
-			// Maybe add a different behavior when we can? (After porting the PCI drivers)
-			uint64_t entry = read_redirection_entry(i);
-			write_redirection_entry(i, entry | (32 + i));
-		}
-		uint64_t entry = read_redirection_entry(i);
-		write_redirection_entry(i, entry | (32 + i));
+		isa_gsi[i] = i;
+		isa_flags[i] = 0;
 	}
+	ACPI_SUBTABLE_HEADER *first = (ACPI_SUBTABLE_HEADER*)(madt + 1);
 	for(ACPI_SUBTABLE_HEADER *i = first; i < (ACPI_SUBTABLE_HEADER*)((char*)madt + madt->Header.Length); i = 
 	(ACPI_SUBTABLE_HEADER*)((uint64_t)i + (uint64_t)i->Length))
 	{
-		if(i->Type == 2)
-		{
-			ACPI_MADT_INTERRUPT_OVERRIDE *mio = (ACPI_MADT_INTERRUPT_OVERRIDE*)i;
-			printf("Interrupt override for GSI %d\n", mio->SourceIrq);
-			uint64_t red = read_redirection_entry(mio->GlobalIrq);
-			red |= 32 + mio->GlobalIrq;
-			if(mio->IntiFlags & 0x3)
-				red |= (1 << 13);
-			if(mio->IntiFlags & 0b1100)
-				red |= (1 << 15);
-			write_redirection_entry(mio->GlobalIrq, red);
-		}
+		if(i->Type != ACPI_MADT_TYPE_INTERRUPT_OVERRIDE)
+			continue;
+		ACPI_MADT_INTERRUPT_OVERRIDE *mio = (ACPI_MADT_INTERRUPT_OVERRIDE*)i;
+		if(mio->SourceIrq >= 16)
+			continue;
+		printf("ioapic: IRQ %u is GSI %u\n", mio->SourceIrq, mio->GlobalIrq);
+		uint64_t flags = 0;
+		if((mio->IntiFlags & ACPI_MADT_POLARITY_MASK) == ACPI_MADT_POLARITY_ACTIVE_LOW)
+			flags |= IOAPIC_REDIR_ACTIVE_LOW;
+		if((mio->IntiFlags & ACPI_MADT_TRIGGER_MASK) == ACPI_MADT_TRIGGER_LEVEL)
+			flags |= IOAPIC_REDIR_LEVEL;
+		isa_gsi[mio->SourceIrq] = mio->GlobalIrq;
+		isa_flags[mio->SourceIrq] = flags;
+		overridden |= 1 << mio->SourceIrq;
 	}
-	
+	/* An IRQ whose pin went to another one is gone, like IRQ 2 when the timer is moved there */
+	for(int i = 0; i < 16; i++)
+	{
+		if(!(overridden & (1 << i)))
+			continue;
+		uint32_t gsi = isa_gsi[i];
+		if(gsi < 16 && gsi != (uint32_t) i && !(overridden & (1 << gsi)))
+			isa_gsi[gsi] = IOAPIC_NO_GSI;
+	}
+	for(unsigned int pin = 0; pin < ioapic_pins; pin++)
+		write_redirection_entry(pin, IOAPIC_REDIR_MASKED);
+	uint64_t dest = (uint64_t) apic_get_lapic_id(0) << IOAPIC_REDIR_DEST_SHIFT;
+	for(int i = 0; i < 16; i++)
+	{
+		uint32_t gsi = isa_gsi[i];
+		if(gsi == IOAPIC_NO_GSI || gsi < ioapic_gsi_base || gsi - ioapic_gsi_base >= ioapic_pins)
+			continue;
+		write_redirection_entry(gsi - ioapic_gsi_base, dest | IOAPIC_REDIR_MASKED | isa_flags[i] | (32 + i));
+	}
+}
+uint32_t ioapic_irq_to_gsi(int irq)
+{
+	if(irq < 0 || irq >= 16)
+		return IOAPIC_NO_GSI;
+	return isa_gsi[irq];
 }
-void ioapic_init()
+/* Returns the pin the GSI is on, or -1 if it isn't this I/O APIC's */
+static int ioapic_gsi_pin(uint32_t gsi)
 {
-	ioapic_base = (volatile char*)vmm_allocate_virt_address(VM_KERNEL, 1, VMM_TYPE_REGULAR, VMM_TYPE_HW);
-	if(!ioapic_base)
+	if(!ioapic_base || gsi == IOAPIC_NO_GSI || gsi < ioapic_gsi_base || gsi - ioapic_gsi_base >= ioapic_pins)
+		return -1;
+	return gsi - ioapic_gsi_base;
+}
+static void ioapic_set_mask(int irq, int masked)
+{
+	int pin = ioapic_gsi_pin(ioapic_irq_to_gsi(irq));
+	if(pin < 0)
+		return;
+	unsigned long flags = spin_lock_irqsave(&ioapic_spl);
+	uint64_t entry = read_redirection_entry(pin);
+	if(masked)
+		entry |= IOAPIC_REDIR_MASKED;
+	else
+		entry &= ~IOAPIC_REDIR_MASKED;
+	write_redirection_entry(pin, entry);
+	spin_unlock_irqrestore(&ioapic_spl, flags);
+}
+void ioapic_unmask_irq(int irq)
+{
+	ioapic_set_mask(irq, 0);
+}
+void ioapic_mask_irq(int irq)
+{
+	ioapic_set_mask(irq, 1);
+}
+/* Sends whatever comes in on the GSI to the cpu */
+int ioapic_set_affinity(uint32_t gsi, unsigned int cpu)
+{
+	int pin = ioapic_gsi_pin(gsi);
+	if(pin < 0)
+		return errno = EINVAL, -1;
+	uint64_t dest = (uint64_t) apic_get_lapic_id(cpu % apic_get_cpu_count()) << IOAPIC_REDIR_DEST_SHIFT;
+	unsigned long flags = spin_lock_irqsave(&ioapic_spl);
+	uint64_t entry = read_redirection_entry(pin);
+	entry &= ~(0xFFULL << IOAPIC_REDIR_DEST_SHIFT);
+	write_redirection_entry(pin, entry | dest);
+	spin_unlock_irqrestore(&ioapic_spl, flags);
+	return 0;
+}
+/* Only the I/O APIC that has GSI 0 is used, which is the only one on most machines */
+int ioapic_init()
+{
+	// The MADT's signature is "APIC"
+	ACPI_STATUS st = AcpiGetTable((ACPI_STRING)"APIC", 0, (ACPI_TABLE_HEADER**)&madt);
+	if(ACPI_FAILURE(st))
+		return errno = ENODEV, -1;
+	printf("MADT: %p\n", madt);
+	uintptr_t phys = 0;
+	ACPI_SUBTABLE_HEADER *first = (ACPI_SUBTABLE_HEADER*)(madt + 1);
+	for(ACPI_SUBTABLE_HEADER *i = first; i < (ACPI_SUBTABLE_HEADER*)((char*)madt + madt->Header.Length); i = 
+	(ACPI_SUBTABLE_HEADER*)((uint64_t)i + (uint64_t)i->Length))
+	{
+		if(i->Type != ACPI_MADT_TYPE_IO_APIC)
+			continue;
+		ACPI_MADT_IO_APIC *io = (ACPI_MADT_IO_APIC*)i;
+		if(io->GlobalIrqBase)
+			continue;
+		phys = io->Address;
+		ioapic_gsi_base = io->GlobalIrqBase;
+		break;
+	}
+	if(!phys)
+		return errno = ENODEV, -1;
+	char *base = vmm_allocate_virt_address(VM_KERNEL, 1, VMM_TYPE_HW, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+	if(!base)
 		panic("Virtual memory allocation for the I/O APIC failed!");
-	paging_map_phys_to_virt((uintptr_t)ioapic_base, IOAPIC_BASE_PHYS, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+	paging_map_phys_to_virt((uintptr_t)base, phys & ~(PAGE_SIZE - 1), VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+	ioapic_base = base + (phys & (PAGE_SIZE - 1));
+	ioapic_pins = ((read_io_apic(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+	printf("ioapic: at %p, %u pins\n", phys, ioapic_pins);
 	set_pin_handlers();
+	/* The PIC's interrupts come in through LINT0, which has to stay quiet from now on */
+	lapic[LAPIC_LVT_LINT0 / 4] |= LAPIC_LVT_MASKED;
+	return 0;
 }
@@ -26,7 +26,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <kernel/pic.h>
+#include <kernel/apic.h>
 static cpu_t cpu;
+/* Read by the user copy routines, which only use stac/clac when the CPU knows them */
+uint8_t cpu_has_smap = 0;
 
 char *cpu_get_name()
 {
@@ -88,8 +91,16 @@ void cpu_identify()
 		printf("Name: %s\n",cpu.brandstr);
 	cpu_get_sign();
 	printf("Stepping %i, Model %i, Family %i\n",cpu.stepping,cpu.model,cpu.family);
+	if(__get_cpuid_max(0, NULL) >= CPUID_FEATURES_EXT)
+	{
+		uint32_t eax, ebx, ecx, edx;
+		__cpuid_count(CPUID_FEATURES_EXT, 0, eax, ebx, ecx, edx);
+		cpu_has_smap = ebx & CPUID_FEATURES_EXT_SMAP ? 1 : 0;
+	}
 }
 void cpu_init_interrupts()
 {
 	pic_remap();
+	/* MSIs go straight to the local APIC, which ignores them until it's enabled */
+	lapic_init();
 }
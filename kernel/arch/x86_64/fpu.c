@@ -0,0 +1,160 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: fpu.c
+ *
+ * Description: Lazy saving and restoring of the x87/SSE/AVX state. The state
+ * stays in the registers until another thread actually uses them, which we notice
+ * through the #NM exception CR0.TS causes.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cpuid.h>
+
+#include <kernel/fpu.h>
+#include <kernel/panic.h>
+
+static int has_xsave = 0;
+static int has_xsaveopt = 0;
+static uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+static size_t fpu_area_size = FXSAVE_AREA_SIZE;
+/* The thread whose state is currently loaded in the registers */
+static thread_t *fpu_owner = NULL;
+
+static inline void fpu_set_ts()
+{
+	uint64_t cr0;
+	asm volatile("mov %%cr0, %0" : "=r"(cr0));
+	asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS));
+}
+static inline void fpu_clear_ts()
+{
+	asm volatile("clts");
+}
+static void fpu_save(void *area)
+{
+	if(has_xsaveopt)
+		asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"((uint32_t) xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+	else if(has_xsave)
+		asm volatile("xsave64 (%0)" :: "r"(area), "a"((uint32_t) xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+	else
+		asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+}
+static void fpu_restore(void *area)
+{
+	if(has_xsave)
+		asm volatile("xrstor64 (%0)" :: "r"(area), "a"((uint32_t) xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+	else
+		asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+}
+static void *fpu_alloc_area()
+{
+	/* xsave needs 64 byte alignment, so over-allocate and keep the real pointer right before the area */
+	char *raw = malloc(fpu_area_size + 64 + sizeof(void*));
+	if(!raw)
+		return NULL;
+	char *area = (char*)(((uintptr_t) raw + sizeof(void*) + 63) & ~(uintptr_t) 63);
+	((void**) area)[-1] = raw;
+	/* The xsave header has to be zeroed before the first xrstor */
+	memset(area, 0, fpu_area_size);
+	return area;
+}
+static void fpu_free_area(void *area)
+{
+	if(area)
+		free(((void**) area)[-1]);
+}
+void fpu_init()
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if(ecx & CPUID_1_ECX_XSAVE)
+	{
+		has_xsave = 1;
+		if(ecx & CPUID_1_ECX_AVX)
+			xcr0 |= XCR0_AVX;
+		uint64_t cr4;
+		asm volatile("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_OSXSAVE));
+		asm volatile("xsetbv" :: "c"(0), "a"((uint32_t) xcr0), "d"((uint32_t)(xcr0 >> 32)));
+		/* With XCR0 set, ebx holds the size needed for the enabled features */
+		__cpuid_count(CPUID_XSAVE_LEAF, 0, eax, ebx, ecx, edx);
+		fpu_area_size = ebx;
+		__cpuid_count(CPUID_XSAVE_LEAF, 1, eax, ebx, ecx, edx);
+		has_xsaveopt = eax & CPUID_D_1_EAX_XSAVEOPT;
+	}
+	/* Nobody owns the FPU yet, so the first thread to use it traps */
+	fpu_set_ts();
+}
+/* #NM handler: hands the registers over to the current thread */
+void fpu_handle_nm()
+{
+	thread_t *current = get_current_thread();
+	fpu_clear_ts();
+	/* Before the scheduler starts there's nobody to hand the registers to */
+	if(!current || fpu_owner == current)
+		return;
+	if(fpu_owner)
+		fpu_save(fpu_owner->fpu_area);
+	if(!current->fpu_area)
+	{
+		/* First use, start from a clean state. fninit only resets the x87 side and would leave
+		 * the previous owner's XMM/YMM registers behind, so load a zeroed image instead. With
+		 * the xsave header all zero, every component comes up in its initial state.
+		*/
+		current->fpu_area = fpu_alloc_area();
+		if(!current->fpu_area)
+			panic("OOM while allocating the FPU state");
+		*(uint16_t*)((char*) current->fpu_area + FXSAVE_FCW_OFFSET) = FCW_DEFAULT;
+		*(uint32_t*)((char*) current->fpu_area + FXSAVE_MXCSR_OFFSET) = MXCSR_DEFAULT;
+	}
+	fpu_restore(current->fpu_area);
+	fpu_owner = current;
+}
+/* Called on every context switch. Threads that don't own the registers get CR0.TS,
+ * so the state only moves when someone actually uses SIMD.
+*/
+void fpu_switch_thread(thread_t *next)
+{
+	if(next == fpu_owner)
+		fpu_clear_ts();
+	else
+		fpu_set_ts();
+}
+void fpu_fork_thread(thread_t *child, thread_t *parent)
+{
+	child->fpu_area = NULL;
+	if(!parent->fpu_area)
+		return;
+	if(parent == fpu_owner)
+	{
+		fpu_clear_ts();
+		fpu_save(parent->fpu_area);
+		if(get_current_thread() != parent)
+			fpu_set_ts();
+	}
+	child->fpu_area = fpu_alloc_area();
+	if(!child->fpu_area)
+		panic("OOM while allocating the FPU state");
+	memcpy(child->fpu_area, parent->fpu_area, fpu_area_size);
+}
+void fpu_destroy_thread(thread_t *thread)
+{
+	if(fpu_owner == thread)
+		fpu_owner = NULL;
+	fpu_free_area(thread->fpu_area);
+	thread->fpu_area = NULL;
+}
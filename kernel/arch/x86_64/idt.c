@@ -10,6 +10,7 @@
  *----------------------------------------------------------------------*/
 #include <string.h>
 #include <kernel/idt.h>
+#include <kernel/irq.h>
 idt_ptr_t idt_ptr;
 idt_entry_t idt_entries[256];
 void idt_flush(uint64_t);
@@ -66,7 +67,12 @@ void idt_init()
 	idt_create_descriptor(45, (uint64_t) irq13, 0x08, 0x8E);
 	idt_create_descriptor(46, (uint64_t) irq14, 0x08, 0x8E);
 	idt_create_descriptor(47, (uint64_t) irq15, 0x08, 0x8E);
+	/* Everything else is free for MSIs */
+	for(int i = IRQ_VECTOR_BASE; i < 256; i++)
+		idt_create_descriptor(i, (uint64_t) irq_vector_stubs + (i - IRQ_VECTOR_BASE) * IRQ_VECTOR_STUB_SIZE,
+		0x08, 0x8E);
 	idt_create_descriptor(128, (uint64_t)__syscall_int, 0x08, 0x8E);
+	idt_create_descriptor(129, (uint64_t)sched_yield_int, 0x08, 0x8E);
 	idt_load();
 }
 
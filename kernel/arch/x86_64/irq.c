@@ -24,28 +24,35 @@
 #include <kernel/irq.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <kernel/spinlock.h>
+#include <kernel/apic.h>
 
 irq_list_t *irq_routines[16]  =
 {
     0, 0, 0, 0, 0, 0, 0, 0,
     0, 0, 0, 0, 0, 0, 0, 0
 };
+static spinlock_t irq_spl;
 void irq_install_handler(int irq, irq_t handler)
 {
+	irq_list_t *new = (irq_list_t*)malloc(sizeof(irq_list_t));
+	if(!new)
+		return;
+	new->handler = handler;
+	new->next = NULL;
+	/* Drivers probe concurrently, and the handler can't see a half-linked list */
+	unsigned long flags = spin_lock_irqsave(&irq_spl);
 	irq_list_t *lst = irq_routines[irq];
 	if(!lst)
+		irq_routines[irq] = new;
+	else
 	{
-		lst = (irq_list_t*)malloc(sizeof(irq_list_t));
-		memset(lst, 0, sizeof(irq_list_t));
-		lst->handler = handler;
-		irq_routines[irq] = lst;
-		return;
+		while(lst->next != NULL)
+			lst = lst->next;
+		lst->next = new;
 	}
-	while(lst->next != NULL)
-		lst = lst->next;
-	lst->next = (irq_list_t*)malloc(sizeof(irq_list_t));
-	lst->next->handler = handler;
-	lst->next->next = NULL;
+	spin_unlock_irqrestore(&irq_spl, flags);
 }
 void irq_uninstall_handler(int irq, irq_t handler)
 {
@@ -65,6 +72,62 @@ void irq_uninstall_handler(int irq, irq_t handler)
 	free(list);
 	prev->next = list->next;
 }
+/* Whether the legacy IRQs come from the I/O APIC, rather than the PIC */
+static int irq_ioapic = 0;
+/* Lines drivers asked for, so they can be carried over when the I/O APIC takes over */
+static uint16_t irq_unmasked = 0;
+void irq_unmask(int irq)
+{
+	unsigned long flags = spin_lock_irqsave(&irq_spl);
+	irq_unmasked |= 1 << irq;
+	if(irq_ioapic)
+		ioapic_unmask_irq(irq);
+	else
+		pic_unmask_irq(irq);
+	spin_unlock_irqrestore(&irq_spl, flags);
+}
+void irq_mask(int irq)
+{
+	unsigned long flags = spin_lock_irqsave(&irq_spl);
+	irq_unmasked &= ~(1 << irq);
+	if(irq_ioapic)
+		ioapic_mask_irq(irq);
+	else
+		pic_mask_irq(irq);
+	spin_unlock_irqrestore(&irq_spl, flags);
+}
+void irq_send_eoi(int irq)
+{
+	if(irq_ioapic)
+		lapic_send_eoi();
+	else
+		pic_send_eoi(irq);
+}
+/* Sends the line's interrupts to the cpu. The PIC can only interrupt the BSP. */
+int irq_set_affinity(int irq, unsigned int cpu)
+{
+	if(!irq_ioapic)
+		return errno = ENOSYS, -1;
+	return ioapic_set_affinity(ioapic_irq_to_gsi(irq), cpu);
+}
+/* Moves the legacy IRQs from the PIC over to the I/O APIC, and masks the PIC off for good */
+void irq_init_ioapic()
+{
+	if(ioapic_init() < 0)
+	{
+		printf("irq: no I/O APIC, staying on the PIC\n");
+		return;
+	}
+	unsigned long flags = spin_lock_irqsave(&irq_spl);
+	for(int i = 0; i < 16; i++)
+	{
+		if(irq_unmasked & (1 << i))
+			ioapic_unmask_irq(i);
+	}
+	pic_disable();
+	irq_ioapic = 1;
+	spin_unlock_irqrestore(&irq_spl, flags);
+}
 void irq_handler(uint64_t irqn)
 {
 	irq_list_t *handlers = irq_routines[irqn - 32];
@@ -73,5 +136,52 @@ void irq_handler(uint64_t irqn)
 		irq_t handler = i->handler;
 		handler();
 	}
-	pic_send_eoi(irqn - 32);
-}
\ No newline at end of file
+	irq_send_eoi(irqn - 32);
+}
+typedef struct
+{
+	irq_vector_t handler;
+	void *ctx;
+	unsigned int cpu;
+} irq_vector_desc_t;
+static irq_vector_desc_t irq_vectors[256];
+int irq_allocate_vector(irq_vector_t handler, void *ctx, unsigned int cpu)
+{
+	unsigned long flags = spin_lock_irqsave(&irq_spl);
+	for(int i = IRQ_VECTOR_BASE; i < IRQ_VECTOR_SPURIOUS; i++)
+	{
+		/* The system call and the yield are software interrupts */
+		if(i == 0x80 || i == 0x81 || irq_vectors[i].handler)
+			continue;
+		irq_vectors[i].ctx = ctx;
+		irq_vectors[i].cpu = cpu % apic_get_cpu_count();
+		irq_vectors[i].handler = handler;
+		spin_unlock_irqrestore(&irq_spl, flags);
+		return i;
+	}
+	spin_unlock_irqrestore(&irq_spl, flags);
+	return errno = ENOSPC, -1;
+}
+/* The device has to have stopped sending it by now */
+void irq_free_vector(int vector)
+{
+	unsigned long flags = spin_lock_irqsave(&irq_spl);
+	irq_vectors[vector].handler = NULL;
+	irq_vectors[vector].ctx = NULL;
+	spin_unlock_irqrestore(&irq_spl, flags);
+}
+/* APIC ID a message for the vector has to be addressed to */
+uint32_t irq_vector_destination(int vector)
+{
+	return apic_get_lapic_id(irq_vectors[vector].cpu);
+}
+void irq_vector_handler(uint64_t vector)
+{
+	/* Spurious interrupts aren't in service, so they don't get an EOI */
+	if(vector == IRQ_VECTOR_SPURIOUS)
+		return;
+	irq_vector_desc_t *desc = &irq_vectors[vector];
+	if(desc->handler)
+		desc->handler(desc->ctx);
+	lapic_send_eoi();
+}
@@ -14,6 +14,10 @@
 #include <stdbool.h>
 #include <kernel/task_switching.h>
 #include <kernel/vmm.h>
+#include <kernel/filemap.h>
+#include <kernel/registers.h>
+#include <kernel/usercopy.h>
+#include <kernel/fpu.h>
 static uint64_t faulting_address;
 const char* exception_msg[] = {
     "Division by zero exception",
@@ -61,7 +65,16 @@ static inline bool is_recursive_fault()
 {
 	return faulting;
 }
-void isr_handler(uint64_t err_code, uint64_t int_no)
+uintptr_t search_exception_table(uintptr_t insn)
+{
+	for(ex_table_entry_t *e = __start_ex_table; e < __stop_ex_table; e++)
+	{
+		if(e->insn == insn)
+			return e->fixup;
+	}
+	return 0;
+}
+void isr_handler(uint64_t err_code, uint64_t int_no, intctx_t *ctx)
 {
 	if(is_recursive_fault())
 	{
@@ -98,7 +111,8 @@ void isr_handler(uint64_t err_code, uint64_t int_no)
 			break;
 		}
 	case 7:{
-			printf(exception_msg[int_no]);
+			/* CR0.TS was set on the last context switch, give the thread its FPU state */
+			fpu_handle_nm();
 			break;
 		}
 	case 8:{
@@ -137,6 +151,16 @@ void isr_handler(uint64_t err_code, uint64_t int_no)
 		if(!entr)
 		{
 		pf:
+			/* The kernel faulted on purpose while copying from or to user memory */
+			if(!(err_code & 0x4))
+			{
+				uintptr_t fixup = search_exception_table(ctx->rip);
+				if(fixup)
+				{
+					ctx->rip = fixup;
+					break;
+				}
+			}
 			printf("%s0x%X\n",exception_msg[int_no],faulting_address);
 			if(err_code & 0x2)
 				printf(" caused by a write\n");
@@ -154,7 +178,13 @@ void isr_handler(uint64_t err_code, uint64_t int_no)
 			goto pf;
 		if(err_code & 0x4 && faulting_address > 0xFFFF800000000000)
 			goto pf;
-		vmm_map_range((void*)faulting_address, 1, entr->rwx);
+		if(entr->file)
+		{
+			if(filemap_fault(entr, faulting_address, err_code & 0x1, err_code & 0x2) < 0)
+				goto pf;
+			break;
+		}
+		vmm_map_range((void*)(faulting_address & ~(PAGE_SIZE - 1)), 1, entr->rwx);
 		}
 	case 15:{
 			break;	/*Reserved exception */
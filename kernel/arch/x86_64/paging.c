@@ -12,9 +12,13 @@
 #include <stdio.h>
 #include <kernel/vmm.h>
 #include <kernel/panic.h>
+#include <kernel/spinlock.h>
+#include <kernel/pagecache.h>
 static _Bool is_spawning = 0;
 PML4 *spawning_pml = NULL;
 #define PML_EXTRACT_ADDRESS(n) (n & 0x0FFFFFFFFFFFF000)
+/* One of the bits left for the OS, set on pages whose frame isn't ours to free (see VMM_NOFREE) */
+#define PML1_NOFREE (1 << 9)
 inline void __native_tlb_invalidate_page(void *addr)
 {
 	__asm__ __volatile__("invlpg %0"::"m"(addr));
@@ -89,7 +93,12 @@ void *virtual2phys(void *ptr)
 	else
 		pml4 = (PML4*)((uint64_t)spawning_pml + PHYS_BASE);
 	PML3 *pml3 = (PML3*)((pml4->entries[dec.pml4] & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
+	/* The physical memory map uses 1GB pages, and the boot code 2MB ones */
+	if(pml3->entries[dec.pdpt] & (1 << 7))
+		return (void *)((pml3->entries[dec.pdpt] & 0x000FFFFFC0000000) + ((uintptr_t) ptr & 0x3FFFFFFF));
 	PML2 *pml2 = (PML2*)((pml3->entries[dec.pdpt] & 0x0FFFFFFFFFFFF000)+ PHYS_BASE);
+	if(pml2->entries[dec.pd] & (1 << 7))
+		return (void *)((pml2->entries[dec.pd] & 0x000FFFFFFFE00000) + ((uintptr_t) ptr & 0x1FFFFF));
 	PML1 *pml1 = (PML1*)((pml2->entries[dec.pd] & 0x0FFFFFFFFFFFF000)+ PHYS_BASE);
 	return (void *)((pml1->entries[dec.pt] & 0x0FFFFFFFFFFFF000) + dec.offsetFromPage);
 }
@@ -123,7 +132,8 @@ void paging_map_all_phys(size_t bytes)
 		__native_tlb_invalidate_page((void*)(virt + mapped));
 	}
 }
-void* paging_map_phys_to_virt(uint64_t virt, uint64_t phys, uint64_t prot)
+static spinlock_t paging_spl;
+static void *__paging_map_phys_to_virt(uint64_t virt, uint64_t phys, uint64_t prot)
 {
 	_Bool user = 0;
 	if (virt < 0x00007fffffffffff)
@@ -179,9 +189,16 @@ void* paging_map_phys_to_virt(uint64_t virt, uint64_t phys, uint64_t prot)
 	}
 	pml1 = (PML1*)((uint64_t)pml1 + PHYS_BASE);
 	entry = &pml1->entries[decAddr.pt];
-	*entry = make_pml1e( phys, (prot & 4) ? 1 : 0, 0, (prot & 0x2) ? 1 : 0, 0, 0, (prot & 0x80) ? 1 : 0, (prot & 1) ? 1 : 0, 1);
+	*entry = make_pml1e( phys, (prot & 4) ? 1 : 0, (prot & VMM_NOFREE) ? 1 : 0, (prot & 0x2) ? 1 : 0, 0, 0, (prot & 0x80) ? 1 : 0, (prot & 1) ? 1 : 0, 1);
 	return (void*)virt;
 }
+void* paging_map_phys_to_virt(uint64_t virt, uint64_t phys, uint64_t prot)
+{
+	unsigned long flags = spin_lock_irqsave(&paging_spl);
+	void *ret = __paging_map_phys_to_virt(virt, phys, prot);
+	spin_unlock_irqrestore(&paging_spl, flags);
+	return ret;
+}
 void paging_unmap(void* memory)
 {
 	decomposed_addr_t dec;
@@ -192,13 +209,23 @@ void paging_unmap(void* memory)
 	else
 		pml4 = (PML4*)((uint64_t)spawning_pml + PHYS_BASE);
 	uint64_t* entry = &pml4->entries[dec.pml4];
+	if(!(*entry & 1))
+		return;
 	PML3 *pml3 = (PML3*)((*entry & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
 	entry = &pml3->entries[dec.pdpt];
+	if(!(*entry & 1))
+		return;
 	PML2 *pml2 = (PML2*)((*entry & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
 	entry = &pml2->entries[dec.pd];
+	if(!(*entry & 1))
+		return;
 	PML1 *pml1 = (PML1*)((*entry & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
 	entry = &pml1->entries[dec.pt];
-	pfree(1, entry);
+	/* Demand-paged areas can have holes, and page cache frames aren't ours, the cache only gets told */
+	if(*entry & 1 && !(*entry & PML1_NOFREE))
+		pfree(1, (void*) PML_EXTRACT_ADDRESS(*entry));
+	else if(*entry & 1)
+		pagecache_unmap_frame(PML_EXTRACT_ADDRESS(*entry));
 	*entry = 0;
 }
 PML4 *paging_clone_as()
@@ -250,10 +277,13 @@ PML4 *paging_fork_as()
 							PML1 *pml1 = (PML1*)paging_fork_pml((PML4*)pml2, k);
 							for(int l = 0; l < PAGE_TABLE_ENTRIES; l++)
 							{
-								if(pml1->entries[l] & 1)
+								/* Page cache pages stay shared, private ones get copied on write */
+								if(pml1->entries[l] & 1 && !(pml1->entries[l] & PML1_NOFREE))
 								{
 									paging_fork_pml((PML4*)pml1, l);
 								}
+								else if(pml1->entries[l] & 1)
+									pagecache_dup_frame(PML_EXTRACT_ADDRESS(pml1->entries[l]));
 							}
 						}
 					}
@@ -282,13 +312,22 @@ void paging_change_perms(void *addr, int prot)
 		pml4 = (PML4*)((uint64_t)current_pml4 + PHYS_BASE);
 	else
 		pml4 = (PML4*)((uint64_t)spawning_pml + PHYS_BASE);
+	/* mprotect() can be pointed at pages that were never mapped, leave those alone */
 	uint64_t* entry = &pml4->entries[dec.pml4];
+	if(!(*entry & 1))
+		return;
 	PML3 *pml3 = (PML3*)((*entry & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
 	entry = &pml3->entries[dec.pdpt];
+	if(!(*entry & 1))
+		return;
 	PML2 *pml2 = (PML2*)((*entry & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
 	entry = &pml2->entries[dec.pd];
+	if(!(*entry & 1))
+		return;
 	PML1 *pml1 = (PML1*)((*entry & 0x0FFFFFFFFFFFF000) + PHYS_BASE);
 	entry = &pml1->entries[dec.pt];
+	if(!(*entry & 1))
+		return;
 	uint32_t perms = *entry & 0xF00000000000FFF;
 	uint64_t page = PML_EXTRACT_ADDRESS(*entry);
 	if(prot & VMM_NOEXEC)
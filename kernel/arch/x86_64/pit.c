@@ -12,6 +12,7 @@
 #include <kernel/portio.h>
 #include <kernel/pit.h>
 #include <kernel/pic.h>
+#include <kernel/timer.h>
 #include <stdint.h>
 #include <kernel/compiler.h>
 #include <stdio.h>
@@ -19,6 +20,7 @@ static volatile uint64_t timer_ticks = 0;
 void timer_handler()
 {
 	timer_ticks++;
+	timer_run(timer_ticks);
 }
 void pit_init(uint32_t frequency)
 {
@@ -30,7 +32,7 @@ void pit_init(uint32_t frequency)
 	io_wait();
 	outb(0x40, divisor >> 8);     // Set high byte of divisor
 	io_wait();
-	pic_unmask_irq(0); // Unmask IRQ0 (PIT)
+	irq_unmask(0); // Unmask IRQ0 (PIT)
 	irq_t handler = &timer_handler;
 	// Install the IRQ handler
 	irq_install_handler(0,handler);
@@ -25,19 +25,27 @@
 #include <sys/uio.h>
 #include <dirent.h>
 #include <mbr.h>
+#include <kernel/ioring.h>
+#include <kernel/pmm.h>
+#include <kernel/paging.h>
+#include <kernel/usercopy.h>
+#include <kernel/pagecache.h>
+#include <kernel/bcache.h>
+#include <kernel/filemap.h>
+#include <fcntl.h>
 #ifdef DEBUG_SYSCALL
 #define DEBUG_PRINT_SYSTEMCALL() printf("%s: syscall\n", __func__)
 #else
 #define DEBUG_PRINT_SYSTEMCALL() asm volatile("nop")
 #endif
 
-const uint32_t SYSCALL_MAX_NUM = 27;
+const uint32_t SYSCALL_MAX_NUM = 37;
 spinlock_t lseek_spl;
 off_t sys_lseek(int fd, off_t offset, int whence)
 {
 	acquire_spinlock(&lseek_spl);
 	DEBUG_PRINT_SYSTEMCALL();
-	if (fd > UINT16_MAX)
+	if(fd < 0 || fd >= UINT8_MAX)
 	{
 		release_spinlock(&lseek_spl);
 		return errno = EBADF, -1;
@@ -57,23 +65,154 @@ off_t sys_lseek(int fd, off_t offset, int whence)
 	else
 	{
 		release_spinlock(&lseek_spl);
-		return errno = EINVAL;
+		return errno = EINVAL, -1;
 	}
 	release_spinlock(&lseek_spl);
 	return ioctx->file_desc[fd]->seek;
 }
+inline int validate_fd(int fd)
+{
+	if(fd < 0 || fd >= UINT8_MAX)
+	{
+		return errno = EBADF;
+	}
+	ioctx_t *ctx = &current_process->ctx;
+	if(ctx->file_desc[fd] == NULL)
+		return errno = EBADF;
+	return 0;
+}
+/* Copies a path in from userspace, returns NULL with errno set if it can't */
+static char *sys_get_path(const char *upath)
+{
+	char *path = malloc(PATH_MAX);
+	if(!path)
+		return errno = ENOMEM, NULL;
+	ssize_t len = strncpy_from_user(path, upath, PATH_MAX);
+	if(len < 0)
+	{
+		free(path);
+		return NULL;
+	}
+	if(len == PATH_MAX)
+	{
+		free(path);
+		return errno = ENAMETOOLONG, NULL;
+	}
+	return path;
+}
+/* Copies a NULL-terminated array of user strings in, for posix_spawn() and execve().
+ * The result is one allocation laid out like the argument block handed to the new image,
+ * the pointers first and the strings after them. first, if not NULL, goes in front of the rest.
+ * *count is set to the number of strings, and *size to the size of the whole block.
+*/
+#define SPAWN_ARG_MAX	(128 * 1024)
+static char **sys_get_strings(char *const *uvec, const char *first, size_t *count, size_t *size)
+{
+	char *strings = malloc(SPAWN_ARG_MAX);
+	if(!strings)
+		return errno = ENOMEM, NULL;
+	size_t nr = 0;
+	size_t used = 0;
+	if(first)
+	{
+		strcpy(strings, first);
+		used = strlen(first) + 1;
+		nr++;
+	}
+	for(size_t i = 0; uvec; i++)
+	{
+		char *ustr;
+		if(copy_from_user(&ustr, &uvec[i], sizeof(char*)) < 0)
+		{
+			free(strings);
+			return NULL;
+		}
+		if(!ustr)
+			break;
+		ssize_t len = strncpy_from_user(strings + used, ustr, SPAWN_ARG_MAX - used);
+		if(len < 0)
+		{
+			free(strings);
+			return NULL;
+		}
+		/* Leave room for the pointers as well */
+		if((size_t) len == SPAWN_ARG_MAX - used || used + len + 1 + (nr + 1) * sizeof(char*) > SPAWN_ARG_MAX)
+		{
+			free(strings);
+			return errno = E2BIG, NULL;
+		}
+		used += len + 1;
+		nr++;
+	}
+	char **block = malloc(nr * sizeof(char*) + used);
+	if(!block)
+	{
+		free(strings);
+		return errno = ENOMEM, NULL;
+	}
+	char *put = (char*)(block + nr);
+	memcpy(put, strings, used);
+	free(strings);
+	for(size_t i = 0; i < nr; i++)
+	{
+		block[i] = put;
+		put += strlen(put) + 1;
+	}
+	*count = nr;
+	*size = nr * sizeof(char*) + used;
+	return block;
+}
+/* Copies a user buffer to the terminal a chunk at a time, returns how much made it */
+static ssize_t tty_write_user(const void *buf, size_t count)
+{
+	char kbuf[256];
+	const char *p = buf;
+	size_t left = count;
+	while(left)
+	{
+		size_t len = left > sizeof(kbuf) ? sizeof(kbuf) : left;
+		if(copy_from_user(kbuf, p, len) < 0)
+			return count == left ? -1 : (ssize_t)(count - left);
+		tty_write(kbuf, len);
+		p += len;
+		left -= len;
+	}
+	return count;
+}
 spinlock_t write_spl;
 ssize_t sys_write(int fd, const void *buf, size_t count)
 {
-	if(!vmm_is_mapped((void*) buf))
-		return errno = EINVAL, -1;
+	if(!access_ok(buf, count))
+		return errno = EFAULT, -1;
 	acquire_spinlock(&write_spl);
 	DEBUG_PRINT_SYSTEMCALL();
 
-	if(fd == 1)
-		tty_write(buf, count);
+	ioctx_t *ioctx = &current_process->ctx;
+	/* stdout and stderr go to the terminal unless something was dup'd over them */
+	if((fd == STDOUT_FILENO || fd == STDERR_FILENO) && !ioctx->file_desc[fd])
+	{
+		ssize_t ret = tty_write_user(buf, count);
+		release_spinlock(&write_spl);
+		return ret;
+	}
+	if(validate_fd(fd))
+	{
+		release_spinlock(&write_spl);
+		return -1;
+	}
+	file_desc_t *desc = ioctx->file_desc[fd];
+	if((desc->flags & O_ACCMODE) == O_RDONLY)
+	{
+		release_spinlock(&write_spl);
+		return errno = EBADF, -1;
+	}
+	if(desc->flags & O_APPEND)
+		desc->seek = desc->vfs_node->size;
+	ssize_t written = write_vfs_user(desc->seek, count, buf, desc->vfs_node);
+	if(written > 0)
+		desc->seek += written;
 	release_spinlock(&write_spl);
-	return count;
+	return written;
 }
 void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
@@ -90,6 +229,21 @@ void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t off
 		vm_prot |= VMM_WRITE;
 	if(!(prot & PROT_EXEC))
 		vm_prot |= VMM_NOEXEC;
+	if(!(flags & MAP_ANONYMOUS))
+	{
+		/* File mappings get their pages from the page cache as they're touched */
+		ioctx_t *ioctx = &current_process->ctx;
+		if(fd < 0 || fd >= UINT8_MAX || !ioctx->file_desc[fd])
+			return errno = EBADF, NULL;
+		if(offset < 0 || offset % PAGE_SIZE)
+			return errno = EINVAL, NULL;
+		vfsnode_t *node = ioctx->file_desc[fd]->vfs_node;
+		if(addr)
+			mapping_addr = filemap_mmap(addr, pages, vm_prot, flags, node, offset);
+		if(!mapping_addr)
+			mapping_addr = filemap_mmap(NULL, pages, vm_prot, flags, node, offset);
+		return mapping_addr;
+	}
 	if(!addr) // Specified by posix, if addr == NULL, guess an address
 		mapping_addr = vmm_allocate_virt_address(0, pages, VMM_TYPE_REGULAR, vm_prot);
 	else
@@ -98,7 +252,6 @@ void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t off
 		if(!mapping_addr)
 			mapping_addr = vmm_allocate_virt_address(0, pages, VMM_TYPE_REGULAR, vm_prot);
 	}
-	printf("Returning %p\n", mapping_addr);
 	if(!mapping_addr)
 		return errno = ENOMEM, NULL;
 	if(!vmm_map_range(mapping_addr, pages, vm_prot))
@@ -109,14 +262,11 @@ int sys_munmap(void *addr, size_t length)
 {
 	DEBUG_PRINT_SYSTEMCALL();
 
-	if ((uintptr_t) addr >= VM_HIGHER_HALF)
-		return errno = EINVAL, -1;
 	size_t pages = length / PAGE_SIZE;
 	if(length % PAGE_SIZE)
 		pages++;
-	if(!((uintptr_t) addr & 0xFFFFFFFFFFFFF000))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped(addr))
+	/* The whole range has to be in userspace, unmapping what isn't mapped is fine */
+	if(!pages || (uintptr_t) addr % PAGE_SIZE || !access_ok(addr, pages * PAGE_SIZE))
 		return errno = EINVAL, -1;
 	vmm_unmap_range(addr, pages);
 	vmm_destroy_mappings(addr, pages);
@@ -126,8 +276,6 @@ int sys_mprotect(void *addr, size_t len, int prot)
 {
 	DEBUG_PRINT_SYSTEMCALL();
 
-	if(!vmm_is_mapped(addr))
-		return errno = EINVAL, -1;
 	int vm_prot = 0;
 	if(prot & PROT_WRITE)
 		vm_prot |= VMM_WRITE;
@@ -136,6 +284,8 @@ int sys_mprotect(void *addr, size_t len, int prot)
 	size_t pages = len / PAGE_SIZE;
 	if(len % PAGE_SIZE)
 		pages++;
+	if((uintptr_t) addr % PAGE_SIZE || !access_ok(addr, pages * PAGE_SIZE))
+		return errno = EINVAL, -1;
 	vmm_change_perms(addr, pages, vm_prot);
 	return 0;
 }
@@ -143,15 +293,19 @@ spinlock_t read_spl;
 extern int tty_keyboard_pos;
 ssize_t sys_read(int fd, const void *buf, size_t count)
 {
-	if(!vmm_is_mapped((void*) buf))
-		return errno = EINVAL, -1;
+	if(!access_ok(buf, count))
+		return errno = EFAULT, -1;
 	DEBUG_PRINT_SYSTEMCALL();
 
 	acquire_spinlock(&read_spl);
 	if (fd == STDIN_FILENO)
 	{
 		char *kb_buf = tty_wait_for_line();
-		memcpy((void*) buf, kb_buf, count);
+		if(copy_to_user((void*) buf, kb_buf, count) < 0)
+		{
+			release_spinlock(&read_spl);
+			return -1;
+		}
 		tty_keyboard_pos = 0;
 		memset(kb_buf, 0, count);
 		memmove(kb_buf, &kb_buf[count], count);
@@ -159,57 +313,119 @@ ssize_t sys_read(int fd, const void *buf, size_t count)
 		return count;
 	}
 	ioctx_t *ioctx = &current_process->ctx;
-	if( fd > UINT16_MAX)
-	{
-		release_spinlock(&read_spl);
-		return errno = EBADF;
-	}
-	if(ioctx->file_desc[fd] == NULL)
+	if(fd < 0 || fd >= UINT8_MAX || ioctx->file_desc[fd] == NULL)
 	{
 		release_spinlock(&read_spl);
-		return errno = EBADF;
-	}
-	if(!buf)
-	{
-		release_spinlock(&read_spl);
-		return errno = EINVAL;
+		return errno = EBADF, -1;
 	}
-	ssize_t size = read_vfs(ioctx->file_desc[fd]->seek, count, (char*)buf, ioctx->file_desc[fd]->vfs_node);
-	ioctx->file_desc[fd]->seek += size;
+	ssize_t size = read_vfs_user(ioctx->file_desc[fd]->seek, count, (void*) buf, ioctx->file_desc[fd]->vfs_node);
+	if(size > 0)
+		ioctx->file_desc[fd]->seek += size;
 	release_spinlock(&read_spl);
 	return size;
 }
+/* Reads at offset without touching the descriptor's seek position */
+ssize_t sys_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	ioctx_t *ioctx = &current_process->ctx;
+	if(fd < 0 || fd >= UINT8_MAX || ioctx->file_desc[fd] == NULL)
+		return errno = EBADF, -1;
+	if(offset < 0)
+		return errno = EINVAL, -1;
+	return read_vfs_user(offset, count, buf, ioctx->file_desc[fd]->vfs_node);
+}
+/* Writes at offset without touching the descriptor's seek position */
+ssize_t sys_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	if(validate_fd(fd))
+		return -1;
+	if(offset < 0)
+		return errno = EINVAL, -1;
+	ioctx_t *ioctx = &current_process->ctx;
+	if((ioctx->file_desc[fd]->flags & O_ACCMODE) == O_RDONLY)
+		return errno = EBADF, -1;
+	return write_vfs_user(offset, count, buf, ioctx->file_desc[fd]->vfs_node);
+}
 uint64_t sys_getpid()
 {
 	DEBUG_PRINT_SYSTEMCALL();
 
 	return current_process->pid;
 }
+/* Looks up path for open(), creating or truncating the file as flags ask */
+static vfsnode_t *sys_open_node(const char *path, int flags)
+{
+	errno = ENOENT;
+	vfsnode_t *node = open_vfs(fs_root, path);
+	if(node && flags & O_CREAT && flags & O_EXCL)
+	{
+		put_vfs(node);
+		return errno = EEXIST, NULL;
+	}
+	if(!node && flags & O_CREAT && errno == ENOENT)
+		return create_vfs(path, VFS_TYPE_FILE);
+	if(!node)
+		return NULL;
+	if(flags & O_TRUNC && node->size && truncate_vfs(node, 0) < 0)
+	{
+		put_vfs(node);
+		return NULL;
+	}
+	return node;
+}
 spinlock_t open_spl;
 int sys_open(const char *filename, int flags)
 {
-	if(!vmm_is_mapped((void*) filename))
-		return errno = EINVAL, -1;
 	DEBUG_PRINT_SYSTEMCALL();
-	
+	char *path = malloc(PATH_MAX);
+	if(!path)
+		return errno = ENOMEM, -1;
+	ssize_t len = strncpy_from_user(path, filename, PATH_MAX);
+	if(len < 0)
+	{
+		free(path);
+		return -1;
+	}
+	if(len == PATH_MAX)
+	{
+		free(path);
+		return errno = ENAMETOOLONG, -1;
+	}
 	acquire_spinlock(&open_spl);
 	ioctx_t *ioctx = &current_process->ctx;
-	for(int i = 0; i < UINT16_MAX; i++)
+	for(int i = 0; i < UINT8_MAX; i++)
 	{
 		if (i <= 2)
 			continue;
 		if(ioctx->file_desc[i] == NULL)
 		{
+			vfsnode_t *node = sys_open_node(path, flags);
+			free(path);
+			if(!node)
+			{
+				release_spinlock(&open_spl);
+				return -1;
+			}
 			ioctx->file_desc[i] = malloc(sizeof(file_desc_t));
+			if(!ioctx->file_desc[i])
+			{
+				put_vfs(node);
+				release_spinlock(&open_spl);
+				return errno = ENOMEM, -1;
+			}
 			memset(ioctx->file_desc[i], 0, sizeof(file_desc_t));
-			ioctx->file_desc[i]->vfs_node = open_vfs(fs_root, filename);
-			ioctx->file_desc[i]->vfs_node->refcount++;
+			/* The reference open_vfs() gave us belongs to the open file description */
+			ioctx->file_desc[i]->vfs_node = node;
+			ioctx->file_desc[i]->refcount = 1;
 			ioctx->file_desc[i]->seek = 0;
 			ioctx->file_desc[i]->flags = flags;
 			release_spinlock(&open_spl);
 			return i;
 		}
 	}
+	free(path);
 	release_spinlock(&open_spl);
 	return errno = EMFILE;
 }
@@ -219,23 +435,25 @@ int sys_close(int fd)
 	DEBUG_PRINT_SYSTEMCALL();
 
 	acquire_spinlock(&close_spl);
-	if(fd > UINT16_MAX) 
+	if(fd < 0 || fd >= UINT8_MAX) 
 	{
 		release_spinlock(&close_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
 	}
 	ioctx_t *ioctx = &current_process->ctx;	
 	if(ioctx->file_desc[fd] == NULL)
 	{
 		release_spinlock(&close_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
 	}
-	close_vfs(ioctx->file_desc[fd]->vfs_node);
-	ioctx->file_desc[fd]->vfs_node->refcount--;
-	if(ioctx->file_desc[fd]->vfs_node->refcount == 0)
+	file_desc_t *desc = ioctx->file_desc[fd];
+	ioctx->file_desc[fd] = NULL;
+	/* The description can still be reachable through a dup()'d or inherited descriptor */
+	if(--desc->refcount == 0)
 	{
-		free(ioctx->file_desc[fd]->vfs_node);
-		free(ioctx->file_desc[fd]);
+		close_vfs(desc->vfs_node);
+		put_vfs(desc->vfs_node);
+		free(desc);
 	}
 	release_spinlock(&close_spl);
 	return 0;
@@ -246,28 +464,29 @@ int sys_dup(int fd)
 	DEBUG_PRINT_SYSTEMCALL();
 
 	acquire_spinlock(&dup_spl);
-	if(fd > UINT16_MAX)
+	if(fd < 0 || fd >= UINT8_MAX)
 	{
 		release_spinlock(&dup_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
 	}
 	ioctx_t *ioctx = &current_process->ctx;
 	if(ioctx->file_desc[fd] == NULL)
 	{
 		release_spinlock(&dup_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
 	}
-	for(int i = 0; i < UINT16_MAX; i++)
+	for(int i = 0; i < UINT8_MAX; i++)
 	{
 		if(ioctx->file_desc[i] == NULL)
 		{
 			ioctx->file_desc[i] = ioctx->file_desc[fd];
-			ioctx->file_desc[fd]->vfs_node->refcount++;
+			ioctx->file_desc[fd]->refcount++;
 			release_spinlock(&dup_spl);
 			return i;
 		}
 	}
-	return errno = EMFILE;
+	release_spinlock(&dup_spl);
+	return errno = EMFILE, -1;
 }
 spinlock_t dup2_spl;
 int sys_dup2(int oldfd, int newfd)
@@ -275,26 +494,32 @@ int sys_dup2(int oldfd, int newfd)
 	DEBUG_PRINT_SYSTEMCALL();
 
 	acquire_spinlock(&dup2_spl);
-	if(oldfd > UINT16_MAX)
+	if(oldfd < 0 || oldfd >= UINT8_MAX)
 	{
 		release_spinlock(&dup2_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
 	}
-	if(newfd > UINT16_MAX)
+	if(newfd < 0 || newfd >= UINT8_MAX)
 	{
 		release_spinlock(&dup2_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
 	}
 	ioctx_t *ioctx = &current_process->ctx;
 	if(ioctx->file_desc[oldfd] == NULL)
 	{
 		release_spinlock(&dup2_spl);
-		return errno = EBADF;
+		return errno = EBADF, -1;
+	}
+	/* Closing newfd first would drop the description we're about to share */
+	if(oldfd == newfd)
+	{
+		release_spinlock(&dup2_spl);
+		return newfd;
 	}
 	if(ioctx->file_desc[newfd])
 		sys_close(newfd);
 	ioctx->file_desc[newfd] = ioctx->file_desc[oldfd];
-	ioctx->file_desc[newfd]->vfs_node->refcount++;
+	ioctx->file_desc[newfd]->refcount++;
 	release_spinlock(&dup2_spl);
 	return newfd;
 }
@@ -302,6 +527,8 @@ void sys__exit(int status)
 {
 	DEBUG_PRINT_SYSTEMCALL();
 
+	ioring_destroy_all();
+	vmm_unmap_files();
 	asm volatile("cli");
 	if(current_process->pid == 1)
 	{
@@ -318,61 +545,48 @@ static spinlock_t posix_spawn_spl;
 extern PML4 *current_pml4;
 int sys_posix_spawn(pid_t *pid, const char *path, void *file_actions, void *attrp, char **const argv, char **const envp)
 {
-	if(!vmm_is_mapped(pid))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped((void*) path))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped(argv))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped(envp))
-		return errno = EINVAL, -1;
 	DEBUG_PRINT_SYSTEMCALL();
+	/* Everything gets copied in up front, the address space is switched around further down */
+	char *kpath = sys_get_path(path);
+	if(!kpath)
+		return -1;
+	size_t num_args, args_size;
+	uintptr_t *arguments = (uintptr_t*) sys_get_strings(argv, kpath, &num_args, &args_size);
+	if(!arguments)
+	{
+		free(kpath);
+		return -1;
+	}
+	/* The environment isn't handed to the new image yet, but it still has to be readable */
+	size_t num_vars, env_size;
+	char **variables = sys_get_strings(envp, NULL, &num_vars, &env_size);
+	if(!variables)
+	{
+		free(arguments);
+		free(kpath);
+		return -1;
+	}
+	free(variables);
 
 	acquire_spinlock(&posix_spawn_spl);
-	// Create a new clean process
-	process_t *new_proc = process_create(path, &current_process->ctx, current_process);
-	*pid = new_proc->pid;
+	// Create a new clean process, which keeps kpath as its command line
+	process_t *new_proc = process_create(kpath, &current_process->ctx, current_process);
 	if(!new_proc)
 	{
 		release_spinlock(&posix_spawn_spl);
+		free(arguments);
+		free(kpath);
 		return errno = ENOMEM, -1;
 	}
-	// Parse through the argv
-	size_t num_args = 1;
-	size_t total_size = strlen(path) + 1 + sizeof(uintptr_t);
-	char **n = argv;
-	
-	while(*n != NULL)
+	if(copy_to_user(pid, &new_proc->pid, sizeof(pid_t)) < 0)
 	{
-		num_args++;
-		total_size += strlen(*argv) + 1;
-		total_size += sizeof(uintptr_t);
-		n++;
+		release_spinlock(&posix_spawn_spl);
+		free(arguments);
+		return -1;
 	}
-	
-	size_t pages = total_size / PAGE_SIZE;
-	
-	if(total_size % PAGE_SIZE)
+	size_t pages = args_size / PAGE_SIZE;
+	if(args_size % PAGE_SIZE)
 		pages++;
-	// Allocate some memory for the args
-	uintptr_t *arguments = vmm_allocate_virt_address(VM_KERNEL, pages, VMM_TYPE_REGULAR, VMM_NOEXEC | VMM_WRITE);
-	vmm_map_range(arguments, pages,  VMM_NOEXEC | VMM_WRITE);
-	// Copy all the data
-	char *argument_strings = (char*)arguments + num_args * sizeof(uintptr_t);
-	for(size_t i = 0; i < num_args; i++)
-	{
-		if( i == 0)
-		{
-			arguments[i] = (uint64_t)argument_strings;
-			strcpy(argument_strings, path);
-			argument_strings += strlen(path) + 1;
-			continue;
-		}
-		
-		arguments[i] = (uint64_t)argument_strings;
-		strcpy(argument_strings, argv[i-1]);
-		argument_strings += strlen(argv[i-1]) + 1;
-	}
 	/*size_t total_env = 0;
 	size_t num_vars = 0;
 	n = envp;
@@ -397,19 +611,14 @@ int sys_posix_spawn(pid_t *pid, const char *path, void *file_actions, void *attr
 		variable_strings += strlen(envp[i]) + 1;
 	}*/
 	// Open the elf file and read from it
-	vfsnode_t *in = open_vfs(fs_root, path);
+	vfsnode_t *in = open_vfs(fs_root, kpath);
 	if (!in)
 	{
-		printf("%s: No such file or directory\n", path);
-		return errno = ENOENT, 1;
+		printf("%s: No such file or directory\n", kpath);
+		release_spinlock(&posix_spawn_spl);
+		free(arguments);
+		return errno = ENOENT, -1;
 	}
-	
-	char *buffer = malloc(in->size);
-	if (!buffer)
-		return errno = ENOMEM, -1;
-	size_t read = read_vfs(0, in->size, buffer, in);
-	if (read != in->size)
-		return errno = EAGAIN, -1;
 	vmm_entry_t *areas;
 	size_t num_r;
 	PML4 *new_pt = vmm_clone_as(&areas, &num_r);
@@ -419,7 +628,7 @@ int sys_posix_spawn(pid_t *pid, const char *path, void *file_actions, void *attr
 	new_proc->num_areas = num_r;
 	uintptr_t *new_arguments = vmm_allocate_virt_address(0, pages, VMM_TYPE_REGULAR, VMM_WRITE | VMM_NOEXEC | VMM_USER);
 	vmm_map_range(new_arguments, pages, VMM_WRITE | VMM_NOEXEC | VMM_USER);
-	memcpy(new_arguments, arguments, pages * PAGE_SIZE);
+	memcpy(new_arguments, arguments, args_size);
 	for(size_t i = 0; i < num_args; i++)
 	{
 		new_arguments[i] = ((uint64_t)new_arguments[i] - (uint64_t)arguments) + (uint64_t)new_arguments;
@@ -435,13 +644,15 @@ int sys_posix_spawn(pid_t *pid, const char *path, void *file_actions, void *attr
 	{
 		new_envp[i] = ((uint64_t)new_envp[i] - (uint64_t)variables) + (uint64_t)new_envp;
 	}*/
-	void *entry = elf_load((void *) buffer);
+	void *entry = elf_load_file(in);
+	put_vfs(in);
 	// Create the new thread
 	process_create_thread(new_proc, (ThreadCallback) entry, 0, num_args, (char**)new_arguments, NULL);
 	new_proc->cr3 = new_pt;
 	vmm_stop_spawning();
 	asm volatile("mov %0, %%cr3"::"r"(current_pml4));
 	release_spinlock(&posix_spawn_spl);
+	free(arguments);
 	return 0;
 }
 spinlock_t fork_spl;
@@ -487,14 +698,12 @@ pid_t sys_fork()
 }
 int sys_mount(const char *source, const char *target, const char *filesystemtype, unsigned long mountflags, const void *data)
 {
-	if(!vmm_is_mapped((void*) source))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped((void*) target))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped((void*) filesystemtype))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped((void*) data))
-		return errno = EINVAL, -1;
+	/* None of the arguments are used yet, partitions get mounted wherever they're found */
+	(void) source;
+	(void) target;
+	(void) filesystemtype;
+	(void) mountflags;
+	(void) data;
 	DEBUG_PRINT_SYSTEMCALL();
 
 	read_partitions();
@@ -529,36 +738,49 @@ extern process_t *first_process;
 static spinlock_t execve_spl;
 int sys_execve(char *path, char *argv[], char *envp[])
 {
-	if(!vmm_is_mapped(path))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped(argv))
-		return errno = EINVAL, -1;
-	if(!vmm_is_mapped(envp))
-		return errno = EINVAL, -1;
 	DEBUG_PRINT_SYSTEMCALL();
+	/* The old image goes away below, so whatever we need from it is copied in first.
+	 * The new image doesn't get argv and envp yet, but they still have to be readable.
+	*/
+	char *kpath = sys_get_path(path);
+	if(!kpath)
+		return -1;
+	size_t count, size;
+	char **strings = sys_get_strings(argv, NULL, &count, &size);
+	if(strings)
+	{
+		free(strings);
+		strings = sys_get_strings(envp, NULL, &count, &size);
+	}
+	if(!strings)
+	{
+		free(kpath);
+		return -1;
+	}
+	free(strings);
 
 	acquire_spinlock(&execve_spl);
+	/* Look the file up first, a failed exec has to leave the old image alone */
+	vfsnode_t *in = open_vfs(fs_root, kpath);
+	free(kpath);
+	if (!in)
+	{
+		release_spinlock(&execve_spl);
+		return errno = ENOENT, -1;
+	}
+	/* The rings and file mappings belong to the old image */
+	ioring_destroy_all();
+	vmm_unmap_files();
 	size_t areas;
 	vmm_entry_t *entries;
 	current_process->cr3 = vmm_clone_as(&entries, &areas);
 	current_process->areas = entries;
 	current_process->num_areas = areas;
-	vfsnode_t *in = open_vfs(fs_root, path);
-	if (!in)
-	{
-		release_spinlock(&execve_spl);
-		return errno = ENOENT;
-	}
-	char *buffer = malloc(in->size);
-	if (!buffer)
-		return errno = ENOMEM;
-	size_t read = read_vfs(0, in->size, buffer, in);
-	if (read != in->size)
-		return errno = EAGAIN;
 	asm volatile ("mov %0, %%cr3" :: "r"(current_process->cr3)); /* We can't use paging_load_cr3 because that would change current_pml4
 							* which we will need for later 
 							*/
-	void *entry = elf_load((void *) buffer);
+	void *entry = elf_load_file(in);
+	put_vfs(in);
 	asm volatile("cli");
 	thread_t *t = sched_create_thread((ThreadCallback) entry,0, NULL);
 	t->owner = current_process;
@@ -593,22 +815,29 @@ loop:
 time_t sys_time(time_t *s)
 {
 	DEBUG_PRINT_SYSTEMCALL();
-	if(vmm_is_mapped(s))
-		*s = get_posix_time();
-	return get_posix_time();
+	time_t t = get_posix_time();
+	if(s && copy_to_user(s, &t, sizeof(time_t)) < 0)
+		return -1;
+	return t;
 }
 int sys_gettimeofday(struct timeval *tv, struct timezone *tz)
 {
 	DEBUG_PRINT_SYSTEMCALL();
 	if(tv)
 	{
-		tv->tv_sec = get_posix_time();
-		tv->tv_usec = 0;
+		struct timeval t;
+		t.tv_sec = get_posix_time();
+		t.tv_usec = 0;
+		if(copy_to_user(tv, &t, sizeof(struct timeval)) < 0)
+			return -1;
 	}
 	if(tz)
 	{
-		tz->tz_minuteswest = 0;
-		tz->tz_dsttime = 0; 
+		struct timezone z;
+		z.tz_minuteswest = 0;
+		z.tz_dsttime = 0;
+		if(copy_to_user(tz, &z, sizeof(struct timezone)) < 0)
+			return -1;
 	}
 	return 0;
 }
@@ -622,119 +851,164 @@ void sys_shutdown()
 	DEBUG_PRINT_SYSTEMCALL();
 	pm_shutdown();
 }
-inline int validate_fd(int fd)
+/* Copies an iovec array in from userspace and checks the buffers it describes.
+ * The buffers themselves stay in userspace, the *_vfs_user() helpers copy them.
+*/
+static struct iovec *sys_get_iovec(const struct iovec *uvec, int veccnt)
 {
-	if(fd > UINT16_MAX)
+	if(veccnt <= 0 || veccnt > IOV_MAX)
+		return errno = EINVAL, NULL;
+	struct iovec *vec = malloc(veccnt * sizeof(struct iovec));
+	if(!vec)
+		return errno = ENOMEM, NULL;
+	if(copy_from_user(vec, uvec, veccnt * sizeof(struct iovec)) < 0)
 	{
-		return errno = EBADF;
+		free(vec);
+		return NULL;
 	}
-	ioctx_t *ctx = &current_process->ctx;
-	if(ctx->file_desc[fd] == NULL)
-		return errno = EBADF;
-	return 0;
+	size_t total = 0;
+	for(int i = 0; i < veccnt; i++)
+	{
+		if(total + vec[i].iov_len < total || total + vec[i].iov_len > SSIZE_MAX)
+		{
+			free(vec);
+			return errno = EINVAL, NULL;
+		}
+		total += vec[i].iov_len;
+		if(!access_ok(vec[i].iov_base, vec[i].iov_len))
+		{
+			free(vec);
+			return errno = EFAULT, NULL;
+		}
+	}
+	return vec;
 }
-ssize_t sys_readv(int fd, const struct iovec *vec, int veccnt)
+ssize_t sys_readv(int fd, const struct iovec *uvec, int veccnt)
 {
-	if(!vmm_is_mapped((void*) vec))
-		return errno = EINVAL, -1;
-
 	DEBUG_PRINT_SYSTEMCALL();
 	if(validate_fd(fd))
 		return -1;
-	ioctx_t *ctx = &current_process->ctx;
-	if(!vec)
-		return errno = EINVAL, -1;
 	if(veccnt == 0)
 		return 0;
-	size_t read = 0;
-	for(int i = 0; i < veccnt; i++)
-	{
-		read_vfs(ctx->file_desc[fd]->seek, vec[i].iov_len, vec[i].iov_base, ctx->file_desc[fd]->vfs_node);
-		read += vec[i].iov_len;
-	}
+	struct iovec *vec = sys_get_iovec(uvec, veccnt);
+	if(!vec)
+		return -1;
+	ioctx_t *ctx = &current_process->ctx;
+	ssize_t read = readv_vfs_user(ctx->file_desc[fd]->seek, vec, veccnt, ctx->file_desc[fd]->vfs_node);
+	free(vec);
+	if(read < 0)
+		return -1;
+	ctx->file_desc[fd]->seek += read;
 	return read;
 }
-ssize_t sys_writev(int fd, const struct iovec *vec, int veccnt)
+ssize_t sys_writev(int fd, const struct iovec *uvec, int veccnt)
 {
-	if(!vmm_is_mapped((void*) vec))
-		return errno = EINVAL, -1;
-	
 	DEBUG_PRINT_SYSTEMCALL();
-	size_t wrote = 0;
-
+	if(fd != STDOUT_FILENO && validate_fd(fd))
+		return -1;
+	if(veccnt == 0)
+		return 0;
+	struct iovec *vec = sys_get_iovec(uvec, veccnt);
+	if(!vec)
+		return -1;
+	ssize_t wrote = 0;
 	if(fd == STDOUT_FILENO)
 	{
 		for(int i = 0; i < veccnt; i++)
 		{
-			tty_write(vec[i].iov_base, vec[i].iov_len);
-			wrote += vec[i].iov_len;
+			ssize_t ret = tty_write_user(vec[i].iov_base, vec[i].iov_len);
+			if(ret < 0)
+			{
+				if(!wrote)
+					wrote = -1;
+				break;
+			}
+			wrote += ret;
+			if((size_t) ret < vec[i].iov_len)
+				break;
 		}
+		free(vec);
 		return wrote;
 	}
-	if(validate_fd(fd))
-		return -1;
 	ioctx_t *ctx = &current_process->ctx;
-	if(!vec)
-		return errno = EINVAL, -1;
-	if(veccnt == 0)
-		return 0;
-	for(int i = 0; i < veccnt; i++)
-	{
-		write_vfs(ctx->file_desc[fd]->seek, vec[i].iov_len, vec[i].iov_base, ctx->file_desc[fd]->vfs_node);
-		wrote += vec[i].iov_len;
-	}
+	if(ctx->file_desc[fd]->flags & O_APPEND)
+		ctx->file_desc[fd]->seek = ctx->file_desc[fd]->vfs_node->size;
+	wrote = writev_vfs_user(ctx->file_desc[fd]->seek, vec, veccnt, ctx->file_desc[fd]->vfs_node);
+	free(vec);
+	if(wrote < 0)
+		return -1;
+	ctx->file_desc[fd]->seek += wrote;
 	return wrote;
 }
-ssize_t sys_preadv(int fd, const struct iovec *vec, int veccnt, off_t offset)
+ssize_t sys_preadv(int fd, const struct iovec *uvec, int veccnt, off_t offset)
 {
-	if(!vmm_is_mapped((void*) vec))
-		return errno = EINVAL, -1;
-	
 	DEBUG_PRINT_SYSTEMCALL();
 	if(validate_fd(fd))
 		return -1;
-	ioctx_t *ctx = &current_process->ctx;
-	if(!vec)
+	if(offset < 0)
 		return errno = EINVAL, -1;
 	if(veccnt == 0)
 		return 0;
-	size_t read = 0;
-	for(int i = 0; i < veccnt; i++)
-	{
-		read_vfs(offset, vec[i].iov_len, vec[i].iov_base, ctx->file_desc[fd]->vfs_node);
-		read += vec[i].iov_len;
-	}
+	struct iovec *vec = sys_get_iovec(uvec, veccnt);
+	if(!vec)
+		return -1;
+	ioctx_t *ctx = &current_process->ctx;
+	ssize_t read = readv_vfs_user(offset, vec, veccnt, ctx->file_desc[fd]->vfs_node);
+	free(vec);
 	return read;
 }
-ssize_t sys_pwritev(int fd, const struct iovec *vec, int veccnt, off_t offset)
+ssize_t sys_pwritev(int fd, const struct iovec *uvec, int veccnt, off_t offset)
 {
-	if(!vmm_is_mapped((void*) vec))
-		return errno = EINVAL, -1;
 	DEBUG_PRINT_SYSTEMCALL();
 	if(validate_fd(fd))
 		return -1;
-	ioctx_t *ctx = &current_process->ctx;
+	if(offset < 0)
+		return errno = EINVAL, -1;
 	if(veccnt == 0)
 		return 0;
-	size_t wrote = 0;
-	for(int i = 0; i < veccnt; i++)
-	{
-		write_vfs(offset, vec[i].iov_len, vec[i].iov_base, ctx->file_desc[fd]->vfs_node);
-		wrote += vec[i].iov_len;
-	}
+	struct iovec *vec = sys_get_iovec(uvec, veccnt);
+	if(!vec)
+		return -1;
+	ioctx_t *ctx = &current_process->ctx;
+	ssize_t wrote = writev_vfs_user(offset, vec, veccnt, ctx->file_desc[fd]->vfs_node);
+	free(vec);
 	return wrote;
 }
+/* count is in entries, like the filesystems' getdents. The filesystems fill a kernel
+ * buffer which is then copied out, so they never touch dirp themselves.
+*/
+#define GETDENTS_MAX_ENTRIES	1024
 int sys_getdents(int fd, struct dirent *dirp, unsigned int count)
 {
-	if(!vmm_is_mapped(dirp))
-		return errno = EINVAL, -1;
+	DEBUG_PRINT_SYSTEMCALL();
 	if(validate_fd(fd))
 		return errno = EBADF, -1;
 	if(!count)
 		return 0;
+	if(count > GETDENTS_MAX_ENTRIES)
+		count = GETDENTS_MAX_ENTRIES;
+	if(!access_ok(dirp, count * sizeof(struct dirent)))
+		return errno = EFAULT, -1;
+	struct dirent *kdirp = malloc(count * sizeof(struct dirent));
+	if(!kdirp)
+		return errno = ENOMEM, -1;
+	memset(kdirp, 0, count * sizeof(struct dirent));
 	ioctx_t *ctx = &current_process->ctx;
-	int read_entries_size = getdents_vfs(count, dirp, ctx->file_desc[fd]->vfs_node);
-	return read_entries_size;
+	unsigned int found = getdents_vfs(count, kdirp, ctx->file_desc[fd]->vfs_node);
+	if(found == (unsigned int) -1)
+	{
+		free(kdirp);
+		return -1;
+	}
+	if(found > count)
+		found = count;
+	if(copy_to_user(dirp, kdirp, found * sizeof(struct dirent)) < 0)
+	{
+		free(kdirp);
+		return -1;
+	}
+	free(kdirp);
+	return found;
 }
 int sys_ioctl(int fd, int request, va_list args)
 {
@@ -743,6 +1017,186 @@ int sys_ioctl(int fd, int request, va_list args)
 	ioctx_t *ctx = &current_process->ctx;
 	return ioctl_vfs(request, args, ctx->file_desc[fd]->vfs_node);
 }
+void *sys_ioring_setup(unsigned int entries)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	return ioring_create(entries);
+}
+int sys_ioring_enter(struct io_ring *ring, unsigned int to_submit, unsigned int min_complete)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	ioring_t *r = ioring_lookup(ring);
+	if(!r)
+		return errno = EINVAL, -1;
+	/* Every operation completes synchronously while the ring is drained,
+	 * so min_complete is always satisfied once we return */
+	(void) min_complete;
+	return ioring_submit(r, to_submit);
+}
+/* Writes len bytes of kernel memory to the output side of sendfile(). Descriptors go through their
+ * vfsnode, whatever they were dup'd from, and only a bare stdout goes to the terminal.
+*/
+static size_t sendfile_write(file_desc_t *out, const void *buf, size_t len)
+{
+	if(!out)
+	{
+		tty_write((char*) buf, len);
+		return len;
+	}
+	size_t written = write_vfs(out->seek, len, (void*) buf, out->vfs_node);
+	if(written != (size_t) -1)
+		out->seek += written;
+	return written;
+}
+/* Copies count bytes from in_fd to out_fd without going through user memory.
+ * Cached files are written straight out of their page cache pages, anything else is staged
+ * in a single kernel page.
+*/
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	off_t off;
+	if(offset && copy_from_user(&off, offset, sizeof(off_t)) < 0)
+		return -1;
+	if(validate_fd(in_fd))
+		return errno = EBADF, -1;
+	ioctx_t *ctx = &current_process->ctx;
+	file_desc_t *out = NULL;
+	if(out_fd >= 0 && out_fd < UINT8_MAX)
+		out = ctx->file_desc[out_fd];
+	if(!out && out_fd != STDOUT_FILENO)
+		return errno = EBADF, -1;
+	file_desc_t *in = ctx->file_desc[in_fd];
+	vfsnode_t *node = in->vfs_node;
+	while(node->type & VFS_TYPE_MOUNTPOINT)
+		node = node->link;
+	if(node->type & VFS_TYPE_DIR)
+		return errno = EISDIR, -1;
+	if(!offset)
+		off = in->seek;
+	if(off < 0)
+		return errno = EINVAL, -1;
+	size_t sent = 0;
+	int error = 0;
+	if(node->cache)
+	{
+		while(sent < count && (size_t) off < node->size)
+		{
+			cached_page_t *p = pagecache_get_page(node->cache, off / PAGE_SIZE, node);
+			if(!p)
+			{
+				error = 1;
+				break;
+			}
+			size_t page_off = off % PAGE_SIZE;
+			size_t len = p->size > page_off ? p->size - page_off : 0;
+			if(len > count - sent)
+				len = count - sent;
+			size_t written = len ? sendfile_write(out, (char*) p->page + page_off, len) : 0;
+			pagecache_put_page(p);
+			if(written == (size_t) -1)
+			{
+				error = 1;
+				break;
+			}
+			off += written;
+			sent += written;
+			if(written < PAGE_SIZE - page_off)
+				break;
+		}
+	}
+	else
+	{
+		void *phys = pmalloc(1);
+		if(!phys)
+			return errno = ENOMEM, -1;
+		char *page = (char*)((uintptr_t) phys + PHYS_BASE);
+		while(sent < count)
+		{
+			size_t to_read = count - sent;
+			if(to_read > PAGE_SIZE)
+				to_read = PAGE_SIZE;
+			size_t read = read_vfs(off, to_read, page, node);
+			if(read == (size_t) -1)
+			{
+				error = 1;
+				break;
+			}
+			if(read == 0)
+				break;
+			size_t written = sendfile_write(out, page, read);
+			if(written == (size_t) -1)
+			{
+				error = 1;
+				break;
+			}
+			off += written;
+			sent += written;
+			if(written < read)
+				break;
+		}
+		pfree(1, phys);
+	}
+	if(!sent && error)
+		return -1;
+	if(!offset)
+		in->seek = off;
+	else if(copy_to_user(offset, &off, sizeof(off_t)) < 0)
+		return -1;
+	return sent;
+}
+int sys_fsync(int fd)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	if(validate_fd(fd))
+		return errno = EBADF, -1;
+	ioctx_t *ctx = &current_process->ctx;
+	if(fsync_vfs(ctx->file_desc[fd]->vfs_node) < 0)
+		return errno = EIO, -1;
+	return 0;
+}
+void sys_sync()
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	pagecache_sync_all();
+	bcache_sync(NULL);
+}
+int sys_unlink(const char *upath)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	char *path = sys_get_path(upath);
+	if(!path)
+		return -1;
+	int ret = unlink_vfs(path);
+	free(path);
+	return ret;
+}
+int sys_mkdir(const char *upath, mode_t mode)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	char *path = sys_get_path(upath);
+	if(!path)
+		return -1;
+	vfsnode_t *node = create_vfs(path, VFS_TYPE_DIR);
+	free(path);
+	if(!node)
+		return -1;
+	put_vfs(node);
+	return 0;
+}
+int sys_ftruncate(int fd, off_t length)
+{
+	DEBUG_PRINT_SYSTEMCALL();
+	if(validate_fd(fd))
+		return errno = EBADF, -1;
+	if(length < 0)
+		return errno = EINVAL, -1;
+	ioctx_t *ctx = &current_process->ctx;
+	/* Only descriptors opened for writing can change the file */
+	if((ctx->file_desc[fd]->flags & O_ACCMODE) == O_RDONLY)
+		return errno = EBADF, -1;
+	return truncate_vfs(ctx->file_desc[fd]->vfs_node, length);
+}
 void *syscall_list[] =
 {
 	[0] = (void*) sys_write,
@@ -774,5 +1228,13 @@ void *syscall_list[] =
 	[26] = (void*) sys_preadv,
 	[27] = (void*) sys_pwritev,
 	[28] = (void*) sys_getdents,
-	[29] = (void*) sys_ioctl
+	[29] = (void*) sys_ioctl,
+	[30] = (void*) sys_ioring_setup,
+	[31] = (void*) sys_ioring_enter,
+	[32] = (void*) sys_sendfile,
+	[33] = (void*) sys_fsync,
+	[34] = (void*) sys_sync,
+	[35] = (void*) sys_unlink,
+	[36] = (void*) sys_mkdir,
+	[37] = (void*) sys_ftruncate
 };
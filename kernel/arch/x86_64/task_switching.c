@@ -18,6 +18,8 @@
 #include <kernel/panic.h>
 #include <kernel/tss.h>
 #include <kernel/process.h>
+#include <kernel/fpu.h>
+#include <kernel/timer.h>
 // First and last nodes of the linked list
 static volatile thread_t* first_thread = NULL;
 volatile thread_t* last_thread = NULL;
@@ -159,6 +161,27 @@ thread_t* sched_create_main_thread(ThreadCallback callback, uint32_t flags,int a
 	last_thread = new_thread;
 	return new_thread;
 }
+/* Round-robin over the runnable threads. The first thread only gets to run when nothing else can. */
+static volatile thread_t *sched_pick_next()
+{
+	volatile thread_t *t;
+	for(t = current_thread->next; t; t = t->next)
+	{
+		if(t != first_thread && t->status == THREAD_RUNNABLE)
+			return t;
+	}
+	for(t = first_thread->next; t && t != current_thread; t = t->next)
+	{
+		if(t->status == THREAD_RUNNABLE)
+			return t;
+	}
+	if(current_thread != first_thread && current_thread->status == THREAD_RUNNABLE)
+		return current_thread;
+	if(first_thread->status == THREAD_RUNNABLE)
+		return first_thread;
+	/* Everyone is blocked, the current thread waits for an interrupt in sched_block() */
+	return current_thread;
+}
 void* sched_switch_thread(void* last_stack)
 {
 	if(!current_thread)
@@ -177,13 +200,9 @@ void* sched_switch_thread(void* last_stack)
 			current_process->areas = areas;
 			current_process->num_areas = num_areas;
 		}
-		if(current_thread->next)
-			current_thread = current_thread->next;
-		else
-			current_thread = first_thread;
-		if(first_thread->next && current_thread == first_thread)
-			current_thread = first_thread->next;
+		current_thread = sched_pick_next();
 		set_kernel_stack((uintptr_t)current_thread->kernel_stack_top);
+		fpu_switch_thread((thread_t*) current_thread);
 		current_process = current_thread->owner;
 		if(current_process)
 		{
@@ -206,6 +225,50 @@ thread_t *get_current_thread()
 {
 	return (thread_t*)current_thread;
 }
+/* Switches to the next thread, through an interrupt with the same frame as the timer's */
+void sched_yield()
+{
+	__asm__ __volatile__("int $0x81" ::: "memory");
+}
+void sched_wake(thread_t *thread)
+{
+	thread->status = THREAD_RUNNABLE;
+}
+static void sched_timer_wake(void *arg)
+{
+	sched_wake(arg);
+}
+/* Blocks the current thread until sched_wake() is called on it, or until the tick count reaches
+ * deadline if that isn't 0. A caller that checks a condition first needs interrupts off from
+ * the check onwards, otherwise the wake up can come before the thread is marked blocked.
+*/
+void sched_block(uint64_t deadline)
+{
+	thread_t *t = (thread_t*) current_thread;
+	unsigned long flags;
+	if(!t)
+	{
+		/* Nothing to switch to yet */
+		__asm__ __volatile__("pause");
+		return;
+	}
+	__asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+	t->status = THREAD_BLOCKED;
+	timer_event_t timer;
+	if(deadline)
+		timer_add(&timer, deadline, sched_timer_wake, t);
+	while(t->status == THREAD_BLOCKED)
+	{
+		sched_yield();
+		/* Nothing else could run, wait for the interrupt that wakes us up */
+		if(t->status == THREAD_BLOCKED)
+			__asm__ __volatile__("sti; hlt; cli" ::: "memory");
+	}
+	if(deadline)
+		timer_cancel(&timer);
+	if(flags & 0x200)
+		__asm__ __volatile__("sti" ::: "memory");
+}
 void sched_destroy_thread(thread_t *thread)
 {
 	for(volatile thread_t *i = first_thread; i; i=i->next)
@@ -216,6 +279,7 @@ void sched_destroy_thread(thread_t *thread)
 			break;
 		}
 	}
+	fpu_destroy_thread(thread);
 	//paging_unmap(thread->kernel_stack_top - 0x2000, 2);
 	//paging_unmap(thread->user_stack_top - 0x2000, 1024);
 	free(thread);
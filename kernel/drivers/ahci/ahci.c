@@ -0,0 +1,566 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: ahci.c
+ *
+ * Description: AHCI SATA driver. Every port with a disk on it gets its own
+ * request queue, whose tags are the port's command slots. Disks that do NCQ
+ * get as many requests in flight as they and the HBA have slots for, the
+ * others get one. Each slot has a page-sized command table, so a request
+ * can be split across up to AHCI_PRDT_ENTRIES pieces of memory. Errors and
+ * timeouts are dealt with by a thread, which resets the port and gives the
+ * commands that were caught up in it back to the block layer.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <kernel/vmm.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/pic.h>
+#include <kernel/irq.h>
+#include <kernel/portio.h>
+#include <kernel/block.h>
+#include <kernel/wait_queue.h>
+#include <kernel/task_switching.h>
+#include <kernel/panic.h>
+
+#include <drivers/mmio.h>
+#include <drivers/pci.h>
+#include <drivers/ata.h>
+#include <drivers/ahci.h>
+
+static PCIDevice *ahcidev = NULL;
+static volatile uint8_t *abar = NULL;
+static uint32_t ahci_cap = 0;
+/* Highest address the HBA can DMA to, it's 32-bit unless it says otherwise */
+static uintptr_t ahci_dma_limit = 0xFFFFFFFF;
+static ahci_port_t *ahci_ports[AHCI_MAX_PORTS];
+/* A sector's worth of DMA memory for polled commands, probing and the error handler take turns with it */
+static void *ahci_scratch = NULL;
+static uintptr_t ahci_scratch_phys = 0;
+static wait_queue_t ahci_eh_wq;
+static volatile uint32_t ahci_eh_ports = 0; /* Ports waiting for the error handler */
+
+static inline uint32_t ahci_read(volatile uint8_t *regs, unsigned int reg)
+{
+	return mmio_readl((uint64_t)(uintptr_t)(regs + reg));
+}
+static inline void ahci_write(volatile uint8_t *regs, unsigned int reg, uint32_t val)
+{
+	mmio_writel((uint64_t)(uintptr_t)(regs + reg), val);
+}
+/* Roughly a microsecond. Only probing and the error handler thread wait on the hardware,
+ * and the short delays they need are below what the tick count can measure.
+*/
+static inline void ahci_udelay(unsigned int us)
+{
+	while(us--)
+		io_wait();
+}
+/* Waits for (reg & mask) == value, returns -1 if that takes longer than timeout ms */
+static int ahci_wait(volatile uint8_t *regs, unsigned int reg, uint32_t mask, uint32_t value, unsigned int timeout)
+{
+	for(unsigned int i = 0; i < timeout * 1000; i++)
+	{
+		if((ahci_read(regs, reg) & mask) == value)
+			return 0;
+		ahci_udelay(1);
+	}
+	return -1;
+}
+/* Zeroed, physically contiguous memory the HBA can reach */
+static void *ahci_alloc_dma(size_t pages, uintptr_t *phys)
+{
+	void *p = pmalloc_below(pages, ahci_dma_limit);
+	if(!p)
+		return NULL;
+	*phys = (uintptr_t) p;
+	void *virt = (void*)((uintptr_t) p + PHYS_BASE);
+	memset(virt, 0, pages * PAGE_SIZE);
+	return virt;
+}
+static int ahci_port_stop(ahci_port_t *port)
+{
+	uint32_t cmd = ahci_read(port->regs, AHCI_PxCMD);
+	ahci_write(port->regs, AHCI_PxCMD, cmd & ~(AHCI_PxCMD_ST | AHCI_PxCMD_FRE));
+	return ahci_wait(port->regs, AHCI_PxCMD, AHCI_PxCMD_CR | AHCI_PxCMD_FR, 0, 500);
+}
+static void ahci_port_start(ahci_port_t *port)
+{
+	ahci_wait(port->regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0, 500);
+	uint32_t cmd = ahci_read(port->regs, AHCI_PxCMD);
+	ahci_write(port->regs, AHCI_PxCMD, cmd | AHCI_PxCMD_FRE);
+	ahci_write(port->regs, AHCI_PxCMD, cmd | AHCI_PxCMD_FRE | AHCI_PxCMD_ST);
+}
+/* COMRESET, for a device that stays busy after the port has been stopped */
+static void ahci_port_reset(ahci_port_t *port)
+{
+	ahci_write(port->regs, AHCI_PxSCTL, 1);
+	ahci_udelay(2000);
+	ahci_write(port->regs, AHCI_PxSCTL, 0);
+	ahci_wait(port->regs, AHCI_PxSSTS, 0xF, AHCI_DET_PRESENT, 100);
+	ahci_write(port->regs, AHCI_PxSERR, 0xFFFFFFFF);
+}
+static void ahci_port_free(ahci_port_t *port)
+{
+	for(unsigned int i = 0; i < AHCI_MAX_SLOTS; i++)
+	{
+		if(port->tables[i])
+			pfree(1, (void*) port->tables_phys[i]);
+	}
+	if(port->cmdlist)
+		pfree(1, (void*) port->cmdlist_phys);
+	free(port);
+}
+static ahci_port_t *ahci_port_init(unsigned int num)
+{
+	volatile uint8_t *regs = abar + AHCI_PORT(num);
+	/* Spin the device up, and give the link a moment to come up after the HBA reset */
+	ahci_write(regs, AHCI_PxCMD, ahci_read(regs, AHCI_PxCMD) | AHCI_PxCMD_SUD | AHCI_PxCMD_POD);
+	if(ahci_wait(regs, AHCI_PxSSTS, 0xF, AHCI_DET_PRESENT, 100) < 0)
+		return NULL;
+	/* ATAPI devices and port multipliers aren't handled */
+	if(ahci_read(regs, AHCI_PxSIG) != AHCI_SIG_ATA)
+		return NULL;
+	ahci_port_t *port = malloc(sizeof(ahci_port_t));
+	if(!port)
+		return NULL;
+	memset(port, 0, sizeof(ahci_port_t));
+	port->regs = regs;
+	port->num = num;
+	if(ahci_port_stop(port) < 0)
+	{
+		ahci_port_free(port);
+		return NULL;
+	}
+	/* The command list and the received FIS area share a page */
+	char *mem = ahci_alloc_dma(1, &port->cmdlist_phys);
+	if(!mem)
+	{
+		ahci_port_free(port);
+		return NULL;
+	}
+	port->cmdlist = (ahci_cmd_header_t*) mem;
+	port->fis = mem + 1024;
+	uint64_t fis_phys = port->cmdlist_phys + 1024;
+	ahci_write(regs, AHCI_PxCLB, (uint32_t) port->cmdlist_phys);
+	ahci_write(regs, AHCI_PxCLBU, (uint32_t)((uint64_t) port->cmdlist_phys >> 32));
+	ahci_write(regs, AHCI_PxFB, (uint32_t) fis_phys);
+	ahci_write(regs, AHCI_PxFBU, (uint32_t)(fis_phys >> 32));
+	for(unsigned int i = 0; i < AHCI_CAP_NCS(ahci_cap); i++)
+	{
+		port->tables[i] = ahci_alloc_dma(1, &port->tables_phys[i]);
+		if(!port->tables[i])
+		{
+			ahci_port_free(port);
+			return NULL;
+		}
+		port->cmdlist[i].ctba = (uint32_t) port->tables_phys[i];
+		port->cmdlist[i].ctbau = (uint32_t)((uint64_t) port->tables_phys[i] >> 32);
+	}
+	/* Get rid of whatever errors and interrupts were left over */
+	ahci_write(regs, AHCI_PxSERR, 0xFFFFFFFF);
+	ahci_write(regs, AHCI_PxIS, 0xFFFFFFFF);
+	ahci_port_start(port);
+	return port;
+}
+/* Fills in the command header and the FIS of a slot whose PRDT is already set up */
+static void ahci_prepare(ahci_port_t *port, unsigned int slot, uint8_t command, uint64_t lba, uint16_t count,
+uint16_t features, int prds, int write)
+{
+	ahci_cmd_header_t *hdr = &port->cmdlist[slot];
+	hdr->flags = sizeof(fis_reg_h2d_t) / 4 | (write ? AHCI_CMD_WRITE : 0);
+	hdr->prdtl = prds;
+	hdr->prdbc = 0;
+	fis_reg_h2d_t *fis = (fis_reg_h2d_t*) port->tables[slot]->cfis;
+	memset(fis, 0, sizeof(fis_reg_h2d_t));
+	fis->type = FIS_TYPE_REG_H2D;
+	fis->flags = 0x80;
+	fis->command = command;
+	fis->device = 0x40;
+	fis->lba0 = lba & 0xFF;
+	fis->lba1 = lba >> 8 & 0xFF;
+	fis->lba2 = lba >> 16 & 0xFF;
+	fis->lba3 = lba >> 24 & 0xFF;
+	fis->lba4 = lba >> 32 & 0xFF;
+	fis->lba5 = lba >> 40 & 0xFF;
+	fis->countl = count & 0xFF;
+	fis->counth = count >> 8;
+	fis->featurel = features & 0xFF;
+	fis->featureh = features >> 8;
+}
+/* Describes the request's bios in the slot's PRDT, merging pieces that are physically contiguous.
+ * Returns the number of entries used, or -1 if they don't fit.
+*/
+static int ahci_fill_prdt(ahci_cmd_table_t *t, request_t *req)
+{
+	int entries = 0;
+	uintptr_t next = 0;
+	for(bio_t *bio = req->bio; bio; bio = bio->next)
+	{
+		for(int i = 0; i < bio->veccnt; i++)
+		{
+			char *base = bio->vec[i].iov_base;
+			size_t len = bio->vec[i].iov_len;
+			while(len)
+			{
+				size_t chunk = PAGE_SIZE - ((uintptr_t) base & (PAGE_SIZE - 1));
+				if(chunk > len)
+					chunk = len;
+				uintptr_t phys = (uintptr_t) virtual2phys(base);
+				ahci_prd_t *prd = entries ? &t->prdt[entries-1] : NULL;
+				if(prd && phys == next && prd->dbc + 1 + chunk <= AHCI_PRD_MAX)
+					prd->dbc += chunk;
+				else
+				{
+					if(entries == AHCI_PRDT_ENTRIES)
+						return -1;
+					prd = &t->prdt[entries++];
+					prd->dba = (uint32_t) phys;
+					prd->dbau = (uint32_t)((uint64_t) phys >> 32);
+					prd->res = 0;
+					prd->dbc = chunk - 1;
+				}
+				next = phys + chunk;
+				base += chunk;
+				len -= chunk;
+			}
+		}
+	}
+	return entries ? entries : -1;
+}
+static int ahci_start(request_queue_t *q, request_t *req)
+{
+	ahci_port_t *port = q->driver_data;
+	unsigned int slot = req->tag;
+	int prds = ahci_fill_prdt(port->tables[slot], req);
+	if(prds < 0)
+		return -1;
+	int write = req->op == BIO_WRITE;
+	/* Both commands take a count of 0 to mean 65536 sectors */
+	uint16_t count = (uint16_t) req->nr_sectors;
+	/* NCQ commands carry the tag where the count would go, and the count in the features */
+	if(port->ncq)
+		ahci_prepare(port, slot, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED,
+		req->sector, slot << 3, count, prds, write);
+	else
+		ahci_prepare(port, slot, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT,
+		req->sector, count, 0, prds, write);
+	port->outstanding |= 1U << slot;
+	if(port->ncq)
+		ahci_write(port->regs, AHCI_PxSACT, 1U << slot);
+	ahci_write(port->regs, AHCI_PxCI, 1U << slot);
+	return 0;
+}
+static void ahci_complete_slots(request_queue_t *q, uint32_t slots, int status)
+{
+	for(unsigned int slot = 0; slots; slot++)
+	{
+		if(!(slots & (1U << slot)))
+			continue;
+		slots &= ~(1U << slot);
+		blk_complete(q, slot, status);
+	}
+}
+/* Hands the port to the error handler thread. The port stops processing commands once one of
+ * them fails, recovering it takes a reset, which is too slow for interrupt handlers and timers.
+*/
+static void ahci_schedule_eh(ahci_port_t *port)
+{
+	if(__sync_lock_test_and_set(&port->eh_pending, 1))
+		return;
+	ahci_write(port->regs, AHCI_PxIE, 0);
+	blk_stop_queue(port->queue);
+	__sync_fetch_and_or(&ahci_eh_ports, 1U << port->num);
+	wake_up(&ahci_eh_wq);
+}
+static void ahci_timeout(request_queue_t *q, request_t *req)
+{
+	ahci_port_t *port = q->driver_data;
+	printf("ahci: port %u: request for sector %u timed out\n", port->num, req->sector);
+	ahci_schedule_eh(port);
+}
+static void ahci_port_irq(ahci_port_t *port)
+{
+	/* The error handler looks at the port itself */
+	if(port->eh_pending)
+		return;
+	uint32_t is = ahci_read(port->regs, AHCI_PxIS);
+	if(!is)
+		return;
+	ahci_write(port->regs, AHCI_PxIS, is);
+	if(is & AHCI_PxIS_ERROR)
+	{
+		ahci_schedule_eh(port);
+		return;
+	}
+	request_queue_t *q = port->queue;
+	/* Slots the HBA is done with have their bit cleared, in SACT for NCQ commands */
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	uint32_t busy = ahci_read(port->regs, port->ncq ? AHCI_PxSACT : AHCI_PxCI);
+	uint32_t done = port->outstanding & ~busy;
+	port->outstanding &= ~done;
+	spin_unlock_irqrestore(&q->lock, flags);
+	ahci_complete_slots(q, done, 0);
+}
+static void ahci_irq()
+{
+	uint32_t is = ahci_read(abar, AHCI_IS);
+	if(!is)
+		return;
+	for(unsigned int i = 0; i < AHCI_MAX_PORTS; i++)
+	{
+		if(is & (1U << i) && ahci_ports[i])
+			ahci_port_irq(ahci_ports[i]);
+	}
+	ahci_write(abar, AHCI_IS, is);
+}
+static void ahci_msi(void *ctx)
+{
+	ahci_irq();
+}
+/* Reads a sector's worth of data into the scratch page on slot 0, polling for it. Only used when
+ * nothing else is issued on the port: before its interrupts are enabled, and while recovering it.
+*/
+static int ahci_read_polled(ahci_port_t *port, uint8_t command, uint64_t lba)
+{
+	if(ahci_wait(port->regs, AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0, 1000) < 0)
+		return -1;
+	ahci_prd_t *prd = &port->tables[0]->prdt[0];
+	prd->dba = (uint32_t) ahci_scratch_phys;
+	prd->dbau = (uint32_t)((uint64_t) ahci_scratch_phys >> 32);
+	prd->res = 0;
+	prd->dbc = 511;
+	ahci_prepare(port, 0, command, lba, 1, 0, 1, 0);
+	ahci_write(port->regs, AHCI_PxCI, 1);
+	int st = ahci_wait(port->regs, AHCI_PxCI, 1, 0, 1000);
+	ahci_write(port->regs, AHCI_PxIS, 0xFFFFFFFF);
+	if(st < 0 || ahci_read(port->regs, AHCI_PxTFD) & AHCI_TFD_ERR)
+		return -1;
+	return 0;
+}
+/* Finds the command an NCQ error was about, returns its slot or -1 if the disk can't tell */
+static int ahci_ncq_failed_slot(ahci_port_t *port)
+{
+	if(ahci_read_polled(port, ATA_CMD_READ_LOG_EXT, ATA_LOG_NCQ_ERROR) < 0)
+		return -1;
+	uint8_t *log = ahci_scratch;
+	if(log[0] & ATA_LOG_NCQ_NQ)
+		return -1;
+	return log[0] & 0x1F;
+}
+/* Completes what got done before the port stopped, resets it, and fails the command that caused
+ * the error. The others only got caught up in it, so they're retried.
+*/
+static void ahci_port_recover(ahci_port_t *port)
+{
+	request_queue_t *q = port->queue;
+	uint32_t tfd = ahci_read(port->regs, AHCI_PxTFD);
+	printf("ahci: port %u error, tfd %x serr %x\n", port->num, tfd, ahci_read(port->regs, AHCI_PxSERR));
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	uint32_t busy = ahci_read(port->regs, port->ncq ? AHCI_PxSACT : AHCI_PxCI);
+	uint32_t done = port->outstanding & ~busy;
+	uint32_t aborted = port->outstanding & busy;
+	port->outstanding = 0;
+	spin_unlock_irqrestore(&q->lock, flags);
+	ahci_complete_slots(q, done, 0);
+	ahci_port_stop(port);
+	ahci_write(port->regs, AHCI_PxSERR, 0xFFFFFFFF);
+	ahci_write(port->regs, AHCI_PxIS, 0xFFFFFFFF);
+	if(ahci_read(port->regs, AHCI_PxTFD) & (AHCI_TFD_BSY | AHCI_TFD_DRQ))
+		ahci_port_reset(port);
+	ahci_port_start(port);
+	/* Timeouts and link errors can't be pinned on one command, device errors can */
+	int failed = -1;
+	if(tfd & AHCI_TFD_ERR && aborted)
+		failed = port->ncq ? ahci_ncq_failed_slot(port) : __builtin_ctz(aborted);
+	ahci_write(port->regs, AHCI_PxIS, 0xFFFFFFFF);
+	for(unsigned int slot = 0; aborted; slot++)
+	{
+		if(!(aborted & (1U << slot)))
+			continue;
+		aborted &= ~(1U << slot);
+		if((int) slot == failed)
+			blk_complete(q, slot, EIO);
+		else
+			blk_requeue(q, slot);
+	}
+	__sync_lock_release(&port->eh_pending);
+	ahci_write(port->regs, AHCI_PxIE, AHCI_PxIS_DONE | AHCI_PxIS_ERROR);
+	blk_start_queue(q);
+}
+static void ahci_eh_thread(void *arg)
+{
+	(void) arg;
+	for(;;)
+	{
+		wait_for_event(&ahci_eh_wq, ahci_eh_ports != 0);
+		uint32_t ports = __sync_fetch_and_and(&ahci_eh_ports, 0);
+		for(unsigned int i = 0; i < AHCI_MAX_PORTS; i++)
+		{
+			if(ports & (1U << i) && ahci_ports[i])
+				ahci_port_recover(ahci_ports[i]);
+		}
+	}
+}
+static int ahci_add_disk(ahci_port_t *port, uint16_t *id)
+{
+	uint64_t sectors = (uint64_t) id[100] | (uint64_t) id[101] << 16 | (uint64_t) id[102] << 32 |
+	(uint64_t) id[103] << 48;
+	if(!sectors)
+		sectors = (uint64_t) id[60] | (uint64_t) id[61] << 16;
+	if(!sectors)
+		return -1;
+	unsigned int depth = 1;
+	/* Word 76 bit 8 says the disk does NCQ, word 75 has its queue depth */
+	if(ahci_cap & AHCI_CAP_SNCQ && id[76] & (1 << 8))
+	{
+		port->ncq = 1;
+		depth = (id[75] & 0x1F) + 1;
+		if(depth > AHCI_CAP_NCS(ahci_cap))
+			depth = AHCI_CAP_NCS(ahci_cap);
+	}
+	port->queue = blk_alloc_queue(ahci_start, AHCI_PRDT_ENTRIES * PAGE_SIZE / BLOCK_SECTOR_SIZE, AHCI_PRDT_ENTRIES);
+	if(!port->queue)
+		return -1;
+	port->queue->depth = depth;
+	port->queue->timeout = ahci_timeout;
+	port->queue->dma_limit = ahci_dma_limit;
+	/* Data base addresses need to be word aligned */
+	port->queue->dma_align = 1;
+	port->queue->driver_data = port;
+	char name[] = "sata00";
+	if(port->num >= 10)
+	{
+		name[4] = '0' + port->num / 10;
+		name[5] = '0' + port->num % 10;
+	}
+	else
+	{
+		name[4] = '0' + port->num;
+		name[5] = '\0';
+	}
+	port->dev = blk_add_disk(name, sectors, port->queue, port);
+	if(!port->dev)
+		return -1;
+	printf("ahci: %s: %u sectors, %s, queue depth %u\n", name, sectors, port->ncq ? "NCQ" : "no NCQ", depth);
+	return 0;
+}
+/* Undoes the part of probing that gets to the registers, so another controller can be tried */
+static int ahci_probe_fail(size_t abar_pages)
+{
+	if(abar)
+		vmm_unmap_range((void*) abar, abar_pages);
+	abar = NULL;
+	ahcidev = NULL;
+	return -1;
+}
+/* ABAR and the ports are kept globally, so only the first controller is used */
+static int ahci_probe(PCIDevice *dev, const pci_id_t *pci_id)
+{
+	if(ahcidev)
+		return -1;
+	ahcidev = dev;
+	printf("ahci: found AHCI controller\n");
+	/* Memory space and bus mastering */
+	uint32_t command_reg = pci_config_read_dword(ahcidev->slot, ahcidev->device, ahcidev->function, PCI_COMMAND);
+	pci_write_dword(ahcidev->slot, ahcidev->device, ahcidev->function, PCI_COMMAND, command_reg | 6);
+	/* The registers are in BAR5, called ABAR */
+	pcibar_t *bar = pci_get_bar(ahcidev->slot, ahcidev->device, ahcidev->function, 5);
+	if(bar->isIO || !bar->address)
+	{
+		free(bar);
+		return ahci_probe_fail(0);
+	}
+	size_t needed_pages = (bar->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	abar = vmm_allocate_virt_address(VM_KERNEL, needed_pages, VMM_TYPE_HW, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+	if(!abar)
+	{
+		free(bar);
+		return ahci_probe_fail(0);
+	}
+	/* The frames are the controller's, unmapping them mustn't give them to the allocator */
+	for(size_t i = 0; i < needed_pages; i++)
+		paging_map_phys_to_virt((uintptr_t) abar + i * PAGE_SIZE, bar->address + i * PAGE_SIZE,
+		VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC | VMM_NOFREE);
+	free(bar);
+	/* Reset the HBA, so no port is left running with whatever the firmware set up */
+	ahci_write(abar, AHCI_GHC, AHCI_GHC_AE);
+	ahci_write(abar, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_HR);
+	if(ahci_wait(abar, AHCI_GHC, AHCI_GHC_HR, 0, 1000) < 0)
+	{
+		printf("ahci: controller reset timed out\n");
+		return ahci_probe_fail(needed_pages);
+	}
+	ahci_write(abar, AHCI_GHC, AHCI_GHC_AE);
+	ahci_cap = ahci_read(abar, AHCI_CAP);
+	if(ahci_cap & AHCI_CAP_S64A)
+		ahci_dma_limit = UINTPTR_MAX;
+	uint32_t pi = ahci_read(abar, AHCI_PI);
+	/* Allocated before the interrupt is set up, so failing doesn't leave a handler behind */
+	ahci_scratch = ahci_alloc_dma(1, &ahci_scratch_phys);
+	if(!ahci_scratch)
+		return ahci_probe_fail(needed_pages);
+	/* A vector of its own if it does MSI, the legacy line is shared */
+	int vector = dev->msi_cap ? irq_allocate_vector(ahci_msi, NULL, dev->instance) : -1;
+	if(vector >= 0 && pci_enable_msi(dev, vector) < 0)
+	{
+		irq_free_vector(vector);
+		vector = -1;
+	}
+	uint16_t intn = 0;
+	if(vector < 0)
+	{
+		intn = pci_get_intn(ahcidev->slot, ahcidev->device, ahcidev->function);
+		irq_install_handler(intn, ahci_irq);
+	}
+	for(unsigned int i = 0; i < AHCI_MAX_PORTS; i++)
+	{
+		if(!(pi & (1U << i)))
+			continue;
+		ahci_port_t *port = ahci_port_init(i);
+		if(!port)
+			continue;
+		if(ahci_read_polled(port, ATA_CMD_IDENTIFY, 0) < 0 || ahci_add_disk(port, ahci_scratch) < 0)
+		{
+			printf("ahci: port %u: couldn't identify the disk\n", i);
+			ahci_port_stop(port);
+			ahci_port_free(port);
+			continue;
+		}
+		ahci_ports[i] = port;
+		ahci_write(port->regs, AHCI_PxIE, AHCI_PxIS_DONE | AHCI_PxIS_ERROR);
+	}
+	if(!sched_create_thread(ahci_eh_thread, 1, NULL))
+		panic("ahci: Could not create the error handler thread\n");
+	if(vector < 0)
+		irq_unmask(intn);
+	ahci_write(abar, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_IE);
+	return 0;
+}
+static const pci_id_t ahci_ids[] =
+{
+	PCI_ID_CLASS(CLASS_MASS_STORAGE_CONTROLLER, 6, 1, 0xFFFFFF),
+	{0}
+};
+static pci_driver_t ahci_driver = {"ahci", ahci_ids, ahci_probe, 0, NULL};
+void initialize_ahci()
+{
+	pci_register_driver(&ahci_driver);
+}
@@ -10,7 +10,10 @@
  *----------------------------------------------------------------------*/
 #include <drivers/ata.h>
 #include <kernel/vmm.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
 #include <stdio.h>
+#include <string.h>
 #include <kernel/portio.h>
 #include <kernel/vfs.h>
 #include <kernel/pic.h>
@@ -18,8 +21,11 @@
 #include <kernel/pit.h>
 #include <kernel/panic.h>
 #include <mbr.h>
+#include <errno.h>
+#include <kernel/block.h>
+#include <kernel/wait_queue.h>
 prdt_entry_t *PRDT;
-void *prdt_base = NULL;
+static uint32_t prdt_phys;
 PCIDevice *idedev = NULL;
 uint16_t bar4_base = 0;
 struct ide_drive
@@ -27,38 +33,55 @@ struct ide_drive
 	_Bool exists;
 	uint32_t lba28;
 	uint64_t lba48;
+	unsigned int channel;
+	unsigned int drive;
+	block_dev_t *dev;
 } ide_drives[4];
+/* There's a single PRDT, so the whole controller does one request at a time */
+static request_queue_t *ata_queue = NULL;
+static struct ide_drive *ata_active = NULL;
+static int ata_start(request_queue_t *q, request_t *req);
+static void ata_timeout(request_queue_t *q, request_t *req);
 unsigned int current_drive = (unsigned int)-1;
 unsigned int current_channel = (unsigned int)-1;
 static volatile int irq = 0;
+/* Whoever polls for the interrupt of a command that isn't DMA sleeps here */
+static wait_queue_t ata_wq;
 #define ATA_TIMEOUT 10000
 int ata_wait_for_irq(uint64_t timeout)
 {
-	uint64_t time = get_tick_count();
-	while(!irq)
-	{
-		if(get_tick_count() - time == timeout)
-		{
-			irq = 0;
-			return 2;
-		}
-		uint16_t altstatus = inb(current_channel ? ATA_CONTROL1 : ATA_CONTROL2);
-		if(altstatus & 1)
-		{
-			altstatus &= ~1;
-			outb((current_channel ? ATA_DATA1 : ATA_DATA2) + ATA_REG_STATUS, altstatus);
-			irq = 0;
-			return 1;
-		}
-	}
+	int timed_out = wait_for_event_timeout(&ata_wq, irq, timeout);
 	irq = 0;
+	if(timed_out)
+		return 2;
+	if(inb(current_channel ? ATA_CONTROL2 : ATA_CONTROL1) & ATA_SR_ERR)
+		return 1;
 	return 0;
 }
 void ata_irq()
 {
-	irq = 1;
-	inb(bar4_base + 2);
-	inb((current_channel ? ATA_DATA2 : ATA_DATA1) + ATA_REG_STATUS);
+	if(!ata_active)
+	{
+		/* No DMA going on, someone is polling for the interrupt */
+		inb(bar4_base + 2);
+		inb((current_channel ? ATA_DATA2 : ATA_DATA1) + ATA_REG_STATUS);
+		irq = 1;
+		wake_up(&ata_wq);
+		return;
+	}
+	uint16_t bm = ata_active->channel ? bar4_base + 0x8 : bar4_base;
+	uint16_t io = ata_active->channel ? ATA_DATA2 : ATA_DATA1;
+	uint8_t bmstatus = inb(bm + 2);
+	/* Both channels share the handler, this one isn't done yet */
+	if(!(bmstatus & 4))
+		return;
+	outb(bm, 0);
+	uint8_t status = inb(io + ATA_REG_STATUS);
+	/* The interrupt and error bits are cleared by writing them back */
+	outb(bm + 2, bmstatus | 6);
+	ata_active = NULL;
+	/* The queue has a depth of one, so the request is always tag 0 */
+	blk_complete(ata_queue, 0, status & (ATA_SR_ERR | ATA_SR_DF) || bmstatus & 2 ? EIO : 0);
 }
 uint8_t delay_400ns()
 {
@@ -92,26 +115,41 @@ void enable_pci_ide(PCIDevice *dev)
 	pcibar_t *bar4 = pci_get_bar(dev->slot, dev->device, dev->function, 4);
 	bar4_base = bar4->address;
 	printf("bar4: %x\n", bar4_base);
-	pic_unmask_irq(14);
-	pic_unmask_irq(15);
+	irq_unmask(14);
+	irq_unmask(15);
 	irq_install_handler(14, &ata_irq);
 	irq_install_handler(15, &ata_irq);
 }
-void initialize_ata()
+/* The ports are the legacy ones, so there's only ever one controller */
+static int ata_probe(PCIDevice *dev, const pci_id_t *id)
 {
-	idedev = get_pcidev_from_classes(1,1,0);
 	if(idedev)
-		printf("ata: found IDE controller\n");
-	else
-		return;
+		return -1;
+	idedev = dev;
+	printf("ata: found IDE controller\n");
 	/*vfsnode_t *node = malloc(sizeof(node));
 	node->name = "/dev/ata";
 	node->type = VFS_TYPE_DEV;
 	//vfs_register_node(node);*/
-	/* Allocate PRDT base */
-	prdt_base = vmm_allocate_virt_address(VM_KERNEL, 16/*64K*/, VMM_TYPE_REGULAR, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
-	vmm_map_range(prdt_base, 16, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
-	printf("ata: allocated prdt base %x\n",prdt_base);
+	/* The bus master walks the PRDT by physical address, so it has to be one contiguous block below 4GiB
+	 * that doesn't cross a 64K boundary. Take twice the size, keep the aligned 64K and give the rest back.
+	*/
+	size_t pages = ATA_PRDT_SIZE / PAGE_SIZE;
+	void *phys = pmalloc_below(pages * 2, 0xFFFFFFFF);
+	if(!phys)
+	{
+		printf("ata: couldn't allocate the PRDT\n");
+		idedev = NULL;
+		return -1;
+	}
+	uintptr_t start = ((uintptr_t) phys + ATA_PRDT_SIZE - 1) & ~((uintptr_t) ATA_PRDT_SIZE - 1);
+	size_t head = (start - (uintptr_t) phys) / PAGE_SIZE;
+	pfree(head, phys);
+	pfree(pages - head, (void*)(start + ATA_PRDT_SIZE));
+	prdt_phys = (uint32_t) start;
+	PRDT = (prdt_entry_t*)(start + PHYS_BASE);
+	memset(PRDT, 0, ATA_PRDT_SIZE);
+	printf("ata: allocated prdt base %x\n", prdt_phys);
 	/* Enable PCI IDE mode, and PCI busmastering DMA*/
 	enable_pci_ide(idedev);
 	/* Reset the controller */
@@ -127,125 +165,152 @@ void initialize_ata()
 		for(int w = 0; w < 2; w++)
 		{
 			ata_set_drive(f, w);
-			int curr = f + w;
-			uint8_t status = inb(ATA_DATA1 + ATA_REG_STATUS);
-			if (status != 0)
-				ide_drives[curr].exists = 1;
-			else
+			int curr = f * 2 + w;
+			uint16_t io = f ? ATA_DATA2 : ATA_DATA1;
+			uint8_t status = inb(io + ATA_REG_STATUS);
+			if (status == 0)
 				continue;
-			outb(ATA_DATA1 + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+			outb(io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
 			delay_400ns();
 			if(ata_wait_for_irq(100))
 			{
 				printf("ata: IDENTIFY error\n");
 				continue;
 			}
+			ide_drives[curr].exists = 1;
+			ide_drives[curr].channel = f;
+			ide_drives[curr].drive = w;
+			/* The sector counts are stored least significant word first */
 			for(int i = 0; i < 256; i++)
 			{
-				uint64_t data = (uint64_t)inw(ATA_DATA1);
-				if(i == 61)
+				uint64_t data = (uint64_t)inw(io);
+				if(i == 60)
 					ide_drives[curr].lba28 |= data;
-				else if(i == 60)
+				else if(i == 61)
 					ide_drives[curr].lba28 |= data << 16;
-				else if(i == 100)
-					ide_drives[curr].lba48 |= data << 48;
-				else if(i == 101)
-					ide_drives[curr].lba48 |= data << 32;
-				else if(i == 102)
-					ide_drives[curr].lba48 |= data << 16;
-				else if(i == 103)
-					ide_drives[curr].lba48 |= data;
+				else if(i >= 100 && i <= 103)
+					ide_drives[curr].lba48 |= data << (16 * (i - 100));
 			}
 		}
 	}
 	printf("Probing finished\n");
-}
-void ata_read_sectors(unsigned int channel, unsigned int drive, uint32_t buffer, uint16_t bytesoftransfer, uint64_t lba48)
-{
-	if(bytesoftransfer == 0) bytesoftransfer = UINT16_MAX;
-	uint16_t num_secs = bytesoftransfer / 512;
-	if(bytesoftransfer % 512)
-		num_secs++;
-	if(!PRDT)
-		PRDT = prdt_base;
-	PRDT->data_buffer = buffer;
-	PRDT->size = bytesoftransfer;
-	PRDT->res = 0x8000;
-	uint32_t param = (uint32_t)((uint64_t)virtual2phys(PRDT));
-	if(!channel)
+	ata_queue = blk_alloc_queue(ata_start, ATA_MAX_SECTORS, ATA_PRDT_MAX_ENTRIES);
+	if(!ata_queue)
+		return -1;
+	ata_queue->timeout = ata_timeout;
+	/* PRDs hold 32-bit addresses, and the controller transfers words. Anything else gets bounced. */
+	ata_queue->dma_limit = 0xFFFFFFFF;
+	ata_queue->dma_align = 1;
+	for(int i = 0; i < 4; i++)
 	{
-		outl(bar4_base + 0x4, param);
-		outb(bar4_base + 2, 4);
-	}else
-	{
-		outl(bar4_base + 0x8 + 0x4, param);
-		outb(bar4_base + 0x8 + 2, 4);
+		uint64_t sectors = ide_drives[i].lba48 ? ide_drives[i].lba48 : ide_drives[i].lba28;
+		if(!ide_drives[i].exists || !sectors)
+			continue;
+		char name[] = "ata0";
+		name[3] += i;
+		ide_drives[i].dev = blk_add_disk(name, sectors, ata_queue, &ide_drives[i]);
 	}
-	ata_set_drive(channel, drive);
-	outb(0x1F0 + ATA_REG_SECCOUNT0 , num_secs >> 8 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA0, lba48 >> 24 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA1, lba48 >> 32 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA2, lba48 >> 40 & 0xFF);
-	outb(0x1F0 + ATA_REG_SECCOUNT0 , num_secs & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA0, lba48 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA1, lba48 >> 8 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA2, lba48 >> 16 & 0xFF);
-	/* Send the read command */
-	outb(bar4_base, 8);
-	if(channel == 0)
-		outb(ATA_DATA1 + ATA_REG_COMMAND, ATA_CMD_READ_DMA_EXT);
-	else
-		outb(ATA_DATA2 + ATA_REG_COMMAND, ATA_CMD_READ_DMA_EXT);
-	outb(bar4_base, 9);
-	ata_wait_for_irq(10000);
-	outb(bar4_base, 0);
+	return 0;
 }
-void ata_write_sectors(unsigned int channel, unsigned int drive, uint32_t buffer, uint16_t bytesoftransfer, uint64_t lba48)
+static const pci_id_t ata_ids[] =
 {
-	if(bytesoftransfer == 0) bytesoftransfer = UINT16_MAX;
-	uint16_t num_secs = bytesoftransfer / 512;
-	if(bytesoftransfer % 512)
-		num_secs++;
-	if(!PRDT)
-		PRDT = prdt_base;
-	PRDT->data_buffer = buffer;
-	PRDT->size = bytesoftransfer;
-	PRDT->res = 0x8000;
-	uint32_t param = (uint32_t)((uint64_t)virtual2phys(PRDT));
-	if(!channel)
-	{
-		outl(bar4_base + 0x4, param);
-		outb(bar4_base + 2, 4);
-	}else
-	{
-		outl(bar4_base + 0x8 + 0x4, param);
-		outb(bar4_base + 0x8 + 2, 4);
-	}
+	PCI_ID_CLASS(CLASS_MASS_STORAGE_CONTROLLER, 1, 0, 0xFFFF00),
+	{0}
+};
+static pci_driver_t ata_driver = {"ata", ata_ids, ata_probe, 0, NULL};
+void initialize_ata()
+{
+	pci_register_driver(&ata_driver);
+}
+/* Points the bus master at the PRDT and starts a DMA command for the given amount of bytes.
+ * ata_irq() picks it up from there.
+*/
+static void ata_issue_dma(unsigned int channel, unsigned int drive, size_t bytes, uint64_t lba48, int write)
+{
+	/* A count of 0 means 65536 sectors, which is what the truncation gives us */
+	uint16_t num_secs = (bytes + 511) / 512;
+	uint16_t bm = channel ? bar4_base + 0x8 : bar4_base;
+	uint16_t io = channel ? ATA_DATA2 : ATA_DATA1;
+	outl(bm + 0x4, prdt_phys);
+	outb(bm + 2, 6);
 	ata_set_drive(channel, drive);
-	outb(0x1F0 + ATA_REG_SECCOUNT0 , num_secs >> 8 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA0, lba48 >> 24 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA1, lba48 >> 32 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA2, lba48 >> 40 & 0xFF);
-	outb(0x1F0 + ATA_REG_SECCOUNT0 , num_secs & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA0, lba48 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA1, lba48 >> 8 & 0xFF);
-	outb(0x1F0 + ATA_REG_LBA2, lba48 >> 16 & 0xFF);
-	/* Send the write command */
-	outb(bar4_base, 0);
-	if(channel == 0)
-		outb(ATA_DATA1 + ATA_REG_COMMAND, ATA_CMD_WRITE_DMA_EXT);
-	else
-		outb(ATA_DATA2 + ATA_REG_COMMAND, ATA_CMD_WRITE_DMA_EXT);
-	outb(bar4_base, 1);
-	ata_wait_for_irq(10000);
-	outb(bar4_base, 0);
-	if(!channel)
-	{
-		outl(bar4_base + 0x4, 0);
-		outb(bar4_base + 2, 4);
-	}else
+	outb(io + ATA_REG_SECCOUNT0 , num_secs >> 8 & 0xFF);
+	outb(io + ATA_REG_LBA0, lba48 >> 24 & 0xFF);
+	outb(io + ATA_REG_LBA1, lba48 >> 32 & 0xFF);
+	outb(io + ATA_REG_LBA2, lba48 >> 40 & 0xFF);
+	outb(io + ATA_REG_SECCOUNT0 , num_secs & 0xFF);
+	outb(io + ATA_REG_LBA0, lba48 & 0xFF);
+	outb(io + ATA_REG_LBA1, lba48 >> 8 & 0xFF);
+	outb(io + ATA_REG_LBA2, lba48 >> 16 & 0xFF);
+	/* Bit 3 of the bus master command register is the direction, set when the device writes to memory */
+	outb(bm, write ? 0 : 8);
+	outb(io + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+	outb(bm, write ? 1 : 9);
+}
+/* Describes every bio of the request in the PRDT, so the whole request is done with a single command.
+ * Pieces that are physically contiguous share an entry, as long as it doesn't cross a 64K boundary.
+ * The block layer already made sure the pieces are word aligned, below 4GiB and that there are no
+ * more of them than there are entries. Returns the number of bytes described.
+*/
+static size_t ata_fill_prdt(request_t *req)
+{
+	size_t entries = 0;
+	size_t total = 0;
+	uint32_t next = 0;
+	for(bio_t *bio = req->bio; bio; bio = bio->next)
 	{
-		outl(bar4_base + 0x8 + 0x4, 0);
-		outb(bar4_base + 0x8 + 2, 4);
+		for(int i = 0; i < bio->veccnt; i++)
+		{
+			char *base = bio->vec[i].iov_base;
+			size_t len = bio->vec[i].iov_len;
+			while(len)
+			{
+				size_t chunk = PAGE_SIZE - ((uintptr_t) base & (PAGE_SIZE - 1));
+				if(chunk > len)
+					chunk = len;
+				uint32_t phys = (uint32_t)(uint64_t) virtual2phys(base);
+				prdt_entry_t *prd = entries ? &PRDT[entries-1] : NULL;
+				size_t prd_len = prd ? (prd->size ? prd->size : 0x10000) : 0;
+				if(prd && phys == next && (phys & 0xFFFF) && prd_len + chunk <= 0x10000)
+					prd->size = (uint16_t)(prd_len + chunk);
+				else
+				{
+					if(entries == ATA_PRDT_MAX_ENTRIES)
+						return 0;
+					PRDT[entries].data_buffer = phys;
+					PRDT[entries].size = (uint16_t) chunk;
+					PRDT[entries].res = 0;
+					entries++;
+				}
+				next = phys + chunk;
+				total += chunk;
+				base += chunk;
+				len -= chunk;
+			}
+		}
 	}
+	if(!entries)
+		return 0;
+	PRDT[entries-1].res = 0x8000;
+	return total;
+}
+static int ata_start(request_queue_t *q, request_t *req)
+{
+	struct ide_drive *d = req->disk->driver_data;
+	size_t bytes = ata_fill_prdt(req);
+	if(!bytes)
+		return -1;
+	ata_active = d;
+	ata_issue_dma(d->channel, d->drive, bytes, req->sector, req->op == BIO_WRITE);
+	return 0;
+}
+/* The interrupt never came, stop the transfer and fail the request */
+static void ata_timeout(request_queue_t *q, request_t *req)
+{
+	if(!ata_active)
+		return;
+	outb(ata_active->channel ? bar4_base + 0x8 : bar4_base, 0);
+	ata_active = NULL;
+	printf("ata: request for sector %u timed out\n", req->sector);
+	blk_complete(q, req->tag, EIO);
 }
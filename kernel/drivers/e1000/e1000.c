@@ -14,6 +14,7 @@
 #include <stdbool.h>
 
 #include <kernel/vmm.h>
+#include <kernel/irq.h>
 #include <kernel/ethernet.h>
 
 #include <drivers/mmio.h>
@@ -28,26 +29,21 @@ _Bool eeprom_exists = false;
 _Bool got_packet = false;
 static char *mem_space = NULL;
 static uint16_t io_space = 0;
-// Returns 1 if it exists, 0 if not
-int detect_e1000_nic()
-{
-	PCIDevice *pcidev = get_pcidev_from_vendor_device(E1000_DEV, INTEL_VEND);
-	if(!pcidev)
-		return 0;
-	nicdev = pcidev;
-	return 1;
-}
 uint32_t e1000_read_command(uint16_t p_address);
 static void initialize_e1000_busmastering()
 {
 	uint32_t command_reg = pci_config_read_dword(nicdev->slot, nicdev->device, nicdev->function, PCI_COMMAND);
 	pci_write_dword(nicdev->slot, nicdev->device, nicdev->function, PCI_COMMAND, command_reg | 4);
 }
-void e1000_handle_recieve()
+static eth_poll_t e1000_poll;
+/* Runs in softirqd, takes at most budget packets off the ring. Returns 1 if it left some. */
+static int e1000_handle_recieve(eth_poll_t *p, unsigned int budget)
 {
 	uint16_t old_cur = 0;
 	while((rx_descs[rx_cur]->status & 0x1))
 	{
+		if(!budget--)
+			return 1;
 		got_packet = true;
 		uint8_t *buf = (uint8_t *)rx_descs[rx_cur]->addr;
 		uint16_t len = rx_descs[rx_cur]->length;
@@ -59,13 +55,15 @@ void e1000_handle_recieve()
 		rx_cur = (rx_cur + 1) % E1000_NUM_RX_DESC;
 		e1000_write_command(REG_RXDESCTAIL, old_cur);
 }
+	return 0;
 }
+/* Reading the cause acknowledges it, the packets themselves are left for the softirq */
 static void e1000_irq()
 {
 	volatile uint32_t status = e1000_read_command(0xc0);
 	if(status & 0x80)
 	{
-		e1000_handle_recieve();
+		eth_poll_schedule(&e1000_poll);
 	}
 }
 void e1000_write_command(uint16_t addr, uint32_t val)
@@ -211,15 +209,31 @@ int e1000_init_descs()
 
 	return 0;
 }
+static void e1000_msi(void *ctx)
+{
+	e1000_irq();
+}
 void e1000_enable_interrupts()
 {
-	uint16_t int_no = pci_get_intn(nicdev->slot, nicdev->device, nicdev->function);
-	
-	// Get the IRQ number and install its handler
-	printf("e1000: using IRQ number %d\n", int_no);
+	/* Parts that do MSI get a vector of their own, instead of sharing a line */
+	int vector = nicdev->msi_cap ? irq_allocate_vector(e1000_msi, NULL, nicdev->instance) : -1;
+	if(vector >= 0 && pci_enable_msi(nicdev, vector) < 0)
+	{
+		irq_free_vector(vector);
+		vector = -1;
+	}
+	if(vector >= 0)
+		printf("e1000: using MSI vector %d\n", vector);
+	else
+	{
+		uint16_t int_no = pci_get_intn(nicdev->slot, nicdev->device, nicdev->function);
 
-	pic_unmask_irq(int_no);
-	irq_install_handler(int_no, e1000_irq);
+		// Get the IRQ number and install its handler
+		printf("e1000: using IRQ number %d\n", int_no);
+
+		irq_unmask(int_no);
+		irq_install_handler(int_no, e1000_irq);
+	}
 	
 	e1000_write_command(REG_IMASK, 0x1F6DC);
 	e1000_write_command(REG_IMASK ,0xff & ~4);
@@ -237,10 +251,12 @@ int e1000_send_packet(const void *p_data, uint16_t p_len)
 	while(!(tx_descs[old_cur]->status & 0xff));
 	return 0;
 }
-int e1000_init()
+/* There's one set of rings, so only the first NIC gets used */
+static int e1000_probe(PCIDevice *dev, const pci_id_t *id)
 {
-	if(!detect_e1000_nic())
-		return 1;
+	if(nicdev)
+		return -1;
+	nicdev = dev;
 	pcibar_t *bar = pci_get_bar(nicdev->slot, nicdev->device, nicdev->function, 0);
 	char *phys_mem_space = NULL;
 	if(bar->isIO)
@@ -250,14 +266,14 @@ int e1000_init()
 	if(phys_mem_space)
 		printf("e1000: mmio mode\n");
 	else
-		return 1;
+		return -1;
 	printf("e1000: physical mem %p\n", phys_mem_space);
 	size_t needed_pages = bar->size / PAGE_SIZE;
 	if(bar->size % PAGE_SIZE)
 		needed_pages++;
 	mem_space = vmm_allocate_virt_address(VM_KERNEL, needed_pages, VMM_TYPE_HW, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
 	if(!mem_space)
-		return 1;
+		return -1;
 	uintptr_t virt = (uintptr_t) mem_space;
 	for(size_t i = 0; i < needed_pages; i++)
 	{
@@ -271,12 +287,26 @@ int e1000_init()
 
 	e1000_detect_eeprom();
 	if(e1000_read_mac_address())
-		return 1;
+		return -1;
 	printf("MAC address: %x:%x:%x:%x:%x:%x\n", mac_address[0], mac_address[1], mac_address[2], mac_address[3], mac_address[4], mac_address[5]);
 	if(e1000_init_descs())
 		printf("e1000: failed to initialize!\n");
+	eth_poll_init(&e1000_poll, e1000_handle_recieve);
 	e1000_enable_interrupts();
 	eth_set_dev_send_packet(e1000_send_packet);
 	free(bar); // Don't forget to free bar, as we don't want a memory leak
 	return 0;
+}
+static const pci_id_t e1000_ids[] =
+{
+	PCI_ID(INTEL_VEND, E1000_DEV),
+	PCI_ID(INTEL_VEND, E1000_I217),
+	PCI_ID(INTEL_VEND, E1000_82577LM),
+	{0}
+};
+static pci_driver_t e1000_driver = {"e1000", e1000_ids, e1000_probe, 0, NULL};
+int e1000_init()
+{
+	pci_register_driver(&e1000_driver);
+	return 0;
 }
\ No newline at end of file
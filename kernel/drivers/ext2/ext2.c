@@ -15,389 +15,1071 @@
 #include <stdlib.h>
 #include <drivers/ext2.h>
 #include <kernel/vfs.h>
+#include <kernel/pagecache.h>
+#include <kernel/bcache.h>
+#include <kernel/icache.h>
+#include <kernel/spinlock.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 ext2_fs_t *fslist = NULL;
-void *ext2_read_block(uint32_t block_index, uint16_t blocks, ext2_fs_t *fs)
+/* Any buffer will do, the block layer bounces what the disk can't DMA into */
+void *ext2_read_block(uint64_t block_index, uint16_t blocks, ext2_fs_t *fs)
 {
 	size_t size = blocks * fs->block_size; /* size = nblocks * block size */
-	void *buff = vmm_allocate_virt_address(VM_KERNEL, 1, VMM_TYPE_REGULAR, 0); /* Allocate a buffer */
-	vmm_map_range(buff, 1, VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC);
+	void *buff = malloc(size);
 	if(!buff)
+		return errno = ENOMEM, NULL;
+	if(blk_read(fs->dev, block_index * fs->block_size / 512, buff, size) < 0)
+	{
+		free(buff);
 		return NULL;
-	memset(buff, 0, size);
-	uint32_t phys = (uint64_t)virtual2phys(buff) >> 0 & 0xFFFFFFFF;
-	uint64_t lba = fs->first_sector + (block_index * fs->block_size / 512);
-	ata_read_sectors(fs->channel, fs->drive, phys, size, lba);
+	}
 	return buff;
 }
-void ext2_write_block(uint32_t block_index, uint16_t blocks, ext2_fs_t *fs, void *buffer)
+int ext2_write_block(uint64_t block_index, uint16_t blocks, ext2_fs_t *fs, void *buffer)
 {
 	size_t size = blocks * fs->block_size; /* size = nblocks * block size */
-	void *buff = vmm_allocate_virt_address(VM_KERNEL, 1, VMM_TYPE_REGULAR, 0); /* Allocate a buffer */
-	vmm_map_range(buff, 1, VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC);
-	if(!buff)
-		return NULL;
-	memcpy(buff, buffer, size);
-	uint32_t phys = (uint64_t)virtual2phys(buff) >> 0 & 0xFFFFFFFF;
-	uint64_t lba = fs->first_sector + (block_index * fs->block_size / 512);
-	ata_read_sectors(fs->channel, fs->drive, phys, size, lba);
-	vmm_destroy_mappings(buff, 1);
+	return blk_write(fs->dev, block_index * fs->block_size / 512, buffer, size);
+}
+/* Buffer cache I/O callbacks, the buffers are physically contiguous so they can be DMA'd into directly */
+static int ext2_bcache_read(bcache_dev_t *dev, buffer_head_t *bh)
+{
+	ext2_fs_t *fs = (ext2_fs_t*) dev;
+	return blk_read(fs->dev, bh->block * fs->block_size / 512, bh->data, fs->block_size);
+}
+static int ext2_bcache_write(bcache_dev_t *dev, buffer_head_t *bh)
+{
+	ext2_fs_t *fs = (ext2_fs_t*) dev;
+	return blk_write(fs->dev, bh->block * fs->block_size / 512, bh->data, fs->block_size);
 }
+/* Reads the whole contents of a directory. Directory blocks are metadata, so they go
+ * through the buffer cache, which keeps path walks from hitting the disk every time.
+*/
 char *ext2_read_inode_bp(inode_t *inode, ext2_fs_t *fs, size_t size_read)
 {
 	uint64_t size = ((uint64_t)inode->size_hi << 32) | inode->size_lo;
 	char *buf = malloc(size);
+	if(!buf)
+		return errno = ENOMEM, NULL;
 	memset(buf, 0, size);
-	char *put = buf;
-	for(uint64_t i = 0; i < size / fs->block_size; i++)
+	for(uint64_t i = 0; i * fs->block_size < size; i++)
 	{
-		if(i < 12)
+		size_t len = size - i * fs->block_size;
+		if(len > fs->block_size)
+			len = fs->block_size;
+		uint64_t block = ext2_bmap(inode, fs, i);
+		if(!block)
+			continue;
+		buffer_head_t *bh = bread(&fs->bdev, block);
+		if(!bh)
 		{
-			char *bf = ext2_read_block(inode->dbp[i], 1, fs);
-			memcpy(put, bf, fs->block_size);
-			size_t pages = fs->block_size / PAGE_SIZE;
-			if(fs->block_size % PAGE_SIZE)
-				pages++;
-			vmm_destroy_mappings(bf, pages);
-			put+=fs->block_size;
+			free(buf);
+			return errno = EIO, NULL;
 		}
-		if(i >= 12 && i < fs->block_size / 4 + 12)
+		memcpy(buf + i * fs->block_size, bh->data, len);
+		brelse(bh);
+	}
+	return buf;
+}
+/* Reads len bytes starting at the disk block block. Whole blocks are read straight into the
+ * buffer, up to EXT2_MAX_TRANSFER bytes per command. A partial block at the end, or anything
+ * the disk can't DMA into directly, goes through a bounce buffer a block at a time.
+*/
+static int ext2_read_run(ext2_fs_t *fs, uint64_t block, void *buffer, size_t len)
+{
+	char *put = buffer;
+	size_t whole = len & ~((size_t) fs->block_size - 1);
+	while(whole)
+	{
+		size_t chunk = whole > EXT2_MAX_TRANSFER ? EXT2_MAX_TRANSFER : whole;
+		if(blk_read(fs->dev, block * fs->block_size / 512, put, chunk) < 0)
+			break;
+		put += chunk;
+		whole -= chunk;
+		len -= chunk;
+		block += chunk / fs->block_size;
+	}
+	while(len)
+	{
+		size_t n = len > fs->block_size ? fs->block_size : len;
+		char *bf = ext2_read_block(block, 1, fs);
+		if(!bf)
+			return -1;
+		memcpy(put, bf, n);
+		free(bf);
+		put += n;
+		len -= n;
+		block++;
+	}
+	return 0;
+}
+/* Writes len bytes, a multiple of the block size, starting at the disk block block.
+ * Returns how much of it made it to the disk in one piece from the start, or -1 if none of it did.
+*/
+static ssize_t ext2_write_run(ext2_fs_t *fs, uint64_t block, void *buffer, size_t len)
+{
+	char *put = buffer;
+	size_t done = 0;
+	while(done < len)
+	{
+		size_t chunk = len - done > EXT2_MAX_TRANSFER ? EXT2_MAX_TRANSFER : len - done;
+		if(blk_write(fs->dev, block * fs->block_size / 512, put, chunk) < 0)
 		{
-			uint32_t *indb = ext2_read_block(inode->single_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size / 4; j++)
+			/* Find out where exactly it went wrong */
+			for(size_t i = 0; i < chunk; i += fs->block_size)
 			{
-				if(indb[j] != 0)
+				if(ext2_write_block(block + i / fs->block_size, 1, fs, put + i) < 0)
 				{
-					char *bf = ext2_read_block(indb[j], 1, fs);
-					memcpy(put, bf, fs->block_size);
-					size_t pages = fs->block_size / PAGE_SIZE;
-					if(fs->block_size % PAGE_SIZE)
-						pages++;
-					vmm_destroy_mappings(bf, pages);
-					put+=fs->block_size;
-					i++;
+					done += i;
+					return done ? (ssize_t) done : -1;
 				}
 			}
 		}
-		if(i >= fs->block_size / 4 + 12 && i < (fs->block_size / 4)*(fs->block_size / 4) + 12)
+		put += chunk;
+		done += chunk;
+		block += chunk / fs->block_size;
+	}
+	return done;
+}
+/* Reads sz bytes of file data, starting at the block blck of the file. Blocks are read a run
+ * at a time, so a contiguous file costs a handful of disk commands.
+ * File data is cached by the page cache further up, so it doesn't go through the buffer cache.
+*/
+size_t ext2_read_file(inode_t *inode, ext2_fs_t *fs, uint32_t ino, size_t sz, uint32_t blck, void *buffer)
+{
+	char *put = buffer;
+	size_t left = sz;
+	uint32_t block = blck;
+	while(left)
+	{
+		ext2_run_t run;
+		uint32_t nblocks = (left + fs->block_size - 1) / fs->block_size;
+		if(ext2_map_blocks(inode, fs, ino, block, nblocks, &run) < 0)
+			return (size_t) -1;
+		size_t len = (size_t) run.len * fs->block_size;
+		if(len > left)
+			len = left;
+		if(!run.physical)
+			memset(put, 0, len); /* A hole */
+		else if(ext2_read_run(fs, run.physical, put, len) < 0)
+			return (size_t) -1;
+		put += len;
+		left -= len;
+		block += run.len;
+	}
+	return sz;
+}
+/* Overwrites sz bytes of file data starting at the block blck, sz needs to be a multiple of the
+ * block size. Holes are left alone, blocks only get allocated by page cache writeback.
+*/
+size_t ext2_write_file(inode_t *inode, ext2_fs_t *fs, uint32_t ino, size_t sz, uint32_t blck, void *buffer)
+{
+	char *put = buffer;
+	size_t left = sz;
+	uint32_t block = blck;
+	while(left)
+	{
+		ext2_run_t run;
+		if(ext2_map_blocks(inode, fs, ino, block, left / fs->block_size, &run) < 0)
+			break;
+		size_t len = (size_t) run.len * fs->block_size;
+		if(run.physical)
 		{
-			uint32_t *dib = ext2_read_block(inode->doubly_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size / 4 ; j++)
+			ssize_t written = ext2_write_run(fs, run.physical, put, len);
+			if(written < 0)
+				break;
+			if((size_t) written < len)
 			{
-				if(dib[j] != 0)
-				{
-					uint32_t *ib = ext2_read_block(dib[j], 1, fs);
-					for(uint64_t k = 0; k < 1024; k++)
-					{
-						if(ib[k] != 0)
-						{
-							char *bf = ext2_read_block(ib[j], 1, fs);
-							memcpy(put, bf, fs->block_size);
-							size_t pages = fs->block_size / PAGE_SIZE;
-							if(fs->block_size % PAGE_SIZE)
-								pages++;
-							vmm_destroy_mappings(bf, pages);
-							put+=fs->block_size;
-							i++;
-						}
-					}
-				}
+				left -= written;
+				break;
 			}
-
 		}
-		if(i >= (fs->block_size / 4)* (fs->block_size / 4) + 12 && i < (fs->block_size / 4)*(fs->block_size / 4)
-		*(fs->block_size / 4) + 12)
+		put += len;
+		left -= len;
+		block += run.len;
+	}
+	/* A short count if it stopped partway, -1 if it didn't get anywhere */
+	if(left == sz)
+		return errno = EIO, (size_t) -1;
+	return sz - left;
+}
+/* Returns the block of the inode table that holds inode, and sets *off to where it is in there */
+static uint64_t ext2_inode_block(ext2_fs_t *fs, uint32_t inode, uint32_t *off)
+{
+	uint32_t bg = (inode - 1) / fs->inodes_per_block_group;
+	uint32_t index = (inode - 1) % fs->inodes_per_block_group;
+	*off = (index * fs->inode_size) % fs->block_size;
+	return fs->bgdt[bg].inode_table_addr + (index * fs->inode_size) / fs->block_size;
+}
+/* Returns a copy of the on-disk inode, which needs to be free()'d by the caller */
+inode_t *ext2_get_inode_from_number(ext2_fs_t *fs, uint32_t inode)
+{
+	uint32_t blockind;
+	buffer_head_t *bh = bread(&fs->bdev, ext2_inode_block(fs, inode, &blockind));
+	if(!bh)
+		return NULL;
+	inode_t *ino = malloc(sizeof(inode_t));
+	if(!ino)
+	{
+		brelse(bh);
+		return errno = ENOMEM, NULL;
+	}
+	memcpy(ino, (char*) bh->data + blockind, sizeof(inode_t));
+	brelse(bh);
+	return ino;
+}
+/* Copies ino back into the inode table, the buffer cache takes it to the disk */
+static int ext2_put_inode(ext2_fs_t *fs, uint32_t inode, inode_t *ino)
+{
+	uint32_t blockind;
+	buffer_head_t *bh = bread(&fs->bdev, ext2_inode_block(fs, inode, &blockind));
+	if(!bh)
+		return errno = EIO, -1;
+	memcpy((char*) bh->data + blockind, ino, sizeof(inode_t));
+	bdirty(bh);
+	brelse(bh);
+	return 0;
+}
+inode_t *ext2_get_inode_from_dir(ext2_fs_t *fs, dir_entry_t *dirent, char *name, uint32_t *inode_number)
+{
+	dir_entry_t *dirs = dirent;
+	while(dirs->inode != 0)
+	{
+		if(!strcmp(dirs->name, name))
 		{
-			uint32_t *tib = ext2_read_block(inode->trebly_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size/4; j++)
-			{
-				if(tib[j] != 0)
-				{
-					uint32_t *dib = ext2_read_block(inode->doubly_indirect_bp, 1, fs);
-					for(uint64_t k = 0; k < fs->block_size / 4 ; k++)
-					{
-						if(dib[k] != 0)
-						{
-							uint32_t *ib = ext2_read_block(dib[k], 1, fs);
-							for(uint64_t l = 0; l < 1024; l++)
-							{
-								if(ib[l] != 0)
-								{
-									char *bf = ext2_read_block(ib[l], 1, fs);
-									memcpy(put, bf, fs->block_size);
-									size_t pages = fs->block_size / PAGE_SIZE;
-									if(fs->block_size % PAGE_SIZE)
-										pages++;
-									vmm_destroy_mappings(bf, pages);
-									put+=fs->block_size;
-									i++;
-								}
-							}
-						}
-					}
-				}
-
-			}
+			*inode_number = dirs->inode;
+			return ext2_get_inode_from_number(fs,dirs->inode);
 		}
+		dirs = (dir_entry_t*)((char*)dirs + dirs->size);
 	}
-	return buf;
+	return NULL;
+}
+/* Writes straight to the disk, for filesystems whose blocks are too big for the page cache.
+ * Only data inside the file can be overwritten, files only grow through the page cache.
+*/
+size_t ext2_write(size_t offset, size_t sizeofwrite, void *buffer, vfsnode_t *node)
+{
+	ext2_fs_t *fs = fslist;
+	if(offset >= node->size)
+		return errno = ENOSYS, (size_t) -1;
+	if(sizeofwrite > node->size - offset)
+		sizeofwrite = node->size - offset;
+	inode_t *ino = ext2_get_inode_from_number(fs, node->inode);
+	if(!ino)
+		return errno = EINVAL, (size_t)-1;
+	uint32_t block_index = offset / fs->block_size;
+	size_t block_off = offset % fs->block_size;
+	size_t span = (block_off + sizeofwrite + fs->block_size - 1) & ~((size_t) fs->block_size - 1);
+	char *buf = malloc(span);
+	if(!buf)
+	{
+		free(ino);
+		return errno = ENOMEM, (size_t) -1;
+	}
+	/* Only the first and last blocks can be partially overwritten, read them in first */
+	size_t last = span - fs->block_size;
+	if(ext2_read_file(ino, fs, node->inode, fs->block_size, block_index, buf) == (size_t) -1 ||
+	(last && ext2_read_file(ino, fs, node->inode, fs->block_size, block_index + last / fs->block_size, buf + last) == (size_t) -1))
+	{
+		free(buf);
+		free(ino);
+		return errno = EIO, (size_t) -1;
+	}
+	memcpy(buf + block_off, buffer, sizeofwrite);
+	size_t written = ext2_write_file(ino, fs, node->inode, span, block_index, buf);
+	free(buf);
+	free(ino);
+	if(written == (size_t) -1 || written <= block_off)
+		return errno = EIO, (size_t) -1;
+	/* Only the part of the caller's data that made it counts */
+	written -= block_off;
+	return written < sizeofwrite ? written : sizeofwrite;
+}
+size_t ext2_read(size_t offset, size_t sizeofreading, void *buffer, vfsnode_t *nd)
+{
+	if(offset > nd->size)
+		return errno = EINVAL, -1;
+	if(sizeofreading > nd->size - offset)
+		sizeofreading = nd->size - offset;
+	ext2_fs_t *fs = fslist;
+	uint32_t block_index = offset / fs->block_size;
+	size_t block_off = offset % fs->block_size;
+	inode_t *ino = ext2_get_inode_from_number(fs, nd->inode);
+	if(!ino)
+		return errno = EINVAL, -1;
+	size_t size;
+	if(!block_off)
+		size = ext2_read_file(ino, fs, nd->inode, sizeofreading, block_index, buffer);
+	else
+	{
+		/* Reads always start at a block boundary, so the start of the block gets read and dropped */
+		char *buf = malloc(block_off + sizeofreading);
+		if(!buf)
+		{
+			free(ino);
+			return errno = ENOMEM, -1;
+		}
+		size = ext2_read_file(ino, fs, nd->inode, block_off + sizeofreading, block_index, buf);
+		if(size != (size_t) -1)
+		{
+			memcpy(buffer, buf + block_off, sizeofreading);
+			size = sizeofreading;
+		}
+		free(buf);
+	}
+	free(ino);
+	return size;
+}
+/* Reads entry 'index' of the block pointer table stored in 'block' */
+static uint32_t ext2_read_block_pointer(uint32_t block, uint32_t index, ext2_fs_t *fs)
+{
+	if(!block)
+		return 0;
+	buffer_head_t *bh = bread(&fs->bdev, block);
+	if(!bh)
+		return 0;
+	uint32_t ret = ((uint32_t*) bh->data)[index];
+	brelse(bh);
+	return ret;
+}
+/* Resolved runs, per inode. Blocks only ever get allocated into holes, which aren't cached,
+ * and never get freed, so a run never goes stale.
+*/
+static ext2_run_cache_t *runcache_hash[EXT2_RUNCACHE_HASH_SIZE];
+static ext2_run_cache_t *runcache_lru_head = NULL;
+static ext2_run_cache_t *runcache_lru_tail = NULL;
+static size_t nr_runcaches = 0;
+static spinlock_t runcache_spl;
 
+static inline unsigned int runcache_hash_index(ext2_fs_t *fs, uint32_t ino)
+{
+	return ((uintptr_t) fs ^ ino) % EXT2_RUNCACHE_HASH_SIZE;
 }
-size_t ext2_read_file(inode_t *inode, ext2_fs_t *fs, size_t sz, uint32_t blck, void *buffer)
+static void runcache_lru_remove(ext2_run_cache_t *rc)
 {
-	uint32_t remainder = sz % fs->block_size;
-	uint32_t block_space = sz + fs->block_size - remainder;
-	char *buf = malloc(block_space);
-	memset(buf, 0, block_space);
-	char *put = buf;
-	uint32_t block = blck;
-	for(uint64_t i = block; i < block_space / fs->block_size; i++)
+	if(rc->lru_prev)
+		rc->lru_prev->lru_next = rc->lru_next;
+	else
+		runcache_lru_head = rc->lru_next;
+	if(rc->lru_next)
+		rc->lru_next->lru_prev = rc->lru_prev;
+	else
+		runcache_lru_tail = rc->lru_prev;
+	rc->lru_prev = rc->lru_next = NULL;
+}
+static void runcache_lru_add(ext2_run_cache_t *rc)
+{
+	rc->lru_next = runcache_lru_head;
+	if(runcache_lru_head)
+		runcache_lru_head->lru_prev = rc;
+	runcache_lru_head = rc;
+	if(!runcache_lru_tail)
+		runcache_lru_tail = rc;
+}
+/* Returns the run cache of the inode, creating one if create is set. Needs runcache_spl held. */
+static ext2_run_cache_t *runcache_get(ext2_fs_t *fs, uint32_t ino, int create)
+{
+	ext2_run_cache_t **head = &runcache_hash[runcache_hash_index(fs, ino)];
+	for(ext2_run_cache_t *rc = *head; rc; rc = rc->hash_next)
+	{
+		if(rc->fs == fs && rc->ino == ino)
+		{
+			runcache_lru_remove(rc);
+			runcache_lru_add(rc);
+			return rc;
+		}
+	}
+	if(!create)
+		return NULL;
+	ext2_run_cache_t *rc;
+	if(nr_runcaches == EXT2_RUNCACHE_MAX_INODES)
+	{
+		/* Recycle the least recently used one */
+		rc = runcache_lru_tail;
+		runcache_lru_remove(rc);
+		ext2_run_cache_t **p = &runcache_hash[runcache_hash_index(rc->fs, rc->ino)];
+		while(*p != rc)
+			p = &(*p)->hash_next;
+		*p = rc->hash_next;
+	}
+	else
+	{
+		rc = malloc(sizeof(ext2_run_cache_t));
+		if(!rc)
+			return NULL;
+		nr_runcaches++;
+	}
+	memset(rc, 0, sizeof(ext2_run_cache_t));
+	rc->fs = fs;
+	rc->ino = ino;
+	rc->hash_next = *head;
+	*head = rc;
+	runcache_lru_add(rc);
+	return rc;
+}
+/* Looks block up in the cached runs, the run handed back starts at block */
+static int runcache_lookup(ext2_fs_t *fs, uint32_t ino, uint32_t block, uint32_t max, ext2_run_t *run)
+{
+	acquire_spinlock(&runcache_spl);
+	ext2_run_cache_t *rc = runcache_get(fs, ino, 0);
+	if(rc)
 	{
-		if(i < 12)
+		/* Binary search for the last run that starts at or before block */
+		size_t lo = 0, hi = rc->nr_runs;
+		while(lo < hi)
 		{
-			char *bf = ext2_read_block(inode->dbp[i], 1, fs);
-			memcpy(put, bf, fs->block_size);
-			size_t pages = fs->block_size / PAGE_SIZE;
-			if(fs->block_size % PAGE_SIZE)
-				pages++;
-			vmm_destroy_mappings(bf, pages);
-			put+=fs->block_size;
+			size_t mid = (lo + hi) / 2;
+			if(rc->runs[mid].logical <= block)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		if(i >= 12 && i < fs->block_size / 4 + 12)
+		ext2_run_t *r = lo ? &rc->runs[lo - 1] : NULL;
+		if(r && block - r->logical < r->len)
 		{
-			uint32_t *indb = ext2_read_block(inode->single_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size / 4; j++)
-			{
-				if(indb[j] != 0)
-				{
-					char *bf = ext2_read_block(indb[j], 1, fs);
-					memcpy(put, bf, fs->block_size);
-					size_t pages = fs->block_size / PAGE_SIZE;
-					if(fs->block_size % PAGE_SIZE)
-						pages++;
-					vmm_destroy_mappings(bf, pages);
-					put+=fs->block_size;
-					i++;
-				}
-			}
+			uint32_t skip = block - r->logical;
+			run->logical = block;
+			run->len = r->len - skip > max ? max : r->len - skip;
+			run->physical = r->physical + skip;
+			release_spinlock(&runcache_spl);
+			return 1;
 		}
-		if(i >= fs->block_size / 4 + 12 && i < (fs->block_size / 4)*(fs->block_size / 4) + 12)
+	}
+	release_spinlock(&runcache_spl);
+	return 0;
+}
+static void runcache_insert(ext2_fs_t *fs, uint32_t ino, const ext2_run_t *run)
+{
+	if(!run->physical || !run->len)
+		return;
+	acquire_spinlock(&runcache_spl);
+	ext2_run_cache_t *rc = runcache_get(fs, ino, 1);
+	if(!rc)
+	{
+		release_spinlock(&runcache_spl);
+		return;
+	}
+	/* Drop whatever the new run overlaps, it was resolved from a later starting point */
+	size_t j = 0;
+	for(size_t i = 0; i < rc->nr_runs; i++)
+	{
+		ext2_run_t *r = &rc->runs[i];
+		if(r->logical + r->len <= run->logical || r->logical >= run->logical + run->len)
+			rc->runs[j++] = *r;
+	}
+	rc->nr_runs = j;
+	/* A file this fragmented has to start over */
+	if(rc->nr_runs == EXT2_RUNCACHE_MAX_RUNS)
+		rc->nr_runs = 0;
+	size_t pos = rc->nr_runs;
+	while(pos && rc->runs[pos - 1].logical > run->logical)
+	{
+		rc->runs[pos] = rc->runs[pos - 1];
+		pos--;
+	}
+	rc->runs[pos] = *run;
+	rc->nr_runs++;
+	release_spinlock(&runcache_spl);
+}
+/* Finds the block pointer table that holds the entry for block (which is past the direct blocks),
+ * and the index of the entry in it. Returns 0 if the table is part of a hole.
+*/
+static uint32_t ext2_pointer_table(inode_t *inode, ext2_fs_t *fs, uint32_t block, uint32_t *index)
+{
+	uint32_t per_block = fs->block_size / 4;
+	block -= 12;
+	*index = block % per_block;
+	if(block < per_block)
+		return inode->single_indirect_bp;
+	block -= per_block;
+	if(block < per_block * per_block)
+		return ext2_read_block_pointer(inode->doubly_indirect_bp, block / per_block, fs);
+	block -= per_block * per_block;
+	uint32_t dib = ext2_read_block_pointer(inode->trebly_indirect_bp, block / (per_block * per_block), fs);
+	return ext2_read_block_pointer(dib, (block / per_block) % per_block, fs);
+}
+/* Maps a run through the indirect block pointers. The entries of a table are scanned in place,
+ * so a contiguous run costs one buffer cache lookup per table rather than one per block.
+*/
+static int ext2_map_indirect(inode_t *inode, ext2_fs_t *fs, uint32_t block, uint32_t max, ext2_run_t *run)
+{
+	uint32_t per_block = fs->block_size / 4;
+	uint64_t start = 0;
+	uint32_t n = 0;
+	while(n < max)
+	{
+		uint32_t b = block + n;
+		uint32_t index, count;
+		const uint32_t *table = NULL;
+		buffer_head_t *bh = NULL;
+		if(b < 12)
 		{
-			uint32_t *dib = ext2_read_block(inode->doubly_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size / 4 ; j++)
-			{
-				if(dib[j] != 0)
-				{
-					uint32_t *ib = ext2_read_block(dib[j], 1, fs);
-					for(uint64_t k = 0; k < 1024; k++)
-					{
-						if(ib[k] != 0)
-						{
-							char *bf = ext2_read_block(ib[j], 1, fs);
-							memcpy(put, bf, fs->block_size);
-							size_t pages = fs->block_size / PAGE_SIZE;
-							if(fs->block_size % PAGE_SIZE)
-								pages++;
-							vmm_destroy_mappings(bf, pages);
-							put+=fs->block_size;
-							i++;
-						}
-					}
-				}
-			}
-
+			table = inode->dbp;
+			index = b;
+			count = 12;
 		}
-		if(i >= (fs->block_size / 4)* (fs->block_size / 4) + 12 && i < (fs->block_size / 4)*(fs->block_size / 4)
-		*(fs->block_size / 4) + 12)
+		else
 		{
-			uint32_t *tib = ext2_read_block(inode->trebly_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size/4; j++)
+			uint32_t t = ext2_pointer_table(inode, fs, b, &index);
+			count = per_block;
+			if(t)
 			{
-				if(tib[j] != 0)
-				{
-					uint32_t *dib = ext2_read_block(inode->doubly_indirect_bp, 1, fs);
-					for(uint64_t k = 0; k < fs->block_size / 4 ; k++)
-					{
-						if(dib[k] != 0)
-						{
-							uint32_t *ib = ext2_read_block(dib[k], 1, fs);
-							for(uint64_t l = 0; l < 1024; l++)
-							{
-								if(ib[l] != 0)
-								{
-									char *bf = ext2_read_block(ib[l], 1, fs);
-									memcpy(put, bf, fs->block_size);
-									size_t pages = fs->block_size / PAGE_SIZE;
-									if(fs->block_size % PAGE_SIZE)
-										pages++;
-									vmm_destroy_mappings(bf, pages);
-									put+=fs->block_size;
-									i++;
-								}
-							}
-						}
-					}
-				}
-
+				bh = bread(&fs->bdev, t);
+				if(!bh)
+					return errno = EIO, -1;
+				table = bh->data;
 			}
 		}
+		uint32_t i = index;
+		for(; i < count && n < max; i++, n++)
+		{
+			uint32_t p = table ? table[i] : 0;
+			if(!n)
+				start = p;
+			else if(start ? p != start + n : p != 0)
+				break;
+		}
+		if(bh)
+			brelse(bh);
+		/* The run ended inside this table */
+		if(i < count)
+			break;
 	}
-	memcpy(buffer, buf, sz);
-	free(buf);
-	return sz;
+	run->logical = block;
+	run->len = n;
+	run->physical = start;
+	return 0;
 }
-size_t ext2_write_file(inode_t *inode, ext2_fs_t *fs, size_t sz, uint32_t blck, void *buffer)
+/* Maps a run through an ext4 extent tree. Every extent of the leaf that gets read is cached,
+ * so a file with few extents only has its tree walked once.
+*/
+static int ext4_map_extents(inode_t *inode, ext2_fs_t *fs, uint32_t ino, uint32_t block, uint32_t max, ext2_run_t *run)
 {
-	uint32_t remainder = sz % fs->block_size;
-	uint32_t block_space = sz + fs->block_size - remainder;
-	char *put = buffer;
-	uint32_t block = blck;
-	for(uint64_t i = block; i < block_space / fs->block_size; i++)
+	ext4_extent_header_t *hdr = (ext4_extent_header_t*) inode->dbp;
+	buffer_head_t *bh = NULL;
+	/* Where the subtree we're in ends, which bounds a hole at the end of its last leaf */
+	uint64_t limit = (uint64_t) UINT32_MAX + 1;
+	for(int level = 0; ; level++)
 	{
-		if(i < 12)
+		size_t room = bh ? fs->block_size : sizeof(inode->dbp) + 12;
+		if(hdr->magic != EXT4_EXT_MAGIC || level > EXT4_EXT_MAX_DEPTH ||
+		sizeof(ext4_extent_header_t) + hdr->entries * sizeof(ext4_extent_t) > room)
 		{
-			ext2_write_block(inode->dbp[i], 1, fs, put);
-			put+=fs->block_size;
+			if(bh)
+				brelse(bh);
+			return errno = EIO, -1;
 		}
-		if(i >= 12 && i < fs->block_size / 4 + 12)
+		if(!hdr->depth)
+			break;
+		ext4_extent_idx_t *idx = (ext4_extent_idx_t*)(hdr + 1);
+		int i = hdr->entries - 1;
+		while(i >= 0 && idx[i].block > block)
+			i--;
+		if(i < 0)
 		{
-			uint32_t *indb = ext2_read_block(inode->single_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size / 4; j++)
-			{
-				if(indb[j] != 0)
-				{
-					ext2_write_block(indb[j], 1, fs, put);
-					put+=fs->block_size;
-					i++;
-				}
-			}
+			/* Before the first subtree, so a hole */
+			if(hdr->entries && idx[0].block < limit)
+				limit = idx[0].block;
+			break;
 		}
-		if(i >= fs->block_size / 4 + 12 && i < (fs->block_size / 4)*(fs->block_size / 4) + 12)
+		if(i + 1 < hdr->entries && idx[i + 1].block < limit)
+			limit = idx[i + 1].block;
+		uint64_t leaf = ((uint64_t) idx[i].leaf_hi << 32) | idx[i].leaf_lo;
+		buffer_head_t *next = bread(&fs->bdev, leaf);
+		if(bh)
+			brelse(bh);
+		if(!next)
+			return errno = EIO, -1;
+		bh = next;
+		hdr = bh->data;
+	}
+	run->logical = block;
+	run->physical = 0;
+	uint64_t end = limit;
+	int found = 0;
+	if(!hdr->depth)
+	{
+		ext4_extent_t *ext = (ext4_extent_t*)(hdr + 1);
+		for(int i = 0; i < hdr->entries; i++)
 		{
-			uint32_t *dib = ext2_read_block(inode->doubly_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size / 4 ; j++)
+			uint32_t len = ext[i].len;
+			int uninit = len > EXT4_EXT_INIT_MAX_LEN;
+			if(uninit)
+				len -= EXT4_EXT_INIT_MAX_LEN;
+			uint64_t start = ((uint64_t) ext[i].start_hi << 32) | ext[i].start_lo;
+			if(!uninit && ino)
 			{
-				if(dib[j] != 0)
-				{
-					uint32_t *ib = ext2_read_block(dib[j], 1, fs);
-					for(uint64_t k = 0; k < 1024; k++)
-					{
-						if(ib[k] != 0)
-						{
-							ext2_write_block(ib[k], 1, fs, put);
-							put+=fs->block_size;
-							i++;
-						}
-					}
-				}
+				ext2_run_t r = {ext[i].block, len, start};
+				runcache_insert(fs, ino, &r);
 			}
-
-		}
-		if(i >= (fs->block_size / 4)* (fs->block_size / 4) + 12 && i < (fs->block_size / 4)*(fs->block_size / 4)
-		*(fs->block_size / 4) + 12)
-		{
-			uint32_t *tib = ext2_read_block(inode->trebly_indirect_bp, 1, fs);
-			for(uint64_t j = 0; j < fs->block_size/4; j++)
+			if(found)
+				continue;
+			if(block < ext[i].block)
 			{
-				if(tib[j] != 0)
-				{
-					uint32_t *dib = ext2_read_block(inode->doubly_indirect_bp, 1, fs);
-					for(uint64_t k = 0; k < fs->block_size / 4 ; k++)
-					{
-						if(dib[k] != 0)
-						{
-							uint32_t *ib = ext2_read_block(dib[k], 1, fs);
-							for(uint64_t l = 0; l < 1024; l++)
-							{
-								if(ib[l] != 0)
-								{
-									ext2_write_block(ib[l], 1, fs, put);
-									put += fs->block_size;
-									i++;
-								}
-							}
-						}
-					}
-				}
-
+				end = ext[i].block;
+				found = 1;
+			}
+			else if(block < (uint64_t) ext[i].block + len)
+			{
+				end = (uint64_t) ext[i].block + len;
+				found = 1;
+				if(!uninit)
+					run->physical = start + (block - ext[i].block);
 			}
 		}
 	}
-	return sz;
+	if(bh)
+		brelse(bh);
+	run->len = end - block > max ? max : end - block;
+	return 0;
 }
-inode_t *ext2_get_inode_from_number(ext2_fs_t *fs, uint32_t inode)
+/* Maps up to max blocks of the file starting at block, and hands back the run block is part of.
+ * ino is the inode's number, used to cache what gets resolved, or 0 to not cache anything.
+*/
+int ext2_map_blocks(inode_t *inode, ext2_fs_t *fs, uint32_t ino, uint32_t block, uint32_t max, ext2_run_t *run)
 {
-	uint32_t block_size = fs->block_size;
-	uint32_t bg = (inode - 1) / fs->inodes_per_block_group;
-	uint32_t index = (inode - 1) % fs->inodes_per_block_group;
-	uint32_t block = (index * fs->inode_size) / block_size;
-	uint32_t blockind = (index * fs->inode_size) % block_size;
-	block_group_desc_t *bgd = &fs->bgdt[bg];
-	inode_t *inode_block = (inode_t*)((char *)ext2_read_block(bgd->inode_table_addr + block, 1, fs) + blockind);
-
-	return inode_block;
+	if(!max)
+		max = 1;
+	if(ino && runcache_lookup(fs, ino, block, max, run))
+		return 0;
+	if(inode->flags & EXT4_INO_FLAG_EXTENTS)
+		return ext4_map_extents(inode, fs, ino, block, max, run);
+	if(ext2_map_indirect(inode, fs, block, max, run) < 0)
+		return -1;
+	if(ino)
+		runcache_insert(fs, ino, run);
+	return 0;
 }
-inode_t *ext2_get_inode_from_dir(ext2_fs_t *fs, dir_entry_t *dirent, char *name, uint32_t *inode_number)
+/* Translates a block index inside the file to a block on the disk. Returns 0 for holes. */
+uint64_t ext2_bmap(inode_t *inode, ext2_fs_t *fs, uint32_t block)
 {
-	dir_entry_t *dirs = dirent;
-	while(dirs->inode != 0)
+	ext2_run_t run;
+	if(ext2_map_blocks(inode, fs, 0, block, 1, &run) < 0)
+		return 0;
+	return run.physical;
+}
+/* Serializes block allocation, and every other change to an inode's size or block pointers */
+static spinlock_t ext2_alloc_spl;
+/* Copies the free block counts of group g and of the filesystem into their on-disk copies */
+static int ext2_sync_counts(ext2_fs_t *fs, uint32_t g)
+{
+	uint64_t bgdt_block = fs->block_size == 1024 ? 2 : 1;
+	size_t off = g * sizeof(block_group_desc_t);
+	buffer_head_t *bh = bread(&fs->bdev, bgdt_block + off / fs->block_size);
+	if(!bh)
+		return errno = EIO, -1;
+	block_group_desc_t *bgd = (block_group_desc_t*)((char*) bh->data + off % fs->block_size);
+	bgd->unallocated_blocks_in_group = fs->bgdt[g].unallocated_blocks_in_group;
+	bdirty(bh);
+	brelse(bh);
+	/* The superblock always sits 1024 bytes into the disk */
+	bh = bread(&fs->bdev, 1024 / fs->block_size);
+	if(!bh)
+		return errno = EIO, -1;
+	superblock_t *sb = (superblock_t*)((char*) bh->data + 1024 % fs->block_size);
+	sb->unallocated_block = fs->sb->unallocated_block;
+	bdirty(bh);
+	brelse(bh);
+	return 0;
+}
+/* Takes a free block off the bitmaps, looking from goal onwards so files stay contiguous.
+ * Returns 0 with errno set if there isn't one. Needs ext2_alloc_spl held.
+*/
+static uint32_t ext2_alloc_block(ext2_fs_t *fs, uint32_t goal)
+{
+	uint32_t first_data = fs->sb->sb_number;
+	if(goal < first_data || goal >= fs->total_blocks)
+		goal = first_data;
+	uint32_t goal_group = (goal - first_data) / fs->blocks_per_block_group;
+	for(uint32_t n = 0; n < fs->number_of_block_groups; n++)
 	{
-		if(!strcmp(dirs->name, name))
+		uint32_t g = (goal_group + n) % fs->number_of_block_groups;
+		if(!fs->bgdt[g].unallocated_blocks_in_group)
+			continue;
+		uint32_t base = first_data + g * fs->blocks_per_block_group;
+		uint32_t count = fs->total_blocks - base;
+		if(count > fs->blocks_per_block_group)
+			count = fs->blocks_per_block_group;
+		buffer_head_t *bh = bread(&fs->bdev, fs->bgdt[g].block_usage_addr);
+		if(!bh)
+			return errno = EIO, 0;
+		uint8_t *bitmap = bh->data;
+		uint32_t from = g == goal_group ? goal - base : 0;
+		for(uint32_t i = 0; i < count; i++)
 		{
-			*inode_number = dirs->inode;
-			return ext2_get_inode_from_number(fs,dirs->inode);
+			uint32_t bit = (from + i) % count;
+			if(bitmap[bit / 8] & (1 << (bit % 8)))
+				continue;
+			bitmap[bit / 8] |= 1 << (bit % 8);
+			bdirty(bh);
+			brelse(bh);
+			fs->bgdt[g].unallocated_blocks_in_group--;
+			fs->sb->unallocated_block--;
+			if(ext2_sync_counts(fs, g) < 0)
+				return 0;
+			return base + bit;
 		}
-		dirs = (dir_entry_t*)((char*)dirs + dirs->size);
+		brelse(bh);
 	}
-	return NULL;
+	return errno = ENOSPC, 0;
 }
-size_t ext2_write(size_t offset, size_t sizeofwrite, void *buffer, vfsnode_t *node)
+/* Allocates a zeroed block to hold a table of block pointers of the file */
+static uint32_t ext2_alloc_table(ext2_fs_t *fs, inode_t *inode, uint32_t goal)
+{
+	uint32_t block = ext2_alloc_block(fs, goal);
+	if(!block)
+		return 0;
+	buffer_head_t *bh = bread(&fs->bdev, block);
+	if(!bh)
+		return errno = EIO, 0;
+	memset(bh->data, 0, fs->block_size);
+	bdirty(bh);
+	brelse(bh);
+	inode->disk_sects += fs->block_size / 512;
+	return block;
+}
+/* Points the block 'block' of the file at the disk block phys, allocating the pointer tables on
+ * the way down. Only the in-memory inode is changed, the caller writes it back.
+*/
+static int ext2_set_block(ext2_fs_t *fs, inode_t *inode, uint32_t block, uint32_t phys)
+{
+	if(block < 12)
+	{
+		inode->dbp[block] = phys;
+		return 0;
+	}
+	uint32_t per_block = fs->block_size / 4;
+	uint32_t index[3];
+	uint32_t *slot;
+	int depth;
+	block -= 12;
+	if(block < per_block)
+	{
+		slot = &inode->single_indirect_bp;
+		depth = 1;
+		index[0] = block;
+	}
+	else if((block -= per_block) < per_block * per_block)
+	{
+		slot = &inode->doubly_indirect_bp;
+		depth = 2;
+		index[0] = block / per_block;
+		index[1] = block % per_block;
+	}
+	else
+	{
+		block -= per_block * per_block;
+		if(block / (per_block * per_block) >= per_block)
+			return errno = EFBIG, -1;
+		slot = &inode->trebly_indirect_bp;
+		depth = 3;
+		index[0] = block / (per_block * per_block);
+		index[1] = (block / per_block) % per_block;
+		index[2] = block % per_block;
+	}
+	if(!*slot && !(*slot = ext2_alloc_table(fs, inode, phys)))
+		return -1;
+	uint32_t table = *slot;
+	for(int level = 0; level < depth; level++)
+	{
+		buffer_head_t *bh = bread(&fs->bdev, table);
+		if(!bh)
+			return errno = EIO, -1;
+		uint32_t *entry = (uint32_t*) bh->data + index[level];
+		int changed = level == depth - 1 || !*entry;
+		if(level == depth - 1)
+			*entry = phys;
+		else if(!*entry && !(*entry = ext2_alloc_table(fs, inode, phys)))
+		{
+			brelse(bh);
+			return -1;
+		}
+		table = *entry;
+		if(changed)
+			bdirty(bh);
+		brelse(bh);
+	}
+	return 0;
+}
+/* Gives the holes among blocks [first, first + nblocks) of the file blocks of their own. Each one
+ * goes right after the block before it if that's free, so files written sequentially stay
+ * contiguous. Extent-mapped files can't be allocated into, their holes stay holes.
+ * Returns how many blocks got allocated, or -1.
+*/
+static int ext2_fill_holes(ext2_fs_t *fs, uint32_t ino_nr, uint32_t first, uint32_t nblocks)
+{
+	acquire_spinlock(&ext2_alloc_spl);
+	inode_t *ino = ext2_get_inode_from_number(fs, ino_nr);
+	if(!ino)
+	{
+		release_spinlock(&ext2_alloc_spl);
+		return -1;
+	}
+	if(ino->flags & EXT4_INO_FLAG_EXTENTS)
+	{
+		release_spinlock(&ext2_alloc_spl);
+		free(ino);
+		return 0;
+	}
+	/* With nothing before it, the file starts out next to its inode */
+	uint32_t goal = fs->sb->sb_number + (ino_nr - 1) / fs->inodes_per_block_group * fs->blocks_per_block_group;
+	int allocated = 0;
+	int ret = 0;
+	for(uint32_t i = 0; i < nblocks && !ret;)
+	{
+		ext2_run_t run;
+		if(ext2_map_blocks(ino, fs, ino_nr, first + i, nblocks - i, &run) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		if(run.physical)
+		{
+			goal = run.physical + run.len;
+			i += run.len;
+			continue;
+		}
+		for(uint32_t j = 0; j < run.len; j++, i++)
+		{
+			uint32_t block = ext2_alloc_block(fs, goal);
+			if(!block || ext2_set_block(fs, ino, first + i, block) < 0)
+			{
+				ret = -1;
+				break;
+			}
+			ino->disk_sects += fs->block_size / 512;
+			goal = block + 1;
+			allocated++;
+		}
+	}
+	if(allocated && ext2_put_inode(fs, ino_nr, ino) < 0)
+		ret = -1;
+	release_spinlock(&ext2_alloc_spl);
+	free(ino);
+	return ret < 0 ? -1 : allocated;
+}
+/* Sets the size of the file. Growing only moves the end, the new part is a hole until it gets
+ * written back. Shrinking would need blocks to be freed, so only a part that hasn't been given
+ * blocks yet can be cut off again.
+*/
+int ext2_truncate(vfsnode_t *node, size_t length)
 {
 	ext2_fs_t *fs = fslist;
-	printf("ay\n");
-	uint32_t block_index = offset / fs->block_size;
-	if(offset % fs->block_size)
-		block_index--;
-	printf("hey");
+	if(length == node->size)
+		return 0;
+	acquire_spinlock(&ext2_alloc_spl);
 	inode_t *ino = ext2_get_inode_from_number(fs, node->inode);
 	if(!ino)
-		return errno = EINVAL, (size_t)-1;
-	/* Ok, this one will be tricky. I'll need to handle 3 different cases of writing. 
-	 * 1 - Overwriting file data - this one is easy. Just get the block offset and write to it, then write to disk again again
-	 * 2 - We're writing to a block that's already allocated to the inode, and zeroed - this is also easy, just write to it
-	 * 3 - We're writing to a new block - this one is the hardest. We'll need to allocate a new block, and add it to the disk inode
-	 * this one will require many more writes and reads than usual.
-	*/
-	if(offset < node->size)
-	{
-		// This is case 1 of ext2_write
-		char *buf = malloc(sizeofwrite);
-		if(!buf)
-			return errno = ENOMEM, -1;
-		printf("Block index: %u\nSize of write: %u\n", block_index, sizeofwrite);
-		size_t read = ext2_read_file(ino, fs, sizeofwrite, block_index, buf);
-		if(read == (size_t)-1)
-			return errno = EIO, -1;
-		memcpy(buf + (offset % fs->block_size), buffer, sizeofwrite);
-		printf("Writing!\n");
-		return ext2_write_file(ino, fs, sizeofwrite, block_index, buf);
+	{
+		release_spinlock(&ext2_alloc_spl);
+		return errno = EIO, -1;
 	}
-	return errno = ENOSYS, -1;
-
+	int ret = 0;
+	uint32_t keep = (length + fs->block_size - 1) / fs->block_size;
+	uint32_t end = (node->size + fs->block_size - 1) / fs->block_size;
+	if(keep < end)
+	{
+		ext2_run_t run;
+		if(ext2_map_blocks(ino, fs, 0, keep, end - keep, &run) < 0)
+			ret = -1;
+		else if(run.physical || run.len < end - keep)
+		{
+			errno = ENOSYS;
+			ret = -1;
+		}
+	}
+	if(!ret)
+	{
+		ino->size_lo = (uint32_t) length;
+		ino->size_hi = (uint64_t) length >> 32;
+		ret = ext2_put_inode(fs, node->inode, ino);
+	}
+	release_spinlock(&ext2_alloc_spl);
+	free(ino);
+	if(ret < 0)
+		return -1;
+	size_t old_size = node->size;
+	node->size = length;
+	if(node->cache)
+		pagecache_resize(node->cache, old_size, length);
+	return 0;
 }
-size_t ext2_read(size_t offset, size_t sizeofreading, void *buffer, vfsnode_t *nd)
+/* If the vector covers whole blocks that sit next to each other on the disk, the disk
+ * can write straight into the caller's buffers with a single command. Anything else
+ * goes through ext2_read() one element at a time.
+*/
+size_t ext2_readv(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *nd)
 {
-	if(offset > nd->size)
-		return errno = EINVAL, -1;
 	ext2_fs_t *fs = fslist;
-	uint32_t block_index = offset/fs->block_size;
-	if(offset % fs->block_size)
-		block_index++;
+	size_t len = 0;
+	for(int i = 0; i < veccnt; i++)
+		len += vec[i].iov_len;
+	/* The tail of the last block is allowed, the page cache always asks for whole pages */
+	size_t file_end = (nd->size + fs->block_size - 1) & ~((size_t) fs->block_size - 1);
+	if(!len || offset % fs->block_size || len % fs->block_size || offset + len > file_end)
+		return readv_vfs_fallback(offset, vec, veccnt, nd);
 	inode_t *ino = ext2_get_inode_from_number(fs, nd->inode);
 	if(!ino)
-		return errno = EINVAL;
-	size_t size = ext2_read_file(ino, fs, sizeofreading, block_index, buffer);
-	return size;
+		return errno = EINVAL, (size_t) -1;
+	uint32_t first = offset / fs->block_size;
+	uint32_t nblocks = len / fs->block_size;
+	ext2_run_t run;
+	int err = ext2_map_blocks(ino, fs, nd->inode, first, nblocks, &run);
+	free(ino);
+	if(err < 0 || !run.physical || run.len < nblocks)
+		return readv_vfs_fallback(offset, vec, veccnt, nd);
+	if(blk_rw_vec(fs->dev, BIO_READ, run.physical * fs->block_size / 512, vec, veccnt) < 0)
+		return readv_vfs_fallback(offset, vec, veccnt, nd);
+	return offset + len > nd->size ? nd->size - offset : len;
+}
+/* Files whose blocks are too big for the page cache get written through here. Same as reads,
+ * whole blocks that sit next to each other on the disk go out with a single command straight
+ * from the caller's buffers, and anything else goes through ext2_write() one element at a time.
+*/
+size_t ext2_writev(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *nd)
+{
+	ext2_fs_t *fs = fslist;
+	size_t len = 0;
+	for(int i = 0; i < veccnt; i++)
+		len += vec[i].iov_len;
+	if(!len || offset % fs->block_size || len % fs->block_size || offset + len > nd->size)
+		return writev_vfs_fallback(offset, vec, veccnt, nd);
+	inode_t *ino = ext2_get_inode_from_number(fs, nd->inode);
+	if(!ino)
+		return errno = EINVAL, (size_t) -1;
+	uint32_t first = offset / fs->block_size;
+	uint32_t nblocks = len / fs->block_size;
+	ext2_run_t run;
+	int err = ext2_map_blocks(ino, fs, nd->inode, first, nblocks, &run);
+	free(ino);
+	if(err < 0 || !run.physical || run.len < nblocks)
+		return writev_vfs_fallback(offset, vec, veccnt, nd);
+	if(blk_rw_vec(fs->dev, BIO_WRITE, run.physical * fs->block_size / 512, vec, veccnt) < 0)
+		return writev_vfs_fallback(offset, vec, veccnt, nd);
+	return len;
+}
+/* Page cache writeback. Blocks that sit next to each other on the disk go out as one bio,
+ * straight from the cached pages. The bios are all queued before any of them gets waited on,
+ * with the queue plugged, so the block layer can sort them and merge them with others.
+*/
+static size_t ext2_writeback(page_cache_t *cache, size_t offset, const struct iovec *vec, int veccnt)
+{
+	ext2_fs_t *fs = cache->sb;
+	inode_t *ino = ext2_get_inode_from_number(fs, cache->ino);
+	if(!ino)
+		return (size_t) -1;
+	uint64_t size = ((uint64_t)ino->size_hi << 32) | ino->size_lo;
+	size_t per_page = PAGE_SIZE / fs->block_size;
+	uint32_t first = offset / fs->block_size;
+	/* Blocks past the end of the file aren't ours to write */
+	uint32_t nblocks = veccnt * per_page;
+	uint32_t file_blocks = (size + fs->block_size - 1) / fs->block_size;
+	if(first >= file_blocks)
+		nblocks = 0;
+	else if(first + nblocks > file_blocks)
+		nblocks = file_blocks - first;
+	if(!nblocks)
+	{
+		free(ino);
+		return 0;
+	}
+	/* Blocks the file grew into don't have anywhere to go yet */
+	int allocated = ext2_fill_holes(fs, cache->ino, first, nblocks);
+	if(allocated)
+	{
+		free(ino);
+		if(allocated < 0 || !(ino = ext2_get_inode_from_number(fs, cache->ino)))
+			return (size_t) -1;
+	}
+	/* Each block starts a vector entry and a bio at the very most */
+	struct iovec *runvec = malloc(sizeof(struct iovec) * nblocks);
+	bio_t *bios = malloc(sizeof(bio_t) * nblocks);
+	if(!runvec || !bios)
+	{
+		free(runvec);
+		free(bios);
+		free(ino);
+		return errno = ENOMEM, (size_t) -1;
+	}
+	int nr_bios = 0;
+	int nvec = 0;
+	int run_first = 0;
+	uint64_t run_start = 0;
+	uint32_t run_len = 0;
+	ext2_run_t map = {0, 0, 0};
+	size_t written = 0;
+	blk_plug(fs->dev);
+	for(uint32_t i = 0; i <= nblocks; i++)
+	{
+		uint64_t block = 0;
+		if(i < nblocks)
+		{
+			/* Only look the mapping up again once we're past the run we know about */
+			if(first + i - map.logical >= map.len &&
+			ext2_map_blocks(ino, fs, cache->ino, first + i, nblocks - i, &map) < 0)
+			{
+				map.logical = first + i;
+				map.len = 1;
+				map.physical = 0;
+			}
+			if(map.physical)
+				block = map.physical + (first + i - map.logical);
+		}
+		char *data = i < nblocks ? (char*) vec[i / per_page].iov_base + (i % per_page) * fs->block_size : NULL;
+		if(run_len && block == run_start + run_len)
+		{
+			/* Blocks of the same page are contiguous in memory as well */
+			if(i % per_page)
+				runvec[nvec - 1].iov_len += fs->block_size;
+			else
+			{
+				runvec[nvec].iov_base = data;
+				runvec[nvec++].iov_len = fs->block_size;
+			}
+			run_len++;
+			continue;
+		}
+		if(run_len)
+		{
+			bio_init(&bios[nr_bios], fs->dev, BIO_WRITE, run_start * fs->block_size / 512,
+			runvec + run_first, nvec - run_first);
+			bio_submit(&bios[nr_bios++]);
+			written += run_len * fs->block_size;
+			run_len = 0;
+		}
+		if(!block)
+			continue;
+		run_start = block;
+		run_len = 1;
+		run_first = nvec;
+		runvec[nvec].iov_base = data;
+		runvec[nvec++].iov_len = fs->block_size;
+	}
+	blk_unplug(fs->dev);
+	int error = 0;
+	for(int i = 0; i < nr_bios; i++)
+	{
+		if(!bio_wait(&bios[i]))
+			continue;
+		/* The vector couldn't be used for DMA, go block by block */
+		uint64_t b = bios[i].sector * 512 / fs->block_size;
+		for(int j = 0; j < bios[i].veccnt; j++)
+		{
+			for(size_t k = 0; k < bios[i].vec[j].iov_len; k += fs->block_size)
+			{
+				if(ext2_write_block(b++, 1, fs, (char*) bios[i].vec[j].iov_base + k) < 0)
+					error = 1;
+			}
+		}
+	}
+	free(runvec);
+	free(bios);
+	free(ino);
+	/* The pages stay dirty and get another go later */
+	if(error)
+		return errno = EIO, (size_t) -1;
+	return written;
 }
 vfsnode_t *ext2_open(vfsnode_t *nd, const char *name)
 {
@@ -426,34 +1108,84 @@ vfsnode_t *ext2_open(vfsnode_t *nd, const char *name)
 			return errno = ENOMEM, NULL;
 		memset(path, 0, len); // This memset is just to make sure the string is zero-terminated
 		memcpy(path, p, len);
-		ino = ext2_get_inode_from_dir(fs, dir, path, &inode_num);
+		inode_t *next = ext2_get_inode_from_dir(fs, dir, path, &inode_num);
+		free(ino);
+		ino = next;
+		if(!ino)
+		{
+			free(path);
+			free(inode_data);
+			return errno = ENOENT, NULL;
+		}
 		if(strtok(p, "/") == NULL)
+		{
+			free(path);
 			break;
+		}
+		free(inode_data);
 		inode_data = ext2_read_inode_bp(ino, fs, &size);
 		dir = (dir_entry_t*)inode_data;
 		p = strtok(p, "/");
 		free(path);
 	}
-	vfsnode_t *node = malloc(sizeof(vfsnode_t));
+	free(inode_data);
+	/* Every open of the same inode shares one node */
+	vfsnode_t *node = icache_get(fs, inode_num);
+	if(node)
+	{
+		free(ino);
+		return node;
+	}
+	node = malloc(sizeof(vfsnode_t));
+	if(!node)
+	{
+		free(ino);
+		return errno = ENOMEM, NULL;
+	}
 	memset(node, 0, sizeof(vfsnode_t));
-	node->name = (char*)name;
+	/* name belongs to the caller, keep our own copy */
+	node->name = malloc(strlen(name) + 1);
+	if(!node->name)
+	{
+		free(node);
+		return errno = ENOMEM, NULL;
+	}
+	strcpy(node->name, name);
 	node->inode = inode_num;
 	node->read = ext2_read;
+	node->readv = ext2_readv;
 	node->open = ext2_open;
 	node->write = ext2_write;
+	node->writev = ext2_writev;
+	node->truncate = ext2_truncate;
 	node->size = ((uint64_t)ino->size_hi << 32) | ino->size_lo;
+	node->cache = pagecache_get(fs, inode_num);
+	/* Blocks bigger than a page are written through */
+	if(node->cache && fs->block_size <= PAGE_SIZE)
+		node->cache->writeback = ext2_writeback;
 	node->uid = ino->uid;
 	node->gid = ino->gid;
-	return node;
+	node->sb = fs;
+	node->refcount = 1;
+	free(ino);
+	vfsnode_t *cached = icache_add(node);
+	if(cached != node)
+	{
+		free(node->name);
+		free(node);
+	}
+	return cached;
 }
-int ext2_open_partition(uint64_t sector, int drive, int channel)
+int ext2_open_partition(block_dev_t *dev)
 {
-	printf("Handling ext2 partition at sector %d\n", sector);
+	printf("Handling ext2 partition %s\n", dev->name);
 	superblock_t *sb = vmm_allocate_virt_address(VM_KERNEL, 1/*64K*/, VMM_TYPE_REGULAR, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
 	vmm_map_range(sb, 1, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
-	uint32_t phys = (uint64_t)virtual2phys(sb) >> 0;
-	uint64_t lba = sector + 2;
-	ata_read_sectors(channel, drive, phys, 1024, lba);
+	if(blk_read(dev, 2, sb, 1024) < 0)
+	{
+		printf("ERROR: ext2: couldn't read the superblock\n");
+		return 1;
+	}
 	if(sb->ext2sig == 0xef53)
 		printf("Valid ext2 signature detected!\n");
 	else
@@ -461,7 +1193,16 @@ int ext2_open_partition(uint64_t sector, int drive, int channel)
 		printf("ERROR: Invalid ext2 signature %x\n", sb->ext2sig);
 		return 1;
 	}
+	/* ext4's extents are understood, but 64-bit group descriptors are laid out differently */
+	if(sb->major_version >= 1 && sb->required_features & EXT4_RQRD_64BIT)
+	{
+		printf("ERROR: ext2: 64-bit filesystems aren't supported\n");
+		return 1;
+	}
 	ext2_fs_t *fs = malloc(sizeof(ext2_fs_t));
+	if(!fs)
+		return 1;
+	memset(fs, 0, sizeof(ext2_fs_t));
 	if(!fslist) fslist = fs;
 	else
 	{
@@ -473,12 +1214,10 @@ int ext2_open_partition(uint64_t sector, int drive, int channel)
 		s->next = fs;
 	}
 	// good til here
-	fs->drive = drive;
-	fs->channel = channel;
+	fs->dev = dev;
 	fs->sb = sb;
 	fs->major = sb->major_version;
 	fs->minor = sb->minor_version;
-	fs->first_sector = sector;
 	fs->total_inodes = sb->total_inodes;
 	fs->total_blocks = sb->total_blocks;
 	fs->block_size = 1024 << sb->log2blocksz;
@@ -489,6 +1228,9 @@ int ext2_open_partition(uint64_t sector, int drive, int channel)
 	fs->number_of_block_groups = fs->total_blocks / fs->blocks_per_block_group;
 	if (fs->total_blocks % fs->blocks_per_block_group)
 		fs->number_of_block_groups++;
+	fs->bdev.block_size = fs->block_size;
+	fs->bdev.read_block = ext2_bcache_read;
+	fs->bdev.write_block = ext2_bcache_write;
 	block_group_desc_t *bgdt = NULL;
 	size_t blocks_for_bgdt = (fs->number_of_block_groups * sizeof(block_group_desc_t)) / fs->block_size;
 	if((fs->number_of_block_groups * sizeof(block_group_desc_t)) % fs->block_size)
@@ -499,6 +1241,7 @@ int ext2_open_partition(uint64_t sector, int drive, int channel)
 		bgdt = ext2_read_block(1, (uint16_t)blocks_for_bgdt, fs);
 	fs->bgdt = bgdt;
 	vfsnode_t *node = malloc(sizeof(vfsnode_t));
+	memset(node, 0, sizeof(vfsnode_t));
 	node->name = "";
 	node->inode = 2;
 	node->open = ext2_open;
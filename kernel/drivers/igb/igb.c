@@ -0,0 +1,454 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: igb.c
+ *
+ * Description: Driver for the multiqueue Intel NICs, the 82574 (e1000e)
+ * and the 82576 (igb). Each CPU gets an RX/TX queue pair with its own
+ * MSI-X vector, and RSS spreads incoming flows over the receive queues.
+ * Receive queues are polled from the NET_RX softirq, which is the only
+ * thing that ever touches them.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <kernel/vmm.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/irq.h>
+#include <kernel/apic.h>
+#include <kernel/sleep.h>
+#include <kernel/ethernet.h>
+
+#include <drivers/mmio.h>
+#include <drivers/pci.h>
+#include <drivers/igb.h>
+
+/* There's one network stack, so only the first NIC gets used */
+static igb_t *igb_dev = NULL;
+/* The usual Toeplitz key, so flows hash the same as they would anywhere else */
+static const uint32_t igb_rss_key[10] =
+{
+	0xDA565A6D, 0xC20E5B25, 0x3D256741, 0xB08FA343, 0xCB2BCAD0,
+	0xB4307BAE, 0xA32DCB77, 0x0CF23080, 0x3BB7426A, 0xFA01ACBE
+};
+
+static inline uint32_t igb_read(volatile uint8_t *regs, unsigned int reg)
+{
+	return mmio_readl((uint64_t)(uintptr_t)(regs + reg));
+}
+static inline void igb_write(volatile uint8_t *regs, unsigned int reg, uint32_t val)
+{
+	mmio_writel((uint64_t)(uintptr_t)(regs + reg), val);
+}
+static inline volatile uint8_t *igb_rx_regs(igb_t *igb, unsigned int q)
+{
+	return igb->regs + (igb->is_82576 ? 0xC000 + 0x40 * q : 0x2800 + 0x100 * q);
+}
+static inline volatile uint8_t *igb_tx_regs(igb_t *igb, unsigned int q)
+{
+	return igb->regs + (igb->is_82576 ? 0xE000 + 0x40 * q : 0x3800 + 0x100 * q);
+}
+/* Waits for (reg & mask) == value, returns -1 if that takes longer than timeout ms */
+static int igb_wait(volatile uint8_t *regs, unsigned int reg, uint32_t mask, uint32_t value, unsigned int timeout)
+{
+	for(unsigned int i = 0; i < timeout; i++)
+	{
+		if((igb_read(regs, reg) & mask) == value)
+			return 0;
+		ksleep(1);
+	}
+	return (igb_read(regs, reg) & mask) == value ? 0 : -1;
+}
+static int igb_rx_poll(eth_poll_t *p, unsigned int budget)
+{
+	igb_queue_t *q = (igb_queue_t*) p;
+	int more = 0, taken = 0;
+	uint16_t last = 0;
+	while(q->rx[q->rx_cur].status & IGB_DESC_DD)
+	{
+		if(!budget--)
+		{
+			more = 1;
+			break;
+		}
+		igb_rx_desc_t *d = &q->rx[q->rx_cur];
+		uint8_t *buf = (uint8_t*)(q->rx_bufs + q->rx_cur * IGB_BUF_SIZE);
+		uint16_t len = d->length;
+		/* Don't look at the packet before the status that says it's there */
+		__asm__ __volatile__("" ::: "memory");
+		if(d->status & IGB_DESC_EOP && !d->errors)
+		{
+			ethernet_handle_packet(buf, len);
+			eth_set_packet_buf(buf + PHYS_BASE);
+			eth_set_packet_len(len);
+		}
+		d->status = 0;
+		last = q->rx_cur;
+		taken = 1;
+		q->rx_cur = (q->rx_cur + 1) % IGB_RING_SIZE;
+	}
+	/* Give the descriptors back in one go */
+	if(taken)
+		igb_write(igb_rx_regs(q->igb, q->index), IGB_QUEUE_TAIL, last);
+	return more;
+}
+/* MSI-X, each queue's vector is its own and the cause is cleared automatically */
+static void igb_msix(void *ctx)
+{
+	igb_queue_t *q = ctx;
+	eth_poll_schedule(&q->poll);
+}
+/* Everything else funnels through queue 0 and ICR */
+static void igb_intr(igb_t *igb)
+{
+	if(igb_read(igb->regs, IGB_ICR) & IGB_ICR_RXT0)
+		eth_poll_schedule(&igb->queues[0].poll);
+}
+static void igb_msi(void *ctx)
+{
+	igb_intr(ctx);
+}
+static void igb_irq()
+{
+	if(igb_dev)
+		igb_intr(igb_dev);
+}
+/* Transmits on the current CPU's queue. The frame is copied, so the caller can free it right away. */
+static int igb_send_packet(char *data, uint16_t len)
+{
+	igb_t *igb = igb_dev;
+	if(len > IGB_BUF_SIZE)
+		return errno = EINVAL, -1;
+	igb_queue_t *q = &igb->queues[apic_get_current_cpu() % igb->nqueues];
+	unsigned long flags = spin_lock_irqsave(&q->tx_lock);
+	/* Take back whatever the NIC is done with */
+	while(q->tx_clean != q->tx_tail && q->tx[q->tx_clean].status & IGB_DESC_DD)
+		q->tx_clean = (q->tx_clean + 1) % IGB_RING_SIZE;
+	uint16_t next = (q->tx_tail + 1) % IGB_RING_SIZE;
+	if(next == q->tx_clean)
+	{
+		spin_unlock_irqrestore(&q->tx_lock, flags);
+		return errno = EAGAIN, -1;
+	}
+	uintptr_t buf = q->tx_bufs + q->tx_tail * IGB_BUF_SIZE;
+	memcpy((void*)(buf + PHYS_BASE), data, len);
+	igb_tx_desc_t *d = &q->tx[q->tx_tail];
+	d->addr = buf;
+	d->length = len;
+	d->cso = 0;
+	d->css = 0;
+	d->special = 0;
+	d->status = 0;
+	d->cmd = IGB_DESC_EOP | IGB_DESC_IFCS | IGB_DESC_RS;
+	q->tx_tail = next;
+	/* The descriptor has to be in memory before the NIC hears about it */
+	__sync_synchronize();
+	igb_write(igb_tx_regs(igb, q->index), IGB_QUEUE_TAIL, next);
+	spin_unlock_irqrestore(&q->tx_lock, flags);
+	return 0;
+}
+static void igb_free(igb_t *igb)
+{
+	for(unsigned int i = 0; i < IGB_MAX_QUEUES; i++)
+	{
+		igb_queue_t *q = &igb->queues[i];
+		if(q->vector >= 0)
+			irq_free_vector(q->vector);
+		if(q->rx)
+			pfree(1, (void*) q->rx_phys);
+		if(q->rx_bufs)
+			pfree(IGB_RING_SIZE * IGB_BUF_SIZE / PAGE_SIZE, (void*) q->rx_bufs);
+		if(q->tx)
+			pfree(1, (void*) q->tx_phys);
+		if(q->tx_bufs)
+			pfree(IGB_RING_SIZE * IGB_BUF_SIZE / PAGE_SIZE, (void*) q->tx_bufs);
+	}
+	free(igb);
+}
+static int igb_queue_alloc(igb_queue_t *q)
+{
+	size_t buf_pages = IGB_RING_SIZE * IGB_BUF_SIZE / PAGE_SIZE;
+	void *p;
+	if(!(p = pmalloc(1)))
+		return -1;
+	q->rx_phys = (uintptr_t) p;
+	q->rx = (igb_rx_desc_t*)(q->rx_phys + PHYS_BASE);
+	if(!(p = pmalloc(1)))
+		return -1;
+	q->tx_phys = (uintptr_t) p;
+	q->tx = (igb_tx_desc_t*)(q->tx_phys + PHYS_BASE);
+	if(!(p = pmalloc(buf_pages)))
+		return -1;
+	q->rx_bufs = (uintptr_t) p;
+	if(!(p = pmalloc(buf_pages)))
+		return -1;
+	q->tx_bufs = (uintptr_t) p;
+	memset((void*) q->rx, 0, PAGE_SIZE);
+	memset((void*) q->tx, 0, PAGE_SIZE);
+	for(unsigned int i = 0; i < IGB_RING_SIZE; i++)
+		q->rx[i].addr = q->rx_bufs + i * IGB_BUF_SIZE;
+	return 0;
+}
+static void igb_queue_start(igb_t *igb, igb_queue_t *q)
+{
+	volatile uint8_t *rx = igb_rx_regs(igb, q->index);
+	igb_write(rx, IGB_QUEUE_BAL, (uint32_t) q->rx_phys);
+	igb_write(rx, IGB_QUEUE_BAH, (uint32_t)((uint64_t) q->rx_phys >> 32));
+	igb_write(rx, IGB_QUEUE_LEN, IGB_RING_SIZE * sizeof(igb_rx_desc_t));
+	igb_write(rx, IGB_QUEUE_HEAD, 0);
+	igb_write(rx, IGB_QUEUE_TAIL, 0);
+	if(igb->is_82576)
+	{
+		/* Legacy descriptors, dropped rather than stalling the others when the ring is full */
+		igb_write(rx, IGB_QUEUE_SRRCTL, IGB_SRRCTL_BSIZE_2K | IGB_SRRCTL_DROP_EN);
+		igb_write(rx, IGB_QUEUE_DCTL, igb_read(rx, IGB_QUEUE_DCTL) | IGB_QUEUE_ENABLE);
+		igb_wait(rx, IGB_QUEUE_DCTL, IGB_QUEUE_ENABLE, IGB_QUEUE_ENABLE, 10);
+	}
+	volatile uint8_t *tx = igb_tx_regs(igb, q->index);
+	igb_write(tx, IGB_QUEUE_BAL, (uint32_t) q->tx_phys);
+	igb_write(tx, IGB_QUEUE_BAH, (uint32_t)((uint64_t) q->tx_phys >> 32));
+	igb_write(tx, IGB_QUEUE_LEN, IGB_RING_SIZE * sizeof(igb_tx_desc_t));
+	igb_write(tx, IGB_QUEUE_HEAD, 0);
+	igb_write(tx, IGB_QUEUE_TAIL, 0);
+	if(igb->is_82576)
+	{
+		igb_write(tx, IGB_QUEUE_DCTL, igb_read(tx, IGB_QUEUE_DCTL) | IGB_QUEUE_ENABLE);
+		igb_wait(tx, IGB_QUEUE_DCTL, IGB_QUEUE_ENABLE, IGB_QUEUE_ENABLE, 10);
+	}
+}
+/* Hashes flows over the receive queues */
+static void igb_setup_rss(igb_t *igb)
+{
+	for(int i = 0; i < 10; i++)
+		igb_write(igb->regs, IGB_RSSRK + i * 4, igb_rss_key[i]);
+	for(int i = 0; i < IGB_RETA_ENTRIES; i += 4)
+	{
+		uint32_t reta = 0;
+		for(int j = 0; j < 4; j++)
+		{
+			uint32_t q = (i + j) % igb->nqueues;
+			/* The 82574 takes the queue in the top bit of the entry */
+			reta |= (igb->is_82576 ? q : q << 7) << (j * 8);
+		}
+		igb_write(igb->regs, IGB_RETA + i, reta);
+	}
+	/* The hash replaces the checksum in the descriptor */
+	igb_write(igb->regs, IGB_RXCSUM, igb_read(igb->regs, IGB_RXCSUM) | IGB_RXCSUM_PCSD);
+	igb_write(igb->regs, IGB_MRQC, (igb->is_82576 ? IGB_MRQC_RSS_82576 : IGB_MRQC_RSS_82574) |
+	IGB_MRQC_IPV4_TCP | IGB_MRQC_IPV4 | IGB_MRQC_IPV6);
+}
+/* A vector per queue, each aimed at the CPU whose queue it is */
+static int igb_alloc_vectors(igb_t *igb)
+{
+	for(unsigned int i = 0; i < igb->nqueues; i++)
+	{
+		igb_queue_t *q = &igb->queues[i];
+		q->vector = irq_allocate_vector(igb_msix, q, i);
+		if(q->vector < 0 || pci_enable_msix(igb->pci, i, q->vector) < 0)
+			return -1;
+	}
+	return 0;
+}
+/* Routes every receive queue's cause to its MSI-X entry */
+static void igb_enable_msix(igb_t *igb)
+{
+	uint32_t mask = 0, ivar = 0;
+	for(unsigned int i = 0; i < igb->nqueues; i++)
+	{
+		if(igb->is_82576)
+		{
+			unsigned int reg = IGB_IVAR0 + (i & 7) * 4;
+			unsigned int shift = (i & 8) << 1;
+			uint32_t val = igb_read(igb->regs, reg) & ~(0xFFU << shift);
+			igb_write(igb->regs, reg, val | (i | IGB_IVAR_VALID) << shift);
+			mask |= 1U << i;
+		}
+		else
+		{
+			ivar |= (i | IGB_IVAR_VALID_82574) << (i * 4);
+			mask |= IGB_ICR_RXQ(i);
+		}
+	}
+	if(igb->is_82576)
+	{
+		igb_write(igb->regs, IGB_GPIE, IGB_GPIE_NSICR | IGB_GPIE_MSIX_MODE | IGB_GPIE_PBA);
+		igb_write(igb->regs, IGB_EIAC, mask);
+		igb_write(igb->regs, IGB_EIMS, mask);
+	}
+	else
+	{
+		igb_write(igb->regs, IGB_IVAR_82574, ivar);
+		igb_write(igb->regs, IGB_CTRL_EXT, igb_read(igb->regs, IGB_CTRL_EXT) | IGB_CTRL_EXT_PBA_CLR);
+		igb_write(igb->regs, IGB_EIAC_82574, mask);
+		igb_write(igb->regs, IGB_IMS, mask);
+	}
+}
+/* One queue, on MSI if there is one and the shared line otherwise */
+static void igb_enable_intx(igb_t *igb)
+{
+	if(igb->is_82576)
+		igb_write(igb->regs, IGB_IVAR0, IGB_IVAR_VALID);
+	int vector = igb->pci->msi_cap ? irq_allocate_vector(igb_msi, igb, 0) : -1;
+	if(vector >= 0 && pci_enable_msi(igb->pci, vector) < 0)
+	{
+		irq_free_vector(vector);
+		vector = -1;
+	}
+	igb->queues[0].vector = vector;
+	if(vector < 0)
+	{
+		uint16_t intn = pci_get_intn(igb->pci->slot, igb->pci->device, igb->pci->function);
+		irq_install_handler(intn, igb_irq);
+		irq_unmask(intn);
+	}
+	igb_write(igb->regs, IGB_IMS, IGB_ICR_RXT0);
+}
+static int igb_probe(PCIDevice *dev, const pci_id_t *id)
+{
+	if(igb_dev)
+		return -1;
+	igb_t *igb = malloc(sizeof(igb_t));
+	if(!igb)
+		return -1;
+	memset(igb, 0, sizeof(igb_t));
+	for(unsigned int i = 0; i < IGB_MAX_QUEUES; i++)
+	{
+		igb->queues[i].igb = igb;
+		igb->queues[i].index = i;
+		igb->queues[i].vector = -1;
+	}
+	igb->pci = dev;
+	igb->is_82576 = dev->deviceID == IGB_DEV_82576;
+	pcibar_t *bar = pci_get_bar(dev->slot, dev->device, dev->function, 0);
+	if(bar->isIO || !bar->address)
+	{
+		free(bar);
+		free(igb);
+		return -1;
+	}
+	size_t needed_pages = (bar->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	igb->regs = vmm_allocate_virt_address(VM_KERNEL, needed_pages, VMM_TYPE_HW, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+	if(!igb->regs)
+	{
+		free(bar);
+		free(igb);
+		return -1;
+	}
+	for(size_t i = 0; i < needed_pages; i++)
+		paging_map_phys_to_virt((uintptr_t) igb->regs + i * PAGE_SIZE, bar->address + i * PAGE_SIZE,
+		VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC);
+	free(bar);
+	/* Memory space and bus mastering */
+	uint32_t command_reg = pci_config_read_dword(dev->slot, dev->device, dev->function, PCI_COMMAND);
+	pci_write_dword(dev->slot, dev->device, dev->function, PCI_COMMAND, command_reg | 6);
+	/* Reset it, with nothing able to interrupt in the middle */
+	igb_write(igb->regs, IGB_IMC, 0xFFFFFFFF);
+	if(igb->is_82576)
+		igb_write(igb->regs, IGB_EIMC, 0xFFFFFFFF);
+	igb_write(igb->regs, IGB_CTRL, igb_read(igb->regs, IGB_CTRL) | IGB_CTRL_RST);
+	ksleep(1);
+	if(igb_wait(igb->regs, IGB_CTRL, IGB_CTRL_RST, 0, 100) < 0)
+	{
+		printf("igb: reset timed out\n");
+		igb_free(igb);
+		return -1;
+	}
+	igb_write(igb->regs, IGB_IMC, 0xFFFFFFFF);
+	if(igb->is_82576)
+		igb_write(igb->regs, IGB_EIMC, 0xFFFFFFFF);
+	igb_write(igb->regs, IGB_CTRL, igb_read(igb->regs, IGB_CTRL) | IGB_CTRL_SLU);
+	/* The NVM loads the address into the first receive address register */
+	uint32_t ral = igb_read(igb->regs, IGB_RAL), rah = igb_read(igb->regs, IGB_RAH);
+	if(!(rah & IGB_RAH_AV))
+	{
+		printf("igb: no MAC address\n");
+		igb_free(igb);
+		return -1;
+	}
+	/* Queue pairs for as many CPUs as there can be, down to what the part and its MSI-X table have */
+	unsigned int max = igb->is_82576 ? IGB_MAX_QUEUES : 2;
+	igb->nqueues = 1;
+	if(dev->msix_cap)
+	{
+		igb->nqueues = dev->msix_entries < max ? dev->msix_entries : max;
+		igb->msix = igb_alloc_vectors(igb) == 0;
+		if(!igb->msix)
+		{
+			for(unsigned int i = 0; i < igb->nqueues; i++)
+			{
+				if(igb->queues[i].vector >= 0)
+					irq_free_vector(igb->queues[i].vector);
+				igb->queues[i].vector = -1;
+			}
+			pci_disable_msix(dev);
+			igb->nqueues = 1;
+		}
+	}
+	for(unsigned int i = 0; i < igb->nqueues; i++)
+	{
+		if(igb_queue_alloc(&igb->queues[i]) < 0)
+		{
+			if(igb->msix)
+				pci_disable_msix(dev);
+			igb_free(igb);
+			return -1;
+		}
+	}
+	for(unsigned int i = 0; i < 128; i++)
+		igb_write(igb->regs, IGB_MTA + i * 4, 0);
+	for(unsigned int i = 0; i < igb->nqueues; i++)
+	{
+		eth_poll_init(&igb->queues[i].poll, igb_rx_poll);
+		igb_queue_start(igb, &igb->queues[i]);
+	}
+	if(igb->nqueues > 1)
+		igb_setup_rss(igb);
+	igb_write(igb->regs, IGB_RCTL, IGB_RCTL_EN | IGB_RCTL_BAM | IGB_RCTL_SECRC);
+	/* Every descriptor but one is the NIC's */
+	for(unsigned int i = 0; i < igb->nqueues; i++)
+		igb_write(igb_rx_regs(igb, i), IGB_QUEUE_TAIL, IGB_RING_SIZE - 1);
+	if(!igb->is_82576)
+		igb_write(igb->regs, IGB_TIPG, 0x0060200A);
+	igb_write(igb->regs, IGB_TCTL, IGB_TCTL_EN | IGB_TCTL_PSP | IGB_TCTL_CT | IGB_TCTL_COLD);
+	igb_dev = igb;
+	if(igb->msix)
+		igb_enable_msix(igb);
+	else
+		igb_enable_intx(igb);
+	for(int i = 0; i < 4; i++)
+		mac_address[i] = ral >> (i * 8);
+	mac_address[4] = rah;
+	mac_address[5] = rah >> 8;
+	printf("igb: %s, MAC address %x:%x:%x:%x:%x:%x, %u queue%s%s\n", igb->is_82576 ? "82576" : "82574",
+	mac_address[0], mac_address[1], mac_address[2], mac_address[3], mac_address[4], mac_address[5],
+	igb->nqueues, igb->nqueues > 1 ? "s with RSS" : "", igb->msix ? ", MSI-X" : "");
+	eth_set_dev_send_packet(igb_send_packet);
+	return 0;
+}
+static const pci_id_t igb_ids[] =
+{
+	PCI_ID(IGB_VENDOR, IGB_DEV_82574),
+	PCI_ID(IGB_VENDOR, IGB_DEV_82576),
+	{0}
+};
+static pci_driver_t igb_driver = {"igb", igb_ids, igb_probe, 0, NULL};
+void igb_init()
+{
+	pci_register_driver(&igb_driver);
+}
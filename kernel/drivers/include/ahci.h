@@ -0,0 +1,152 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _DRIVERS_AHCI_H
+#define _DRIVERS_AHCI_H
+
+#include <stdint.h>
+
+#include <kernel/block.h>
+
+/* Generic host control registers */
+#define AHCI_CAP		0x00
+#define AHCI_GHC		0x04
+#define AHCI_IS			0x08
+#define AHCI_PI			0x0C
+#define AHCI_VS			0x10
+#define AHCI_CAP_NCS(cap)	((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SNCQ		(1U << 30)
+#define AHCI_CAP_S64A		(1U << 31)
+#define AHCI_GHC_HR		(1U << 0)
+#define AHCI_GHC_IE		(1U << 1)
+#define AHCI_GHC_AE		(1U << 31)
+
+/* Port registers, each port gets 0x80 bytes of them */
+#define AHCI_PORT(n)		(0x100 + (n) * 0x80)
+#define AHCI_PxCLB		0x00
+#define AHCI_PxCLBU		0x04
+#define AHCI_PxFB		0x08
+#define AHCI_PxFBU		0x0C
+#define AHCI_PxIS		0x10
+#define AHCI_PxIE		0x14
+#define AHCI_PxCMD		0x18
+#define AHCI_PxTFD		0x20
+#define AHCI_PxSIG		0x24
+#define AHCI_PxSSTS		0x28
+#define AHCI_PxSCTL		0x2C
+#define AHCI_PxSERR		0x30
+#define AHCI_PxSACT		0x34
+#define AHCI_PxCI		0x38
+#define AHCI_PxCMD_ST		(1U << 0)
+#define AHCI_PxCMD_SUD		(1U << 1)
+#define AHCI_PxCMD_POD		(1U << 2)
+#define AHCI_PxCMD_FRE		(1U << 4)
+#define AHCI_PxCMD_FR		(1U << 14)
+#define AHCI_PxCMD_CR		(1U << 15)
+#define AHCI_PxIS_DHRS		(1U << 0)
+#define AHCI_PxIS_PSS		(1U << 1)
+#define AHCI_PxIS_DSS		(1U << 2)
+#define AHCI_PxIS_SDBS		(1U << 3)
+#define AHCI_PxIS_IFS		(1U << 27)
+#define AHCI_PxIS_HBDS		(1U << 28)
+#define AHCI_PxIS_HBFS		(1U << 29)
+#define AHCI_PxIS_TFES		(1U << 30)
+#define AHCI_PxIS_ERROR		(AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+#define AHCI_PxIS_DONE		(AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS)
+#define AHCI_PxSSTS_DET(ssts)	((ssts) & 0xF)
+#define AHCI_DET_PRESENT	3
+#define AHCI_SIG_ATA		0x00000101
+
+#define AHCI_TFD_ERR		0x01
+#define AHCI_TFD_DRQ		0x08
+#define AHCI_TFD_BSY		0x80
+
+#define FIS_TYPE_REG_H2D	0x27
+
+/* NCQ commands, the rest of them are in drivers/ata.h */
+#define ATA_CMD_READ_FPDMA_QUEUED	0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED	0x61
+/* Log page 0x10 says which queued command failed, reading it also gets the disk out of its error state */
+#define ATA_CMD_READ_LOG_EXT		0x2F
+#define ATA_LOG_NCQ_ERROR		0x10
+#define ATA_LOG_NCQ_NQ			(1 << 7) /* The error wasn't about a queued command */
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t flags; /* Bit 7 is set for commands */
+	uint8_t command;
+	uint8_t featurel;
+	uint8_t lba0, lba1, lba2;
+	uint8_t device;
+	uint8_t lba3, lba4, lba5;
+	uint8_t featureh;
+	uint8_t countl;
+	uint8_t counth;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t res[4];
+} __attribute__((packed)) fis_reg_h2d_t;
+
+/* The command list is 32 of these */
+typedef struct
+{
+	uint16_t flags; /* FIS length in dwords, and AHCI_CMD_* */
+	uint16_t prdtl;
+	volatile uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t res[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+#define AHCI_CMD_WRITE		(1 << 6)
+#define AHCI_CMD_CLEAR_BUSY	(1 << 10)
+
+typedef struct
+{
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t res;
+	uint32_t dbc; /* Byte count - 1, bit 31 asks for an interrupt */
+} __attribute__((packed)) ahci_prd_t;
+/* A PRD can describe up to 4MiB */
+#define AHCI_PRD_MAX		0x400000
+
+/* Sized so that a command table fits a page */
+#define AHCI_PRDT_ENTRIES	248
+typedef struct
+{
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t res[48];
+	ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+#define AHCI_MAX_SLOTS		32
+#define AHCI_MAX_PORTS		32
+
+typedef struct ahci_port
+{
+	volatile uint8_t *regs;
+	unsigned int num;
+	int ncq;
+	uint32_t outstanding; /* Slots that have been issued, protected by the queue lock */
+	volatile int eh_pending; /* Waiting for the error handler, the port's interrupts are off meanwhile */
+	ahci_cmd_header_t *cmdlist;
+	uintptr_t cmdlist_phys;
+	void *fis;
+	ahci_cmd_table_t *tables[AHCI_MAX_SLOTS];
+	uintptr_t tables_phys[AHCI_MAX_SLOTS];
+	request_queue_t *queue;
+	block_dev_t *dev;
+} ahci_port_t;
+
+/* Disks show up in the block layer as sata0, sata1... after the port they're on */
+void initialize_ahci();
+#endif
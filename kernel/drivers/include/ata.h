@@ -14,6 +14,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 typedef struct
 {
 	uint32_t data_buffer; // the data buffer address
@@ -87,7 +89,11 @@ typedef struct
 #define ATA_CONTROL1	   0x3F6
 #define ATA_CONTROL2	   0x376
 #define ATA_IRQ	  14
+/* The PRDT area is 64K, which gives us 8192 entries. It's physically contiguous, 64K aligned and below 4GiB */
+#define ATA_PRDT_SIZE		0x10000
+#define ATA_PRDT_MAX_ENTRIES	(ATA_PRDT_SIZE / sizeof(prdt_entry_t))
+/* The most a 48-bit command can transfer, which 8192 pages happen to cover */
+#define ATA_MAX_SECTORS		65536
+/* Disks show up in the block layer as ata0 to ata3, I/O goes through there */
 void initialize_ata();
-void ata_read_sectors(unsigned int channel, unsigned int drive, uint32_t buffer, uint16_t bytesoftransfer, uint64_t lba48);
-void ata_write_sectors(unsigned int channel, unsigned int drive, uint32_t buffer, uint16_t bytesoftransfer, uint64_t lba48);
 #endif
@@ -12,7 +12,8 @@
 #define _EXT2_H
 
 #include <stdint.h>
-#include <drivers/ata.h>
+#include <kernel/bcache.h>
+#include <kernel/block.h>
 
 #define EXT2_MBR_CODE 0x83
 #define EXT2_FS_CLEAN 1
@@ -38,6 +39,8 @@
 #define EXT2_ROFTR_SPARSE_SUPERBLOCKS_GROUP_DESC_TABLES 1
 #define EXT2_ROFTR_FS_64BIT_SZ 2
 #define EXT2_ROFTR_DIR_CONTENTS_BIN_TREE 4
+#define EXT4_RQRD_EXTENTS 0x40
+#define EXT4_RQRD_64BIT 0x80
 #define EXT2_INO_TYPE_FIFO 0x1000
 #define EXT2_INO_TYPE_CHARDEV 0x2000
 #define EXT2_INO_TYPE_DIR 0x4000
@@ -60,6 +63,16 @@
 #define EXT2_INO_FLAG_HASH_INDEXED_DIR 0x10000
 #define EXT2_INO_FLAG_AFS_DIR 0x20000
 #define EXT2_INO_FLAG_JOURNAL_FILE_DATA 0x40000
+#define EXT4_INO_FLAG_EXTENTS 0x80000
+#define EXT4_EXT_MAGIC 0xF30A
+#define EXT4_EXT_MAX_DEPTH 5
+#define EXT4_EXT_INIT_MAX_LEN 32768 /* Longer extents are uninitialized, they read as zeroes */
+/* Resolved runs kept per inode, and how many inodes keep them */
+#define EXT2_RUNCACHE_MAX_RUNS 32
+#define EXT2_RUNCACHE_MAX_INODES 128
+#define EXT2_RUNCACHE_HASH_SIZE 64
+/* Largest read or write issued to the disk as a single command */
+#define EXT2_MAX_TRANSFER 0x100000
 typedef struct
 {
 	uint32_t total_inodes;
@@ -138,6 +151,29 @@ typedef struct
 	uint32_t block_address_frag;
 	uint32_t os_spec_val[3];
 } inode_t;
+/* ext4 extent trees live in the inode's block pointers, and in blocks of their own below that */
+typedef struct
+{
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth; /* 0 if the entries are extents, otherwise they're indexes */
+	uint32_t generation;
+} ext4_extent_header_t;
+typedef struct
+{
+	uint32_t block; /* First logical block the extent covers */
+	uint16_t len;
+	uint16_t start_hi;
+	uint32_t start_lo;
+} ext4_extent_t;
+typedef struct
+{
+	uint32_t block; /* First logical block covered by the subtree */
+	uint32_t leaf_lo;
+	uint16_t leaf_hi;
+	uint16_t unused;
+} ext4_extent_idx_t;
 typedef struct
 {
 	uint32_t inode;
@@ -149,21 +185,41 @@ typedef struct
 } dir_entry_t;
 typedef struct ex
 {
+	bcache_dev_t bdev; /* Needs to be the first member, the buffer cache callbacks cast it back */
 	superblock_t *sb;
 	uint32_t major;
 	uint32_t minor;
 	uint32_t total_inodes;
 	uint32_t total_blocks;
-	uint64_t first_sector;
 	uint32_t block_size;
 	uint32_t frag_size;
 	uint32_t blocks_per_block_group;
 	uint32_t inodes_per_block_group;
 	uint32_t number_of_block_groups;
-	int channel, drive;
+	block_dev_t *dev;
 	uint16_t inode_size;
 	block_group_desc_t *bgdt;
 	struct ex *next;
 } ext2_fs_t;
+/* A run of logical blocks that sit next to each other on the disk, physical is 0 for holes */
+typedef struct
+{
+	uint32_t logical;
+	uint32_t len;
+	uint64_t physical;
+} ext2_run_t;
+/* The runs of an inode that were resolved so far, sorted by logical block */
+typedef struct ext2_run_cache
+{
+	ext2_fs_t *fs;
+	uint32_t ino;
+	size_t nr_runs;
+	ext2_run_t runs[EXT2_RUNCACHE_MAX_RUNS];
+	struct ext2_run_cache *hash_next;
+	struct ext2_run_cache *lru_prev;
+	struct ext2_run_cache *lru_next;
+} ext2_run_cache_t;
 void init_ext2drv();
+int ext2_map_blocks(inode_t *inode, ext2_fs_t *fs, uint32_t ino, uint32_t block, uint32_t max, ext2_run_t *run);
+uint64_t ext2_bmap(inode_t *inode, ext2_fs_t *fs, uint32_t block);
 #endif
@@ -0,0 +1,156 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _DRIVERS_IGB_H
+#define _DRIVERS_IGB_H
+
+#include <stdint.h>
+
+#include <kernel/spinlock.h>
+#include <kernel/ethernet.h>
+#include <drivers/pci.h>
+
+#define IGB_VENDOR		0x8086
+#define IGB_DEV_82574		0x10D3
+#define IGB_DEV_82576		0x10C9
+
+#define IGB_CTRL		0x0000
+#define IGB_STATUS		0x0008
+#define IGB_CTRL_EXT		0x0018
+#define IGB_ICR			0x00C0
+#define IGB_IMS			0x00D0
+#define IGB_IMC			0x00D8
+#define IGB_RCTL		0x0100
+#define IGB_TCTL		0x0400
+#define IGB_TIPG		0x0410
+#define IGB_RXCSUM		0x5000
+#define IGB_MTA			0x5200
+#define IGB_RAL			0x5400
+#define IGB_RAH			0x5404
+#define IGB_MRQC		0x5818
+#define IGB_RETA		0x5C00
+#define IGB_RSSRK		0x5C80
+/* 82574 only */
+#define IGB_EIAC_82574		0x00DC
+#define IGB_IVAR_82574		0x00E4
+/* 82576 only */
+#define IGB_GPIE		0x1514
+#define IGB_EIMS		0x1524
+#define IGB_EIMC		0x1528
+#define IGB_EIAC		0x152C
+#define IGB_IVAR0		0x1700
+
+#define IGB_CTRL_SLU		(1U << 6)
+#define IGB_CTRL_RST		(1U << 26)
+#define IGB_CTRL_EXT_PBA_CLR	(1U << 31)
+#define IGB_ICR_RXT0		(1U << 7)
+#define IGB_ICR_RXQ(q)		(1U << (20 + (q))) /* 82574 with MSI-X */
+#define IGB_RAH_AV		(1U << 31)
+#define IGB_RXCSUM_PCSD		(1U << 13)
+#define IGB_GPIE_NSICR		(1U << 0)
+#define IGB_GPIE_MSIX_MODE	(1U << 4)
+#define IGB_GPIE_PBA		(1U << 31)
+#define IGB_IVAR_VALID_82574	0x8
+#define IGB_IVAR_VALID		0x80
+
+#define IGB_RCTL_EN		(1U << 1)
+#define IGB_RCTL_BAM		(1U << 15)
+#define IGB_RCTL_SECRC		(1U << 26)
+#define IGB_TCTL_EN		(1U << 1)
+#define IGB_TCTL_PSP		(1U << 3)
+#define IGB_TCTL_CT		(15U << 4)
+#define IGB_TCTL_COLD		(64U << 12)
+
+/* RSS hashes on the addresses, and the ports for TCP */
+#define IGB_MRQC_RSS_82574	0x1
+#define IGB_MRQC_RSS_82576	0x2
+#define IGB_MRQC_IPV4_TCP	(1U << 16)
+#define IGB_MRQC_IPV4		(1U << 17)
+#define IGB_MRQC_IPV6		(1U << 20)
+#define IGB_RETA_ENTRIES	128
+
+/* Queue registers, from the queue's base. The 82574 has them 0x100 apart, the 82576 0x40. */
+#define IGB_QUEUE_BAL		0x00
+#define IGB_QUEUE_BAH		0x04
+#define IGB_QUEUE_LEN		0x08
+#define IGB_QUEUE_SRRCTL	0x0C /* 82576 receive queues only */
+#define IGB_QUEUE_HEAD		0x10
+#define IGB_QUEUE_TAIL		0x18
+#define IGB_QUEUE_DCTL		0x28
+#define IGB_QUEUE_ENABLE	(1U << 25) /* In DCTL, the 82576 needs it */
+#define IGB_SRRCTL_BSIZE_2K	2
+#define IGB_SRRCTL_DROP_EN	(1U << 31)
+
+#define IGB_DESC_EOP		(1 << 0)
+#define IGB_DESC_IFCS		(1 << 1)
+#define IGB_DESC_RS		(1 << 3)
+#define IGB_DESC_DD		(1 << 0)
+
+/* Legacy descriptors, which both parts still take */
+typedef struct
+{
+	volatile uint64_t addr;
+	volatile uint16_t length;
+	volatile uint16_t checksum;
+	volatile uint8_t status;
+	volatile uint8_t errors;
+	volatile uint16_t special;
+} __attribute__((packed)) igb_rx_desc_t;
+
+typedef struct
+{
+	volatile uint64_t addr;
+	volatile uint16_t length;
+	volatile uint8_t cso;
+	volatile uint8_t cmd;
+	volatile uint8_t status;
+	volatile uint8_t css;
+	volatile uint16_t special;
+} __attribute__((packed)) igb_tx_desc_t;
+
+/* Every descriptor has half a page of buffer, which always fits a whole frame */
+#define IGB_RING_SIZE		128
+#define IGB_BUF_SIZE		2048
+#define IGB_MAX_QUEUES		4
+
+struct igb;
+/* One RX/TX pair, with its own MSI-X vector and CPU. The receive side belongs to the NET_RX
+ * softirq alone, so it has no lock; the transmit side is meant for its CPU's threads.
+*/
+typedef struct igb_queue
+{
+	eth_poll_t poll; /* First, so the poll gets back to its queue */
+	struct igb *igb;
+	unsigned int index;
+	int vector;
+	igb_rx_desc_t *rx;
+	uintptr_t rx_phys;
+	uintptr_t rx_bufs; /* Physical, IGB_RING_SIZE buffers in a row */
+	uint16_t rx_cur;
+	igb_tx_desc_t *tx;
+	uintptr_t tx_phys;
+	uintptr_t tx_bufs;
+	uint16_t tx_tail;
+	uint16_t tx_clean; /* Oldest descriptor that might still be in flight */
+	spinlock_t tx_lock;
+} igb_queue_t;
+
+typedef struct igb
+{
+	PCIDevice *pci;
+	volatile uint8_t *regs;
+	int is_82576;
+	unsigned int nqueues;
+	int msix;
+	igb_queue_t queues[IGB_MAX_QUEUES];
+} igb_t;
+
+void igb_init();
+#endif
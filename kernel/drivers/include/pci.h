@@ -13,13 +13,28 @@
 #include <stdint.h>
 #include <kernel/portio.h>
 
+struct pci_driver;
+/* slot is the bus the device is on */
 typedef struct PCIDevice
 {
 	uint16_t deviceID, vendorID;
 	char* vendor_string, *function_string;
 	uint8_t slot, device, function;
 	uint8_t pciClass, subClass, progIF;
+	uint8_t header_type;
+	uint8_t secondary_bus; /* Bridges only */
 	struct PCIDevice* next;
+	/* Where the device sits in the tree. Bridges have what's behind them as children. */
+	struct PCIDevice *parent;
+	struct PCIDevice *children;
+	struct PCIDevice *sibling;
+	struct pci_driver *driver;
+	unsigned int instance; /* Which of its driver's devices this is, in bus order */
+	void *driver_data;
+	/* Where the MSI and MSI-X capabilities are in configuration space, 0 if they aren't */
+	uint8_t msi_cap, msix_cap;
+	uint16_t msix_entries;
+	volatile uint32_t *msix_table; /* Mapped the first time an entry is set up */
 }PCIDevice;
 typedef struct
 {
@@ -29,10 +44,37 @@ typedef struct
 	size_t size;
 }pcibar_t;
 
+#define PCI_ANY_ID		0xFFFF
+/* What a driver can take. class_code is class << 16 | subclass << 8 | progif, of which only
+ * the bits in class_mask have to match.
+*/
+typedef struct pci_id
+{
+	uint16_t vendor, device;
+	uint32_t class_code;
+	uint32_t class_mask;
+} pci_id_t;
+#define PCI_ID(vendor, device)			{(vendor), (device), 0, 0}
+#define PCI_ID_CLASS(class, subclass, progif, mask)	{PCI_ANY_ID, PCI_ANY_ID, (class) << 16 | (subclass) << 8 | (progif), (mask)}
+
+typedef struct pci_driver
+{
+	const char *name;
+	const pci_id_t *ids; /* Ends with an entry that's all zeroes */
+	/* Called from a worker thread, returns 0 if the driver took the device */
+	int (*probe)(PCIDevice *dev, const pci_id_t *id);
+	unsigned int instances;
+	struct pci_driver *next;
+} pci_driver_t;
+
+/* Threads driver probes run on */
+#define PCI_PROBE_WORKERS	4
+
 void pci_init();
-uint16_t pci_config_read_word (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint16_t pci_config_read_word(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
+uint8_t pci_config_read_byte(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
 void pci_check_devices();
-uint32_t pci_config_read_dword (uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+uint32_t pci_config_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
 const char* pci_identify_common_vendors(uint16_t vendorID);
 const char* pci_identify_device_type(uint16_t headerType);
 const char* pci_identify_device_function(uint8_t pciClass, uint8_t subClass, uint8_t progIF);
@@ -40,13 +82,58 @@ pcibar_t* pci_get_bar(uint8_t slot, uint8_t device, uint8_t function, uint8_t ba
 uint16_t pci_get_intn(uint8_t slot, uint8_t device, uint8_t function);
 PCIDevice *get_pcidev_from_vendor_device(uint16_t deviceid, uint16_t vendorid);
 PCIDevice *get_pcidev_from_classes(uint8_t class, uint8_t subclass, uint8_t progif);
-void pci_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
-void pci_write_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
+void pci_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t data);
+void pci_write_word(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint16_t data);
+void pci_write_byte(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint8_t data);
 void pci_set_barx(uint8_t slot, uint8_t device, uint8_t function, uint8_t index, uint32_t address, uint8_t is_io, uint8_t is_prefetch);
+void pci_register_driver(pci_driver_t *driver);
+void pci_wait_for_probes();
+PCIDevice *pci_get_root();
+uint8_t pci_find_capability(PCIDevice *dev, uint8_t cap);
+int pci_enable_msi(PCIDevice *dev, int vector);
+int pci_enable_msix(PCIDevice *dev, unsigned int entry, int vector);
+void pci_disable_msix(PCIDevice *dev);
+void pci_disable_intx(PCIDevice *dev);
+#define PCI_VENDOR_ID 0x0
+#define PCI_CLASS_REVISION 0x8
+#define PCI_HEADER_TYPE 0xE
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_HEADER_BRIDGE 0x1
+#define PCI_SECONDARY_BUS 0x19
 #define PCI_BAR0 0x10
 #define PCI_BARx(index) (PCI_BAR0 + 0x4 * index)
 #define PCI_INTN 0x3C
 #define PCI_COMMAND 0x4
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_COMMAND_INTX_DISABLE 0x400
+#define PCI_STATUS 0x6
+#define PCI_STATUS_CAP_LIST 0x10
+#define PCI_CAPABILITY_LIST 0x34
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_MSIX 0x11
+/* MSI capability, the data and mask move up 4 bytes when the address is 64-bit */
+#define PCI_MSI_FLAGS 0x2
+#define PCI_MSI_FLAGS_ENABLE 0x1
+#define PCI_MSI_FLAGS_QSIZE 0x70
+#define PCI_MSI_FLAGS_64BIT 0x80
+#define PCI_MSI_FLAGS_MASKBIT 0x100
+#define PCI_MSI_ADDRESS_LO 0x4
+#define PCI_MSI_ADDRESS_HI 0x8
+#define PCI_MSI_DATA_32 0x8
+#define PCI_MSI_DATA_64 0xC
+#define PCI_MSI_MASK_32 0xC
+#define PCI_MSI_MASK_64 0x10
+/* MSI-X capability, the table itself is in one of the BARs */
+#define PCI_MSIX_FLAGS 0x2
+#define PCI_MSIX_FLAGS_QSIZE 0x7FF
+#define PCI_MSIX_FLAGS_MASKALL 0x4000
+#define PCI_MSIX_FLAGS_ENABLE 0x8000
+#define PCI_MSIX_TABLE 0x4
+#define PCI_MSIX_TABLE_BIR 0x7
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_CTRL_MASKBIT 0x1
+/* Messages are writes to the local APIC of the CPU they're for */
+#define PCI_MSI_ADDRESS_BASE 0xFEE00000
 #define CLASS_MASS_STORAGE_CONTROLLER 0x1
 #define CLASS_NETWORK_CONTROLLER 0x2
 #define CLASS_DISPLAY_CONTROLLER 0x3
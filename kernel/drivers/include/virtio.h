@@ -0,0 +1,106 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _DRIVERS_VIRTIO_H
+#define _DRIVERS_VIRTIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VIRTIO_VENDOR			0x1AF4
+
+/* Legacy PCI interface, which transitional devices have in BAR0's I/O space */
+#define VIRTIO_PCI_DEVICE_FEATURES	0x00
+#define VIRTIO_PCI_GUEST_FEATURES	0x04
+#define VIRTIO_PCI_QUEUE_PFN		0x08
+#define VIRTIO_PCI_QUEUE_SIZE		0x0C
+#define VIRTIO_PCI_QUEUE_SEL		0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10
+#define VIRTIO_PCI_STATUS		0x12
+#define VIRTIO_PCI_ISR			0x13
+/* Device specific configuration, it's only here while MSI-X is off */
+#define VIRTIO_PCI_CONFIG		0x14
+/* With MSI-X on, the MSI-X table entries for config changes and the selected queue go
+ * there instead, and the configuration moves up
+*/
+#define VIRTIO_PCI_MSI_CONFIG_VECTOR	0x14
+#define VIRTIO_PCI_MSI_QUEUE_VECTOR	0x16
+#define VIRTIO_PCI_CONFIG_MSIX		0x18
+#define VIRTIO_MSI_NO_VECTOR		0xFFFF
+#define VIRTIO_PCI_QUEUE_ALIGN		4096
+
+#define VIRTIO_STATUS_ACKNOWLEDGE	1
+#define VIRTIO_STATUS_DRIVER		2
+#define VIRTIO_STATUS_DRIVER_OK		4
+#define VIRTIO_STATUS_FAILED		0x80
+#define VIRTIO_ISR_QUEUE		1
+
+#define VIRTIO_RING_F_INDIRECT_DESC	(1U << 28)
+#define VIRTIO_RING_F_EVENT_IDX		(1U << 29)
+
+#define VIRTQ_DESC_F_NEXT		1
+#define VIRTQ_DESC_F_WRITE		2 /* The device writes to the buffer */
+#define VIRTQ_DESC_F_INDIRECT		4
+#define VIRTQ_USED_F_NO_NOTIFY		1
+
+typedef struct
+{
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+/* With VIRTIO_RING_F_EVENT_IDX, used_event comes right after the ring */
+typedef struct
+{
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct
+{
+	uint32_t id;
+	uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+/* And avail_event comes after this one's */
+typedef struct
+{
+	uint16_t flags;
+	uint16_t idx;
+	virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+/* A split virtqueue. The avail side belongs to whoever submits, the used side to the interrupt handler. */
+typedef struct virtq
+{
+	uint16_t io;
+	uint16_t index;
+	uint16_t size;
+	int event_idx;
+	virtq_desc_t *desc;
+	volatile virtq_avail_t *avail;
+	volatile virtq_used_t *used;
+	uint16_t avail_idx;
+	uint16_t kicked_idx; /* avail_idx the last time the device was notified */
+	uint16_t last_used;
+	uintptr_t phys;
+	size_t pages;
+} virtq_t;
+
+int virtq_init(virtq_t *vq, uint16_t io, uint16_t index, int event_idx);
+void virtq_reset(virtq_t *vq);
+void virtq_submit(virtq_t *vq, uint16_t head);
+void virtq_kick(virtq_t *vq);
+int virtq_next_used(virtq_t *vq, uint32_t *id);
+int virtq_enable_intr(virtq_t *vq);
+#endif
@@ -0,0 +1,74 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _DRIVERS_VIRTIO_BLK_H
+#define _DRIVERS_VIRTIO_BLK_H
+
+#include <stdint.h>
+
+#include <kernel/block.h>
+#include <kernel/spinlock.h>
+#include <drivers/pci.h>
+#include <drivers/virtio.h>
+
+/* The transitional device, which has the legacy interface */
+#define VIRTIO_DEV_BLK			0x1001
+
+#define VIRTIO_BLK_F_SEG_MAX		(1U << 2)
+#define VIRTIO_BLK_F_RO			(1U << 5)
+
+/* Device configuration */
+#define VIRTIO_BLK_CFG_CAPACITY		0x00
+#define VIRTIO_BLK_CFG_SEG_MAX		0x0C
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_S_OK			0
+
+typedef struct
+{
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_t;
+
+/* Data segments a request can have, on top of the header and the status */
+#define VIRTIO_BLK_MAX_SEGMENTS		252
+/* Everything a tag needs the device to see, in one page. The indirect table is only
+ * used with VIRTIO_RING_F_INDIRECT_DESC.
+*/
+typedef struct
+{
+	virtio_blk_req_t hdr;
+	volatile uint8_t status;
+	uint8_t pad[7];
+	virtq_desc_t table[VIRTIO_BLK_MAX_SEGMENTS + 2];
+} __attribute__((packed)) virtio_blk_cmd_t;
+
+typedef struct virtio_blk
+{
+	PCIDevice *pci;
+	uint16_t io;
+	uint32_t features;
+	virtq_t vq;
+	/* Without indirect descriptors, each tag gets its own run of per_tag ring descriptors */
+	unsigned int per_tag;
+	virtio_blk_cmd_t *cmds[BLOCK_MAX_DEPTH];
+	uintptr_t cmds_phys[BLOCK_MAX_DEPTH];
+	request_queue_t *queue;
+	block_dev_t *dev;
+	int vector; /* MSI-X vector of the queue, -1 if it's on the legacy line */
+	spinlock_t lock; /* Keeps resets and the interrupt handler off the used ring at the same time */
+	struct virtio_blk *next;
+} virtio_blk_t;
+
+/* Disks show up in the block layer as vd0, vd1... */
+void initialize_virtio_blk();
+#endif
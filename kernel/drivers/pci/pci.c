@@ -8,9 +8,22 @@
  * General Public License version 2 as published by the Free Software
  * Foundation.
  *----------------------------------------------------------------------*/
-#include <drivers/pci.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <acpi.h>
+
 #include <kernel/compiler.h>
+#include <kernel/spinlock.h>
+#include <kernel/wait_queue.h>
+#include <kernel/task_switching.h>
+#include <kernel/vmm.h>
+#include <kernel/paging.h>
+#include <kernel/irq.h>
+
+#include <drivers/pci.h>
 const uint16_t CONFIG_ADDRESS = 0xCF8;
 const uint16_t CONFIG_DATA = 0xCFC;
 
@@ -670,183 +683,212 @@ const uint16_t CONFIG_DATA = 0xCFC;
 			return "Unknown vendor";
 		}
 	}
-	uint16_t pci_config_read_word (uint8_t bus, uint8_t slot,
-                                    uint8_t func, uint8_t offset)
-        {
-           uint32_t address;
-           uint32_t lbus  = (uint32_t)bus;
-           uint32_t lslot = (uint32_t)slot;
-           uint32_t lfunc = (uint32_t)func;
-           uint16_t tmp = 0;
-
-           /* create configuration address as per Figure 1 */
-           address = (uint32_t)((lbus << 16) | (lslot << 11) |
-                     (lfunc << 8) | (offset & 0xfc) | ((uint32_t)0x80000000));
-
-           /* write out the address */
-           outl (CONFIG_ADDRESS, address);
-           /* read in the data */
-           /* (offset & 2) * 8) = 0 will choose the first word of the 32 bits register */
-           tmp = (uint16_t)((inl (CONFIG_DATA) >> ((offset & 2) * 8)) & 0xffff);
-           return (tmp);
-        }
-	uint32_t pci_config_read_dword (uint8_t bus, uint8_t slot,
-                                    uint8_t func, uint8_t offset)
-        {
-           uint32_t address;
-           uint32_t lbus  = (uint32_t)bus;
-           uint32_t lslot = (uint32_t)slot;
-           uint32_t lfunc = (uint32_t)func;
-           uint32_t tmp = 0;
-
-           /* create configuration address as per Figure 1 */
-           address = (uint32_t)((lbus << 16) | (lslot << 11) |
-                     (lfunc << 8) | (offset & 0xfc) | ((uint32_t)0x80000000));
-
-           /* write out the address */
-           outl (CONFIG_ADDRESS, address);
-           /* read in the data */
-           tmp = (uint32_t)((inl (CONFIG_DATA)));
-           return (tmp);
-        }
-void pci_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data)
-{
-	uint32_t address;
-	uint32_t lbus  = (uint32_t)bus;
-	uint32_t lslot = (uint32_t)slot;
-	uint32_t lfunc = (uint32_t)func;
-
-	/* create configuration address as per Figure 1 */
-	address = (uint32_t)((lbus << 16) | (lslot << 11) |
-		  (lfunc << 8) | (offset & 0xfc) | ((uint32_t)0x80000000));
-
-	/* write out the address */
-	outl (CONFIG_ADDRESS, address);
-	/* read in the data */
+/* ECAM window of segment 0 from the MCFG, every bus gets mapped the first time it's touched */
+static uintptr_t pci_ecam_phys = 0;
+static uint8_t pci_ecam_start = 0, pci_ecam_end = 0;
+static volatile uint8_t *pci_ecam_buses[256];
+static spinlock_t pci_ecam_spl;
+/* The port I/O mechanism takes two accesses, nothing can come in between */
+static spinlock_t pci_io_spl;
+static void pci_ecam_init()
+{
+	ACPI_TABLE_MCFG *mcfg = NULL;
+	if(ACPI_FAILURE(AcpiGetTable((ACPI_STRING) ACPI_SIG_MCFG, 0, (ACPI_TABLE_HEADER**) &mcfg)))
+		return;
+	ACPI_MCFG_ALLOCATION *alloc = (ACPI_MCFG_ALLOCATION*)(mcfg + 1);
+	size_t entries = (mcfg->Header.Length - sizeof(ACPI_TABLE_MCFG)) / sizeof(ACPI_MCFG_ALLOCATION);
+	for(size_t i = 0; i < entries; i++)
+	{
+		/* Devices are only told apart by bus, device and function, so only segment 0 is used */
+		if(alloc[i].PciSegment)
+			continue;
+		pci_ecam_phys = alloc[i].Address;
+		pci_ecam_start = alloc[i].StartBusNumber;
+		pci_ecam_end = alloc[i].EndBusNumber;
+		printf("pci: ECAM at %p, buses %u-%u\n", pci_ecam_phys, pci_ecam_start, pci_ecam_end);
+		return;
+	}
+}
+/* Returns where the function's configuration space is mapped, or NULL if it has to go through port I/O */
+static volatile uint8_t *pci_ecam_map(uint8_t bus, uint8_t slot, uint8_t func)
+{
+	if(!pci_ecam_phys || bus < pci_ecam_start || bus > pci_ecam_end)
+		return NULL;
+	volatile uint8_t *base = pci_ecam_buses[bus];
+	if(!base)
+	{
+		unsigned long flags = spin_lock_irqsave(&pci_ecam_spl);
+		if(!(base = pci_ecam_buses[bus]))
+		{
+			/* 32 devices of 8 functions, with 4K each */
+			base = vmm_allocate_virt_address(VM_KERNEL, 256, VMM_TYPE_HW, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+			if(base)
+			{
+				uintptr_t phys = pci_ecam_phys + ((uintptr_t) bus << 20);
+				for(size_t i = 0; i < 256; i++)
+					paging_map_phys_to_virt((uintptr_t) base + i * PAGE_SIZE, phys + i * PAGE_SIZE,
+					VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC);
+				pci_ecam_buses[bus] = base;
+			}
+		}
+		spin_unlock_irqrestore(&pci_ecam_spl, flags);
+		if(!base)
+			return NULL;
+	}
+	return base + ((uintptr_t) slot << 15 | (uintptr_t) func << 12);
+}
+static inline uint32_t pci_io_address(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset)
+{
+	return (uint32_t) bus << 16 | (uint32_t) slot << 11 | (uint32_t) func << 8 | (offset & 0xFC) | 0x80000000;
+}
+uint32_t pci_config_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset)
+{
+	volatile uint8_t *ecam = pci_ecam_map(bus, slot, func);
+	if(ecam)
+		return *(volatile uint32_t*)(ecam + (offset & 0xFFC));
+	/* Port I/O only reaches the first 256 bytes */
+	if(offset >= 256)
+		return 0xFFFFFFFF;
+	unsigned long flags = spin_lock_irqsave(&pci_io_spl);
+	outl(CONFIG_ADDRESS, pci_io_address(bus, slot, func, offset));
+	uint32_t data = inl(CONFIG_DATA);
+	spin_unlock_irqrestore(&pci_io_spl, flags);
+	return data;
+}
+uint16_t pci_config_read_word(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset)
+{
+	return (uint16_t)(pci_config_read_dword(bus, slot, func, offset) >> ((offset & 2) * 8));
+}
+uint8_t pci_config_read_byte(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset)
+{
+	return (uint8_t)(pci_config_read_dword(bus, slot, func, offset) >> ((offset & 3) * 8));
+}
+void pci_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t data)
+{
+	volatile uint8_t *ecam = pci_ecam_map(bus, slot, func);
+	if(ecam)
+	{
+		*(volatile uint32_t*)(ecam + (offset & 0xFFC)) = data;
+		return;
+	}
+	if(offset >= 256)
+		return;
+	unsigned long flags = spin_lock_irqsave(&pci_io_spl);
+	outl(CONFIG_ADDRESS, pci_io_address(bus, slot, func, offset));
 	outl(CONFIG_DATA, data);
+	spin_unlock_irqrestore(&pci_io_spl, flags);
 }
-void pci_write_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data)
+void pci_write_word(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint16_t data)
 {
-	uint32_t address;
-	uint32_t lbus  = (uint32_t)bus;
-	uint32_t lslot = (uint32_t)slot;
-	uint32_t lfunc = (uint32_t)func;
-
-	/* create configuration address as per Figure 1 */
-	address = (uint32_t)((lbus << 16) | (lslot << 11) |
-		  (lfunc << 8) | (offset & 0xfc) | ((uint32_t)0x80000000));
-
-	/* write out the address */
-	outl (CONFIG_ADDRESS, address);
-	/* read in the data */
-	outw(CONFIG_DATA, data);
+	volatile uint8_t *ecam = pci_ecam_map(bus, slot, func);
+	if(ecam)
+	{
+		*(volatile uint16_t*)(ecam + (offset & 0xFFE)) = data;
+		return;
+	}
+	if(offset >= 256)
+		return;
+	unsigned long flags = spin_lock_irqsave(&pci_io_spl);
+	outl(CONFIG_ADDRESS, pci_io_address(bus, slot, func, offset));
+	outw(CONFIG_DATA + (offset & 2), data);
+	spin_unlock_irqrestore(&pci_io_spl, flags);
 }
-	PCIDevice *linked_list = NULL;
-	PCIDevice* last = NULL;
-	void* pci_check_function(uint8_t bus, uint8_t device, uint8_t function)
+void pci_write_byte(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint8_t data)
+{
+	volatile uint8_t *ecam = pci_ecam_map(bus, slot, func);
+	if(ecam)
 	{
-		// Get vendorID
-		uint16_t vendorID = (uint16_t)(pci_config_read_dword(bus, device, function,0) & 0x0000ffff);
-		if(vendorID == 0xFFFF) //Invalid function
-			return NULL;
-		// Get vendor string from common vendors
-		const char* vendor = IdentifyCommonVendors(vendorID);
-		// Get device ID
-		uint16_t deviceID = (pci_config_read_dword(bus, device, function,0) >> 16);
-		// Get Device Class
-		uint8_t pciClass = (uint8_t)(pci_config_read_word(bus, device, function , 0xA)>>8);
-		// Get Device SubClass
-		uint8_t subClass = (uint8_t)pci_config_read_word(bus,device, function, 0xB);
-		// Get ProgIF
-		uint8_t progIF = (uint8_t)(pci_config_read_word(bus, device, function,0xC)>>8);
-		// What a nice variable name :D
-		const char* function_function = IdentifyDeviceFunction(pciClass, subClass, progIF); /* Get the device's
-		function */
-		// Set up the meta-data
-		PCIDevice* dev = malloc(sizeof(PCIDevice));
-		memset(dev, 0 , sizeof(PCIDevice));
-		dev->slot = bus;
-		dev->function = function;
-		dev->device = device;
-		dev->function_string = (char*)function_function;
-		dev->vendor_string = (char*)vendor;
-		dev->vendorID = vendorID;
-		dev->deviceID = deviceID;
-		dev->pciClass = pciClass;
-		dev->subClass = subClass;
-		dev->progIF = progIF;
-		// Put it on the linked list
+		ecam[offset & 0xFFF] = data;
+		return;
+	}
+	if(offset >= 256)
+		return;
+	unsigned long flags = spin_lock_irqsave(&pci_io_spl);
+	outl(CONFIG_ADDRESS, pci_io_address(bus, slot, func, offset));
+	outb(CONFIG_DATA + (offset & 3), data);
+	spin_unlock_irqrestore(&pci_io_spl, flags);
+}
+PCIDevice *linked_list = NULL;
+PCIDevice *last = NULL;
+/* Devices on bus 0, the rest of the tree hangs off their bridges */
+static PCIDevice *pci_root = NULL;
+static uint32_t pci_scanned_buses[8];
+static void pci_scan_bus(uint8_t bus, PCIDevice *parent);
+static PCIDevice *pci_add_function(uint8_t bus, uint8_t device, uint8_t function, PCIDevice *parent)
+{
+	uint32_t id = pci_config_read_dword(bus, device, function, PCI_VENDOR_ID);
+	if((id & 0xFFFF) == 0xFFFF)
+		return NULL;
+	uint32_t class_reg = pci_config_read_dword(bus, device, function, PCI_CLASS_REVISION);
+	PCIDevice *dev = malloc(sizeof(PCIDevice));
+	if(!dev)
+		return NULL;
+	memset(dev, 0, sizeof(PCIDevice));
+	dev->slot = bus;
+	dev->device = device;
+	dev->function = function;
+	dev->vendorID = id & 0xFFFF;
+	dev->deviceID = id >> 16;
+	dev->pciClass = class_reg >> 24;
+	dev->subClass = class_reg >> 16;
+	dev->progIF = class_reg >> 8;
+	dev->header_type = pci_config_read_byte(bus, device, function, PCI_HEADER_TYPE) & 0x7F;
+	dev->msi_cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+	dev->msix_cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+	if(dev->msix_cap)
+		dev->msix_entries = (pci_config_read_word(bus, device, function, dev->msix_cap + PCI_MSIX_FLAGS) &
+		PCI_MSIX_FLAGS_QSIZE) + 1;
+	dev->vendor_string = (char*) IdentifyCommonVendors(dev->vendorID);
+	dev->function_string = (char*) IdentifyDeviceFunction(dev->pciClass, dev->subClass, dev->progIF);
+	dev->parent = parent;
+	PCIDevice **siblings = parent ? &parent->children : &pci_root;
+	dev->sibling = *siblings;
+	*siblings = dev;
+	if(last)
 		last->next = dev;
-		last = dev;
-
-		return dev;
-
+	else
+		linked_list = dev;
+	last = dev;
+	printf("pci: %x:%x.%x %s %s (%X:%X)\n", bus, device, function, dev->vendor_string, dev->function_string,
+	dev->vendorID, dev->deviceID);
+	/* Firmware numbered the buses behind the bridge, walk them too */
+	if(dev->header_type == PCI_HEADER_BRIDGE)
+	{
+		dev->secondary_bus = pci_config_read_byte(bus, device, function, PCI_SECONDARY_BUS);
+		if(dev->secondary_bus > bus)
+			pci_scan_bus(dev->secondary_bus, dev);
+	}
+	return dev;
+}
+static void pci_scan_bus(uint8_t bus, PCIDevice *parent)
+{
+	if(pci_scanned_buses[bus / 32] & (1U << (bus % 32)))
+		return;
+	pci_scanned_buses[bus / 32] |= 1U << (bus % 32);
+	for(uint8_t device = 0; device < 32; device++)
+	{
+		if(!pci_add_function(bus, device, 0, parent))
+			continue;
+		if(!(pci_config_read_byte(bus, device, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION))
+			continue;
+		for(uint8_t function = 1; function < 8; function++)
+			pci_add_function(bus, device, function, parent);
 	}
-	void pci_check_devices()
+}
+void pci_check_devices()
+{
+	/* A multi-function host bridge has a host controller per function, each with its own bus */
+	if(pci_config_read_byte(0, 0, 0, PCI_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION)
 	{
-		for(uint16_t slot = 0; slot < 256; slot++)
+		for(uint8_t function = 0; function < 8; function++)
 		{
-			for(uint16_t device = 0; device < 32; device++)
-			{
-				//uint8_t function = 0;
-				// Get vendor
-				uint16_t vendor = (uint16_t)(pci_config_read_dword(slot, device, 0,0) & 0x0000ffff);
-
-				if(vendor == 0xFFFF) //Invalid, just skip this device
-					break;
-
-				printf("Found a device at slot %d, device %d, function %d: ",slot,device,0);
-
-				// Check the vendor against a bunch of mainstream hardware developers
-				printf("Vendor: %s\n", IdentifyCommonVendors(vendor));
-				printf("DeviceID: %X\n", pci_config_read_dword(slot, device, 0,0) >> 16);
-
-				// Get header type
-				uint16_t header = (uint16_t)(pci_config_read_word(slot, device, 0,0xE));
-
-				printf("Device type: %s\n",IdentifyDeviceType(header & 0x7F));
-				uint8_t pciClass = (uint8_t)(pci_config_read_word(slot, device, 0 , 0xA)>>8);
-				uint8_t subClass = (uint8_t)pci_config_read_word(slot,device, 0, 0xB);
-				uint8_t progIF = (uint8_t)(pci_config_read_word(slot, device, 0,0xC)>>8);
-				printf("Function of Device: %s\n", IdentifyDeviceFunction(pciClass, subClass, progIF));
-
-				// Set up some meta-data
-				PCIDevice* dev = malloc(sizeof(PCIDevice));
-				memset(dev, 0 , sizeof(PCIDevice));
-				dev->slot = slot;
-				dev->function = 0;
-				dev->device = device;
-				dev->function_string = (char*)IdentifyDeviceFunction(pciClass, subClass, progIF);
-				dev->vendor_string = (char*)IdentifyCommonVendors(vendor);
-				dev->vendorID = vendor;
-				dev->deviceID = (pci_config_read_dword(slot, device, 0,0) >> 16);
-				dev->pciClass = pciClass;
-				dev->subClass = subClass;
-				dev->progIF = progIF;
-				// If last is not NULL (it is at first), set this device as the last node's next
-				if(likely(last))
-					last->next = dev;
-				else
-					linked_list = dev;
-
-
-				last = dev;
-				if(header & 0x80)
-				{
-					for(int i = 1; i < 8;i++)
-					{
-						PCIDevice* dev = pci_check_function(slot, device, i);
-						if(!dev)
-							continue;
-						printf("Found PCI device at bus %d, device %d, function %d\n", dev->slot, dev->device,
-						dev->function);
-						printf("Device function: %s\n",dev->function_string);
-
-					}
-				}
-			}
+			if((pci_config_read_dword(0, 0, function, PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF)
+				pci_scan_bus(function, NULL);
 		}
 	}
+	else
+		pci_scan_bus(0, NULL);
+}
 pcibar_t* pci_get_bar(uint8_t slot, uint8_t device, uint8_t function, uint8_t barindex)
 {
 	uint8_t offset = 0x10 + 0x4 * barindex;
@@ -869,11 +911,246 @@ uint16_t pci_get_intn(uint8_t slot, uint8_t device, uint8_t function)
 	printf("Returning intn %d\n", intn&0xFF);
 	return intn&0xFF;
 }
+/* Returns the offset of the capability in configuration space, 0 if the device doesn't have it */
+uint8_t pci_find_capability(PCIDevice *dev, uint8_t cap)
+{
+	if(!(pci_config_read_word(dev->slot, dev->device, dev->function, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+		return 0;
+	uint8_t off = pci_config_read_byte(dev->slot, dev->device, dev->function, PCI_CAPABILITY_LIST) & 0xFC;
+	/* There's only room for 48 of them, a longer list is a loop */
+	for(int i = 0; off && i < 48; i++)
+	{
+		uint16_t hdr = pci_config_read_word(dev->slot, dev->device, dev->function, off);
+		if((hdr & 0xFF) == cap)
+			return off;
+		off = (hdr >> 8) & 0xFC;
+	}
+	return 0;
+}
+void pci_disable_intx(PCIDevice *dev)
+{
+	uint16_t command = pci_config_read_word(dev->slot, dev->device, dev->function, PCI_COMMAND);
+	pci_write_word(dev->slot, dev->device, dev->function, PCI_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+}
+/* Fixed delivery, edge triggered, to the CPU the vector was allocated on */
+static inline uint32_t pci_msi_address(int vector)
+{
+	return PCI_MSI_ADDRESS_BASE | irq_vector_destination(vector) << 12;
+}
+/* Only one message is asked for, so the device can't OR anything into the vector */
+int pci_enable_msi(PCIDevice *dev, int vector)
+{
+	uint8_t cap = dev->msi_cap;
+	if(!cap)
+		return errno = ENODEV, -1;
+	uint16_t control = pci_config_read_word(dev->slot, dev->device, dev->function, cap + PCI_MSI_FLAGS);
+	int is64 = control & PCI_MSI_FLAGS_64BIT;
+	pci_write_dword(dev->slot, dev->device, dev->function, cap + PCI_MSI_ADDRESS_LO, pci_msi_address(vector));
+	if(is64)
+		pci_write_dword(dev->slot, dev->device, dev->function, cap + PCI_MSI_ADDRESS_HI, 0);
+	pci_write_word(dev->slot, dev->device, dev->function, cap + (is64 ? PCI_MSI_DATA_64 : PCI_MSI_DATA_32),
+	(uint16_t) vector);
+	if(control & PCI_MSI_FLAGS_MASKBIT)
+		pci_write_dword(dev->slot, dev->device, dev->function, cap + (is64 ? PCI_MSI_MASK_64 : PCI_MSI_MASK_32), 0);
+	control &= ~PCI_MSI_FLAGS_QSIZE;
+	pci_write_word(dev->slot, dev->device, dev->function, cap + PCI_MSI_FLAGS, control | PCI_MSI_FLAGS_ENABLE);
+	pci_disable_intx(dev);
+	return 0;
+}
+static volatile uint32_t *pci_msix_map(PCIDevice *dev)
+{
+	if(dev->msix_table)
+		return dev->msix_table;
+	uint32_t table = pci_config_read_dword(dev->slot, dev->device, dev->function, dev->msix_cap + PCI_MSIX_TABLE);
+	uint8_t bir = table & PCI_MSIX_TABLE_BIR;
+	uint16_t bar_off = PCI_BARx(bir);
+	uint32_t bar = pci_config_read_dword(dev->slot, dev->device, dev->function, bar_off);
+	if(bar & 1)
+		return NULL;
+	uint64_t phys = bar & 0xFFFFFFF0;
+	/* 64-bit BARs take the next one for the upper half */
+	if((bar & 6) == 4)
+		phys |= (uint64_t) pci_config_read_dword(dev->slot, dev->device, dev->function, bar_off + 4) << 32;
+	phys += table & ~PCI_MSIX_TABLE_BIR;
+	size_t off = phys & (PAGE_SIZE - 1);
+	size_t pages = (off + dev->msix_entries * PCI_MSIX_ENTRY_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+	char *virt = vmm_allocate_virt_address(VM_KERNEL, pages, VMM_TYPE_HW, VMM_WRITE | VMM_GLOBAL | VMM_NOEXEC);
+	if(!virt)
+		return NULL;
+	for(size_t i = 0; i < pages; i++)
+		paging_map_phys_to_virt((uintptr_t) virt + i * PAGE_SIZE, (phys - off) + i * PAGE_SIZE,
+		VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC);
+	uint16_t command = pci_config_read_word(dev->slot, dev->device, dev->function, PCI_COMMAND);
+	pci_write_word(dev->slot, dev->device, dev->function, PCI_COMMAND, command | PCI_COMMAND_MEMORY);
+	dev->msix_table = (volatile uint32_t*)(virt + off);
+	return dev->msix_table;
+}
+/* Points one entry of the table at the vector. Entries that are never set up stay masked. */
+int pci_enable_msix(PCIDevice *dev, unsigned int entry, int vector)
+{
+	uint8_t cap = dev->msix_cap;
+	if(!cap)
+		return errno = ENODEV, -1;
+	if(entry >= dev->msix_entries)
+		return errno = EINVAL, -1;
+	volatile uint32_t *table = pci_msix_map(dev);
+	if(!table)
+		return errno = ENOMEM, -1;
+	uint16_t control = pci_config_read_word(dev->slot, dev->device, dev->function, cap + PCI_MSIX_FLAGS);
+	/* Nothing can go out while the entry is half written */
+	pci_write_word(dev->slot, dev->device, dev->function, cap + PCI_MSIX_FLAGS,
+	control | PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL);
+	volatile uint32_t *e = table + entry * (PCI_MSIX_ENTRY_SIZE / 4);
+	e[3] |= PCI_MSIX_ENTRY_CTRL_MASKBIT;
+	e[0] = pci_msi_address(vector);
+	e[1] = 0;
+	e[2] = (uint32_t) vector;
+	e[3] &= ~PCI_MSIX_ENTRY_CTRL_MASKBIT;
+	pci_write_word(dev->slot, dev->device, dev->function, cap + PCI_MSIX_FLAGS,
+	(control | PCI_MSIX_FLAGS_ENABLE) & ~PCI_MSIX_FLAGS_MASKALL);
+	pci_disable_intx(dev);
+	return 0;
+}
+/* Goes back to the legacy line */
+void pci_disable_msix(PCIDevice *dev)
+{
+	if(!dev->msix_cap)
+		return;
+	uint16_t control = pci_config_read_word(dev->slot, dev->device, dev->function, dev->msix_cap + PCI_MSIX_FLAGS);
+	pci_write_word(dev->slot, dev->device, dev->function, dev->msix_cap + PCI_MSIX_FLAGS,
+	control & ~PCI_MSIX_FLAGS_ENABLE);
+	uint16_t command = pci_config_read_word(dev->slot, dev->device, dev->function, PCI_COMMAND);
+	pci_write_word(dev->slot, dev->device, dev->function, PCI_COMMAND, command & ~PCI_COMMAND_INTX_DISABLE);
+}
+/* A driver probing a device, waiting for a worker to pick it up */
+typedef struct pci_probe
+{
+	PCIDevice *dev;
+	pci_driver_t *driver;
+	const pci_id_t *id;
+	struct pci_probe *next;
+} pci_probe_t;
+static pci_driver_t *pci_drivers = NULL;
+static pci_probe_t *pci_probes = NULL, *pci_probes_tail = NULL;
+static unsigned int pci_probes_pending = 0;
+static unsigned int pci_workers = 0;
+static spinlock_t pci_drivers_spl;
+static wait_queue_t pci_probes_wq; /* Workers wait here for probes to run */
+static wait_queue_t pci_done_wq; /* And pci_wait_for_probes() for them to be done */
+static int pci_match(const pci_id_t *id, PCIDevice *dev)
+{
+	uint32_t class_code = (uint32_t) dev->pciClass << 16 | (uint32_t) dev->subClass << 8 | dev->progIF;
+	return (id->vendor == PCI_ANY_ID || id->vendor == dev->vendorID) &&
+	(id->device == PCI_ANY_ID || id->device == dev->deviceID) &&
+	(class_code & id->class_mask) == (id->class_code & id->class_mask);
+}
+static void pci_run_probe(pci_probe_t *probe)
+{
+	PCIDevice *dev = probe->dev;
+	if(probe->driver->probe(dev, probe->id) < 0)
+	{
+		printf("pci: %s couldn't take %x:%x.%x\n", probe->driver->name, dev->slot, dev->device, dev->function);
+		dev->driver = NULL;
+	}
+	free(probe);
+	unsigned long flags = spin_lock_irqsave(&pci_drivers_spl);
+	pci_probes_pending--;
+	spin_unlock_irqrestore(&pci_drivers_spl, flags);
+	wake_up(&pci_done_wq);
+}
+/* Drivers probe on these, so one that waits for its hardware doesn't hold up the others */
+static void pci_probe_worker(void *arg)
+{
+	for(;;)
+	{
+		wait_for_event(&pci_probes_wq, pci_probes);
+		unsigned long flags = spin_lock_irqsave(&pci_drivers_spl);
+		pci_probe_t *probe = pci_probes;
+		if(probe && !(pci_probes = probe->next))
+			pci_probes_tail = NULL;
+		spin_unlock_irqrestore(&pci_drivers_spl, flags);
+		if(probe)
+			pci_run_probe(probe);
+	}
+}
+/* Hands every device that isn't taken and matches one of the driver's IDs to its probe callback.
+ * The probes run on the workers, pci_wait_for_probes() waits for them to finish.
+*/
+void pci_register_driver(pci_driver_t *driver)
+{
+	pci_probe_t *head = NULL, *tail = NULL;
+	unsigned long flags = spin_lock_irqsave(&pci_drivers_spl);
+	driver->next = pci_drivers;
+	pci_drivers = driver;
+	for(PCIDevice *dev = linked_list; dev; dev = dev->next)
+	{
+		if(dev->driver)
+			continue;
+		const pci_id_t *id;
+		for(id = driver->ids; id->vendor || id->class_mask; id++)
+		{
+			if(pci_match(id, dev))
+				break;
+		}
+		if(!id->vendor && !id->class_mask)
+			continue;
+		pci_probe_t *probe = malloc(sizeof(pci_probe_t));
+		if(!probe)
+			break;
+		dev->driver = driver;
+		dev->instance = driver->instances++;
+		probe->dev = dev;
+		probe->driver = driver;
+		probe->id = id;
+		probe->next = NULL;
+		if(tail)
+			tail->next = probe;
+		else
+			head = probe;
+		tail = probe;
+		pci_probes_pending++;
+	}
+	if(head && pci_workers)
+	{
+		if(pci_probes_tail)
+			pci_probes_tail->next = head;
+		else
+			pci_probes = head;
+		pci_probes_tail = tail;
+		head = NULL;
+	}
+	spin_unlock_irqrestore(&pci_drivers_spl, flags);
+	wake_up(&pci_probes_wq);
+	/* Without workers the probes run right here, in bus order */
+	while(head)
+	{
+		pci_probe_t *next = head->next;
+		pci_run_probe(head);
+		head = next;
+	}
+}
+void pci_wait_for_probes()
+{
+	wait_for_event(&pci_done_wq, !pci_probes_pending);
+}
+PCIDevice *pci_get_root()
+{
+	return pci_root;
+}
 void pci_init()
 {
 	printf("Initializing the PCI driver\n");
+	pci_ecam_init();
 	printf("Enumerating PCI devices\n");
 	pci_check_devices();
+	/* Probes only run concurrently once there are threads to run them on */
+	if(!get_current_thread())
+		return;
+	for(unsigned int i = 0; i < PCI_PROBE_WORKERS; i++)
+	{
+		if(sched_create_thread(pci_probe_worker, 1, NULL))
+			pci_workers++;
+	}
 }
 PCIDevice *get_pcidev_from_vendor_device(uint16_t deviceid, uint16_t vendorid)
 {
@@ -9,12 +9,19 @@
  * Foundation.
  *----------------------------------------------------------------------*/
 #include <kernel/irq.h>
+#include <kernel/softirq.h>
 #include <kernel/pic.h>
 #include <kernel/portio.h>
 #include <kernel/panic.h>
 #include <stdio.h>
 #include <drivers/ps2.h>
 extern void send_event_to_kernel(unsigned char keycode);
+/* Scancodes the interrupt handler read, waiting for the softirq to turn them into
+ * characters (and echo them). The handler only ever moves the head, the softirq the tail.
+*/
+#define KEYB_BUFFER_SIZE 128
+static volatile unsigned char keyb_buffer[KEYB_BUFFER_SIZE];
+static volatile unsigned int keyb_head = 0, keyb_tail = 0;
 /* This took a while to make... Some keys still remain, but I don't need them right now */
 void keyb_handler()
 {
@@ -23,13 +30,34 @@ void keyb_handler()
 	status = inb(PS2_STATUS);
 	if(status & 0x01){
 		keycode = inb(PS2_DATA);
+		/* If the softirq is that far behind, the key gets dropped */
+		if(keyb_head - keyb_tail < KEYB_BUFFER_SIZE)
+		{
+			keyb_buffer[keyb_head % KEYB_BUFFER_SIZE] = keycode;
+			__asm__ __volatile__("" ::: "memory");
+			keyb_head++;
+		}
+		softirq_raise(SOFTIRQ_INPUT);
+	}
+}
+static int keyb_softirq(unsigned int budget)
+{
+	while(keyb_tail != keyb_head)
+	{
+		if(!budget--)
+			return 1;
+		__asm__ __volatile__("" ::: "memory");
+		unsigned char keycode = keyb_buffer[keyb_tail % KEYB_BUFFER_SIZE];
+		keyb_tail++;
 		send_event_to_kernel(keycode);
 	}
+	return 0;
 }
 int init_keyboard()
 {
 	irq_t handler = &keyb_handler;
-	pic_unmask_irq(1);
+	softirq_register(SOFTIRQ_INPUT, keyb_softirq);
+	irq_unmask(1);
 	irq_install_handler(1,handler);
 	return 0;
 }
@@ -11,6 +11,7 @@
 #include <drivers/nmi.h>
 #include <drivers/rtc.h>
 #include <kernel/portio.h>
+#include <kernel/irq.h>
 #include <stdbool.h>
 #include <stdio.h>
 void nmi_enable()
@@ -136,7 +137,7 @@ void init_rtc()
 	date.unixtime = get_unix_time(&date);
 	// Enable IRQ8
 	irq_install_handler(8, rtc_handler);
-	pic_unmask_irq(8);
+	irq_unmask(8);
 	nmi_disable();
 	asm volatile("cli");
 	outb(0x70, RTC_STATUS_REG_B);
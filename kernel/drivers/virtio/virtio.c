@@ -0,0 +1,126 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: virtio.c
+ *
+ * Description: Split virtqueues, set up through the legacy virtio PCI
+ * interface. With VIRTIO_RING_F_EVENT_IDX both sides tell each other how
+ * far they've gotten, so the device is only notified, and only interrupts
+ * us, when the other side would otherwise miss something.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kernel/portio.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+
+#include <drivers/virtio.h>
+
+/* Whether the other side asked to hear about idx moving from old to new */
+static inline int virtq_need_event(uint16_t event, uint16_t new, uint16_t old)
+{
+	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+static inline volatile uint16_t *virtq_used_event(virtq_t *vq)
+{
+	return (volatile uint16_t*)((volatile char*) vq->avail + sizeof(virtq_avail_t) + sizeof(uint16_t) * vq->size);
+}
+static inline volatile uint16_t *virtq_avail_event(virtq_t *vq)
+{
+	return (volatile uint16_t*)((volatile char*) vq->used + sizeof(virtq_used_t) + sizeof(virtq_used_elem_t) * vq->size);
+}
+/* Sets up queue index of the device at io. The legacy interface wants the queue in one
+ * physically contiguous block, with the used ring on its own page.
+*/
+int virtq_init(virtq_t *vq, uint16_t io, uint16_t index, int event_idx)
+{
+	outw(io + VIRTIO_PCI_QUEUE_SEL, index);
+	uint16_t size = inw(io + VIRTIO_PCI_QUEUE_SIZE);
+	if(!size)
+		return errno = ENODEV, -1;
+	size_t avail_end = sizeof(virtq_desc_t) * size + sizeof(virtq_avail_t) + sizeof(uint16_t) * (size + 1);
+	size_t used_off = (avail_end + VIRTIO_PCI_QUEUE_ALIGN - 1) & ~(VIRTIO_PCI_QUEUE_ALIGN - 1);
+	size_t used_len = sizeof(virtq_used_t) + sizeof(virtq_used_elem_t) * size + sizeof(uint16_t);
+	size_t pages = (used_off + used_len + PAGE_SIZE - 1) / PAGE_SIZE;
+	/* The queue is given to the device as a 32-bit page number */
+	void *phys = pmalloc_below(pages, (1ULL << 44) - 1);
+	if(!phys)
+		return errno = ENOMEM, -1;
+	char *mem = (char*)((uintptr_t) phys + PHYS_BASE);
+	memset(mem, 0, pages * PAGE_SIZE);
+	memset(vq, 0, sizeof(virtq_t));
+	vq->io = io;
+	vq->index = index;
+	vq->size = size;
+	vq->event_idx = event_idx;
+	vq->desc = (virtq_desc_t*) mem;
+	vq->avail = (virtq_avail_t*)(mem + sizeof(virtq_desc_t) * size);
+	vq->used = (virtq_used_t*)(mem + used_off);
+	vq->phys = (uintptr_t) phys;
+	vq->pages = pages;
+	outl(io + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(vq->phys / VIRTIO_PCI_QUEUE_ALIGN));
+	return 0;
+}
+/* Empties the queue and hands it to the device again, after the device has been reset */
+void virtq_reset(virtq_t *vq)
+{
+	memset(vq->desc, 0, vq->pages * PAGE_SIZE);
+	vq->avail_idx = 0;
+	vq->kicked_idx = 0;
+	vq->last_used = 0;
+	outw(vq->io + VIRTIO_PCI_QUEUE_SEL, vq->index);
+	outl(vq->io + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(vq->phys / VIRTIO_PCI_QUEUE_ALIGN));
+}
+/* Makes the descriptor chain at head available. The device doesn't hear about it until virtq_kick(). */
+void virtq_submit(virtq_t *vq, uint16_t head)
+{
+	vq->avail->ring[vq->avail_idx % vq->size] = head;
+	/* The entry needs to be there before the device can see the index move past it */
+	__asm__ __volatile__("" ::: "memory");
+	vq->avail->idx = ++vq->avail_idx;
+}
+void virtq_kick(virtq_t *vq)
+{
+	uint16_t old = vq->kicked_idx;
+	uint16_t new = vq->avail_idx;
+	vq->kicked_idx = new;
+	/* The index update has to be visible before we read what the device is waiting for */
+	__sync_synchronize();
+	if(vq->event_idx ? virtq_need_event(*virtq_avail_event(vq), new, old) : !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY))
+		outw(vq->io + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+}
+/* Takes the next chain the device is done with, returns 0 if there isn't one */
+int virtq_next_used(virtq_t *vq, uint32_t *id)
+{
+	if(vq->last_used == vq->used->idx)
+		return 0;
+	/* Don't read the element before the index that covers it */
+	__asm__ __volatile__("" ::: "memory");
+	*id = vq->used->ring[vq->last_used % vq->size].id;
+	vq->last_used++;
+	return 1;
+}
+/* Asks for an interrupt once the device uses anything past what we've seen. Returns 1 if it
+ * already has, in which case the caller needs to look at the used ring again.
+*/
+int virtq_enable_intr(virtq_t *vq)
+{
+	if(vq->event_idx)
+		*virtq_used_event(vq) = vq->last_used;
+	__sync_synchronize();
+	return vq->last_used != vq->used->idx;
+}
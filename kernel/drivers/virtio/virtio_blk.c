@@ -0,0 +1,354 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: virtio_blk.c
+ *
+ * Description: virtio block driver. Every disk has one virtqueue, and the
+ * block layer tags of its request queue pick the descriptors a request
+ * goes out on. With indirect descriptors a request only takes up one
+ * descriptor in the ring, which is what lets the queue stay deep. A request
+ * that times out gets the device reset, which the others are retried after.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <kernel/portio.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+#include <kernel/pic.h>
+#include <kernel/irq.h>
+#include <kernel/block.h>
+
+#include <drivers/pci.h>
+#include <drivers/virtio.h>
+#include <drivers/virtio_blk.h>
+
+static virtio_blk_t *virtio_blk_devs = NULL;
+static uint16_t virtio_blk_irqs = 0;
+/* Disks are probed concurrently */
+static spinlock_t virtio_blk_spl;
+
+static int virtio_blk_start(request_queue_t *q, request_t *req)
+{
+	virtio_blk_t *blk = q->driver_data;
+	unsigned int tag = req->tag;
+	virtio_blk_cmd_t *cmd = blk->cmds[tag];
+	uintptr_t cmd_phys = blk->cmds_phys[tag];
+	int write = req->op == BIO_WRITE;
+	if(write && blk->features & VIRTIO_BLK_F_RO)
+		return -1;
+	int indirect = blk->features & VIRTIO_RING_F_INDIRECT_DESC;
+	/* Indirect tables number their descriptors from 0, ring descriptors from the tag's run */
+	virtq_desc_t *d = indirect ? cmd->table : blk->vq.desc;
+	uint16_t base = indirect ? 0 : tag * blk->per_tag;
+	unsigned int max = blk->per_tag;
+	unsigned int n = 0;
+	cmd->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	cmd->hdr.reserved = 0;
+	cmd->hdr.sector = req->sector;
+	cmd->status = 0xFF;
+	d[base].addr = cmd_phys + offsetof(virtio_blk_cmd_t, hdr);
+	d[base].len = sizeof(virtio_blk_req_t);
+	d[base].flags = VIRTQ_DESC_F_NEXT;
+	d[base].next = base + 1;
+	n++;
+	for(bio_t *bio = req->bio; bio; bio = bio->next)
+	{
+		for(int i = 0; i < bio->veccnt; i++)
+		{
+			char *p = bio->vec[i].iov_base;
+			size_t len = bio->vec[i].iov_len;
+			while(len)
+			{
+				size_t chunk = PAGE_SIZE - ((uintptr_t) p & (PAGE_SIZE - 1));
+				if(chunk > len)
+					chunk = len;
+				/* Keep one for the status */
+				if(n + 1 >= max)
+					return -1;
+				d[base + n].addr = (uintptr_t) virtual2phys(p);
+				d[base + n].len = chunk;
+				d[base + n].flags = VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE);
+				d[base + n].next = base + n + 1;
+				n++;
+				p += chunk;
+				len -= chunk;
+			}
+		}
+	}
+	d[base + n].addr = cmd_phys + offsetof(virtio_blk_cmd_t, status);
+	d[base + n].len = 1;
+	d[base + n].flags = VIRTQ_DESC_F_WRITE;
+	d[base + n].next = 0;
+	n++;
+	uint16_t head = base;
+	if(indirect)
+	{
+		head = tag;
+		blk->vq.desc[tag].addr = cmd_phys + offsetof(virtio_blk_cmd_t, table);
+		blk->vq.desc[tag].len = n * sizeof(virtq_desc_t);
+		blk->vq.desc[tag].flags = VIRTQ_DESC_F_INDIRECT;
+		blk->vq.desc[tag].next = 0;
+	}
+	virtq_submit(&blk->vq, head);
+	virtq_kick(&blk->vq);
+	return 0;
+}
+static void virtio_blk_complete(virtio_blk_t *blk)
+{
+	uint32_t id;
+	unsigned long flags = spin_lock_irqsave(&blk->lock);
+	do
+	{
+		while(virtq_next_used(&blk->vq, &id))
+		{
+			unsigned int tag = blk->features & VIRTIO_RING_F_INDIRECT_DESC ? id : id / blk->per_tag;
+			int status = blk->cmds[tag]->status == VIRTIO_BLK_S_OK ? 0 : EIO;
+			blk_complete(blk->queue, tag, status);
+		}
+	} while(virtq_enable_intr(&blk->vq));
+	spin_unlock_irqrestore(&blk->lock, flags);
+}
+static void virtio_blk_irq()
+{
+	for(virtio_blk_t *blk = virtio_blk_devs; blk; blk = blk->next)
+	{
+		/* Reading the ISR acknowledges the interrupt */
+		if(inb(blk->io + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE)
+			virtio_blk_complete(blk);
+	}
+}
+/* With MSI-X, the vector is the queue's alone and there's no ISR to read */
+static void virtio_blk_msix(void *ctx)
+{
+	virtio_blk_complete(ctx);
+}
+static int virtio_blk_setup_msix(virtio_blk_t *blk)
+{
+	if(pci_enable_msix(blk->pci, 0, blk->vector) < 0)
+		return -1;
+	outw(blk->io + VIRTIO_PCI_MSI_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+	outw(blk->io + VIRTIO_PCI_QUEUE_SEL, 0);
+	outw(blk->io + VIRTIO_PCI_MSI_QUEUE_VECTOR, 0);
+	/* The device reads back VIRTIO_MSI_NO_VECTOR if it couldn't take the entry */
+	if(inw(blk->io + VIRTIO_PCI_MSI_QUEUE_VECTOR) == VIRTIO_MSI_NO_VECTOR)
+	{
+		pci_disable_msix(blk->pci);
+		return -1;
+	}
+	return 0;
+}
+/* Resets the device and sets it up again the way probing left it. Whatever it was doing is forgotten. */
+static void virtio_blk_reinit(virtio_blk_t *blk)
+{
+	uint16_t io = blk->io;
+	outb(io + VIRTIO_PCI_STATUS, 0);
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	outl(io + VIRTIO_PCI_GUEST_FEATURES, blk->features);
+	virtq_reset(&blk->vq);
+	/* The vector registers are reset with the device, the MSI-X table isn't */
+	if(blk->vector >= 0)
+	{
+		outw(io + VIRTIO_PCI_MSI_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+		outw(io + VIRTIO_PCI_MSI_QUEUE_VECTOR, 0);
+	}
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+/* The device sat on req for too long. A reset is the only way to get its descriptors back, which
+ * takes everything else in flight with it. req fails, the others are retried.
+ * Runs from the timer interrupt, and none of it waits.
+*/
+static void virtio_blk_timeout(request_queue_t *q, request_t *req)
+{
+	virtio_blk_t *blk = q->driver_data;
+	printf("virtio-blk: %s: request for sector %u timed out, resetting\n", blk->dev->name, req->sector);
+	blk_stop_queue(q);
+	unsigned long flags = spin_lock_irqsave(&blk->lock);
+	virtio_blk_reinit(blk);
+	uint32_t inflight = 0;
+	int failed = -1;
+	unsigned long qflags = spin_lock_irqsave(&q->lock);
+	for(unsigned int tag = 0; tag < q->depth; tag++)
+	{
+		if(q->active[tag])
+			inflight |= 1U << tag;
+	}
+	if(req->tag < q->depth && q->active[req->tag] == req)
+		failed = req->tag;
+	spin_unlock_irqrestore(&q->lock, qflags);
+	spin_unlock_irqrestore(&blk->lock, flags);
+	for(unsigned int tag = 0; inflight; tag++)
+	{
+		if(!(inflight & (1U << tag)))
+			continue;
+		inflight &= ~(1U << tag);
+		if((int) tag == failed)
+			blk_complete(q, tag, EIO);
+		else
+			blk_requeue(q, tag);
+	}
+	blk_start_queue(q);
+}
+static void virtio_blk_free(virtio_blk_t *blk)
+{
+	for(int i = 0; i < BLOCK_MAX_DEPTH; i++)
+	{
+		if(blk->cmds[i])
+			pfree(1, (void*) blk->cmds_phys[i]);
+	}
+	if(blk->vq.pages)
+		pfree(blk->vq.pages, (void*) blk->vq.phys);
+	free(blk);
+}
+static int virtio_blk_probe(PCIDevice *pci, const pci_id_t *id)
+{
+	unsigned int index = pci->instance;
+	pcibar_t *bar = pci_get_bar(pci->slot, pci->device, pci->function, 0);
+	if(!bar->isIO)
+	{
+		free(bar);
+		return -1;
+	}
+	uint16_t io = (uint16_t) bar->address;
+	free(bar);
+	/* I/O space and bus mastering */
+	uint32_t command_reg = pci_config_read_dword(pci->slot, pci->device, pci->function, PCI_COMMAND);
+	pci_write_dword(pci->slot, pci->device, pci->function, PCI_COMMAND, command_reg | 5);
+	virtio_blk_t *blk = malloc(sizeof(virtio_blk_t));
+	if(!blk)
+		return -1;
+	memset(blk, 0, sizeof(virtio_blk_t));
+	blk->pci = pci;
+	blk->io = io;
+	/* Reset it, and tell it we know what it is */
+	outb(io + VIRTIO_PCI_STATUS, 0);
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	uint32_t wanted = VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX;
+	blk->features = inl(io + VIRTIO_PCI_DEVICE_FEATURES) & wanted;
+	outl(io + VIRTIO_PCI_GUEST_FEATURES, blk->features);
+	if(virtq_init(&blk->vq, io, 0, blk->features & VIRTIO_RING_F_EVENT_IDX ? 1 : 0) < 0)
+	{
+		outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+		virtio_blk_free(blk);
+		return -1;
+	}
+	uint64_t capacity = inl(io + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+	(uint64_t) inl(io + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32;
+	unsigned int segs = VIRTIO_BLK_MAX_SEGMENTS;
+	if(blk->features & VIRTIO_BLK_F_SEG_MAX)
+	{
+		uint32_t seg_max = inl(io + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+		if(seg_max && seg_max < segs)
+			segs = seg_max;
+	}
+	unsigned int depth;
+	if(blk->features & VIRTIO_RING_F_INDIRECT_DESC)
+		depth = blk->vq.size;
+	else
+	{
+		/* The ring gets carved up between the tags */
+		if(segs + 2 > blk->vq.size)
+			segs = blk->vq.size - 2;
+		depth = blk->vq.size / (segs + 2);
+	}
+	blk->per_tag = segs + 2;
+	if(depth > BLOCK_MAX_DEPTH)
+		depth = BLOCK_MAX_DEPTH;
+	if(!depth || !segs)
+	{
+		outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+		virtio_blk_free(blk);
+		return -1;
+	}
+	for(unsigned int i = 0; i < depth; i++)
+	{
+		void *phys = pmalloc(1);
+		if(!phys)
+		{
+			outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+			virtio_blk_free(blk);
+			return -1;
+		}
+		blk->cmds_phys[i] = (uintptr_t) phys;
+		blk->cmds[i] = (virtio_blk_cmd_t*)((uintptr_t) phys + PHYS_BASE);
+	}
+	blk->queue = blk_alloc_queue(virtio_blk_start, segs * PAGE_SIZE / BLOCK_SECTOR_SIZE, segs);
+	if(!blk->queue)
+	{
+		outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+		virtio_blk_free(blk);
+		return -1;
+	}
+	blk->queue->depth = depth;
+	blk->queue->timeout = virtio_blk_timeout;
+	blk->queue->driver_data = blk;
+	/* Every disk's queue gets a vector of its own, and the disks get spread over the CPUs.
+	 * The configuration has been read by now, so it moving doesn't matter.
+	*/
+	blk->vector = pci->msix_cap ? irq_allocate_vector(virtio_blk_msix, blk, index) : -1;
+	if(blk->vector >= 0 && virtio_blk_setup_msix(blk) < 0)
+	{
+		irq_free_vector(blk->vector);
+		blk->vector = -1;
+	}
+	if(blk->vector < 0)
+	{
+		/* Otherwise it's the legacy line, installed once however many disks share it */
+		uint16_t intn = pci_get_intn(pci->slot, pci->device, pci->function);
+		unsigned long flags = spin_lock_irqsave(&virtio_blk_spl);
+		blk->next = virtio_blk_devs;
+		virtio_blk_devs = blk;
+		int install = intn < 16 && !(virtio_blk_irqs & (1 << intn));
+		if(install)
+			virtio_blk_irqs |= 1 << intn;
+		spin_unlock_irqrestore(&virtio_blk_spl, flags);
+		if(install)
+		{
+			irq_install_handler(intn, virtio_blk_irq);
+			irq_unmask(intn);
+		}
+	}
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	char name[] = "vd00";
+	if(index >= 10)
+	{
+		name[2] = '0' + index / 10 % 10;
+		name[3] = '0' + index % 10;
+	}
+	else
+	{
+		name[2] = '0' + index;
+		name[3] = '\0';
+	}
+	blk->dev = blk_add_disk(name, capacity, blk->queue, blk);
+	printf("virtio-blk: %s: %u sectors, queue depth %u%s%s\n", name, capacity, depth,
+	blk->features & VIRTIO_RING_F_INDIRECT_DESC ? ", indirect descriptors" : "", blk->vector >= 0 ? ", MSI-X" : "");
+	return 0;
+}
+static const pci_id_t virtio_blk_ids[] =
+{
+	PCI_ID(VIRTIO_VENDOR, VIRTIO_DEV_BLK),
+	{0}
+};
+static pci_driver_t virtio_blk_driver = {"virtio-blk", virtio_blk_ids, virtio_blk_probe, 0, NULL};
+void initialize_virtio_blk()
+{
+	pci_register_driver(&virtio_blk_driver);
+}
@@ -12,12 +12,28 @@
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_MSR_BSP 0x100 // Processor is a BSP
 #define IA32_APIC_BASE_MSR_ENABLE 0x800
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_MASKED (1 << 16)
+#define IOAPIC_VERSION 0x1
+#define IOAPIC_REDIR_ACTIVE_LOW (1ULL << 13)
+#define IOAPIC_REDIR_LEVEL (1ULL << 15)
+#define IOAPIC_REDIR_MASKED (1ULL << 16)
+#define IOAPIC_REDIR_DEST_SHIFT 56
+#define IOAPIC_NO_GSI 0xFFFFFFFF
 
-void ioapic_init();
+int ioapic_init();
+void ioapic_unmask_irq(int irq);
+void ioapic_mask_irq(int irq);
+int ioapic_set_affinity(uint32_t gsi, unsigned int cpu);
+uint32_t ioapic_irq_to_gsi(int irq);
 void set_pin_handlers();
 uint32_t read_io_apic(uint32_t reg);
 void write_io_apic(uint32_t reg, uint32_t value);
 void lapic_init();
+void lapic_send_eoi();
+unsigned int apic_get_cpu_count();
+unsigned int apic_get_current_cpu();
+uint32_t apic_get_lapic_id(unsigned int cpu);
 void wake_up_processor(uint8_t);
 
 #endif
\ No newline at end of file
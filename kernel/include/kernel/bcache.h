@@ -0,0 +1,51 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_BCACHE_H
+#define _KERNEL_BCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Unreferenced buffers get evicted, least recently used first, past this point */
+#define BCACHE_MAX_BUFFERS	2048
+#define BCACHE_HASH_SIZE	256
+
+/* buffer_head_t.flags */
+#define BH_DIRTY		(1 << 0)
+
+struct buffer_head;
+/* A device that can be cached, block_size needs to be a multiple of 512 */
+typedef struct bcache_dev
+{
+	size_t block_size;
+	int (*read_block)(struct bcache_dev *dev, struct buffer_head *bh);
+	int (*write_block)(struct bcache_dev *dev, struct buffer_head *bh);
+} bcache_dev_t;
+
+typedef struct buffer_head
+{
+	bcache_dev_t *dev;
+	uint64_t block;
+	void *data; /* Mapped through the physical memory map */
+	uintptr_t phys; /* Physical address of data, for DMA */
+	unsigned long refcount;
+	uint32_t flags;
+	struct buffer_head *hash_next;
+	struct buffer_head *lru_prev;
+	struct buffer_head *lru_next;
+} buffer_head_t;
+
+buffer_head_t *bread(bcache_dev_t *dev, uint64_t block);
+void brelse(buffer_head_t *bh);
+void bdirty(buffer_head_t *bh);
+int bwrite(buffer_head_t *bh);
+int bcache_sync(bcache_dev_t *dev);
+#endif
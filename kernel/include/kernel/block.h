@@ -0,0 +1,162 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_BLOCK_H
+#define _KERNEL_BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/wait_queue.h>
+
+#define BLOCK_SECTOR_SIZE	512
+/* How long a request can sit in the queue before it gets served ahead of the elevator order */
+#define BLOCK_READ_EXPIRE_MS	500
+#define BLOCK_WRITE_EXPIRE_MS	5000
+/* Requests served in one direction before the other one gets a look in */
+#define BLOCK_BATCH		16
+/* Requests a queue has, a submitter that runs out waits for the device */
+#define BLOCK_MAX_REQUESTS	64
+/* Requests a driver can have in flight at once, they're told apart by their tag */
+#define BLOCK_MAX_DEPTH		32
+/* A request the driver hasn't completed after this long gets handed to its timeout handler */
+#define BLOCK_TIMEOUT_MS	10000
+/* Times a request the driver hands back with blk_requeue() gets started again before it's failed */
+#define BLOCK_MAX_RETRIES	3
+
+#define BIO_READ		0
+#define BIO_WRITE		1
+
+/* bio_t.flags */
+#define BIO_DONE		(1 << 0)
+
+struct bio;
+struct request;
+struct request_queue;
+struct block_dev;
+typedef void (*bio_end_io_t)(struct bio *bio);
+/* Starts a request on the hardware, the driver calls blk_complete() with its tag once it's done.
+ * Returns -1 if the request couldn't be started at all.
+*/
+typedef int (*blk_start_t)(struct request_queue *q, struct request *req);
+typedef void (*blk_timeout_t)(struct request_queue *q, struct request *req);
+
+/* One I/O to or from a contiguous range of sectors. The vector needs to stay around until it completes. */
+typedef struct bio
+{
+	struct block_dev *dev;
+	uint64_t sector; /* Relative to dev */
+	int op;
+	const struct iovec *vec;
+	int veccnt;
+	size_t size;
+	size_t nr_segments; /* Page-sized pieces the vector breaks down into */
+	volatile int status; /* 0, or an errno value */
+	volatile uint32_t flags;
+	bio_end_io_t end_io; /* Called from the interrupt handler before BIO_DONE is set, can be NULL */
+	void *private;
+	struct bio *next;
+	wait_queue_t wait; /* Woken up once BIO_DONE is set */
+	/* Vectors the device can't reach go through a copy, which bio_wait() gets rid of */
+	void *bounce;
+	size_t bounce_pages;
+	const struct iovec *orig_vec;
+	int orig_veccnt;
+	struct iovec bounce_vec;
+	/* Bios bigger than a request can be get split into children, which bio_wait() gets rid of */
+	struct bio *parent;
+	struct bio *split;
+	struct bio *split_next;
+	volatile int remaining; /* Children that haven't ended yet, plus one while they're submitted */
+	volatile int split_status;
+} bio_t;
+
+/* What the driver gets to work on: bios for adjacent sectors, merged together */
+typedef struct request
+{
+	struct block_dev *disk;
+	uint64_t sector; /* On the whole disk */
+	size_t nr_sectors;
+	size_t nr_segments;
+	int op;
+	unsigned int tag;
+	unsigned int retries;
+	uint64_t deadline;
+	timer_event_t timer; /* Goes off if the driver holds on to it past BLOCK_TIMEOUT_MS */
+	bio_t *bio;
+	bio_t *biotail;
+	struct request *sort_prev;
+	struct request *sort_next;
+	struct request *fifo_prev;
+	struct request *fifo_next;
+} request_t;
+
+/* Requests waiting for a driver, which takes up to depth of them at a time. A queue can serve several disks. */
+typedef struct request_queue
+{
+	spinlock_t lock;
+	request_t *sorted; /* By disk and sector, the order the elevator serves them in */
+	request_t *fifo_head[2]; /* Per direction, by deadline */
+	request_t *fifo_tail[2];
+	request_t *active[BLOCK_MAX_DEPTH]; /* By tag */
+	uint32_t tags; /* Tags in use */
+	unsigned int depth;
+	request_t *free_requests;
+	wait_queue_t wait; /* Submitters waiting for a free request */
+	struct block_dev *head_disk; /* Where the elevator is */
+	uint64_t head_sector;
+	int batch_op;
+	unsigned int batch_count;
+	unsigned int plugged;
+	unsigned int stopped; /* Nothing gets started while the driver is recovering the device */
+	size_t max_sectors;
+	size_t max_segments;
+	/* Bios that don't meet these are bounced through memory that does */
+	uintptr_t dma_limit; /* Highest physical address the device can reach */
+	uintptr_t dma_align; /* Alignment mask every piece of a vector needs to honour */
+	blk_start_t start;
+	blk_timeout_t timeout;
+	void *driver_data;
+} request_queue_t;
+
+typedef struct block_dev
+{
+	char *name;
+	uint64_t nr_sectors;
+	uint64_t first_sector; /* Where the device starts on its disk, 0 for disks */
+	struct block_dev *disk; /* Points back to itself for disks */
+	request_queue_t *queue;
+	void *driver_data;
+	struct block_dev *next;
+} block_dev_t;
+
+request_queue_t *blk_alloc_queue(blk_start_t start, size_t max_sectors, size_t max_segments);
+block_dev_t *blk_add_disk(const char *name, uint64_t nr_sectors, request_queue_t *q, void *driver_data);
+block_dev_t *blk_add_partition(block_dev_t *disk, const char *name, uint64_t first_sector, uint64_t nr_sectors);
+block_dev_t *blk_get_dev(const char *name);
+block_dev_t *blk_first_disk();
+block_dev_t *blk_next_disk(block_dev_t *dev);
+void bio_init(bio_t *bio, block_dev_t *dev, int op, uint64_t sector, const struct iovec *vec, int veccnt);
+void bio_submit(bio_t *bio);
+int bio_wait(bio_t *bio);
+void blk_plug(block_dev_t *dev);
+void blk_unplug(block_dev_t *dev);
+void blk_complete(request_queue_t *q, unsigned int tag, int status);
+void blk_requeue(request_queue_t *q, unsigned int tag);
+void blk_stop_queue(request_queue_t *q);
+void blk_start_queue(request_queue_t *q);
+int blk_rw_vec(block_dev_t *dev, int op, uint64_t sector, const struct iovec *vec, int veccnt);
+int blk_read(block_dev_t *dev, uint64_t sector, void *buffer, size_t len);
+int blk_write(block_dev_t *dev, uint64_t sector, const void *buffer, size_t len);
+#endif
@@ -26,6 +26,9 @@ typedef struct cpu {
 #define CPUID_BRAND2 			0x80000004
 #define CPUID_ASS			0x80000008 // Address space size (ASS for short :P)
 #define CPUID_SIGN   			0x1
+#define CPUID_FEATURES_EXT		0x7
+#define CPUID_FEATURES_EXT_SMAP		(1 << 20)
+extern uint8_t cpu_has_smap;
 void cpu_identify();
 void cpu_init_interrupts();
 
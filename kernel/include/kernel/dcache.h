@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_DCACHE_H
+#define _KERNEL_DCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/vfs.h>
+
+/* Unused entries get dropped, least recently used first, past this point */
+#define DCACHE_MAX_ENTRIES	4096
+#define DCACHE_HASH_SIZE	512
+
+/* dentry_t.flags */
+#define DENTRY_NEGATIVE		(1 << 0) /* The path was looked up, and it doesn't exist */
+#define DENTRY_DEAD		(1 << 1) /* Dropped from the cache while pinned, the last unpin frees it */
+
+/* One component of a path. Entries that were only walked through have neither
+ * a node nor DENTRY_NEGATIVE set, they get resolved when they're opened themselves.
+*/
+typedef struct dentry
+{
+	char *name;
+	size_t namelen;
+	struct dentry *parent;
+	vfsnode_t *node; /* Holds a reference to the node */
+	uint32_t flags;
+	unsigned long refcount;
+	unsigned long nr_children;
+	struct dentry *hash_next;
+	struct dentry *lru_prev;
+	struct dentry *lru_next;
+} dentry_t;
+
+vfsnode_t *dcache_open(const char *path);
+void dcache_invalidate(const char *path);
+void dcache_purge();
+#endif
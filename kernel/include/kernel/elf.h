@@ -3024,6 +3024,8 @@ typedef int (module_init_t)(void);
 void *elf_load_kernel_module(void *file, void **);
 _Bool elf_is_valid(Elf64_Ehdr* header);
 void* elf_load(void* file);
+struct vfsnode;
+void *elf_load_file(struct vfsnode *node);
 
 #ifdef __cplusplus
 }
@@ -38,6 +38,18 @@ extern char mac_address[6];
 extern char router_mac[6];
 typedef int (*device_send_packet)(char*, uint16_t);
 
+/* A receive queue the NET_RX softirq polls. Its interrupt only schedules it, and the poll
+ * takes at most budget packets, returning nonzero if it left some.
+*/
+struct eth_poll;
+typedef int (*eth_poll_fn)(struct eth_poll *p, unsigned int budget);
+typedef struct eth_poll
+{
+	eth_poll_fn poll;
+	volatile int scheduled;
+	struct eth_poll *next;
+} eth_poll_t;
+
 void eth_set_packet_buf(uint8_t *buf);
 void eth_set_packet_len(uint16_t len);
 void eth_set_dev_send_packet(device_send_packet);
@@ -45,4 +57,6 @@ int eth_send_packet(char *destmac, char *payload, uint16_t len, uint16_t protoco
 int ethernet_handle_packet(uint8_t *packet, uint16_t len);
 int ethernet_init();
 void eth_set_router_mac(char* mac);
+void eth_poll_init(eth_poll_t *p, eth_poll_fn poll);
+void eth_poll_schedule(eth_poll_t *p);
 #endif
\ No newline at end of file
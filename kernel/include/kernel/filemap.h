@@ -0,0 +1,22 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_FILEMAP_H
+#define _KERNEL_FILEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/vmm.h>
+#include <kernel/vfs.h>
+
+void *filemap_mmap(void *addr, size_t pages, int prot, int flags, vfsnode_t *node, size_t offset);
+int filemap_fault(vmm_entry_t *area, uintptr_t addr, int present, int write);
+#endif
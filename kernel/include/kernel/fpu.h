@@ -0,0 +1,38 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_FPU_H
+#define _KERNEL_FPU_H
+
+#include <stdint.h>
+#include <kernel/task_switching.h>
+
+#define CR0_TS			(1 << 3)
+#define CR4_OSXSAVE		(1 << 18)
+#define CPUID_XSAVE_LEAF	0xD
+#define CPUID_1_ECX_XSAVE	(1 << 26)
+#define CPUID_1_ECX_AVX		(1 << 28)
+#define CPUID_D_1_EAX_XSAVEOPT	(1 << 0)
+#define XCR0_X87		(1 << 0)
+#define XCR0_SSE		(1 << 1)
+#define XCR0_AVX		(1 << 2)
+#define FXSAVE_AREA_SIZE	512
+#define MXCSR_DEFAULT		0x1F80
+#define FCW_DEFAULT		0x37F
+/* Where the control words live in the legacy part of the fxsave/xsave area */
+#define FXSAVE_FCW_OFFSET	0
+#define FXSAVE_MXCSR_OFFSET	24
+
+void fpu_init();
+void fpu_handle_nm();
+void fpu_switch_thread(thread_t *next);
+void fpu_fork_thread(thread_t *child, thread_t *parent);
+void fpu_destroy_thread(thread_t *thread);
+#endif
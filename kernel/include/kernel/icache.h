@@ -0,0 +1,26 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_ICACHE_H
+#define _KERNEL_ICACHE_H
+
+#include <sys/types.h>
+
+#include <kernel/vfs.h>
+
+/* Nodes nobody references get freed, least recently used first, past this point */
+#define ICACHE_MAX_UNUSED	1024
+#define ICACHE_HASH_SIZE	256
+
+vfsnode_t *icache_get(void *sb, ino_t ino);
+vfsnode_t *icache_add(vfsnode_t *node);
+void icache_grab(vfsnode_t *node);
+void icache_put(vfsnode_t *node);
+#endif
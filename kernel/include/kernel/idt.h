@@ -88,4 +88,6 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 extern void __syscall_int();
+extern void sched_yield_int();
+extern char irq_vector_stubs[];
 #endif /* _IDT_H */
@@ -32,6 +32,24 @@ typedef struct tar_header
 #define TAR_TYPE_BLOCK_SPECIAL	'4'
 #define TAR_TYPE_DIR		'5'
 
+/* Address space set aside for a compressed initrd that doesn't say how large it is */
+#define INITRD_MAX_SIZE		0x20000000
+
+/* One file or directory in the archive. The index is built once at mount time and the
+ * archive itself is never touched afterwards.
+*/
+typedef struct tar_entry
+{
+	tar_header_t *header; /* NULL for directories that only show up in the paths under them */
+	ino_t ino;
+	const char *name; /* Last path component, points into the archive and isn't NUL terminated */
+	size_t namelen;
+	struct tar_entry *parent;
+	struct tar_entry *children;
+	struct tar_entry *next_sibling;
+	struct tar_entry *hash_next; /* Chained in a hash of (parent, name) */
+} tar_entry_t;
+
 inline size_t tar_get_size(const char *in)
 {
     	size_t size = 0;
@@ -41,9 +59,9 @@ inline size_t tar_get_size(const char *in)
 		size += ((in[j - 1] - '0') * count);
     	return size;
 }
-size_t tar_parse(uintptr_t adress);
+size_t tar_parse(uintptr_t address, size_t size);
 
-void init_initrd(void *addr);
+void init_initrd(void *addr, size_t size);
 int initrd_load_into_ramfs(size_t files);
 
 #endif
@@ -14,11 +14,13 @@
 #include <kernel/vfs.h>
 #include <sys/types.h>
 #include <limits.h>
+/* An open file description, shared by dup()'d descriptors and across fork() */
 typedef struct
 {
 	off_t seek;
-	vfsnode_t *vfs_node;
+	vfsnode_t *vfs_node; /* Holds a reference to the node */
 	int flags;
+	unsigned long refcount;
 } file_desc_t;
 typedef struct
 {
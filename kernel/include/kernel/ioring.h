@@ -0,0 +1,42 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_IORING_H
+#define _KERNEL_IORING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/ioring.h>
+
+/* Kernel-side bookkeeping of a ring shared with a process.
+ * The geometry is copied out to the shared header for userspace's benefit, but the
+ * kernel only ever trusts its own copy, and the only indices it reads back are the
+ * ones userspace owns (sq_tail and cq_head).
+*/
+typedef struct ioring
+{
+	struct io_ring *shared;
+	size_t pages;
+	uint32_t sq_entries;
+	uint32_t sq_mask;
+	uint32_t cq_entries;
+	uint32_t cq_mask;
+	uint32_t sq_off;
+	uint32_t cq_off;
+	uint32_t sq_head;
+	uint32_t cq_tail;
+	struct ioring *next;
+} ioring_t;
+
+struct io_ring *ioring_create(unsigned int entries);
+ioring_t *ioring_lookup(struct io_ring *shared);
+int ioring_submit(ioring_t *ring, unsigned int to_submit);
+void ioring_destroy_all(void);
+#endif
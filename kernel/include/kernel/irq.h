@@ -10,6 +10,7 @@
  *----------------------------------------------------------------------*/
 #ifndef _IRQ_H
 #define _IRQ_H
+#include <stdint.h>
 typedef void(*irq_t)();
 
 typedef struct irq
@@ -20,5 +21,24 @@ typedef struct irq
 
 void irq_install_handler(int irq, irq_t handler);
 void irq_uninstall_handler(int irq, irq_t handler);
+/* Legacy lines go through whichever of the PIC and the I/O APIC is in use */
+void irq_unmask(int irq);
+void irq_mask(int irq);
+void irq_send_eoi(int irq);
+int irq_set_affinity(int irq, unsigned int cpu);
+void irq_init_ioapic();
+
+/* Vectors past the legacy IRQs aren't tied to a line. They're handed out to MSI and MSI-X,
+ * one device (or queue) each, and get their EOI sent to the local APIC.
+*/
+typedef void(*irq_vector_t)(void *ctx);
+#define IRQ_VECTOR_BASE		48
+#define IRQ_VECTOR_SPURIOUS	0xFF
+/* Size of each of the entry stubs at irq_vector_stubs */
+#define IRQ_VECTOR_STUB_SIZE	16
+
+int irq_allocate_vector(irq_vector_t handler, void *ctx, unsigned int cpu);
+void irq_free_vector(int vector);
+uint32_t irq_vector_destination(int vector);
 
 #endif
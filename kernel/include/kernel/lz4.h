@@ -0,0 +1,37 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_LZ4_H
+#define _KERNEL_LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LZ4_FRAME_MAGIC		0x184D2204
+/* Matches can reach this far back into what was already decompressed */
+#define LZ4_WINDOW_SIZE		65536
+
+/* Decoding state of an LZ4 frame, as produced by lz4(1) */
+typedef struct lz4_frame
+{
+	const uint8_t *src; /* Next block */
+	const uint8_t *src_end;
+	size_t block_max; /* No block decompresses to more than this */
+	uint64_t content_size; /* 0 if the frame doesn't say */
+	int block_checksum;
+	int done;
+} lz4_frame_t;
+
+int lz4_is_frame(const void *src, size_t len);
+int lz4_frame_init(lz4_frame_t *frame, const void *src, size_t len);
+ssize_t lz4_frame_next(lz4_frame_t *frame, void *out, size_t pos, size_t cap);
+ssize_t lz4_decompress_block(const void *src, size_t srclen, void *out, size_t pos, size_t cap);
+#endif
@@ -0,0 +1,98 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_PAGECACHE_H
+#define _KERNEL_PAGECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <kernel/radix.h>
+
+/* Clean pages get evicted, least recently used first, past this point (64 MiB) */
+#define PAGECACHE_MAX_PAGES	16384
+/* Readahead window bounds, in pages */
+#define READAHEAD_MIN_PAGES	4
+#define READAHEAD_MAX_PAGES	32
+#define PAGECACHE_HASH_SIZE	64
+/* Upper bound on how many adjacent dirty pages get written with a single request */
+#define WRITEBACK_MAX_PAGES	64
+
+/* cached_page_t.flags */
+#define PAGE_DIRTY		(1 << 0)
+#define PAGE_WRITEBACK		(1 << 1)
+#define PAGE_MAPPED		(1 << 2) /* Mapped into some address space, set while mapcount isn't 0 */
+#define PAGE_MAPPED_WRITE	(1 << 3) /* Mapped writable and shared, it can change without us noticing */
+#define PAGE_LOCKED		(1 << 4) /* Being read in, the contents aren't valid until this clears */
+#define PAGE_DETACHED		(1 << 5) /* No longer in the cache, freed when the last pin goes away */
+#define PAGE_READAHEAD		(1 << 6) /* First page of a readahead batch, reading it kicks off the next one */
+
+/* page_cache_t.flags */
+#define PAGECACHE_RAM		(1 << 0) /* The cache is the only copy, pages never get evicted or written back */
+
+struct vfsnode;
+struct page_cache;
+struct iovec;
+/* Writes whole pages of the file back to the disk, offset is page aligned.
+ * Returns the number of bytes written, or -1 on error.
+*/
+typedef size_t (*pagecache_writeback_t)(struct page_cache *cache, size_t offset, const struct iovec *vec, int veccnt);
+typedef struct cached_page
+{
+	void *page; /* Mapped through the physical memory map */
+	unsigned long index; /* Offset in the file, in pages */
+	size_t size; /* Valid bytes, only less than PAGE_SIZE at the end of the file */
+	uint32_t flags;
+	unsigned int refcount; /* Pins held while the page is used without the lock */
+	unsigned int mapcount; /* Page table entries pointing at the page */
+	uint64_t dirtied_at; /* Tick count of when the page went from clean to dirty */
+	struct page_cache *cache;
+	struct cached_page *lru_prev;
+	struct cached_page *lru_next;
+} cached_page_t;
+/* The cached contents of one file, shared by every vfsnode that refers to it */
+typedef struct page_cache
+{
+	void *sb; /* Identifies the filesystem instance */
+	ino_t ino;
+	radix_tree_t pages;
+	size_t nr_pages;
+	unsigned long ra_next; /* Where the next read lands if the file is read sequentially */
+	unsigned long ra_pages; /* Size of the current readahead window */
+	size_t nr_dirty;
+	pagecache_writeback_t writeback; /* Set by the filesystem, files without it can't be written through the cache */
+	uint32_t flags;
+	struct page_cache *next;
+} page_cache_t;
+
+page_cache_t *pagecache_get(void *sb, ino_t ino);
+size_t pagecache_read(page_cache_t *cache, size_t offset, size_t len, void *buffer, struct vfsnode *node);
+void pagecache_invalidate(page_cache_t *cache, size_t offset, size_t len);
+size_t pagecache_write(page_cache_t *cache, size_t offset, size_t len, const void *buffer, struct vfsnode *node);
+cached_page_t *pagecache_get_page(page_cache_t *cache, unsigned long index, struct vfsnode *node);
+void pagecache_put_page(cached_page_t *page);
+void pagecache_map_write(cached_page_t *page);
+int pagecache_map_page(cached_page_t *page);
+void pagecache_dup_frame(uintptr_t phys);
+void pagecache_unmap_frame(uintptr_t phys);
+void pagecache_resize(page_cache_t *cache, size_t old_size, size_t new_size);
+void pagecache_release(page_cache_t *cache);
+int pagecache_sync(page_cache_t *cache);
+int pagecache_sync_all();
+void pagecache_start_flusher();
+void pagecache_start_readahead();
+
+/* Writeback tunables. The ratios are percentages of PAGECACHE_MAX_PAGES. */
+extern unsigned int pagecache_dirty_background_ratio; /* The flusher writes everything back past this */
+extern unsigned int pagecache_dirty_ratio; /* Writers write back their own pages past this */
+extern unsigned int pagecache_dirty_expire_ms; /* Dirty pages older than this get written back */
+extern unsigned int pagecache_flush_interval_ms; /* How often the flusher wakes up */
+#endif
@@ -27,10 +27,12 @@ typedef struct stack
 }stack_t;
 
 size_t pmm_get_used_mem();
+size_t pmm_get_total_mem();
 void pmm_push(uintptr_t base,size_t size,size_t kernel_space_size);
 void pmm_pop();
 void pmm_init(size_t memory_size,uintptr_t stack_space);
 void *pmalloc(size_t blocks);
+void *pmalloc_below(size_t blocks, uintptr_t limit);
 void  pfree(size_t blocks,void* ptr);
 
 #endif
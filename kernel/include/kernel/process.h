@@ -13,6 +13,7 @@
 #include <kernel/task_switching.h>
 #include <kernel/vmm.h>
 #include <kernel/ioctx.h>
+#include <kernel/ioring.h>
 #define THREADS_PER_PROCESS 30
 typedef struct proc
 {
@@ -30,6 +31,7 @@ typedef struct proc
 	void *brk;
 	int has_exited;
 	struct proc *parent;
+	ioring_t *rings;
 } process_t;
 process_t *process_create(const char *cmd_line, ioctx_t *ctx, process_t *parent);
 void process_create_thread(process_t *proc, ThreadCallback callback, uint32_t flags, int argc, char **argv, char **envp);
@@ -0,0 +1,37 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_RADIX_H
+#define _KERNEL_RADIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RADIX_TREE_MAP_SHIFT	6
+#define RADIX_TREE_MAP_SIZE	(1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK	(RADIX_TREE_MAP_SIZE - 1)
+
+typedef struct radix_tree_node
+{
+	void *slots[RADIX_TREE_MAP_SIZE];
+	unsigned int count;
+} radix_tree_node_t;
+/* A sparse array of pointers, indexed by an unsigned long. An empty tree is all zeroes. */
+typedef struct radix_tree
+{
+	unsigned int height;
+	radix_tree_node_t *root;
+} radix_tree_t;
+
+void *radix_tree_lookup(radix_tree_t *tree, unsigned long index);
+int radix_tree_insert(radix_tree_t *tree, unsigned long index, void *item);
+void *radix_tree_delete(radix_tree_t *tree, unsigned long index);
+unsigned int radix_tree_gang_lookup(radix_tree_t *tree, void **results, unsigned long first, unsigned int max);
+#endif
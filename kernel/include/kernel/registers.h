@@ -18,6 +18,14 @@ typedef struct registers
 	uint64_t rax,rbx,rcx,rdx,rdi,rsi,rsp,rbp,rip, r8, r9, r10, r11, r12, r13, r14, r15, rflags;
 	uint16_t cs, ss;
 }__attribute__((packed))registers_t;
+/* The stack built by the exception stubs in interrupts.S */
+typedef struct intctx
+{
+	uint64_t ds;
+	uint64_t r15, r14, r13, r12, r11, r10, r9, r8, rbp, rsi, rdi, rdx, rcx, rbx, rax;
+	uint64_t err_code;
+	uint64_t rip, cs, rflags, rsp, ss;
+} intctx_t;
 inline void wrmsr(uint32_t msr, uint32_t lo, uint32_t hi)
 {
 	asm volatile("wrmsr"::"a"(lo), "d"(hi), "c"(msr));
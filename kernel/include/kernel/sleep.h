@@ -11,7 +11,7 @@
 #ifndef _KERNEL_SLEEP_H
 #define _KERNEL_SLEEP_H
 #include <stdint.h>
-#include <kernel/timer.h>
+#include <kernel/pit.h>
 
 void ksleep(uint32_t ms);
 #endif
@@ -0,0 +1,31 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_SOFTIRQ_H
+#define _KERNEL_SOFTIRQ_H
+#include <stdint.h>
+
+/* Bottom halves. An interrupt handler only acknowledges the device and raises one of
+ * these, and the work gets done later in softirqd, with interrupts on.
+*/
+#define SOFTIRQ_NET_RX		0
+#define SOFTIRQ_INPUT		1
+#define SOFTIRQ_MAX		2
+
+/* How much a handler gets to do in one go, in whatever units it counts (packets, keys...) */
+#define SOFTIRQ_BUDGET		64
+
+/* Does at most budget units of work, returns nonzero if there's more left */
+typedef int (*softirq_t)(unsigned int budget);
+
+void softirq_register(int nr, softirq_t handler);
+void softirq_raise(int nr);
+void softirq_init();
+#endif
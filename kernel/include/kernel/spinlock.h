@@ -19,4 +19,7 @@ typedef struct spinlock
 extern void acquire_spinlock(spinlock_t*);
 extern void release_spinlock(spinlock_t*);
 void wait_spinlock(spinlock_t*);
+/* For locks that interrupt handlers take as well, interrupts stay off while they're held */
+unsigned long spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags);
 #endif
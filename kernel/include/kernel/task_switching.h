@@ -13,6 +13,9 @@
 #define _TASK_SWITCHING_AMD64_H
 #include <stdint.h>
 typedef void(*ThreadCallback)(void*);
+/* thread_t.status, the scheduler passes over blocked threads until something wakes them up */
+#define THREAD_RUNNABLE		0
+#define THREAD_BLOCKED		1
 struct proc;
 typedef struct thr
 {
@@ -23,12 +26,17 @@ typedef struct thr
 	struct proc *owner;
 	ThreadCallback rip;
 	uint32_t flags;
+	volatile int status;
 	int id;
 	struct thr *next;
+	void *fpu_area; /* x87/SSE/AVX state, allocated the first time the thread uses it */
 } thread_t;
 thread_t *sched_create_thread(ThreadCallback callback, uint32_t flags, void* args);
 thread_t* sched_create_main_thread(ThreadCallback callback, uint32_t flags,int argc, char **argv, char **envp);
 void sched_destroy_thread(thread_t *thread);
 thread_t *get_current_thread();
+void sched_yield();
+void sched_block(uint64_t deadline);
+void sched_wake(thread_t *thread);
 uintptr_t *sched_fork_stack(uintptr_t *stack, uintptr_t *forkregstack, uintptr_t *rsp, uintptr_t rip);
 #endif
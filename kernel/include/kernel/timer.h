@@ -0,0 +1,31 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_TIMER_H
+#define _KERNEL_TIMER_H
+#include <stdint.h>
+
+typedef void (*timer_callback_t)(void *arg);
+/* Something to do once the tick count reaches deadline. The callback runs from the timer
+ * interrupt, so it can't sleep.
+*/
+typedef struct timer_event
+{
+	uint64_t deadline;
+	timer_callback_t callback;
+	void *arg;
+	int pending;
+	struct timer_event *next;
+} timer_event_t;
+
+void timer_add(timer_event_t *ev, uint64_t deadline, timer_callback_t callback, void *arg);
+int timer_cancel(timer_event_t *ev);
+void timer_run(uint64_t now);
+#endif
@@ -0,0 +1,43 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_TMPFS_H
+#define _KERNEL_TMPFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <kernel/vfs.h>
+#include <kernel/spinlock.h>
+
+struct tmpfs;
+/* Files can't have more than one name, so the inode doubles as its directory entry */
+typedef struct tmpfs_inode
+{
+	vfsnode_t node; /* Needs to come first, put_vfs() frees the inode through it */
+	struct tmpfs *fs;
+	struct tmpfs_inode *parent; /* NULL once it's been unlinked */
+	struct tmpfs_inode *children;
+	struct tmpfs_inode *next_sibling;
+	char name[];
+} tmpfs_inode_t;
+
+typedef struct tmpfs
+{
+	spinlock_t lock; /* Protects the directory tree */
+	ino_t next_ino;
+	size_t max_pages; /* Data pages the files are allowed to cover */
+	size_t nr_pages; /* Data pages they cover right now, holes included */
+	tmpfs_inode_t *root;
+} tmpfs_t;
+
+tmpfs_t *tmpfs_mount(const char *mountpoint);
+#endif
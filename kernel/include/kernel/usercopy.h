@@ -0,0 +1,73 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_USERCOPY_H
+#define _KERNEL_USERCOPY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <kernel/vmm.h>
+
+/* Pairs an instruction that may fault on a user address with the address to resume at */
+typedef struct
+{
+	uintptr_t insn;
+	uintptr_t fixup;
+} ex_table_entry_t;
+
+extern ex_table_entry_t __start_ex_table[];
+extern ex_table_entry_t __stop_ex_table[];
+
+size_t __copy_user(void *dst, const void *src, size_t len);
+ssize_t __strncpy_user(char *dst, const char *src, size_t count);
+
+/* Checks that [ptr, ptr + size) is entirely below the user/kernel split.
+ * Whether it's actually mapped is left to the page fault handler.
+*/
+static inline bool access_ok(const void *ptr, size_t size)
+{
+	uintptr_t addr = (uintptr_t) ptr;
+	return addr + size >= addr && addr + size <= VM_USER_ADDR_LIMIT;
+}
+static inline int copy_from_user(void *dst, const void *usr, size_t len)
+{
+	if(!access_ok(usr, len))
+		return errno = EFAULT, -1;
+	if(__copy_user(dst, usr, len))
+		return errno = EFAULT, -1;
+	return 0;
+}
+static inline int copy_to_user(void *usr, const void *src, size_t len)
+{
+	if(!access_ok(usr, len))
+		return errno = EFAULT, -1;
+	if(__copy_user(usr, src, len))
+		return errno = EFAULT, -1;
+	return 0;
+}
+/* Returns the length of the string, or count if it didn't fit (in which case dst isn't terminated) */
+static inline ssize_t strncpy_from_user(char *dst, const char *usr, size_t count)
+{
+	uintptr_t addr = (uintptr_t) usr;
+	if(addr >= VM_USER_ADDR_LIMIT)
+		return errno = EFAULT, -1;
+	if(count > VM_USER_ADDR_LIMIT - addr)
+		count = VM_USER_ADDR_LIMIT - addr;
+	ssize_t len = __strncpy_user(dst, usr, count);
+	if(len < 0)
+		return errno = EFAULT, -1;
+	return len;
+}
+uintptr_t search_exception_table(uintptr_t insn);
+#endif
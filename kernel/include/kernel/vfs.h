@@ -12,6 +12,7 @@
 #define _VFS_H
 #include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
 #include <dirent.h>
 #include <stdarg.h>
 #define VFS_TYPE_FILE 0
@@ -20,12 +21,20 @@
 #define VFS_TYPE_MOUNTPOINT 4
 #define VFS_TYPE_DEV 5
 struct vfsnode;
+struct iovec;
+struct page_cache;
 typedef size_t (*__read)(size_t offset, size_t sizeofread, void* buffer, struct vfsnode* this);
 typedef size_t (*__write)(size_t offset, size_t sizeofwrite, void* buffer, struct vfsnode* this);
 typedef void (*__close)(struct vfsnode* this);
 typedef struct vfsnode *(*__open)(struct vfsnode* this, const char *name);
 typedef unsigned int (*__getdents)(unsigned int count, struct dirent* dirp, struct vfsnode* this);
 typedef unsigned int (*__ioctl)(int request, va_list varg, struct vfsnode* this);
+typedef size_t (*__readv)(size_t offset, const struct iovec *vec, int veccnt, struct vfsnode* this);
+typedef size_t (*__writev)(size_t offset, const struct iovec *vec, int veccnt, struct vfsnode* this);
+typedef struct vfsnode *(*__create)(struct vfsnode *this, const char *name, int type);
+typedef int (*__unlink)(struct vfsnode *this, const char *name);
+typedef int (*__truncate)(struct vfsnode *this, size_t length);
+typedef void (*__release)(struct vfsnode *this);
 typedef struct vfsnode
 {
 	ino_t inode;
@@ -45,15 +54,41 @@ typedef struct vfsnode
 	__close close;
 	__getdents getdents;
 	__ioctl ioctl;
+	__readv readv;
+	__writev writev;
+	__create create; /* Called on directories, name is a single path component */
+	__unlink unlink;
+	__truncate truncate;
+	__release release; /* Called when the last reference goes away, before the node is freed */
+	struct page_cache *cache; /* Set by filesystems whose files should be cached */
+	void *sb; /* Filesystem instance, set on nodes that live in the inode cache */
+	struct vfsnode *icache_next;
+	struct vfsnode *lru_prev;
+	struct vfsnode *lru_next;
 }vfsnode_t;
 
 size_t read_vfs(size_t offset, size_t sizeofread, void* buffer, vfsnode_t* this);
 size_t write_vfs(size_t offset, size_t sizeofwrite, void* buffer, vfsnode_t* this);
+ssize_t read_vfs_user(size_t offset, size_t len, void *ubuf, vfsnode_t *this);
+ssize_t write_vfs_user(size_t offset, size_t len, const void *ubuf, vfsnode_t *this);
+ssize_t readv_vfs_user(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this);
+ssize_t writev_vfs_user(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this);
+size_t readv_vfs(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this);
+size_t writev_vfs(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this);
+size_t readv_vfs_fallback(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this);
+size_t writev_vfs_fallback(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this);
 void close_vfs(vfsnode_t* this);
+void get_vfs(vfsnode_t *this);
+void put_vfs(vfsnode_t *this);
 vfsnode_t *open_vfs(vfsnode_t* this, const char*);
+vfsnode_t *open_vfs_uncached(vfsnode_t* this, const char*);
 int mount_fs(vfsnode_t *node, const char *mp);
 unsigned int getdents_vfs(unsigned int count, struct dirent* dirp, vfsnode_t *this);
 int ioctl_vfs(int request, va_list args, vfsnode_t *this);
+int fsync_vfs(vfsnode_t *this);
+vfsnode_t *create_vfs(const char *path, int type);
+int unlink_vfs(const char *path);
+int truncate_vfs(vfsnode_t *this, size_t length);
 int vfs_init();
 vfsnode_t* vfs_findnode(const char *path);
 void vfs_register_node(vfsnode_t *toBeAdded);
@@ -28,13 +28,19 @@
 #define VMM_USER 0x80
 #define VMM_WRITE 0x1
 #define VMM_NOEXEC 0x4
+#define VMM_NOFREE 0x100 /* The frame belongs to someone else (the page cache, a device), unmapping it doesn't free it */
 #define VM_HIGHER_HALF 0xFFFF800000000000
+#define VM_USER_ADDR_LIMIT 0x0000800000000000
+struct vfsnode;
 typedef struct ventry
 {
 	uintptr_t base;
 	size_t pages;
 	int rwx;
 	int type;
+	struct vfsnode *file; /* Backing file of file mappings, holds a reference */
+	size_t offset; /* Offset in the file that base maps to */
+	int mapflags; /* MAP_SHARED or MAP_PRIVATE, for file mappings */
 } vmm_entry_t;
 #define VM_KERNEL (1)
 #define VM_UPSIDEDOWN (2)
@@ -46,6 +52,7 @@ void *vmm_allocate_virt_address(uint64_t flags, size_t pages, uint32_t type, uin
 void *vmm_map_range(void* range, size_t pages, uint64_t flags);
 void vmm_unmap_range(void *range, size_t pages);
 void vmm_destroy_mappings(void *range, size_t pages);
+void vmm_unmap_files();
 void *vmm_reserve_address(void *addr, size_t pages, uint32_t type, uint64_t prot);
 vmm_entry_t *vmm_is_mapped(void *addr);
 PML4 *vmm_clone_as(vmm_entry_t **, size_t *);
@@ -0,0 +1,61 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _KERNEL_WAIT_QUEUE_H
+#define _KERNEL_WAIT_QUEUE_H
+#include <stdint.h>
+
+#include <kernel/spinlock.h>
+#include <kernel/task_switching.h>
+#include <kernel/pit.h>
+
+/* A waiting thread's entry, it lives on the waiter's stack */
+typedef struct wait_token
+{
+	thread_t *thread;
+	struct wait_token *next;
+} wait_token_t;
+
+/* Threads waiting for something to happen. All zeroes is an empty queue. */
+typedef struct wait_queue
+{
+	spinlock_t lock;
+	wait_token_t *waiters;
+} wait_queue_t;
+
+unsigned long wait_queue_prepare(wait_queue_t *wq, wait_token_t *token);
+void wait_queue_finish(wait_queue_t *wq, wait_token_t *token, unsigned long flags);
+void wake_up(wait_queue_t *wq);
+void wake_up_locked(wait_queue_t *wq);
+
+/* Sleeps until cond holds, looking at it again every time wq is woken up. Gives up after
+ * timeout ms, unless that's 0. Evaluates to 0, or -1 if it timed out.
+ * Whoever makes cond true calls wake_up() after it.
+*/
+#define wait_for_event_timeout(wq, cond, timeout) \
+({ \
+	int __ret = 0; \
+	uint64_t __deadline = (timeout) ? get_tick_count() + (timeout) : 0; \
+	wait_token_t __token; \
+	unsigned long __flags = wait_queue_prepare((wq), &__token); \
+	while(!(cond)) \
+	{ \
+		if(__deadline && get_tick_count() >= __deadline) \
+		{ \
+			__ret = -1; \
+			break; \
+		} \
+		sched_block(__deadline); \
+	} \
+	wait_queue_finish((wq), &__token, __flags); \
+	__ret; \
+})
+#define wait_for_event(wq, cond) wait_for_event_timeout(wq, cond, 0)
+#endif
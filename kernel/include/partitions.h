@@ -13,7 +13,10 @@
 
 #include <stdint.h>
 
-typedef int (*fs_handler)(uint64_t sector, int drive, int channel);
+#include <kernel/block.h>
+
+/* Gets the partition's block device, sectors are relative to the start of the partition */
+typedef int (*fs_handler)(block_dev_t *dev);
 
 fs_handler lookup_handler_from_partition_code(uint8_t part_code);
 void part_add_handler(uint8_t part_code, fs_handler handler);
@@ -24,8 +24,6 @@
 void mutex_lock(unsigned long*);
 void mutex_unlock(unsigned long*);
 int printf(const char *, ...);
-extern const uint16_t CONFIG_ADDRESS;
-extern const uint16_t CONFIG_DATA;
 
 ACPI_STATUS AcpiOsInitialize()
 {
@@ -181,7 +179,7 @@ void ACPI_IRQ()
 ACPI_STATUS AcpiOsInstallInterruptHandler(UINT32 InterruptLevel, ACPI_OSD_HANDLER Handler, void *Context)
 {
 	irq_install_handler(InterruptLevel, ACPI_IRQ);
-	pic_unmask_irq((uint16_t)InterruptLevel);
+	irq_unmask(InterruptLevel);
 	ServiceRout = Handler;
 	ctx = Context;
 	printf("Set ACPI handler\n");
@@ -190,7 +188,7 @@ ACPI_STATUS AcpiOsInstallInterruptHandler(UINT32 InterruptLevel, ACPI_OSD_HANDLE
 ACPI_STATUS AcpiOsRemoveInterruptHandler(UINT32 InterruptNumber, ACPI_OSD_HANDLER Handler)
 {
 	irq_uninstall_handler(InterruptNumber, ACPI_IRQ);
-	pic_mask_irq((uint16_t)InterruptNumber);
+	irq_mask(InterruptNumber);
 	ServiceRout = NULL;
 	return AE_OK;
 }
@@ -243,61 +241,33 @@ ACPI_STATUS AcpiOsWritePort (ACPI_IO_ADDRESS Address, UINT32 Value, UINT32 Width
 	return AE_OK;
 }
 
-void pci_write_byte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint8_t data)
-{
-	uint32_t address;
-	uint32_t lbus  = (uint32_t)bus;
-	uint32_t lslot = (uint32_t)slot;
-	uint32_t lfunc = (uint32_t)func;
-
-	/* create configuration address as per Figure 1 */
-	address = (uint32_t)((lbus << 16) | (lslot << 11) |
-		  (lfunc << 8) | (offset & 0xfc) | ((uint32_t)0x80000000));
-
-	/* write out the address */
-	outl (CONFIG_ADDRESS, address);
-	/* read in the data */
-	outb(CONFIG_DATA, data);
-}
-
-void pci_write_qword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint64_t data)
-{
-	uint32_t address;
-	uint32_t lbus  = (uint32_t)bus;
-	uint32_t lslot = (uint32_t)slot;
-	uint32_t lfunc = (uint32_t)func;
-
-	/* create configuration address as per Figure 1 */
-	address = (uint32_t)((lbus << 16) | (lslot << 11) |
-		  (lfunc << 8) | (offset & 0xfc) | ((uint32_t)0x80000000));
-
-	/* write out the address */
-	outl (CONFIG_ADDRESS, address);
-	/* read in the data */
-	outl(CONFIG_DATA, data & 0xFFFFFFFF);
-	address = (uint32_t)((lbus << 16) | (lslot << 11) |
-		  (lfunc << 8) | ((offset+4) & 0xfc) | ((uint32_t)0x80000000));
-
-	/* write out the address */
-	outl (CONFIG_ADDRESS, address);
-	outl(CONFIG_DATA, data & 0xFFFFFFFF00000000);
-}
+/* ACPI_PCI_ID's Segment is always 0 here, pci.c only knows about that one */
 ACPI_STATUS AcpiOsWritePciConfiguration (ACPI_PCI_ID *PciId, UINT32 Register, UINT64 Value, UINT32 Width)
 {
 	if(Width == 8)
-		pci_write_byte(PciId->Bus, PciId->Device, PciId->Function, PciId->Segment, (uint8_t)Value);
+		pci_write_byte(PciId->Bus, PciId->Device, PciId->Function, Register, (uint8_t)Value);
 	if(Width == 16)
-		pci_write_word(PciId->Bus, PciId->Device, PciId->Function, PciId->Segment, (uint16_t)Value);
+		pci_write_word(PciId->Bus, PciId->Device, PciId->Function, Register, (uint16_t)Value);
 	if(Width == 32)
-		pci_write_dword(PciId->Bus, PciId->Device, PciId->Function, PciId->Segment, (uint32_t)Value);
+		pci_write_dword(PciId->Bus, PciId->Device, PciId->Function, Register, (uint32_t)Value);
 	if(Width == 64)
-		pci_write_qword(PciId->Bus, PciId->Device, PciId->Function, PciId->Segment, Value);
-	
+	{
+		pci_write_dword(PciId->Bus, PciId->Device, PciId->Function, Register, (uint32_t)Value);
+		pci_write_dword(PciId->Bus, PciId->Device, PciId->Function, Register + 4, (uint32_t)(Value >> 32));
+	}
 	return AE_OK;
 }
 ACPI_STATUS AcpiOsReadPciConfiguration (ACPI_PCI_ID *PciId, UINT32 Register, UINT64 *Value, UINT32 Width)
 {
-	*Value = (UINT64)pci_config_read_dword(PciId->Bus, PciId->Device, PciId->Function, PciId->Segment);
+	if(Width == 8)
+		*Value = pci_config_read_byte(PciId->Bus, PciId->Device, PciId->Function, Register);
+	else if(Width == 16)
+		*Value = pci_config_read_word(PciId->Bus, PciId->Device, PciId->Function, Register);
+	else if(Width == 32)
+		*Value = pci_config_read_dword(PciId->Bus, PciId->Device, PciId->Function, Register);
+	else
+		*Value = pci_config_read_dword(PciId->Bus, PciId->Device, PciId->Function, Register) |
+		(UINT64) pci_config_read_dword(PciId->Bus, PciId->Device, PciId->Function, Register + 4) << 32;
 	return AE_OK;
 }
 ACPI_STATUS
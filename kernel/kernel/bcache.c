@@ -0,0 +1,243 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: bcache.c
+ *
+ * Description: Block buffer cache. Buffers are looked up by (device, block) through
+ * a hash table and are refcounted; unreferenced ones sit on an LRU list and get
+ * recycled, after being written back if they're dirty.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kernel/bcache.h>
+#include <kernel/pmm.h>
+#include <kernel/paging.h>
+#include <kernel/spinlock.h>
+
+static buffer_head_t *bcache_hash_table[BCACHE_HASH_SIZE];
+/* Only holds buffers nobody has a reference to, most recently released at the head */
+static buffer_head_t *lru_head = NULL;
+static buffer_head_t *lru_tail = NULL;
+static size_t nr_buffers = 0;
+static spinlock_t bcache_spl;
+
+static inline unsigned int bcache_hash(bcache_dev_t *dev, uint64_t block)
+{
+	return (unsigned int)(((uintptr_t) dev >> 4) ^ block) % BCACHE_HASH_SIZE;
+}
+static inline size_t bcache_pages(bcache_dev_t *dev)
+{
+	return (dev->block_size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+static void lru_remove(buffer_head_t *bh)
+{
+	if(bh->lru_prev)
+		bh->lru_prev->lru_next = bh->lru_next;
+	else if(lru_head == bh)
+		lru_head = bh->lru_next;
+	if(bh->lru_next)
+		bh->lru_next->lru_prev = bh->lru_prev;
+	else if(lru_tail == bh)
+		lru_tail = bh->lru_prev;
+	bh->lru_prev = bh->lru_next = NULL;
+}
+static void lru_add(buffer_head_t *bh)
+{
+	bh->lru_prev = NULL;
+	bh->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = bh;
+	lru_head = bh;
+	if(!lru_tail)
+		lru_tail = bh;
+}
+static void hash_remove(buffer_head_t *bh)
+{
+	buffer_head_t **p = &bcache_hash_table[bcache_hash(bh->dev, bh->block)];
+	while(*p && *p != bh)
+		p = &(*p)->hash_next;
+	if(*p)
+		*p = bh->hash_next;
+	bh->hash_next = NULL;
+}
+static buffer_head_t *hash_lookup(bcache_dev_t *dev, uint64_t block)
+{
+	for(buffer_head_t *bh = bcache_hash_table[bcache_hash(dev, block)]; bh; bh = bh->hash_next)
+	{
+		if(bh->dev == dev && bh->block == block)
+			return bh;
+	}
+	return NULL;
+}
+static void bcache_free(buffer_head_t *bh)
+{
+	pfree(bcache_pages(bh->dev), (void*) bh->phys);
+	free(bh);
+}
+/* Writes a dirty buffer back. Called with the lock held, which is dropped around the I/O.
+ * The buffer is referenced in the meantime, so it can't be recycled under us, and it's
+ * marked clean before the write so that changes made while it's in flight keep it dirty.
+ * A buffer nobody else references goes back to the head of the LRU list afterwards.
+*/
+static int bcache_write_locked(buffer_head_t *bh)
+{
+	if(bh->refcount++ == 0)
+		lru_remove(bh);
+	bh->flags &= ~BH_DIRTY;
+	release_spinlock(&bcache_spl);
+	int ret = bh->dev->write_block(bh->dev, bh);
+	acquire_spinlock(&bcache_spl);
+	if(ret < 0)
+		bh->flags |= BH_DIRTY;
+	if(--bh->refcount == 0)
+		lru_add(bh);
+	return ret;
+}
+/* Recycles the least recently used buffers until we're back under the limit.
+ * Called with the lock held, dirty buffers get written back first.
+*/
+static void bcache_shrink()
+{
+	while(nr_buffers > BCACHE_MAX_BUFFERS && lru_tail)
+	{
+		buffer_head_t *bh = lru_tail;
+		if(bh->flags & BH_DIRTY)
+		{
+			/* On failure it stays around rather than losing the data, and we try again later */
+			if(bcache_write_locked(bh) < 0)
+				break;
+			continue;
+		}
+		lru_remove(bh);
+		hash_remove(bh);
+		nr_buffers--;
+		bcache_free(bh);
+	}
+}
+static buffer_head_t *bcache_alloc(bcache_dev_t *dev, uint64_t block)
+{
+	buffer_head_t *bh = malloc(sizeof(buffer_head_t));
+	if(!bh)
+		return NULL;
+	memset(bh, 0, sizeof(buffer_head_t));
+	void *phys = pmalloc(bcache_pages(dev));
+	if(!phys)
+	{
+		free(bh);
+		return NULL;
+	}
+	bh->dev = dev;
+	bh->block = block;
+	bh->phys = (uintptr_t) phys;
+	bh->data = (void*)((uintptr_t) phys + PHYS_BASE);
+	bh->refcount = 1;
+	return bh;
+}
+/* Returns a referenced buffer holding block, reading it from the device if it isn't cached.
+ * Every bread() needs to be paired with a brelse().
+*/
+buffer_head_t *bread(bcache_dev_t *dev, uint64_t block)
+{
+	acquire_spinlock(&bcache_spl);
+	buffer_head_t *bh = hash_lookup(dev, block);
+	if(bh)
+	{
+		if(bh->refcount++ == 0)
+			lru_remove(bh);
+		release_spinlock(&bcache_spl);
+		return bh;
+	}
+	release_spinlock(&bcache_spl);
+
+	/* Do the I/O without the lock held */
+	bh = bcache_alloc(dev, block);
+	if(!bh)
+		return errno = ENOMEM, NULL;
+	if(dev->read_block(dev, bh) < 0)
+	{
+		bcache_free(bh);
+		return errno = EIO, NULL;
+	}
+
+	acquire_spinlock(&bcache_spl);
+	/* Someone else might have read the same block in the meantime */
+	buffer_head_t *other = hash_lookup(dev, block);
+	if(other)
+	{
+		if(other->refcount++ == 0)
+			lru_remove(other);
+		release_spinlock(&bcache_spl);
+		bcache_free(bh);
+		return other;
+	}
+	unsigned int hash = bcache_hash(dev, block);
+	bh->hash_next = bcache_hash_table[hash];
+	bcache_hash_table[hash] = bh;
+	nr_buffers++;
+	bcache_shrink();
+	release_spinlock(&bcache_spl);
+	return bh;
+}
+void brelse(buffer_head_t *bh)
+{
+	if(!bh)
+		return;
+	acquire_spinlock(&bcache_spl);
+	if(--bh->refcount == 0)
+	{
+		lru_add(bh);
+		bcache_shrink();
+	}
+	release_spinlock(&bcache_spl);
+}
+/* Marks the buffer as modified, it gets written back when it's recycled or synced */
+void bdirty(buffer_head_t *bh)
+{
+	acquire_spinlock(&bcache_spl);
+	bh->flags |= BH_DIRTY;
+	release_spinlock(&bcache_spl);
+}
+/* Writes the buffer back to the device right away */
+int bwrite(buffer_head_t *bh)
+{
+	acquire_spinlock(&bcache_spl);
+	int ret = bcache_write_locked(bh);
+	release_spinlock(&bcache_spl);
+	return ret < 0 ? (errno = EIO, -1) : 0;
+}
+/* Writes back every dirty buffer that belongs to dev, or to any device if dev is NULL */
+int bcache_sync(bcache_dev_t *dev)
+{
+	int ret = 0;
+	acquire_spinlock(&bcache_spl);
+	for(unsigned int i = 0; i < BCACHE_HASH_SIZE; i++)
+	{
+		/* Only unreferenced buffers get recycled, and never without the lock, so bh is still
+		 * in the chain once the lock is back and the write has dropped its reference.
+		*/
+		for(buffer_head_t *bh = bcache_hash_table[i]; bh; bh = bh->hash_next)
+		{
+			if(!(bh->flags & BH_DIRTY) || (dev && bh->dev != dev))
+				continue;
+			if(bcache_write_locked(bh) < 0)
+				ret = -1;
+		}
+	}
+	release_spinlock(&bcache_spl);
+	return ret ? (errno = EIO, -1) : 0;
+}
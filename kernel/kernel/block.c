@@ -0,0 +1,721 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: block.c
+ *
+ * Description: Block I/O layer. I/O gets submitted as bios, which are merged
+ * with queued requests for the sectors right next to them. The queue hands
+ * requests to the driver in elevator order, unless one of them has been
+ * waiting past its deadline, keeping up to the queue's depth of them in
+ * flight. Drivers complete requests from their interrupt handler, which
+ * starts the next one straight away and wakes up whoever waits on the
+ * bios. A request the driver doesn't complete in time is handed back to
+ * it by a timer. Bios too big for one request are split into several.
+ * Drivers recovering a device stop the queue meanwhile, and requeue the
+ * requests that were caught up in it.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kernel/block.h>
+#include <kernel/paging.h>
+#include <kernel/pit.h>
+#include <kernel/vmm.h>
+#include <kernel/pmm.h>
+
+static block_dev_t *blk_devs = NULL;
+static spinlock_t blk_devs_spl;
+
+request_queue_t *blk_alloc_queue(blk_start_t start, size_t max_sectors, size_t max_segments)
+{
+	request_queue_t *q = malloc(sizeof(request_queue_t));
+	if(!q)
+		return errno = ENOMEM, NULL;
+	memset(q, 0, sizeof(request_queue_t));
+	/* A fixed pool, which also bounds how much can be queued. Submitters that run out wait for the device. */
+	request_t *requests = malloc(sizeof(request_t) * BLOCK_MAX_REQUESTS);
+	if(!requests)
+	{
+		free(q);
+		return errno = ENOMEM, NULL;
+	}
+	for(int i = 0; i < BLOCK_MAX_REQUESTS; i++)
+	{
+		requests[i].sort_next = q->free_requests;
+		q->free_requests = &requests[i];
+	}
+	q->start = start;
+	q->depth = 1;
+	q->max_sectors = max_sectors;
+	q->max_segments = max_segments;
+	q->dma_limit = UINTPTR_MAX;
+	return q;
+}
+static block_dev_t *blk_add_dev(const char *name, uint64_t nr_sectors)
+{
+	block_dev_t *dev = malloc(sizeof(block_dev_t));
+	if(!dev)
+		return errno = ENOMEM, NULL;
+	memset(dev, 0, sizeof(block_dev_t));
+	dev->name = malloc(strlen(name) + 1);
+	if(!dev->name)
+	{
+		free(dev);
+		return errno = ENOMEM, NULL;
+	}
+	strcpy(dev->name, name);
+	dev->nr_sectors = nr_sectors;
+	return dev;
+}
+static void blk_register(block_dev_t *dev)
+{
+	acquire_spinlock(&blk_devs_spl);
+	block_dev_t **p = &blk_devs;
+	while(*p)
+		p = &(*p)->next;
+	*p = dev;
+	release_spinlock(&blk_devs_spl);
+}
+block_dev_t *blk_add_disk(const char *name, uint64_t nr_sectors, request_queue_t *q, void *driver_data)
+{
+	block_dev_t *dev = blk_add_dev(name, nr_sectors);
+	if(!dev)
+		return NULL;
+	dev->disk = dev;
+	dev->queue = q;
+	dev->driver_data = driver_data;
+	blk_register(dev);
+	return dev;
+}
+block_dev_t *blk_add_partition(block_dev_t *disk, const char *name, uint64_t first_sector, uint64_t nr_sectors)
+{
+	if(first_sector >= disk->nr_sectors || nr_sectors > disk->nr_sectors - first_sector)
+		return errno = EINVAL, NULL;
+	block_dev_t *dev = blk_add_dev(name, nr_sectors);
+	if(!dev)
+		return NULL;
+	dev->disk = disk;
+	dev->queue = disk->queue;
+	dev->first_sector = first_sector;
+	dev->driver_data = disk->driver_data;
+	blk_register(dev);
+	return dev;
+}
+block_dev_t *blk_get_dev(const char *name)
+{
+	acquire_spinlock(&blk_devs_spl);
+	block_dev_t *dev = blk_devs;
+	while(dev && strcmp(dev->name, (char*) name))
+		dev = dev->next;
+	release_spinlock(&blk_devs_spl);
+	return dev;
+}
+block_dev_t *blk_next_disk(block_dev_t *dev)
+{
+	acquire_spinlock(&blk_devs_spl);
+	dev = dev ? dev->next : blk_devs;
+	while(dev && dev->disk != dev)
+		dev = dev->next;
+	release_spinlock(&blk_devs_spl);
+	return dev;
+}
+block_dev_t *blk_first_disk()
+{
+	return blk_next_disk(NULL);
+}
+void bio_init(bio_t *bio, block_dev_t *dev, int op, uint64_t sector, const struct iovec *vec, int veccnt)
+{
+	memset(bio, 0, sizeof(bio_t));
+	bio->dev = dev;
+	bio->op = op;
+	bio->sector = sector;
+	bio->vec = vec;
+	bio->veccnt = veccnt;
+	for(int i = 0; i < veccnt; i++)
+	{
+		uintptr_t base = (uintptr_t) vec[i].iov_base;
+		if(!vec[i].iov_len)
+			continue;
+		bio->size += vec[i].iov_len;
+		bio->nr_segments += (base + vec[i].iov_len - 1) / PAGE_SIZE - base / PAGE_SIZE + 1;
+	}
+}
+static void bio_end(bio_t *bio, int status)
+{
+	bio->status = status;
+	if(bio->end_io)
+		bio->end_io(bio);
+	/* The waiter can free the bio as soon as it sees BIO_DONE, and it takes the lock on its way out */
+	unsigned long flags = spin_lock_irqsave(&bio->wait.lock);
+	bio->flags |= BIO_DONE;
+	wake_up_locked(&bio->wait);
+	spin_unlock_irqrestore(&bio->wait.lock, flags);
+}
+/* Checks that every piece of the vector is mapped and can be reached by the device.
+ * Returns 1 if the bio needs to be bounced.
+*/
+static int blk_check_dma(request_queue_t *q, bio_t *bio)
+{
+	for(int i = 0; i < bio->veccnt; i++)
+	{
+		char *base = bio->vec[i].iov_base;
+		size_t len = bio->vec[i].iov_len;
+		if((uintptr_t) base & q->dma_align || len & q->dma_align)
+			return 1;
+		while(len)
+		{
+			size_t chunk = PAGE_SIZE - ((uintptr_t) base & (PAGE_SIZE - 1));
+			if(chunk > len)
+				chunk = len;
+			/* The device can't fault pages in, so make sure they're there */
+			(void) *(volatile char*) base;
+			uintptr_t phys = (uintptr_t) virtual2phys(base);
+			if(phys + chunk - 1 > q->dma_limit)
+				return 1;
+			base += chunk;
+			len -= chunk;
+		}
+	}
+	return 0;
+}
+/* Points the bio at a physically contiguous copy the device can reach */
+static int blk_bounce(request_queue_t *q, bio_t *bio)
+{
+	size_t pages = (bio->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	void *phys = pmalloc_below(pages, q->dma_limit);
+	if(!phys)
+		return -1;
+	char *buf = (char*)((uintptr_t) phys + PHYS_BASE);
+	if(bio->op == BIO_WRITE)
+	{
+		size_t off = 0;
+		for(int i = 0; i < bio->veccnt; i++)
+		{
+			memcpy(buf + off, bio->vec[i].iov_base, bio->vec[i].iov_len);
+			off += bio->vec[i].iov_len;
+		}
+	}
+	bio->bounce = buf;
+	bio->bounce_pages = pages;
+	bio->orig_vec = bio->vec;
+	bio->orig_veccnt = bio->veccnt;
+	bio->bounce_vec.iov_base = buf;
+	bio->bounce_vec.iov_len = bio->size;
+	bio->vec = &bio->bounce_vec;
+	bio->veccnt = 1;
+	bio->nr_segments = pages;
+	return 0;
+}
+/* Copies what was read back out of the bounce buffer. This isn't done when the bio ends,
+ * as the interrupt handler could be running in someone else's address space.
+*/
+static void blk_unbounce(bio_t *bio)
+{
+	char *buf = bio->bounce;
+	if(bio->op == BIO_READ && !bio->status)
+	{
+		size_t off = 0;
+		for(int i = 0; i < bio->orig_veccnt; i++)
+		{
+			memcpy(bio->orig_vec[i].iov_base, buf + off, bio->orig_vec[i].iov_len);
+			off += bio->orig_vec[i].iov_len;
+		}
+	}
+	pfree(bio->bounce_pages, (void*)((uintptr_t) buf - PHYS_BASE));
+	bio->vec = bio->orig_vec;
+	bio->veccnt = bio->orig_veccnt;
+	bio->bounce = NULL;
+}
+/* Works out how much of the vector, from piece i at offset off on, fits in one request.
+ * nvec gets an upper bound on the pieces that takes.
+*/
+static size_t blk_split_size(request_queue_t *q, const bio_t *bio, int i, size_t off, int *nvec)
+{
+	size_t max = q->max_sectors * BLOCK_SECTOR_SIZE;
+	size_t size = 0;
+	size_t segs = 0;
+	int n = 0;
+	for(; i < bio->veccnt && size < max && segs < q->max_segments; i++, off = 0)
+	{
+		uintptr_t base = (uintptr_t) bio->vec[i].iov_base + off;
+		size_t len = bio->vec[i].iov_len - off;
+		if(!len)
+			continue;
+		size_t pieces = (base + len - 1) / PAGE_SIZE - base / PAGE_SIZE + 1;
+		if(pieces > q->max_segments - segs)
+		{
+			/* Only the pages that still fit */
+			pieces = q->max_segments - segs;
+			len = pieces * PAGE_SIZE - (base & (PAGE_SIZE - 1));
+		}
+		if(len > max - size)
+			len = max - size;
+		size += len;
+		segs += pieces;
+		n++;
+	}
+	*nvec = n;
+	return size - size % BLOCK_SECTOR_SIZE;
+}
+/* Ends the parent once the last of its children does */
+static void bio_split_end(bio_t *child)
+{
+	bio_t *parent = child->parent;
+	if(child->status)
+		__sync_bool_compare_and_swap(&parent->split_status, 0, child->status);
+	if(__sync_sub_and_fetch(&parent->remaining, 1) == 0)
+		bio_end(parent, parent->split_status);
+}
+/* Breaks a bio the queue can't take in one request down into ones it can, and submits those */
+static void bio_split(request_queue_t *q, bio_t *bio)
+{
+	bio->remaining = 1;
+	bio->split_status = 0;
+	bio_t **tail = &bio->split;
+	uint64_t sector = bio->sector;
+	size_t left = bio->size;
+	int i = 0;
+	size_t off = 0;
+	blk_plug(bio->dev);
+	while(left)
+	{
+		int nvec;
+		size_t size = blk_split_size(q, bio, i, off, &nvec);
+		if(!size)
+		{
+			/* Pieces so small that not even one sector fits in a request */
+			bio->split_status = EINVAL;
+			break;
+		}
+		bio_t *child = malloc(sizeof(bio_t) + nvec * sizeof(struct iovec));
+		if(!child)
+		{
+			bio->split_status = ENOMEM;
+			break;
+		}
+		struct iovec *vec = (struct iovec*)(child + 1);
+		int veccnt = 0;
+		for(size_t todo = size; todo;)
+		{
+			size_t len = bio->vec[i].iov_len - off;
+			if(len > todo)
+				len = todo;
+			if(len)
+			{
+				vec[veccnt].iov_base = (char*) bio->vec[i].iov_base + off;
+				vec[veccnt].iov_len = len;
+				veccnt++;
+			}
+			off += len;
+			todo -= len;
+			if(off == bio->vec[i].iov_len)
+			{
+				i++;
+				off = 0;
+			}
+		}
+		bio_init(child, bio->dev, bio->op, sector, vec, veccnt);
+		child->parent = bio;
+		child->end_io = bio_split_end;
+		*tail = child;
+		tail = &child->split_next;
+		__sync_add_and_fetch(&bio->remaining, 1);
+		bio_submit(child);
+		sector += size / BLOCK_SECTOR_SIZE;
+		left -= size;
+	}
+	blk_unplug(bio->dev);
+	if(__sync_sub_and_fetch(&bio->remaining, 1) == 0)
+		bio_end(bio, bio->split_status);
+}
+/* Sorts by disk first, so the elevator sweeps one disk at a time */
+static inline int blk_before(block_dev_t *a, uint64_t asect, block_dev_t *b, uint64_t bsect)
+{
+	if(a != b)
+		return (uintptr_t) a < (uintptr_t) b;
+	return asect < bsect;
+}
+static int blk_can_merge(request_queue_t *q, request_t *req, bio_t *bio, size_t nr)
+{
+	return req->op == bio->op && req->nr_sectors + nr <= q->max_sectors &&
+	req->nr_segments + bio->nr_segments <= q->max_segments;
+}
+/* Tacks bio onto a queued request for the sectors right before or after it */
+static int blk_merge(request_queue_t *q, bio_t *bio, block_dev_t *disk, uint64_t sector, size_t nr)
+{
+	for(request_t *req = q->sorted; req; req = req->sort_next)
+	{
+		if(req->disk != disk || !blk_can_merge(q, req, bio, nr))
+			continue;
+		if(req->sector + req->nr_sectors == sector)
+		{
+			req->biotail->next = bio;
+			req->biotail = bio;
+		}
+		else if(sector + nr == req->sector)
+		{
+			bio->next = req->bio;
+			req->bio = bio;
+			req->sector = sector;
+		}
+		else
+			continue;
+		req->nr_sectors += nr;
+		req->nr_segments += bio->nr_segments;
+		return 1;
+	}
+	return 0;
+}
+static void blk_insert(request_queue_t *q, request_t *req)
+{
+	request_t *prev = NULL;
+	request_t *r = q->sorted;
+	while(r && blk_before(r->disk, r->sector, req->disk, req->sector))
+	{
+		prev = r;
+		r = r->sort_next;
+	}
+	req->sort_prev = prev;
+	req->sort_next = r;
+	if(prev)
+		prev->sort_next = req;
+	else
+		q->sorted = req;
+	if(r)
+		r->sort_prev = req;
+	/* New requests have the latest deadline, only requeued ones go further forward */
+	request_t *before = q->fifo_tail[req->op];
+	while(before && before->deadline > req->deadline)
+		before = before->fifo_prev;
+	req->fifo_prev = before;
+	req->fifo_next = before ? before->fifo_next : q->fifo_head[req->op];
+	if(req->fifo_next)
+		req->fifo_next->fifo_prev = req;
+	else
+		q->fifo_tail[req->op] = req;
+	if(before)
+		before->fifo_next = req;
+	else
+		q->fifo_head[req->op] = req;
+}
+static void blk_remove(request_queue_t *q, request_t *req)
+{
+	if(req->sort_prev)
+		req->sort_prev->sort_next = req->sort_next;
+	else
+		q->sorted = req->sort_next;
+	if(req->sort_next)
+		req->sort_next->sort_prev = req->sort_prev;
+	if(req->fifo_prev)
+		req->fifo_prev->fifo_next = req->fifo_next;
+	else
+		q->fifo_head[req->op] = req->fifo_next;
+	if(req->fifo_next)
+		req->fifo_next->fifo_prev = req->fifo_prev;
+	else
+		q->fifo_tail[req->op] = req->fifo_prev;
+}
+/* Deadline scheduling: expired requests go first. Otherwise the elevator keeps sweeping upwards
+ * in one direction for a batch, and wraps around to the lowest sector when it runs out.
+*/
+static request_t *blk_pick(request_queue_t *q)
+{
+	uint64_t now = get_tick_count();
+	for(int op = BIO_READ; op <= BIO_WRITE; op++)
+	{
+		if(q->fifo_head[op] && q->fifo_head[op]->deadline <= now)
+		{
+			q->batch_op = op;
+			q->batch_count = 1;
+			return q->fifo_head[op];
+		}
+	}
+	int op = q->batch_op;
+	if(!q->fifo_head[op] || (q->batch_count >= BLOCK_BATCH && q->fifo_head[!op]))
+	{
+		op = !op;
+		q->batch_count = 0;
+	}
+	q->batch_op = op;
+	q->batch_count++;
+	request_t *first = NULL;
+	for(request_t *r = q->sorted; r; r = r->sort_next)
+	{
+		if(r->op != op)
+			continue;
+		if(!first)
+			first = r;
+		if(!blk_before(r->disk, r->sector, q->head_disk, q->head_sector))
+			return r;
+	}
+	return first;
+}
+static void blk_free_request(request_queue_t *q, request_t *req)
+{
+	req->sort_next = q->free_requests;
+	q->free_requests = req;
+	wake_up(&q->wait);
+}
+/* The driver has held on to the request for too long. It gets the device back in shape and
+ * completes the request, if it doesn't the request gets another go. Runs from the timer interrupt.
+*/
+static void blk_expire(void *arg)
+{
+	request_t *req = arg;
+	request_queue_t *q = req->disk->queue;
+	q->timeout(q, req);
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	if(q->active[req->tag] == req && !req->timer.pending)
+		timer_add(&req->timer, get_tick_count() + BLOCK_TIMEOUT_MS, blk_expire, req);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+static int blk_get_tag(request_queue_t *q)
+{
+	for(unsigned int i = 0; i < q->depth; i++)
+	{
+		if(!(q->tags & (1U << i)))
+			return i;
+	}
+	return -1;
+}
+/* Hands requests to the driver until it has as many as it can take. Needs the queue lock held. */
+static void blk_dispatch(request_queue_t *q)
+{
+	int tag;
+	if(q->stopped)
+		return;
+	while(q->sorted && (tag = blk_get_tag(q)) >= 0)
+	{
+		request_t *req = blk_pick(q);
+		blk_remove(q, req);
+		q->head_disk = req->disk;
+		q->head_sector = req->sector + req->nr_sectors;
+		req->tag = tag;
+		q->tags |= 1U << tag;
+		q->active[tag] = req;
+		if(q->start(q, req) == 0)
+		{
+			if(q->timeout)
+				timer_add(&req->timer, get_tick_count() + BLOCK_TIMEOUT_MS, blk_expire, req);
+			continue;
+		}
+		q->tags &= ~(1U << tag);
+		q->active[tag] = NULL;
+		for(bio_t *bio = req->bio, *next; bio; bio = next)
+		{
+			next = bio->next;
+			bio_end(bio, EIO);
+		}
+		blk_free_request(q, req);
+	}
+}
+/* Queues a bio. It runs once the queue gets to it, or right away if the device is idle and the
+ * queue isn't plugged. bio->flags gets BIO_DONE once it's finished, and end_io is called.
+*/
+void bio_submit(bio_t *bio)
+{
+	block_dev_t *dev = bio->dev;
+	request_queue_t *q = dev->queue;
+	size_t nr = bio->size / BLOCK_SECTOR_SIZE;
+	bio->flags = 0;
+	bio->status = 0;
+	bio->next = NULL;
+	bio->bounce = NULL;
+	bio->split = NULL;
+	if(!nr || bio->size % BLOCK_SECTOR_SIZE || bio->sector >= dev->nr_sectors || nr > dev->nr_sectors - bio->sector)
+	{
+		bio_end(bio, EINVAL);
+		return;
+	}
+	if(nr > q->max_sectors || bio->nr_segments > q->max_segments)
+	{
+		bio_split(q, bio);
+		return;
+	}
+	if(blk_check_dma(q, bio) && blk_bounce(q, bio) < 0)
+	{
+		bio_end(bio, ENOMEM);
+		return;
+	}
+	uint64_t sector = dev->first_sector + bio->sector;
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	while(!blk_merge(q, bio, dev->disk, sector, nr))
+	{
+		request_t *req = q->free_requests;
+		if(req)
+		{
+			q->free_requests = req->sort_next;
+			memset(req, 0, sizeof(request_t));
+			req->disk = dev->disk;
+			req->sector = sector;
+			req->nr_sectors = nr;
+			req->nr_segments = bio->nr_segments;
+			req->op = bio->op;
+			req->deadline = get_tick_count() + (bio->op == BIO_READ ? BLOCK_READ_EXPIRE_MS : BLOCK_WRITE_EXPIRE_MS);
+			req->bio = req->biotail = bio;
+			blk_insert(q, req);
+			break;
+		}
+		/* Every request is in use, wait for the device to finish one */
+		blk_dispatch(q);
+		spin_unlock_irqrestore(&q->lock, flags);
+		wait_for_event(&q->wait, q->free_requests);
+		flags = spin_lock_irqsave(&q->lock);
+	}
+	if(!q->plugged)
+		blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+/* Sleeps until a bio finishes, returns its status. Waiting unplugs the queue, otherwise
+ * nothing would get the bio going. Bounced or split bios need to be waited on, even with an end_io.
+*/
+int bio_wait(bio_t *bio)
+{
+	request_queue_t *q = bio->dev->queue;
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+	wait_for_event(&bio->wait, bio->flags & BIO_DONE);
+	while(bio->split)
+	{
+		/* The parent ends from the last child's end_io, before that child is done with itself */
+		bio_t *child = bio->split;
+		wait_for_event(&child->wait, child->flags & BIO_DONE);
+		if(child->bounce)
+			blk_unbounce(child);
+		bio->split = child->split_next;
+		free(child);
+	}
+	if(bio->bounce)
+		blk_unbounce(bio);
+	return bio->status;
+}
+/* Holds back requests while a burst of them is being submitted, so they can be merged and sorted
+ * before the device sees any of them. Plugs nest.
+*/
+void blk_plug(block_dev_t *dev)
+{
+	request_queue_t *q = dev->queue;
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	q->plugged++;
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+void blk_unplug(block_dev_t *dev)
+{
+	request_queue_t *q = dev->queue;
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	if(q->plugged && !--q->plugged)
+		blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+/* Called by the driver, usually from its interrupt handler, once the request with the given tag is done.
+ * The next request gets started before the finished bios are ended.
+*/
+void blk_complete(request_queue_t *q, unsigned int tag, int status)
+{
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	request_t *req = tag < q->depth ? q->active[tag] : NULL;
+	if(!req)
+	{
+		spin_unlock_irqrestore(&q->lock, flags);
+		return;
+	}
+	bio_t *bio = req->bio;
+	timer_cancel(&req->timer);
+	q->tags &= ~(1U << tag);
+	q->active[tag] = NULL;
+	blk_free_request(q, req);
+	blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+	while(bio)
+	{
+		/* Whoever waits on the bio can free it as soon as it's ended */
+		bio_t *next = bio->next;
+		bio_end(bio, status);
+		bio = next;
+	}
+}
+/* Called by the driver for a request it had to abort while recovering the device, through no fault
+ * of the request's own. It goes back on the queue, unless it has already been retried too often.
+*/
+void blk_requeue(request_queue_t *q, unsigned int tag)
+{
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	request_t *req = tag < q->depth ? q->active[tag] : NULL;
+	if(!req)
+	{
+		spin_unlock_irqrestore(&q->lock, flags);
+		return;
+	}
+	timer_cancel(&req->timer);
+	q->tags &= ~(1U << tag);
+	q->active[tag] = NULL;
+	if(req->retries++ < BLOCK_MAX_RETRIES)
+	{
+		blk_insert(q, req);
+		blk_dispatch(q);
+		spin_unlock_irqrestore(&q->lock, flags);
+		return;
+	}
+	bio_t *bio = req->bio;
+	blk_free_request(q, req);
+	blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+	while(bio)
+	{
+		bio_t *next = bio->next;
+		bio_end(bio, EIO);
+		bio = next;
+	}
+}
+/* Keeps the queue from handing the driver anything new until it's started again. Stops nest,
+ * and can come from interrupt handlers.
+*/
+void blk_stop_queue(request_queue_t *q)
+{
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	q->stopped++;
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+void blk_start_queue(request_queue_t *q)
+{
+	unsigned long flags = spin_lock_irqsave(&q->lock);
+	if(q->stopped && !--q->stopped)
+		blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+}
+/* Synchronous I/O, returns -1 with errno set if it fails */
+int blk_rw_vec(block_dev_t *dev, int op, uint64_t sector, const struct iovec *vec, int veccnt)
+{
+	bio_t bio;
+	bio_init(&bio, dev, op, sector, vec, veccnt);
+	bio_submit(&bio);
+	int status = bio_wait(&bio);
+	if(status)
+		return errno = status, -1;
+	return 0;
+}
+int blk_read(block_dev_t *dev, uint64_t sector, void *buffer, size_t len)
+{
+	struct iovec v = {buffer, len};
+	return blk_rw_vec(dev, BIO_READ, sector, &v, 1);
+}
+int blk_write(block_dev_t *dev, uint64_t sector, const void *buffer, size_t len)
+{
+	struct iovec v = {(void*) buffer, len};
+	return blk_rw_vec(dev, BIO_WRITE, sector, &v, 1);
+}
@@ -0,0 +1,364 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: dcache.c
+ *
+ * Description: Directory entry cache. Paths are walked one component at a time
+ * through a hash of (parent, name), so opening a path that was opened before costs
+ * a hash probe per component instead of a trip through the filesystem.
+ * Lookups that failed are remembered too, as negative entries.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kernel/dcache.h>
+#include <kernel/vfs.h>
+#include <kernel/spinlock.h>
+
+static dentry_t root_dentry;
+static dentry_t *dcache_hash_table[DCACHE_HASH_SIZE];
+static dentry_t *lru_head = NULL;
+static dentry_t *lru_tail = NULL;
+static size_t nr_dentries = 0;
+static spinlock_t dcache_spl;
+
+static inline unsigned int dcache_hash(dentry_t *parent, const char *name, size_t len)
+{
+	/* FNV-1a over the name, mixed with the parent */
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return (hash ^ (uint32_t)((uintptr_t) parent >> 4)) % DCACHE_HASH_SIZE;
+}
+static void lru_remove(dentry_t *d)
+{
+	if(d->lru_prev)
+		d->lru_prev->lru_next = d->lru_next;
+	else if(lru_head == d)
+		lru_head = d->lru_next;
+	if(d->lru_next)
+		d->lru_next->lru_prev = d->lru_prev;
+	else if(lru_tail == d)
+		lru_tail = d->lru_prev;
+	d->lru_prev = d->lru_next = NULL;
+}
+static void lru_add(dentry_t *d)
+{
+	d->lru_prev = NULL;
+	d->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = d;
+	lru_head = d;
+	if(!lru_tail)
+		lru_tail = d;
+}
+static dentry_t *d_lookup(dentry_t *parent, const char *name, size_t len)
+{
+	for(dentry_t *d = dcache_hash_table[dcache_hash(parent, name, len)]; d; d = d->hash_next)
+	{
+		if(d->parent == parent && d->namelen == len && !memcmp(d->name, name, len))
+			return d;
+	}
+	return NULL;
+}
+static dentry_t *d_alloc(dentry_t *parent, const char *name, size_t len)
+{
+	dentry_t *d = malloc(sizeof(dentry_t));
+	if(!d)
+		return NULL;
+	memset(d, 0, sizeof(dentry_t));
+	d->name = malloc(len + 1);
+	if(!d->name)
+	{
+		free(d);
+		return NULL;
+	}
+	memcpy(d->name, name, len);
+	d->name[len] = '\0';
+	d->namelen = len;
+	d->parent = parent;
+	parent->nr_children++;
+	unsigned int hash = dcache_hash(parent, name, len);
+	d->hash_next = dcache_hash_table[hash];
+	dcache_hash_table[hash] = d;
+	lru_add(d);
+	nr_dentries++;
+	return d;
+}
+static void d_put_node(dentry_t *d)
+{
+	if(!d->node)
+		return;
+	put_vfs(d->node);
+	d->node = NULL;
+}
+/* Takes the entry out of the cache. Entries someone has pinned only get marked dead,
+ * whoever drops the last pin frees them.
+*/
+static void d_free(dentry_t *d)
+{
+	dentry_t **p = &dcache_hash_table[dcache_hash(d->parent, d->name, d->namelen)];
+	while(*p && *p != d)
+		p = &(*p)->hash_next;
+	if(*p)
+		*p = d->hash_next;
+	lru_remove(d);
+	d->parent->nr_children--;
+	nr_dentries--;
+	d_put_node(d);
+	if(d->refcount)
+	{
+		d->flags |= DENTRY_DEAD;
+		d->parent = NULL;
+		return;
+	}
+	free(d->name);
+	free(d);
+}
+/* Turns path into an absolute path without ".", ".." or repeated slashes, so every spelling
+ * of a path ends up on the same entries. Returns NULL if there's no memory for it.
+*/
+static char *dcache_normalize(const char *path)
+{
+	size_t len = strlen(path);
+	char *norm = malloc(len + 2);
+	if(!norm)
+		return NULL;
+	size_t out = 0;
+	const char *p = path;
+	while(*p)
+	{
+		while(*p == '/')
+			p++;
+		if(!*p)
+			break;
+		size_t n = 0;
+		while(p[n] && p[n] != '/')
+			n++;
+		if(n == 1 && p[0] == '.')
+		{
+			/* Nothing to do */
+		}
+		else if(n == 2 && p[0] == '.' && p[1] == '.')
+		{
+			/* Back up to the previous slash, the root is its own parent */
+			while(out && norm[out - 1] != '/')
+				out--;
+			if(out)
+				out--;
+		}
+		else
+		{
+			norm[out++] = '/';
+			memcpy(norm + out, p, n);
+			out += n;
+		}
+		p += n;
+	}
+	if(!out)
+		norm[out++] = '/';
+	norm[out] = '\0';
+	return norm;
+}
+/* Drops unused leaf entries, oldest first, until we're under the limit */
+static void dcache_shrink()
+{
+	dentry_t *d = lru_tail;
+	while(nr_dentries > DCACHE_MAX_ENTRIES && d)
+	{
+		dentry_t *prev = d->lru_prev;
+		if(!d->nr_children && !d->refcount)
+			d_free(d);
+		d = prev;
+	}
+}
+static vfsnode_t *__dcache_open(const char *path)
+{
+	acquire_spinlock(&dcache_spl);
+	dentry_t *d = &root_dentry;
+	const char *p = path;
+	while(*p)
+	{
+		while(*p == '/')
+			p++;
+		if(!*p)
+			break;
+		size_t len = 0;
+		while(p[len] && p[len] != '/')
+			len++;
+		dentry_t *child = d_lookup(d, p, len);
+		if(!child)
+		{
+			child = d_alloc(d, p, len);
+			if(!child)
+			{
+				release_spinlock(&dcache_spl);
+				return open_vfs_uncached(fs_root, path);
+			}
+		}
+		else
+		{
+			lru_remove(child);
+			lru_add(child);
+		}
+		d = child;
+		p += len;
+	}
+	/* The root itself isn't cached */
+	if(d == &root_dentry)
+	{
+		release_spinlock(&dcache_spl);
+		return open_vfs_uncached(fs_root, path);
+	}
+	if(d->flags & DENTRY_NEGATIVE)
+	{
+		release_spinlock(&dcache_spl);
+		return errno = ENOENT, NULL;
+	}
+	if(d->node)
+	{
+		vfsnode_t *node = d->node;
+		get_vfs(node);
+		release_spinlock(&dcache_spl);
+		return node;
+	}
+	/* Never seen this one, ask the filesystem. Pin the entry so it can't be freed meanwhile. */
+	d->refcount++;
+	release_spinlock(&dcache_spl);
+	vfsnode_t *node = open_vfs_uncached(fs_root, path);
+	int err = errno;
+	acquire_spinlock(&dcache_spl);
+	d->refcount--;
+	if(d->flags & DENTRY_DEAD)
+	{
+		/* Invalidated or purged while we were out, so what we found can't be cached */
+		if(!d->refcount)
+		{
+			free(d->name);
+			free(d);
+		}
+	}
+	else if(!node)
+	{
+		if(err == ENOENT)
+			d->flags |= DENTRY_NEGATIVE;
+	}
+	else if(d->node)
+	{
+		/* Someone else got here first */
+		put_vfs(node);
+		node = d->node;
+		get_vfs(node);
+	}
+	else
+	{
+		/* The reference we got from the filesystem is the cache's, the caller gets another one */
+		d->node = node;
+		get_vfs(node);
+	}
+	dcache_shrink();
+	release_spinlock(&dcache_spl);
+	return node ? node : (errno = err, NULL);
+}
+vfsnode_t *dcache_open(const char *path)
+{
+	char *norm = dcache_normalize(path);
+	if(!norm)
+		return open_vfs_uncached(fs_root, path);
+	vfsnode_t *node = __dcache_open(norm);
+	int err = errno;
+	free(norm);
+	return node ? node : (errno = err, NULL);
+}
+/* Forgets everything. Entries that are pinned are left to whoever pinned them. */
+static void dcache_purge_locked()
+{
+	for(unsigned int i = 0; i < DCACHE_HASH_SIZE; i++)
+	{
+		dentry_t *d = dcache_hash_table[i];
+		while(d)
+		{
+			dentry_t *next = d->hash_next;
+			d_put_node(d);
+			if(d->refcount)
+			{
+				d->flags |= DENTRY_DEAD;
+				d->parent = NULL;
+				d->hash_next = d->lru_prev = d->lru_next = NULL;
+			}
+			else
+			{
+				free(d->name);
+				free(d);
+			}
+			d = next;
+		}
+		dcache_hash_table[i] = NULL;
+	}
+	lru_head = lru_tail = NULL;
+	nr_dentries = 0;
+	root_dentry.nr_children = 0;
+}
+/* Forgets what's cached for path, after it was created or removed */
+void dcache_invalidate(const char *path)
+{
+	char *norm = dcache_normalize(path);
+	acquire_spinlock(&dcache_spl);
+	if(!norm)
+	{
+		/* Can't tell which entry it was, so forget them all */
+		dcache_purge_locked();
+		release_spinlock(&dcache_spl);
+		return;
+	}
+	dentry_t *d = &root_dentry;
+	const char *p = norm;
+	while(*p && d)
+	{
+		while(*p == '/')
+			p++;
+		if(!*p)
+			break;
+		size_t len = 0;
+		while(p[len] && p[len] != '/')
+			len++;
+		d = d_lookup(d, p, len);
+		p += len;
+	}
+	free(norm);
+	if(!d || d == &root_dentry)
+	{
+		release_spinlock(&dcache_spl);
+		return;
+	}
+	/* Whatever was cached below it is stale too, that's rare enough to just start over */
+	if(d->nr_children)
+		dcache_purge_locked();
+	else
+		d_free(d);
+	release_spinlock(&dcache_spl);
+}
+/* Forgets everything, used when the namespace changes underneath the cache */
+void dcache_purge()
+{
+	acquire_spinlock(&dcache_spl);
+	dcache_purge_locked();
+	release_spinlock(&dcache_spl);
+}
@@ -10,8 +10,14 @@
  *----------------------------------------------------------------------*/
 #include <kernel/elf.h>
 #include <kernel/vmm.h>
+#include <kernel/vfs.h>
+#include <kernel/filemap.h>
+#include <kernel/paging.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 _Bool elf_parse_program_headers(void *file)
 {
 	Elf64_Ehdr *hdr = (Elf64_Ehdr *) file;
@@ -65,6 +71,118 @@ void *elf_load(void *file)
 	elf_parse_program_headers(file);
 	return (void *) ((Elf64_Ehdr *) file)->e_entry;
 }
+/* Segments can be mapped from the page cache as long as each one starts at the same offset
+ * into a page in the file and in memory, and no two of them share a page
+*/
+static _Bool elf_can_map(Elf64_Phdr *phdrs, Elf64_Half phnum, vfsnode_t *node)
+{
+	uintptr_t prev_end = 0;
+	if(!node->cache && !node->sb)
+		return false;
+	for(Elf64_Half i = 0; i < phnum; i++)
+	{
+		if(phdrs[i].p_type != PT_LOAD)
+			continue;
+		if(phdrs[i].p_offset % PAGE_SIZE != phdrs[i].p_vaddr % PAGE_SIZE)
+			return false;
+		if(phdrs[i].p_filesz > phdrs[i].p_memsz || phdrs[i].p_offset + phdrs[i].p_filesz > node->size)
+			return false;
+		uintptr_t start = phdrs[i].p_vaddr & ~(PAGE_SIZE - 1);
+		if(start < prev_end)
+			return false;
+		prev_end = (phdrs[i].p_vaddr + phdrs[i].p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	}
+	return true;
+}
+static int elf_map_segment(Elf64_Phdr *phdr, vfsnode_t *node)
+{
+	uintptr_t base = phdr->p_vaddr & ~(PAGE_SIZE - 1);
+	uintptr_t file_end = phdr->p_vaddr + phdr->p_filesz;
+	uintptr_t mem_end = phdr->p_vaddr + phdr->p_memsz;
+	int prot = VMM_USER;
+	if(phdr->p_flags & PF_W)
+		prot |= VMM_WRITE;
+	if(!(phdr->p_flags & PF_X))
+		prot |= VMM_NOEXEC;
+	size_t file_pages = phdr->p_filesz ? (file_end - base + PAGE_SIZE - 1) / PAGE_SIZE : 0;
+	if(file_pages)
+	{
+		if(filemap_mmap((void*) base, file_pages, prot, MAP_PRIVATE, node, phdr->p_offset & ~(PAGE_SIZE - 1)) != (void*) base)
+			return -1;
+		/* The rest of the last file page is the start of the bss, which needs to be zero and not
+		 * whatever comes next in the file, so that page gets its own copy right away
+		*/
+		if(mem_end > file_end && file_end % PAGE_SIZE)
+		{
+			uintptr_t last = file_end & ~(PAGE_SIZE - 1);
+			if(filemap_fault(vmm_is_mapped((void*) last), last, 0, 1) < 0)
+				return -1;
+			char *page = (char*)((uintptr_t) virtual2phys((void*) last) + PHYS_BASE);
+			memset(page + file_end % PAGE_SIZE, 0, PAGE_SIZE - file_end % PAGE_SIZE);
+		}
+	}
+	/* Whatever is left is plain zero-filled memory */
+	uintptr_t anon = base + file_pages * PAGE_SIZE;
+	if(mem_end > anon)
+	{
+		size_t pages = (mem_end - anon + PAGE_SIZE - 1) / PAGE_SIZE;
+		if(!vmm_reserve_address((void*) anon, pages, VMM_TYPE_REGULAR, prot))
+			return -1;
+	}
+	return 0;
+}
+/* Reads the whole executable in and copies the segments out of it */
+static void *elf_load_copy(vfsnode_t *node)
+{
+	char *buffer = malloc(node->size);
+	if(!buffer)
+		return errno = ENOMEM, NULL;
+	if(read_vfs(0, node->size, buffer, node) != node->size)
+	{
+		free(buffer);
+		return errno = EAGAIN, NULL;
+	}
+	void *entry = elf_load(buffer);
+	free(buffer);
+	return entry;
+}
+/* Loads an executable into the current address space. Only the headers get read, the segments are
+ * mapped from the page cache and faulted in as they're used, with writable ones copied on write.
+*/
+void *elf_load_file(vfsnode_t *node)
+{
+	Elf64_Ehdr hdr;
+	if(read_vfs(0, sizeof(Elf64_Ehdr), &hdr, node) != sizeof(Elf64_Ehdr))
+		return errno = EINVAL, NULL;
+	if(!elf_is_valid(&hdr))
+		return errno = EINVAL, NULL;
+	size_t phdrs_size = hdr.e_phnum * sizeof(Elf64_Phdr);
+	Elf64_Phdr *phdrs = malloc(phdrs_size);
+	if(!phdrs)
+		return errno = ENOMEM, NULL;
+	if(read_vfs(hdr.e_phoff, phdrs_size, phdrs, node) != phdrs_size)
+	{
+		free(phdrs);
+		return errno = EINVAL, NULL;
+	}
+	if(!elf_can_map(phdrs, hdr.e_phnum, node))
+	{
+		free(phdrs);
+		return elf_load_copy(node);
+	}
+	for(Elf64_Half i = 0; i < hdr.e_phnum; i++)
+	{
+		if(phdrs[i].p_type != PT_LOAD)
+			continue;
+		if(elf_map_segment(&phdrs[i], node) < 0)
+		{
+			free(phdrs);
+			return errno = ENOMEM, NULL;
+		}
+	}
+	free(phdrs);
+	return (void *) hdr.e_entry;
+}
 static Elf64_Shdr *strtab = NULL;
 static Elf64_Shdr *symtab = NULL;
 static Elf64_Shdr *shstrtab = NULL;
@@ -17,27 +17,14 @@
 #include <kernel/arp.h>
 #include <kernel/network.h>
 #include <kernel/vmm.h>
+#include <kernel/spinlock.h>
+#include <kernel/softirq.h>
 
 #include <drivers/pci.h>
 #include <drivers/e1000.h>
 
 char mac_address[6] = {0};
 char router_mac[6] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
-int ethernet_init()
-{
-	PCIDevice *dev = get_pcidev_from_classes(CLASS_NETWORK_CONTROLLER, 0, 0);
-	if(!dev)
-		return 1;
-	
-	if(dev->vendorID == INTEL_VEND && dev->deviceID == E1000_DEV)
-		return e1000_init();
-	if(dev->vendorID == INTEL_VEND && dev->deviceID == E1000_I217)
-		return e1000_init();
-	if(dev->vendorID == INTEL_VEND && dev->deviceID == E1000_82577LM)
-		return e1000_init();
-	else
-		return 1;
-}
 uint8_t *packet = NULL;
 uint16_t packet_len = 0;
 void eth_set_packet_buf(uint8_t *buf)
@@ -53,6 +40,59 @@ void eth_set_dev_send_packet(device_send_packet p)
 {
 	dev_send_packet = p;
 }
+/* Receive queues waiting for the NET_RX softirq */
+static eth_poll_t *eth_polls = NULL;
+static spinlock_t eth_polls_spl;
+static void eth_poll_queue(eth_poll_t *p)
+{
+	unsigned long flags = spin_lock_irqsave(&eth_polls_spl);
+	p->next = eth_polls;
+	eth_polls = p;
+	spin_unlock_irqrestore(&eth_polls_spl, flags);
+}
+static int eth_rx_softirq(unsigned int budget)
+{
+	unsigned long flags = spin_lock_irqsave(&eth_polls_spl);
+	eth_poll_t *list = eth_polls;
+	eth_polls = NULL;
+	spin_unlock_irqrestore(&eth_polls_spl, flags);
+	int more = 0;
+	while(list)
+	{
+		eth_poll_t *p = list;
+		list = p->next;
+		/* Cleared first, so an interrupt that comes in while it's polled schedules it again */
+		p->scheduled = 0;
+		__sync_synchronize();
+		if(p->poll(p, budget) && !__sync_lock_test_and_set(&p->scheduled, 1))
+		{
+			eth_poll_queue(p);
+			more = 1;
+		}
+	}
+	return more;
+}
+void eth_poll_init(eth_poll_t *p, eth_poll_fn poll)
+{
+	p->poll = poll;
+	p->scheduled = 0;
+	p->next = NULL;
+	softirq_register(SOFTIRQ_NET_RX, eth_rx_softirq);
+}
+/* Callable from interrupt handlers */
+void eth_poll_schedule(eth_poll_t *p)
+{
+	if(__sync_lock_test_and_set(&p->scheduled, 1))
+		return;
+	eth_poll_queue(p);
+	softirq_raise(SOFTIRQ_NET_RX);
+}
+/* NIC drivers bind through the PCI driver registry, returns 1 if none of them took a device */
+int ethernet_init()
+{
+	pci_wait_for_probes();
+	return dev_send_packet ? 0 : 1;
+}
 int eth_send_packet(char *destmac, char *payload, uint16_t len, uint16_t protocol)
 {
 	ethernet_header_t *hdr = malloc(len + sizeof(ethernet_header_t));
@@ -33,13 +33,11 @@ int exec(const char *path, char **argv, char **envp)
 		printf("%s: %s\n", path, strerror(errno));
 		return errno = ENOENT;
 	}
-	char *buffer = malloc(in->size);
-	if (!buffer)
-		return errno = ENOMEM;
-	size_t read = read_vfs(0, in->size, buffer, in);
-	if (read != in->size)
-		return errno = EAGAIN;
-	void *entry = elf_load((void *) buffer);
+	/* The segments are mapped from the page cache, the mappings keep their own references */
+	void *entry = elf_load_file(in);
+	put_vfs(in);
+	if(!entry)
+		return errno;
 	char **env = copy_env_vars(envp);
 	int argc;
 	char **args = copy_argv(argv, path, &argc);
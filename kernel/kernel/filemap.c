@@ -0,0 +1,116 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: filemap.c
+ *
+ * Description: File backed memory mappings. Nothing is mapped up front, pages
+ * get faulted in straight from the page cache. Shared mappings map the cached
+ * page itself, private ones share it read-only until they're written to, at
+ * which point they get a copy of their own.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <kernel/filemap.h>
+#include <kernel/pagecache.h>
+#include <kernel/paging.h>
+#include <kernel/pmm.h>
+
+void *filemap_mmap(void *addr, size_t pages, int prot, int flags, vfsnode_t *node, size_t offset)
+{
+	if(offset % PAGE_SIZE)
+		return errno = EINVAL, NULL;
+	if(node->type & VFS_TYPE_DIR)
+		return errno = ENODEV, NULL;
+	/* Whatever gets mapped comes out of the page cache, so files that aren't cached get a cache now */
+	if(!node->cache)
+	{
+		if(!node->sb)
+			return errno = ENODEV, NULL;
+		node->cache = pagecache_get(node->sb, node->inode);
+		if(!node->cache)
+			return errno = ENOMEM, NULL;
+	}
+	if(addr)
+		addr = vmm_reserve_address(addr, pages, VMM_TYPE_REGULAR, prot);
+	else
+		addr = vmm_allocate_virt_address(0, pages, VMM_TYPE_REGULAR, prot);
+	if(!addr)
+		return errno = ENOMEM, NULL;
+	vmm_entry_t *area = vmm_is_mapped(addr);
+	get_vfs(node);
+	area->file = node;
+	area->offset = offset;
+	area->mapflags = flags & (MAP_SHARED | MAP_PRIVATE);
+	return addr;
+}
+/* Gives a private mapping its own copy of src at page */
+static int filemap_cow(vmm_entry_t *area, uintptr_t page, const void *src)
+{
+	void *phys = pmalloc(1);
+	if(!phys)
+		return errno = ENOMEM, -1;
+	memcpy((void*)((uintptr_t) phys + PHYS_BASE), src, PAGE_SIZE);
+	paging_map_phys_to_virt(page, (uintptr_t) phys, area->rwx);
+	asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+	return 0;
+}
+/* Handles a fault on a file mapping, the caller already checked it against the area's protection.
+ * Returns -1 if the address lies past the end of the file, or the page couldn't be read.
+*/
+int filemap_fault(vmm_entry_t *area, uintptr_t addr, int present, int write)
+{
+	vfsnode_t *node = area->file;
+	uintptr_t page = addr & ~(PAGE_SIZE - 1);
+	size_t offset = area->offset + (page - area->base);
+	int private = area->mapflags & MAP_PRIVATE;
+	/* A write to a page that was mapped read-only, which for private mappings means it's still the cache's */
+	if(present && private)
+	{
+		uintptr_t frame = (uintptr_t) virtual2phys((void*) page);
+		if(filemap_cow(area, page, (const void*) page) < 0)
+			return -1;
+		pagecache_unmap_frame(frame);
+		return 0;
+	}
+	cached_page_t *p = pagecache_get_page(node->cache, offset / PAGE_SIZE, node);
+	if(!p)
+		return -1;
+	if(write && private)
+	{
+		int ret = filemap_cow(area, page, p->page);
+		pagecache_put_page(p);
+		return ret;
+	}
+	int prot = area->rwx | VMM_NOFREE;
+	/* A write to a shared page that's mapped read-only already has its mapping counted */
+	if(!present && pagecache_map_page(p) < 0)
+	{
+		pagecache_put_page(p);
+		return -1;
+	}
+	/* Shared pages start out read-only, so we find out when they get dirtied */
+	if(write)
+		pagecache_map_write(p);
+	else
+		prot &= ~VMM_WRITE;
+	paging_map_phys_to_virt(page, (uintptr_t) p->page - PHYS_BASE, prot);
+	asm volatile("invlpg (%0)" :: "r"(page) : "memory");
+	pagecache_put_page(p);
+	return 0;
+}
@@ -1,10 +1,13 @@
 #include <kernel/heap.h>
 #include <stdio.h>
 #include <kernel/vmm.h>
+#include <kernel/spinlock.h>
 size_t bucket0, bucket1, bucket2, bucket3, bucket4;
 bucket_t *buckets[5] = {0};
 volatile _Bool dbg_flag = 0;
-void *heap_malloc(size_t size)
+/* Threads and interrupt handlers all allocate from here */
+static spinlock_t heap_spl;
+static void *__heap_malloc(size_t size)
 {
 	_Bool merge_existing = 0;
 	if(dbg_flag)
@@ -80,7 +83,7 @@ void *heap_malloc(size_t size)
 	/*if(!bucket->closest_free_block) Extend();*/
 	return &block->data;
 }
-void heap_free(void *address)
+static void __heap_free(void *address)
 {
 	block_t *block = (block_t*)((char *)(address) - sizeof(block_t));
 	size_t block_size = block->size;
@@ -120,6 +123,19 @@ void heap_free(void *address)
 	}
 	block->size = 0;
 }
+void *heap_malloc(size_t size)
+{
+	unsigned long flags = spin_lock_irqsave(&heap_spl);
+	void *p = __heap_malloc(size);
+	spin_unlock_irqrestore(&heap_spl, flags);
+	return p;
+}
+void heap_free(void *address)
+{
+	unsigned long flags = spin_lock_irqsave(&heap_spl);
+	__heap_free(address);
+	spin_unlock_irqrestore(&heap_spl, flags);
+}
 void heap_init(void *address, size_t bucket0s, size_t bucket1s, size_t bucket2s, size_t bucket3s, size_t bucket4s) 
 {
 	bucket0 = bucket0s;
@@ -0,0 +1,136 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: icache.c
+ *
+ * Description: Inode cache. Filesystems register the vfsnodes they create here,
+ * keyed by (filesystem, inode number), so every open of a file shares the same
+ * refcounted node. Nodes that drop to zero references are kept on an LRU list
+ * for a while, in case the file gets opened again.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kernel/icache.h>
+#include <kernel/spinlock.h>
+
+static vfsnode_t *icache_hash_table[ICACHE_HASH_SIZE];
+/* Only holds nodes with no references, most recently released at the head */
+static vfsnode_t *lru_head = NULL;
+static vfsnode_t *lru_tail = NULL;
+static size_t nr_unused = 0;
+static spinlock_t icache_spl;
+
+static inline unsigned int icache_hash(void *sb, ino_t ino)
+{
+	return (unsigned int)(((uintptr_t) sb >> 4) ^ ino) % ICACHE_HASH_SIZE;
+}
+static void lru_remove(vfsnode_t *node)
+{
+	if(node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else if(lru_head == node)
+		lru_head = node->lru_next;
+	if(node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else if(lru_tail == node)
+		lru_tail = node->lru_prev;
+	node->lru_prev = node->lru_next = NULL;
+	nr_unused--;
+}
+static void lru_add(vfsnode_t *node)
+{
+	node->lru_prev = NULL;
+	node->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = node;
+	lru_head = node;
+	if(!lru_tail)
+		lru_tail = node;
+	nr_unused++;
+}
+static vfsnode_t *icache_lookup(void *sb, ino_t ino)
+{
+	for(vfsnode_t *node = icache_hash_table[icache_hash(sb, ino)]; node; node = node->icache_next)
+	{
+		if(node->sb == sb && node->inode == ino)
+			return node;
+	}
+	return NULL;
+}
+static void __icache_grab(vfsnode_t *node)
+{
+	if(node->refcount++ == 0)
+		lru_remove(node);
+}
+static void icache_evict(vfsnode_t *node)
+{
+	vfsnode_t **p = &icache_hash_table[icache_hash(node->sb, node->inode)];
+	while(*p && *p != node)
+		p = &(*p)->icache_next;
+	if(*p)
+		*p = node->icache_next;
+	lru_remove(node);
+	free(node->name);
+	free(node);
+}
+/* Returns a referenced node for the inode, or NULL if it isn't cached */
+vfsnode_t *icache_get(void *sb, ino_t ino)
+{
+	acquire_spinlock(&icache_spl);
+	vfsnode_t *node = icache_lookup(sb, ino);
+	if(node)
+		__icache_grab(node);
+	release_spinlock(&icache_spl);
+	return node;
+}
+/* Adds a freshly created node, which comes with one reference for the caller.
+ * If someone else added the same inode in the meantime, that node is referenced
+ * and returned instead, and the caller should get rid of its own.
+*/
+vfsnode_t *icache_add(vfsnode_t *node)
+{
+	acquire_spinlock(&icache_spl);
+	vfsnode_t *other = icache_lookup(node->sb, node->inode);
+	if(other)
+	{
+		__icache_grab(other);
+		release_spinlock(&icache_spl);
+		return other;
+	}
+	unsigned int hash = icache_hash(node->sb, node->inode);
+	node->icache_next = icache_hash_table[hash];
+	icache_hash_table[hash] = node;
+	release_spinlock(&icache_spl);
+	return node;
+}
+void icache_grab(vfsnode_t *node)
+{
+	acquire_spinlock(&icache_spl);
+	__icache_grab(node);
+	release_spinlock(&icache_spl);
+}
+void icache_put(vfsnode_t *node)
+{
+	acquire_spinlock(&icache_spl);
+	if(--node->refcount == 0)
+	{
+		lru_add(node);
+		while(nr_unused > ICACHE_MAX_UNUSED)
+			icache_evict(lru_tail);
+	}
+	release_spinlock(&icache_spl);
+}
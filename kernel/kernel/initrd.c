@@ -10,32 +10,211 @@
  *----------------------------------------------------------------------*/
 #include <kernel/initrd.h>
 #include <kernel/vfs.h>
+#include <kernel/icache.h>
+#include <kernel/lz4.h>
+#include <kernel/vmm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <kernel/panic.h>
 #include <assert.h>
-tar_header_t *headers[100] = { 0 };
+#include <dirent.h>
+/* Entry 0 is the top of the archive, everything else is numbered as it gets indexed */
+static tar_entry_t tar_root;
+static tar_entry_t **tar_inodes = NULL;
+static size_t nr_inodes = 0;
+static size_t max_inodes = 0;
+static tar_entry_t **tar_hash = NULL;
+static size_t tar_hash_size = 0;
 size_t n_files = 0;
-size_t tar_parse(uintptr_t address)
+
+static inline size_t tar_hash_name(tar_entry_t *parent, const char *name, size_t len)
+{
+	/* FNV-1a over the name, mixed with the parent */
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return (hash ^ (uint32_t)((uintptr_t) parent >> 4)) & (tar_hash_size - 1);
+}
+static tar_entry_t *tar_lookup(tar_entry_t *dir, const char *name, size_t len)
+{
+	if(len == 1 && name[0] == '.')
+		return dir;
+	if(len == 2 && name[0] == '.' && name[1] == '.')
+		return dir->parent ? dir->parent : dir;
+	for(tar_entry_t *e = tar_hash[tar_hash_name(dir, name, len)]; e; e = e->hash_next)
+	{
+		if(e->parent == dir && e->namelen == len && !memcmp(e->name, name, len))
+			return e;
+	}
+	return NULL;
+}
+static tar_entry_t *tar_add_entry(tar_entry_t *dir, const char *name, size_t len)
+{
+	if(nr_inodes == max_inodes)
+	{
+		size_t new_max = max_inodes ? max_inodes * 2 : 64;
+		tar_entry_t **inodes = realloc(tar_inodes, new_max * sizeof(tar_entry_t*));
+		if(!inodes)
+			return NULL;
+		tar_inodes = inodes;
+		max_inodes = new_max;
+	}
+	tar_entry_t *e = malloc(sizeof(tar_entry_t));
+	if(!e)
+		return NULL;
+	memset(e, 0, sizeof(tar_entry_t));
+	e->ino = nr_inodes;
+	e->name = name;
+	e->namelen = len;
+	e->parent = dir;
+	e->next_sibling = dir->children;
+	dir->children = e;
+	size_t hash = tar_hash_name(dir, name, len);
+	e->hash_next = tar_hash[hash];
+	tar_hash[hash] = e;
+	tar_inodes[nr_inodes++] = e;
+	return e;
+}
+/* Walks path down from dir. With create set, missing components get added as implied directories. */
+static tar_entry_t *tar_walk(tar_entry_t *dir, const char *path, size_t pathlen, int create)
 {
 	size_t i = 0;
+	while(i < pathlen)
+	{
+		while(i < pathlen && path[i] == '/')
+			i++;
+		if(i == pathlen)
+			break;
+		size_t len = 0;
+		while(i + len < pathlen && path[i + len] && path[i + len] != '/')
+			len++;
+		if(!len)
+			break;
+		tar_entry_t *e = tar_lookup(dir, path + i, len);
+		if(!e && create)
+			e = tar_add_entry(dir, path + i, len);
+		if(!e)
+			return NULL;
+		dir = e;
+		i += len;
+	}
+	return dir;
+}
+static inline size_t tar_filename_len(tar_header_t *header)
+{
+	size_t len = 0;
+	while(len < sizeof(header->filename) && header->filename[len])
+		len++;
+	return len;
+}
+/* The index is built as the archive becomes available, which for compressed initrds
+ * means one block at a time while it's being decompressed
+*/
+static uintptr_t tar_next = 0;
+static int tar_end_seen = 0;
 
-	for (i = 0;; i++) {
-		tar_header_t *header = (tar_header_t *) address;
-		if (header->filename[0] == '\0')
+static void tar_rehash()
+{
+	size_t new_size = tar_hash_size * 2;
+	tar_entry_t **hash = malloc(new_size * sizeof(tar_entry_t*));
+	if(!hash)
+		return;
+	memset(hash, 0, new_size * sizeof(tar_entry_t*));
+	free(tar_hash);
+	tar_hash = hash;
+	tar_hash_size = new_size;
+	for(size_t i = 1; i < nr_inodes; i++)
+	{
+		tar_entry_t *e = tar_inodes[i];
+		size_t h = tar_hash_name(e->parent, e->name, e->namelen);
+		e->hash_next = tar_hash[h];
+		tar_hash[h] = e;
+	}
+}
+static void tar_index_init(uintptr_t address)
+{
+	tar_hash_size = 256;
+	tar_hash = malloc(tar_hash_size * sizeof(tar_entry_t*));
+	max_inodes = 64;
+	tar_inodes = malloc(max_inodes * sizeof(tar_entry_t*));
+	if(!tar_hash || !tar_inodes)
+		panic("tarfs: Could not allocate the path index\n");
+	memset(tar_hash, 0, tar_hash_size * sizeof(tar_entry_t*));
+	memset(&tar_root, 0, sizeof(tar_entry_t));
+	tar_inodes[0] = &tar_root;
+	nr_inodes = 1;
+	n_files = 0;
+	tar_next = address;
+	tar_end_seen = 0;
+}
+/* Indexes every header that lies entirely below end. Returns 1 once the end of the archive was seen. */
+static int tar_index(uintptr_t end)
+{
+	while(!tar_end_seen && tar_next + 512 <= end)
+	{
+		tar_header_t *header = (tar_header_t *) tar_next;
+		if(header->filename[0] == '\0')
+		{
+			tar_end_seen = 1;
 			break;
+		}
+		tar_entry_t *e = tar_walk(&tar_root, header->filename, tar_filename_len(header), 1);
+		if(!e)
+			panic("tarfs: Could not allocate the path index\n");
+		/* Later entries for the same path replace earlier ones, like tar(1) does on extraction */
+		if(e != &tar_root)
+			e->header = header;
+		/* Keep the chains short, directories implied by the paths end up in the hash too */
+		if(nr_inodes > tar_hash_size)
+			tar_rehash();
 		size_t size = tar_get_size(header->size);
-		headers[i] = header;
-		address += ((size / 512) + 1) * 512;
-		if (size % 512)
-			address += 512;
+		tar_next += ((size + 511) / 512 + 1) * 512;
+		n_files++;
+	}
+	return tar_end_seen;
+}
+/* Indexes an uncompressed archive, returns the number of headers in it */
+size_t tar_parse(uintptr_t address, size_t size)
+{
+	tar_index_init(address);
+	tar_index(address + size);
+	return n_files;
+}
+static inline int tar_is_dir(tar_entry_t *e)
+{
+	return !e->header || e->header->typeflag == TAR_TYPE_DIR;
+}
+static unsigned char tar_dtype(tar_entry_t *e)
+{
+	if(tar_is_dir(e))
+		return DT_DIR;
+	switch(e->header->typeflag)
+	{
+		case TAR_TYPE_FILE:
+			return DT_REG;
+		case TAR_TYPE_CHAR_SPECIAL:
+			return DT_CHR;
+		case TAR_TYPE_BLOCK_SPECIAL:
+			return DT_BLK;
+		case TAR_TYPE_HARD_LNK:
+		case TAR_TYPE_SYMLNK:
+			return DT_LNK;
+		default:
+			return DT_UNKNOWN;
 	}
-	return i;
 }
 size_t tar_read(size_t offset, size_t sizeOfReading, void *buffer, vfsnode_t *this)
 {
-	char *tempBuffer = (char *) headers[this->inode] + 512 + offset;
+	tar_entry_t *e = tar_inodes[this->inode];
+	if(!e->header || offset >= this->size)
+		return 0;
+	if(sizeOfReading > this->size - offset)
+		sizeOfReading = this->size - offset;
+	char *tempBuffer = (char *) e->header + 512 + offset;
 	memcpy(buffer, tempBuffer, sizeOfReading);
 	return sizeOfReading;
 }
@@ -56,100 +235,104 @@ void tar_close(vfsnode_t *this)
 }
 unsigned int tar_getdents(unsigned int count, struct dirent* dirp, vfsnode_t* this)
 {
-	char *full_path = this->name;
-	tar_header_t **iterator = headers;
 	unsigned int found = 0;
-	for(size_t i = 0; i < n_files; i++)
+	for(tar_entry_t *e = tar_inodes[this->inode]->children; e && found < count; e = e->next_sibling)
 	{
-		if(!strcmp(iterator[i]->filename, full_path))
-			continue;
-		if(!memcmp(iterator[i]->filename, full_path, strlen(full_path)))
-		{
-			/* The memcmp above was just a primitive search, this is the real parsing
-			   Basically the code after this parses the string using strtok(3) and tries to figure out if it's
-			   a direct child of the directory, etc.
-			   Note that some parts of the code are specific to tarfs(that's why it's under 'initrd.c')
-			*/
-			char *l = iterator[i]->filename, *temp = NULL, *before = l;
-			l = strtok(l, "/");
-			while((temp = strtok(NULL, "/")))
-			{
-				if(*temp == '/' && temp[1] == '\0')
-					break;
-				before = l;
-				l = temp;	
-			}
-			/* If the token before the last / isn't equal to the last bytes of the full_path, it's not a 
-			   direct child 
-			*/
-			char *last_tok = full_path+(strlen(full_path) - (size_t) (l+1 - before));
-			if(memcmp(before, last_tok, (size_t) (l+1 - before)))
-				continue;
-			l++;
-			dirp[found].d_ino = i;
-			strcpy(dirp[found].d_name, l);
-			if(iterator[i]->typeflag == TAR_TYPE_DIR)
-				dirp[found].d_type = DT_DIR;
-			else if(iterator[i]->typeflag == TAR_TYPE_FILE)
-				dirp[found].d_type = DT_REG;
-			else if(iterator[i]->typeflag == TAR_TYPE_CHAR_SPECIAL)
-				dirp[found].d_type = DT_CHR;
-			else if(iterator[i]->typeflag == TAR_TYPE_BLOCK_SPECIAL)
-				dirp[found].d_type = DT_BLK;
-			else if(iterator[i]->typeflag == TAR_TYPE_HARD_LNK || iterator[i]->typeflag == TAR_TYPE_SYMLNK)
-				dirp[found].d_type = DT_LNK;
-			else
-				dirp[found].d_type = DT_UNKNOWN;
-			found++;
-			count--;
-		}
-		if(count == 0)
-			break;
+		dirp[found].d_ino = e->ino;
+		memcpy(dirp[found].d_name, e->name, e->namelen);
+		dirp[found].d_name[e->namelen] = '\0';
+		dirp[found].d_type = tar_dtype(e);
+		found++;
 	}
 	return found;
 }
 vfsnode_t *tar_open(vfsnode_t *this, const char *name)
 {
-	char *full_path = malloc(strlen(this->name) + strlen(name) + 1);
-
-	assert(full_path);
-
-	strcpy(full_path, this->name);
-	strcpy(full_path + strlen(this->name), name);
-	full_path[strlen(this->name) + strlen(name)] = 0;
-
-	tar_header_t **iterator = headers;
-	for(size_t i = 0; i < n_files; i++)
+	tar_entry_t *e = tar_walk(tar_inodes[this->inode], name, strlen(name), 0);
+	if(!e)
+		return errno = ENOENT, NULL;
+	/* Every open of the same file shares one node */
+	vfsnode_t *node = icache_get(&tar_root, e->ino);
+	if(node)
+		return node;
+	node = malloc(sizeof(vfsnode_t));
+	if(!node)
+		return errno = ENOMEM, NULL;
+	memset(node, 0, sizeof(*node));
+	/* The path inside the archive, the same way the root is named */
+	node->name = malloc(strlen(this->name) + strlen(name) + 1);
+	if(!node->name)
+	{
+		free(node);
+		return errno = ENOMEM, NULL;
+	}
+	strcpy(node->name, this->name);
+	strcat(node->name, name);
+	node->open = tar_open;
+	node->close = tar_close;
+	node->read = tar_read;
+	node->write = tar_write;
+	node->getdents = tar_getdents;
+	node->inode = e->ino;
+	node->size = e->header ? tar_get_size(e->header->size) : 0;
+	node->type = tar_is_dir(e) ? VFS_TYPE_DIR : VFS_TYPE_FILE;
+	node->sb = &tar_root;
+	node->refcount = 1;
+	vfsnode_t *cached = icache_add(node);
+	if(cached != node)
 	{
-		if(!strcmp(full_path, iterator[i]->filename))
+		free(node->name);
+		free(node);
+	}
+	return cached;
+}
+/* Decompresses an LZ4 initrd into freshly mapped memory, one block at a time, indexing the
+ * archive as it goes. Memory is only mapped as the output grows, since the frame might not
+ * say how large it's going to get.
+*/
+static void *initrd_decompress(void *initrd, size_t size)
+{
+	lz4_frame_t frame;
+	if(lz4_frame_init(&frame, initrd, size) < 0)
+		panic("initrd: Unsupported LZ4 frame\n");
+	size_t max = frame.content_size ? frame.content_size : INITRD_MAX_SIZE;
+	size_t pages = (max + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint8_t *out = vmm_allocate_virt_address(VM_KERNEL, pages, VMM_TYPE_REGULAR, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
+	if(!out)
+		panic("initrd: Could not allocate memory for the initrd\n");
+	size_t mapped = 0;
+	size_t pos = 0;
+	tar_index_init((uintptr_t) out);
+	for(;;)
+	{
+		size_t wanted = (pos + frame.block_max + PAGE_SIZE - 1) / PAGE_SIZE;
+		if(wanted > pages)
+			wanted = pages;
+		if(wanted > mapped)
 		{
-			// This part of the code seems broken, needs to be looked at
-			vfsnode_t *node = malloc(sizeof(vfsnode_t));
-			assert(node);
-			memset(node, 0, sizeof(*node));
-			node->name = malloc(strlen(this->mountpoint) + strlen(full_path));
-			strcpy(node->name, this->mountpoint);
-			strcpy(node->name + strlen(this->mountpoint), full_path);
-			node->open = tar_open;
-			node->close = tar_close;
-			node->read = tar_read;
-			node->write = tar_write;
-			node->getdents = tar_getdents;
-			node->inode = i;
-			node->size = tar_get_size(iterator[i]->size);
-			if(iterator[i]->typeflag == TAR_TYPE_DIR)
-				node->type = VFS_TYPE_DIR;
-			else
-				node->type = VFS_TYPE_FILE;
-			return node;
+			if(!vmm_map_range(out + mapped * PAGE_SIZE, wanted - mapped, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL))
+				panic("initrd: Could not allocate memory for the initrd\n");
+			mapped = wanted;
 		}
+		ssize_t produced = lz4_frame_next(&frame, out, pos, mapped * PAGE_SIZE);
+		if(produced < 0)
+			panic("initrd: The initrd is corrupted\n");
+		if(!produced)
+			break;
+		pos += produced;
+		/* Index whatever headers this block completed */
+		tar_index((uintptr_t) out + pos);
 	}
-	return errno = ENOENT, NULL;
+	printf("Decompressed the initrd to %u bytes\n", pos);
+	return out;
 }
-void init_initrd(void *initrd)
+void init_initrd(void *initrd, size_t size)
 {
 	printf("Found an Initrd at %p\n", initrd);
-	n_files = tar_parse((uintptr_t) initrd);
+	if(lz4_is_frame(initrd, size))
+		initrd_decompress(initrd, size);
+	else
+		tar_parse((uintptr_t) initrd, size);
 	printf("Found %d files in the Initrd\n", n_files);
 	vfsnode_t *node = malloc(sizeof(vfsnode_t));
 	assert(node);
@@ -161,7 +344,9 @@ void init_initrd(void *initrd)
 	node->write = tar_write;
 	node->getdents = tar_getdents;
 	node->type = VFS_TYPE_DIR;
-	node->inode = 0;
+	/* The root of the filesystem is the sysroot/ directory in the archive */
+	tar_entry_t *root = tar_walk(&tar_root, node->name, strlen(node->name), 0);
+	node->inode = root ? root->ino : 0;
 	mount_fs(node, "/");
 	printf("Mounted initrd on /\n");
 }
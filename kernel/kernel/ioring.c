@@ -0,0 +1,243 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: ioring.c
+ *
+ * Description: Shared memory submission/completion rings, which let a process
+ * queue a batch of I/O system calls and have them all executed on a single
+ * kernel entry
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/uio.h>
+
+#include <kernel/ioring.h>
+#include <kernel/process.h>
+#include <kernel/vmm.h>
+#include <kernel/vfs.h>
+#include <kernel/usercopy.h>
+
+ssize_t sys_read(int fd, const void *buf, size_t count);
+ssize_t sys_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t sys_write(int fd, const void *buf, size_t count);
+ssize_t sys_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t sys_readv(int fd, const struct iovec *vec, int veccnt);
+ssize_t sys_preadv(int fd, const struct iovec *vec, int veccnt, off_t offset);
+int sys_open(const char *filename, int flags);
+int sys_close(int fd);
+int sys_getdents(int fd, struct dirent *dirp, unsigned int count);
+
+static inline uint32_t ioring_round_entries(unsigned int entries)
+{
+	uint32_t n = 1;
+	while(n < entries)
+		n <<= 1;
+	return n;
+}
+struct io_ring *ioring_create(unsigned int entries)
+{
+	if(entries == 0 || entries > IORING_MAX_ENTRIES)
+		return errno = EINVAL, NULL;
+	uint32_t sq_entries = ioring_round_entries(entries);
+	/* Leave room for completions of two full submission batches, like io_uring does */
+	uint32_t cq_entries = sq_entries * 2;
+	size_t size = sizeof(struct io_ring);
+	size = (size + 63) & ~63;
+	size_t sq_off = size;
+	size += sq_entries * sizeof(struct io_sqe);
+	size_t cq_off = size;
+	size += cq_entries * sizeof(struct io_cqe);
+	size_t pages = size / PAGE_SIZE;
+	if(size % PAGE_SIZE)
+		pages++;
+	ioring_t *ring = malloc(sizeof(ioring_t));
+	if(!ring)
+		return errno = ENOMEM, NULL;
+	struct io_ring *shared = vmm_allocate_virt_address(0, pages, VMM_TYPE_REGULAR, VMM_WRITE | VMM_NOEXEC | VMM_USER);
+	if(!shared)
+	{
+		free(ring);
+		return errno = ENOMEM, NULL;
+	}
+	/* vmm_map_range() zeroes the pages, so the indices all start at 0 */
+	if(!vmm_map_range(shared, pages, VMM_WRITE | VMM_NOEXEC | VMM_USER))
+	{
+		vmm_unmap_range(shared, pages);
+		vmm_destroy_mappings(shared, pages);
+		free(ring);
+		return errno = ENOMEM, NULL;
+	}
+	memset(ring, 0, sizeof(ioring_t));
+	ring->sq_entries = sq_entries;
+	ring->sq_mask = sq_entries - 1;
+	ring->cq_entries = cq_entries;
+	ring->cq_mask = cq_entries - 1;
+	ring->sq_off = sq_off;
+	ring->cq_off = cq_off;
+	/* Userspace gets a copy of the geometry, whatever it does to it only hurts itself */
+	shared->sq_entries = sq_entries;
+	shared->sq_mask = sq_entries - 1;
+	shared->cq_entries = cq_entries;
+	shared->cq_mask = cq_entries - 1;
+	shared->sq_off = sq_off;
+	shared->cq_off = cq_off;
+	ring->shared = shared;
+	ring->pages = pages;
+	ring->next = current_process->rings;
+	current_process->rings = ring;
+	return shared;
+}
+ioring_t *ioring_lookup(struct io_ring *shared)
+{
+	for(ioring_t *r = current_process->rings; r; r = r->next)
+	{
+		if(r->shared == shared)
+			return r;
+	}
+	return errno = EINVAL, NULL;
+}
+/* Tears down every ring of the current process, on exit and exec */
+void ioring_destroy_all(void)
+{
+	ioring_t *r = current_process->rings;
+	current_process->rings = NULL;
+	while(r)
+	{
+		ioring_t *next = r->next;
+		vmm_unmap_range(r->shared, r->pages);
+		vmm_destroy_mappings(r->shared, r->pages);
+		free(r);
+		r = next;
+	}
+}
+static int64_t ioring_do_op(struct io_sqe *sqe)
+{
+	int64_t ret;
+	errno = 0;
+	switch(sqe->opcode)
+	{
+		case IORING_OP_NOP:
+			return 0;
+		case IORING_OP_READ:
+		{
+			if(sqe->off == IORING_OFF_CURRENT)
+			{
+				ret = sys_read(sqe->fd, (void*) sqe->addr, sqe->len);
+				break;
+			}
+			ret = sys_pread(sqe->fd, (void*) sqe->addr, sqe->len, sqe->off);
+			break;
+		}
+		case IORING_OP_WRITE:
+		{
+			if(sqe->off == IORING_OFF_CURRENT)
+			{
+				ret = sys_write(sqe->fd, (void*) sqe->addr, sqe->len);
+				break;
+			}
+			ret = sys_pwrite(sqe->fd, (void*) sqe->addr, sqe->len, sqe->off);
+			break;
+		}
+		case IORING_OP_READV:
+		{
+			if(sqe->off == IORING_OFF_CURRENT)
+				ret = sys_readv(sqe->fd, (const struct iovec*) sqe->addr, sqe->len);
+			else
+				ret = sys_preadv(sqe->fd, (const struct iovec*) sqe->addr, sqe->len, sqe->off);
+			break;
+		}
+		case IORING_OP_OPEN:
+			ret = sys_open((const char*) sqe->addr, sqe->op_flags);
+			break;
+		case IORING_OP_CLOSE:
+			ret = sys_close(sqe->fd);
+			break;
+		case IORING_OP_GETDENTS:
+			ret = sys_getdents(sqe->fd, (struct dirent*) sqe->addr, sqe->len);
+			break;
+		default:
+			return -EINVAL;
+	}
+	if(ret < 0 && errno)
+		return -errno;
+	return ret;
+}
+/* The ring lives in user memory and can be unmapped under our feet, so every access to
+ * it goes through the fixup-backed copy helpers.
+*/
+static void ioring_post_cqe(ioring_t *ring, uint64_t user_data, int64_t res)
+{
+	struct io_ring *shared = ring->shared;
+	uint32_t tail = ring->cq_tail;
+	uint32_t head;
+	/* cq_head belongs to userspace, so it's only used to decide whether there's room */
+	if(copy_from_user(&head, (void*) &shared->cq_head, sizeof(uint32_t)) < 0)
+		return;
+	if(tail - head >= ring->cq_entries)
+	{
+		/* The process isn't reaping its completions, drop this one */
+		uint32_t overflow;
+		if(copy_from_user(&overflow, (void*) &shared->cq_overflow, sizeof(uint32_t)) < 0)
+			return;
+		overflow++;
+		copy_to_user((void*) &shared->cq_overflow, &overflow, sizeof(uint32_t));
+		return;
+	}
+	struct io_cqe cqe;
+	cqe.user_data = user_data;
+	cqe.res = res;
+	cqe.flags = 0;
+	cqe.reserved = 0;
+	struct io_cqe *slot = (struct io_cqe*)((char*) shared + ring->cq_off) + (tail & ring->cq_mask);
+	if(copy_to_user(slot, &cqe, sizeof(struct io_cqe)) < 0)
+		return;
+	/* Make sure the entry is visible before the new tail */
+	asm volatile("" ::: "memory");
+	ring->cq_tail = tail + 1;
+	copy_to_user((void*) &shared->cq_tail, &ring->cq_tail, sizeof(uint32_t));
+}
+/* Drains up to to_submit entries from the submission ring, executing each one and
+ * posting its result to the completion ring. Returns the number of entries consumed.
+*/
+int ioring_submit(ioring_t *ring, unsigned int to_submit)
+{
+	struct io_ring *shared = ring->shared;
+	struct io_sqe *sqes = (struct io_sqe*)((char*) shared + ring->sq_off);
+	uint32_t head = ring->sq_head;
+	uint32_t tail;
+	if(copy_from_user(&tail, (void*) &shared->sq_tail, sizeof(uint32_t)) < 0)
+		return -1;
+	/* A tail more than a ring's worth ahead is garbage, don't run stale slots over and over */
+	if(tail - head > ring->sq_entries)
+		return errno = EINVAL, -1;
+	int submitted = 0;
+	while(to_submit-- && head != tail)
+	{
+		asm volatile("" ::: "memory");
+		/* Take a private copy, the process may scribble over the slot once sq_head moves */
+		struct io_sqe sqe;
+		if(copy_from_user(&sqe, &sqes[head & ring->sq_mask], sizeof(struct io_sqe)) < 0)
+			return submitted ? submitted : -1;
+		head++;
+		ring->sq_head = head;
+		copy_to_user((void*) &shared->sq_head, &head, sizeof(uint32_t));
+		ioring_post_cqe(ring, sqe.user_data, ioring_do_op(&sqe));
+		submitted++;
+	}
+	return submitted;
+}
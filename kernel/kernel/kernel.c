@@ -33,9 +33,12 @@
 #include <kernel/tty.h>
 #include <kernel/panic.h>
 #include <kernel/cpu.h>
+#include <kernel/fpu.h>
 #include <kernel/pit.h>
 #include <kernel/vfs.h>
+#include <kernel/pagecache.h>
 #include <kernel/initrd.h>
+#include <kernel/tmpfs.h>
 #include <kernel/task_switching.h>
 #include <kernel/elf.h>
 #include <kernel/tss.h>
@@ -44,12 +47,17 @@
 #include <kernel/power_management.h>
 #include <kernel/udp.h>
 #include <kernel/dhcp.h>
+#include <kernel/softirq.h>
+#include <kernel/irq.h>
 
 #include <drivers/ps2.h>
 #include <drivers/ata.h>
+#include <drivers/ahci.h>
+#include <drivers/virtio_blk.h>
 #include <drivers/ext2.h>
 #include <drivers/rtc.h>
 #include <drivers/e1000.h>
+#include <drivers/igb.h>
 #include <drivers/softwarefb.h>
 #include <drivers/pci.h>
 /* Function: init_arch()
@@ -161,6 +169,8 @@ void kernel_main()
 	/* Identify the CPU it's running on (bootstrap CPU) */
 	cpu_identify();
 	cpu_init_interrupts();
+	/* Enable xsave and arm the lazy FPU switching */
+	fpu_init();
 
 	void *mem = (void*)0xFFFFFFF890000000;
 	vmm_map_range(mem, 1024, VMM_GLOBAL | VMM_WRITE | VMM_NOEXEC);
@@ -176,6 +186,8 @@ void kernel_main()
 	}
 	// Initialize ACPI
 	acpi_initialize();
+	/* Take the legacy IRQs off the PIC, now that the MADT can be read */
+	irq_init_ioapic();
 	pit_init(1000);
 	extern void init_keyboard();
 	init_keyboard();
@@ -187,7 +199,12 @@ void kernel_main()
 	initrd_addr = (void*)((char*) initrd_addr + PHYS_BASE);
 	asm volatile("movq $0, pdlower; movq $0, pdlower + 8;invlpg 0x0;invlpg 0x200000");
 	/* Initialize the initrd */
-	init_initrd(initrd_addr);
+	init_initrd(initrd_addr, initrd_tag->mod_end - initrd_tag->mod_start);
+	/* Scratch space for programs, kept entirely in memory */
+	if(!tmpfs_mount("/tmp"))
+		printf("tmpfs: couldn't mount /tmp\n");
+	if(!tmpfs_mount("/dev/shm"))
+		printf("tmpfs: couldn't mount /dev/shm\n");
 	
 	/* Initalize multitasking */
 	sched_create_thread(kernel_multitasking, 1,
@@ -214,11 +231,22 @@ void kernel_multitasking(void *arg)
 	printf(ANSI_COLOR_GREEN "Spartix kernel %s branch %s build %d for the %s architecture\n" ANSI_COLOR_RESET,
 	     KERNEL_VERSION, KERNEL_BRANCH, &__BUILD_NUMBER, KERNEL_ARCH);
 	printf("This kernel was built on %s, %d as integer\n", __DATE__, &__BUILD_DATE);
+	/* Interrupt handlers defer their work to softirqd from here on */
+	softirq_init();
 	/* Initialize PCI */
 	pci_init();
 	/*extern void init_elf_symbols(struct multiboot_tag_elf_sections *);
 	init_elf_symbols(&secs);*/
+	/* Drivers bind to what they match, probing on the PCI workers */
 	initialize_ata();
+	initialize_ahci();
+	initialize_virtio_blk();
+	e1000_init();
+	igb_init();
+	pci_wait_for_probes();
+	/* Start writing dirty file data back, and reading it ahead, in the background */
+	pagecache_start_flusher();
+	pagecache_start_readahead();
 
 	char *args[] = {"/etc/fstab", NULL};
 	char *envp[] = {"PATH=/bin:/usr/bin:/usr/lib", NULL};
@@ -0,0 +1,182 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: lz4.c
+ *
+ * Description: LZ4 frame decompressor. Frames are decoded a block at a time into
+ * a single contiguous buffer, so blocks that refer back into earlier ones need
+ * no extra history buffer. Checksums aren't verified.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kernel/lz4.h>
+
+/* frame descriptor flags */
+#define LZ4_FLG_VERSION(flg)	((flg) >> 6)
+#define LZ4_FLG_BLOCK_CHECKSUM	(1 << 4)
+#define LZ4_FLG_CONTENT_SIZE	(1 << 3)
+#define LZ4_FLG_DICT_ID		(1 << 0)
+#define LZ4_BLOCK_UNCOMPRESSED	0x80000000
+#define LZ4_MIN_MATCH		4
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+static inline uint64_t lz4_read64(const uint8_t *p)
+{
+	return lz4_read32(p) | ((uint64_t) lz4_read32(p + 4) << 32);
+}
+int lz4_is_frame(const void *src, size_t len)
+{
+	return len >= 4 && lz4_read32(src) == LZ4_FRAME_MAGIC;
+}
+/* Parses the frame header, returns -1 if it isn't a frame we can decode */
+int lz4_frame_init(lz4_frame_t *frame, const void *src, size_t len)
+{
+	const uint8_t *p = src;
+	if(len < 7 || !lz4_is_frame(src, len))
+		return errno = EINVAL, -1;
+	uint8_t flg = p[4];
+	uint8_t bd = p[5];
+	/* Frames that need a dictionary aren't something an initrd would use */
+	if(LZ4_FLG_VERSION(flg) != 1 || flg & LZ4_FLG_DICT_ID)
+		return errno = EINVAL, -1;
+	unsigned int block_size_id = (bd >> 4) & 7;
+	if(block_size_id < 4)
+		return errno = EINVAL, -1;
+	size_t header_len = 7;
+	memset(frame, 0, sizeof(lz4_frame_t));
+	if(flg & LZ4_FLG_CONTENT_SIZE)
+	{
+		header_len += 8;
+		if(len < header_len)
+			return errno = EINVAL, -1;
+		frame->content_size = lz4_read64(p + 6);
+	}
+	frame->block_max = (size_t) 1 << (8 + 2 * block_size_id);
+	frame->block_checksum = flg & LZ4_FLG_BLOCK_CHECKSUM ? 1 : 0;
+	frame->src = p + header_len;
+	frame->src_end = p + len;
+	return 0;
+}
+/* Decodes one compressed block into out + pos. Matches may reach back anywhere into out,
+ * which is what lets linked blocks work. Returns the number of bytes produced.
+*/
+ssize_t lz4_decompress_block(const void *src, size_t srclen, void *out, size_t pos, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + srclen;
+	uint8_t *ostart = out;
+	uint8_t *op = ostart + pos;
+	uint8_t *oend = ostart + cap;
+	while(ip < iend)
+	{
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if(lit == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if(ip == iend)
+					return errno = EINVAL, -1;
+				b = *ip++;
+				lit += b;
+			} while(b == 255);
+		}
+		if((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+			return errno = EINVAL, -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		/* The last sequence is only literals */
+		if(ip == iend)
+			break;
+		if(iend - ip < 2)
+			return errno = EINVAL, -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(!offset || offset > (size_t)(op - ostart))
+			return errno = EINVAL, -1;
+		size_t len = token & 15;
+		if(len == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if(ip == iend)
+					return errno = EINVAL, -1;
+				b = *ip++;
+				len += b;
+			} while(b == 255);
+		}
+		len += LZ4_MIN_MATCH;
+		if((size_t)(oend - op) < len)
+			return errno = EINVAL, -1;
+		const uint8_t *match = op - offset;
+		if(offset >= len)
+		{
+			memcpy(op, match, len);
+			op += len;
+		}
+		else
+		{
+			/* The match overlaps what it's producing, so it has to go byte by byte */
+			while(len--)
+				*op++ = *match++;
+		}
+	}
+	return op - (ostart + pos);
+}
+/* Decodes the next block of the frame into out + pos, cap - pos needs to be at least block_max.
+ * Returns the number of bytes produced, 0 at the end of the frame, or -1 if it's corrupted.
+*/
+ssize_t lz4_frame_next(lz4_frame_t *frame, void *out, size_t pos, size_t cap)
+{
+	if(frame->done)
+		return 0;
+	if(frame->src_end - frame->src < 4)
+		return errno = EINVAL, -1;
+	uint32_t block = lz4_read32(frame->src);
+	frame->src += 4;
+	/* The end mark, we don't check the content checksum that might follow it */
+	if(!block)
+	{
+		frame->done = 1;
+		return 0;
+	}
+	size_t size = block & ~LZ4_BLOCK_UNCOMPRESSED;
+	if(size > frame->block_max || (size_t)(frame->src_end - frame->src) < size)
+		return errno = EINVAL, -1;
+	ssize_t produced;
+	if(block & LZ4_BLOCK_UNCOMPRESSED)
+	{
+		if(cap - pos < size)
+			return errno = EINVAL, -1;
+		memcpy((uint8_t*) out + pos, frame->src, size);
+		produced = size;
+	}
+	else
+		produced = lz4_decompress_block(frame->src, size, out, pos, cap);
+	frame->src += size;
+	if(frame->block_checksum)
+		frame->src += 4;
+	if(frame->src > frame->src_end)
+		return errno = EINVAL, -1;
+	return produced;
+}
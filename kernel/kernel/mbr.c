@@ -11,34 +11,52 @@
 #include <kernel/vmm.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <mbr.h>
-#include <drivers/ata.h>
 #include <partitions.h>
+#include <kernel/block.h>
+/* Looks for partitions on every disk, and hands the first one a filesystem driver knows to it */
 void read_partitions()
 {
 	/* Map the buffer */
 	unsigned int *mbrbuf = vmm_allocate_virt_address(VM_KERNEL, 1 /*64K*/, VMM_TYPE_REGULAR, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
 	vmm_map_range(mbrbuf, 1, VMM_WRITE | VMM_NOEXEC | VMM_GLOBAL);
-	uint64_t phys = (uint64_t)virtual2phys(mbrbuf);
-	uint32_t arg = (uint32_t)phys;
 	asm volatile("sti");
-	/* Read the mbr from the disk */
-	ata_read_sectors(0, 0, arg, 512, 0);
-	mbrpart_t *part = (mbrpart_t*)((char *)mbrbuf + 0x1BE);
-	printf("Partitions: \n");
-	/* Cycle through all the partitions */
-	for(int i = 0; i < 4; i++)
+	for(block_dev_t *disk = blk_first_disk(); disk; disk = blk_next_disk(disk))
 	{
-		if(part->part_type != 0)
+		/* Read the mbr from the disk */
+		if(blk_read(disk, 0, mbrbuf, 512) < 0)
+			continue;
+		mbrpart_t *part = (mbrpart_t*)((char *)mbrbuf + 0x1BE);
+		printf("Partitions on %s: \n", disk->name);
+		/* Cycle through all the partitions */
+		for(int i = 0; i < 4; i++, part++)
 		{
+			if(part->part_type == 0)
+				continue;
 			printf("Partition %d: %d\nNumber of sectors: %d\nPartition type: 0%X\n" , i, part->sector, part->size_sector, part->part_type);
-		 	fs_handler handler = lookup_handler_from_partition_code(part->part_type);
-			 if(!handler) continue;
-		 	handler(part->sector, 0, 0);
-			 break;
+			fs_handler handler = lookup_handler_from_partition_code(part->part_type);
+			if(!handler)
+				continue;
+			/* Partitions are named after their disk, ata0p1 and so on */
+			size_t len = strlen(disk->name);
+			char *name = malloc(len + 3);
+			if(!name)
+				continue;
+			strcpy(name, disk->name);
+			name[len] = 'p';
+			name[len + 1] = '1' + i;
+			name[len + 2] = '\0';
+			block_dev_t *dev = blk_get_dev(name);
+			if(!dev)
+				dev = blk_add_partition(disk, name, part->sector, part->size_sector);
+			free(name);
+			if(!dev)
+				continue;
+			handler(dev);
+			vmm_destroy_mappings(mbrbuf, 1);
+			return;
 		}
-		part++;
-
 	}
-
+	vmm_destroy_mappings(mbrbuf, 1);
 }
@@ -95,7 +95,9 @@ int load_module(const char *path, const char *name)
 	if (!buffer)
 		return errno = ENOMEM;
 	size_t read = read_vfs(0, file->size, buffer, file);
-	if (read != file->size)
+	size_t expected = file->size;
+	put_vfs(file);
+	if (read != expected)
 		return errno = EAGAIN;
 	void *fini;
 	void *entry = elf_load_kernel_module(buffer, &fini);
@@ -0,0 +1,832 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: pagecache.c
+ *
+ * Description: Caches file contents in whole pages, indexed per file by a radix
+ * tree. Misses read the pages the caller wants with a single vectored read, and the
+ * rest of the readahead window, which grows while the file is being read
+ * sequentially, is read in the background by the readahead thread.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <kernel/pagecache.h>
+#include <kernel/vfs.h>
+#include <kernel/pmm.h>
+#include <kernel/paging.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+#include <kernel/pit.h>
+#include <kernel/sleep.h>
+#include <kernel/task_switching.h>
+#include <kernel/panic.h>
+#include <kernel/wait_queue.h>
+#include <kernel/usercopy.h>
+
+static page_cache_t *cache_hash[PAGECACHE_HASH_SIZE];
+static cached_page_t *lru_head = NULL;
+static cached_page_t *lru_tail = NULL;
+static size_t nr_cached_pages = 0;
+static size_t nr_dirty_pages = 0;
+static spinlock_t pagecache_spl;
+/* Woken whenever pages finish being read in */
+static wait_queue_t pagecache_wq;
+/* Mapped pages by page frame number, so page table teardown can find what it unmapped */
+static radix_tree_t frame_tree;
+
+/* Readahead that's been set up but not issued yet, the readahead thread works through it */
+typedef struct pagecache_ra
+{
+	page_cache_t *cache;
+	vfsnode_t *node; /* Referenced until the read is done */
+	cached_page_t *pages[READAHEAD_MAX_PAGES];
+	size_t nr;
+	struct pagecache_ra *next;
+} pagecache_ra_t;
+static pagecache_ra_t *ra_head = NULL;
+static pagecache_ra_t *ra_tail = NULL;
+static wait_queue_t ra_wq;
+static int ra_running = 0;
+
+unsigned int pagecache_dirty_background_ratio = 10;
+unsigned int pagecache_dirty_ratio = 20;
+unsigned int pagecache_dirty_expire_ms = 3000;
+unsigned int pagecache_flush_interval_ms = 500;
+
+static inline unsigned int pagecache_hash(void *sb, ino_t ino)
+{
+	return (unsigned int)(((uintptr_t) sb >> 4) ^ ino) % PAGECACHE_HASH_SIZE;
+}
+page_cache_t *pagecache_get(void *sb, ino_t ino)
+{
+	acquire_spinlock(&pagecache_spl);
+	unsigned int hash = pagecache_hash(sb, ino);
+	for(page_cache_t *c = cache_hash[hash]; c; c = c->next)
+	{
+		if(c->sb == sb && c->ino == ino)
+		{
+			release_spinlock(&pagecache_spl);
+			return c;
+		}
+	}
+	page_cache_t *cache = malloc(sizeof(page_cache_t));
+	if(!cache)
+	{
+		release_spinlock(&pagecache_spl);
+		return errno = ENOMEM, NULL;
+	}
+	memset(cache, 0, sizeof(page_cache_t));
+	cache->sb = sb;
+	cache->ino = ino;
+	cache->ra_pages = READAHEAD_MIN_PAGES;
+	cache->next = cache_hash[hash];
+	cache_hash[hash] = cache;
+	release_spinlock(&pagecache_spl);
+	return cache;
+}
+static void lru_remove(cached_page_t *p)
+{
+	if(p->lru_prev)
+		p->lru_prev->lru_next = p->lru_next;
+	else
+		lru_head = p->lru_next;
+	if(p->lru_next)
+		p->lru_next->lru_prev = p->lru_prev;
+	else
+		lru_tail = p->lru_prev;
+	p->lru_prev = p->lru_next = NULL;
+}
+static void lru_add(cached_page_t *p)
+{
+	p->lru_prev = NULL;
+	p->lru_next = lru_head;
+	if(lru_head)
+		lru_head->lru_prev = p;
+	lru_head = p;
+	if(!lru_tail)
+		lru_tail = p;
+}
+/* Takes the page out of the cache. Pages someone still has pinned or mapped are only
+ * detached, whoever drops the last pin or mapping frees them.
+*/
+static void pagecache_free_page(cached_page_t *p)
+{
+	if(!(p->flags & PAGE_DETACHED))
+	{
+		radix_tree_delete(&p->cache->pages, p->index);
+		p->cache->nr_pages--;
+		if(p->flags & PAGE_DIRTY)
+		{
+			p->cache->nr_dirty--;
+			nr_dirty_pages--;
+		}
+		lru_remove(p);
+		nr_cached_pages--;
+		p->flags |= PAGE_DETACHED;
+	}
+	if(p->refcount || p->mapcount)
+		return;
+	pfree(1, (void*)((uintptr_t) p->page - PHYS_BASE));
+	free(p);
+}
+static void pagecache_put_locked(cached_page_t *p)
+{
+	if(--p->refcount == 0 && p->flags & PAGE_DETACHED)
+		pagecache_free_page(p);
+}
+void pagecache_put_page(cached_page_t *p)
+{
+	acquire_spinlock(&pagecache_spl);
+	pagecache_put_locked(p);
+	release_spinlock(&pagecache_spl);
+}
+/* Evicts clean pages, dirty ones stay around until the flusher gets to them.
+ * Mapped pages stay too, until the last mapping goes away.
+*/
+static void pagecache_shrink()
+{
+	cached_page_t *p = lru_tail;
+	while(nr_cached_pages > PAGECACHE_MAX_PAGES && p)
+	{
+		cached_page_t *prev = p->lru_prev;
+		if(!(p->flags & (PAGE_DIRTY | PAGE_WRITEBACK | PAGE_MAPPED | PAGE_LOCKED)) && !p->refcount &&
+		!(p->cache->flags & PAGECACHE_RAM))
+			pagecache_free_page(p);
+		p = prev;
+	}
+}
+static cached_page_t *pagecache_alloc_page(page_cache_t *cache, unsigned long index)
+{
+	cached_page_t *p = malloc(sizeof(cached_page_t));
+	if(!p)
+		return NULL;
+	memset(p, 0, sizeof(cached_page_t));
+	void *phys = pmalloc(1);
+	if(!phys)
+	{
+		free(p);
+		return NULL;
+	}
+	p->page = (void*)((uintptr_t) phys + PHYS_BASE);
+	p->index = index;
+	p->cache = cache;
+	return p;
+}
+static int pagecache_insert_page(cached_page_t *p)
+{
+	if(radix_tree_insert(&p->cache->pages, p->index, p) < 0)
+	{
+		pfree(1, (void*)((uintptr_t) p->page - PHYS_BASE));
+		free(p);
+		return -1;
+	}
+	p->cache->nr_pages++;
+	nr_cached_pages++;
+	lru_add(p);
+	return 0;
+}
+/* Puts locked pages for [index, index + nr) in the cache, so anyone else looking for them
+ * waits for our read instead of issuing their own. Stops short at a page that's already cached.
+ * Each page comes with a pin for the fill. Returns how many pages were set up.
+*/
+static size_t pagecache_fill_prepare(page_cache_t *cache, unsigned long index, size_t nr, cached_page_t **pages)
+{
+	size_t i;
+	for(i = 0; i < nr; i++)
+	{
+		if(radix_tree_lookup(&cache->pages, index + i))
+			break;
+		cached_page_t *p = pagecache_alloc_page(cache, index + i);
+		if(!p)
+			break;
+		p->flags = PAGE_LOCKED;
+		p->refcount = 1;
+		if(pagecache_insert_page(p) < 0)
+			break;
+		pages[i] = p;
+	}
+	return i;
+}
+/* Reads the pages set up by pagecache_fill_prepare() with one vectored read. Called with the
+ * lock held, which is dropped around the I/O. Pages the read didn't reach get dropped.
+*/
+static int pagecache_fill(page_cache_t *cache, vfsnode_t *node, cached_page_t **pages, size_t nr)
+{
+	struct iovec vec[READAHEAD_MAX_PAGES];
+	size_t offset = pages[0]->index * PAGE_SIZE;
+	for(size_t i = 0; i < nr; i++)
+	{
+		vec[i].iov_base = pages[i]->page;
+		vec[i].iov_len = PAGE_SIZE;
+	}
+	release_spinlock(&pagecache_spl);
+	/* Go straight to the filesystem, read_vfs() would just land us back here */
+	size_t read;
+	if(node->readv)
+		read = node->readv(offset, vec, nr, node);
+	else
+		read = readv_vfs_fallback(offset, vec, nr, node);
+	if(read == (size_t) -1)
+		read = 0;
+	acquire_spinlock(&pagecache_spl);
+	/* Not every filesystem stops at the end of the file */
+	if(offset + read > node->size)
+		read = node->size > offset ? node->size - offset : 0;
+	for(size_t i = 0; i < nr; i++)
+	{
+		cached_page_t *p = pages[i];
+		size_t start = i * PAGE_SIZE;
+		p->flags &= ~PAGE_LOCKED;
+		if(start >= read)
+			pagecache_free_page(p);
+		else
+		{
+			p->size = read - start > PAGE_SIZE ? PAGE_SIZE : read - start;
+			/* Whatever is past the end of the file shows up in mappings, so it has to be zero */
+			memset((char*) p->page + p->size, 0, PAGE_SIZE - p->size);
+		}
+		pagecache_put_locked(p);
+	}
+	pagecache_shrink();
+	wake_up(&pagecache_wq);
+	return read ? 0 : (errno = EIO, -1);
+}
+/* Decides how much to read on a miss at index. Sequential access doubles the window,
+ * anything else shrinks it back to the minimum.
+*/
+static size_t pagecache_readahead(page_cache_t *cache, vfsnode_t *node, unsigned long index, size_t wanted)
+{
+	if(index == cache->ra_next)
+	{
+		cache->ra_pages *= 2;
+		if(cache->ra_pages > READAHEAD_MAX_PAGES)
+			cache->ra_pages = READAHEAD_MAX_PAGES;
+	}
+	else
+		cache->ra_pages = READAHEAD_MIN_PAGES;
+	size_t nr = cache->ra_pages > wanted ? cache->ra_pages : wanted;
+	if(nr > READAHEAD_MAX_PAGES)
+		nr = READAHEAD_MAX_PAGES;
+	/* Don't read past the end of the file */
+	size_t file_pages = (node->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(index + nr > file_pages)
+		nr = file_pages - index;
+	return nr;
+}
+/* Sets up locked pages for [index, index + nr) and hands them to the readahead thread.
+ * Only the pages get set up here, the read itself happens later without the lock.
+ * Called with the lock held.
+*/
+static void pagecache_queue_readahead(page_cache_t *cache, vfsnode_t *node, unsigned long index, size_t nr)
+{
+	size_t file_pages = (node->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(!ra_running || index >= file_pages)
+		return;
+	if(index + nr > file_pages)
+		nr = file_pages - index;
+	pagecache_ra_t *ra = malloc(sizeof(pagecache_ra_t));
+	if(!ra)
+		return;
+	ra->nr = pagecache_fill_prepare(cache, index, nr, ra->pages);
+	if(!ra->nr)
+	{
+		free(ra);
+		return;
+	}
+	/* When the reader gets this far, it's time to start on the batch after this one */
+	ra->pages[0]->flags |= PAGE_READAHEAD;
+	ra->cache = cache;
+	ra->node = node;
+	get_vfs(node);
+	ra->next = NULL;
+	if(ra_tail)
+		ra_tail->next = ra;
+	else
+		ra_head = ra;
+	ra_tail = ra;
+	wake_up(&ra_wq);
+}
+/* Called on a hit on a readahead marker, the file is being read sequentially, so read further ahead */
+static void pagecache_readahead_hit(page_cache_t *cache, vfsnode_t *node, cached_page_t *p)
+{
+	p->flags &= ~PAGE_READAHEAD;
+	cache->ra_pages *= 2;
+	if(cache->ra_pages > READAHEAD_MAX_PAGES)
+		cache->ra_pages = READAHEAD_MAX_PAGES;
+	/* The next batch starts right after what's cached already */
+	unsigned long index = p->index + 1;
+	while(index < p->index + READAHEAD_MAX_PAGES && radix_tree_lookup(&cache->pages, index))
+		index++;
+	if(index == p->index + READAHEAD_MAX_PAGES)
+		return;
+	pagecache_queue_readahead(cache, node, index, cache->ra_pages);
+}
+/* Returns the page at index pinned and up to date, reading it in if needed. Called with the lock
+ * held, but it gets dropped while waiting on I/O. wanted is how many pages the caller is after.
+ * Only those are read synchronously, the rest of the readahead window goes to the readahead thread.
+*/
+static cached_page_t *pagecache_grab_page(page_cache_t *cache, vfsnode_t *node, unsigned long index, size_t wanted)
+{
+	for(;;)
+	{
+		cached_page_t *p = radix_tree_lookup(&cache->pages, index);
+		if(p)
+		{
+			p->refcount++;
+			lru_remove(p);
+			lru_add(p);
+			if(p->flags & PAGE_READAHEAD)
+				pagecache_readahead_hit(cache, node, p);
+			if(!(p->flags & PAGE_LOCKED))
+				return p;
+			/* Someone else is reading it in, the pin keeps it around while we wait */
+			release_spinlock(&pagecache_spl);
+			wait_for_event(&pagecache_wq, !(p->flags & PAGE_LOCKED));
+			acquire_spinlock(&pagecache_spl);
+			if(!(p->flags & PAGE_DETACHED))
+				return p;
+			/* The read failed, or the page was dropped in the meantime */
+			pagecache_put_locked(p);
+			if(index * PAGE_SIZE >= node->size)
+				return errno = EIO, NULL;
+			continue;
+		}
+		cached_page_t *pages[READAHEAD_MAX_PAGES];
+		size_t nr = pagecache_readahead(cache, node, index, wanted);
+		size_t sync = wanted < nr ? wanted : nr;
+		/* Without the thread there's nobody to do the rest, so read the whole window now */
+		if(!ra_running)
+			sync = nr;
+		sync = pagecache_fill_prepare(cache, index, sync, pages);
+		if(!sync)
+			return errno = ENOMEM, NULL;
+		if(nr > sync)
+			pagecache_queue_readahead(cache, node, index + sync, nr - sync);
+		p = pages[0];
+		p->refcount++;
+		if(pagecache_fill(cache, node, pages, sync) < 0 || p->flags & PAGE_DETACHED)
+		{
+			pagecache_put_locked(p);
+			return errno = EIO, NULL;
+		}
+		return p;
+	}
+}
+size_t pagecache_read(page_cache_t *cache, size_t offset, size_t len, void *buffer, vfsnode_t *node)
+{
+	if(offset >= node->size)
+		return 0;
+	if(len > node->size - offset)
+		len = node->size - offset;
+	char *buf = buffer;
+	size_t done = 0;
+	int error = EIO;
+	while(done < len)
+	{
+		unsigned long index = (offset + done) / PAGE_SIZE;
+		size_t page_off = (offset + done) % PAGE_SIZE;
+		size_t wanted = (page_off + len - done + PAGE_SIZE - 1) / PAGE_SIZE;
+		acquire_spinlock(&pagecache_spl);
+		cached_page_t *p = pagecache_grab_page(cache, node, index, wanted);
+		if(p)
+			cache->ra_next = index + 1;
+		release_spinlock(&pagecache_spl);
+		if(!p)
+		{
+			error = errno;
+			break;
+		}
+		if(page_off >= p->size)
+		{
+			pagecache_put_page(p);
+			break;
+		}
+		size_t to_copy = p->size - page_off;
+		if(to_copy > len - done)
+			to_copy = len - done;
+		/* The copy happens without the lock, buffer may be user memory, and a fault on a file
+		 * mapping comes right back into the page cache. The pin keeps the page from going away.
+		*/
+		size_t left = __copy_user(buf + done, (char*) p->page + page_off, to_copy);
+		pagecache_put_page(p);
+		done += to_copy - left;
+		if(left)
+		{
+			error = EFAULT;
+			break;
+		}
+	}
+	if(!done && len)
+		return errno = error, (size_t) -1;
+	return done;
+}
+/* Drops the cached pages that overlap [offset, offset + len), after the file was changed underneath us */
+void pagecache_invalidate(page_cache_t *cache, size_t offset, size_t len)
+{
+	if(!len || cache->flags & PAGECACHE_RAM)
+		return;
+	acquire_spinlock(&pagecache_spl);
+	unsigned long first = offset / PAGE_SIZE;
+	unsigned long last = (offset + len - 1) / PAGE_SIZE;
+	cached_page_t *pages[16];
+	unsigned int found;
+	while((found = radix_tree_gang_lookup(&cache->pages, (void**) pages, first, 16)))
+	{
+		unsigned int i;
+		for(i = 0; i < found && pages[i]->index <= last; i++)
+		{
+			first = pages[i]->index + 1;
+			/* Pages that are pinned or mapped only get detached, so the next read sees the new
+			 * contents, and existing mappings keep the old frame until they're torn down.
+			*/
+			pagecache_free_page(pages[i]);
+		}
+		if(i < found)
+			break;
+	}
+	release_spinlock(&pagecache_spl);
+}
+static void pagecache_mark_dirty(cached_page_t *p)
+{
+	/* There's nowhere to write RAM pages back to, and detached pages aren't counted anymore */
+	if(p->flags & (PAGE_DIRTY | PAGE_DETACHED) || p->cache->flags & PAGECACHE_RAM)
+		return;
+	p->flags |= PAGE_DIRTY;
+	p->dirtied_at = get_tick_count();
+	p->cache->nr_dirty++;
+	nr_dirty_pages++;
+}
+/* Returns the page at index, reading it in if needed, so it can be mapped into an address space
+ * or written out by sendfile. The page comes pinned, drop the pin with pagecache_put_page().
+*/
+cached_page_t *pagecache_get_page(page_cache_t *cache, unsigned long index, vfsnode_t *node)
+{
+	if(index * PAGE_SIZE >= node->size)
+		return errno = EINVAL, NULL;
+	acquire_spinlock(&pagecache_spl);
+	cached_page_t *p = pagecache_grab_page(cache, node, index, 1);
+	if(p)
+		cache->ra_next = index + 1;
+	release_spinlock(&pagecache_spl);
+	return p;
+}
+/* Accounts for a new page table entry pointing at the page. PAGE_MAPPED keeps it in the cache
+ * until pagecache_unmap_frame() has been called for every mapping.
+*/
+int pagecache_map_page(cached_page_t *page)
+{
+	acquire_spinlock(&pagecache_spl);
+	if(page->mapcount == 0)
+	{
+		uintptr_t pfn = ((uintptr_t) page->page - PHYS_BASE) / PAGE_SIZE;
+		if(radix_tree_insert(&frame_tree, pfn, page) < 0)
+		{
+			release_spinlock(&pagecache_spl);
+			return errno = ENOMEM, -1;
+		}
+		page->flags |= PAGE_MAPPED;
+	}
+	page->mapcount++;
+	release_spinlock(&pagecache_spl);
+	return 0;
+}
+/* Called by fork for every page cache frame it shares with the child */
+void pagecache_dup_frame(uintptr_t phys)
+{
+	acquire_spinlock(&pagecache_spl);
+	cached_page_t *p = radix_tree_lookup(&frame_tree, phys / PAGE_SIZE);
+	if(p)
+		p->mapcount++;
+	release_spinlock(&pagecache_spl);
+}
+/* Called when a page table entry pointing at a page cache frame goes away */
+void pagecache_unmap_frame(uintptr_t phys)
+{
+	acquire_spinlock(&pagecache_spl);
+	cached_page_t *p = radix_tree_lookup(&frame_tree, phys / PAGE_SIZE);
+	if(p && --p->mapcount == 0)
+	{
+		radix_tree_delete(&frame_tree, phys / PAGE_SIZE);
+		/* Stores through a shared mapping don't go through us, whatever they left has to be written */
+		if(p->flags & PAGE_MAPPED_WRITE)
+			pagecache_mark_dirty(p);
+		p->flags &= ~(PAGE_MAPPED | PAGE_MAPPED_WRITE);
+		if(p->flags & PAGE_DETACHED && !p->refcount)
+			pagecache_free_page(p);
+	}
+	release_spinlock(&pagecache_spl);
+}
+/* Called when a page gets mapped writable into a shared mapping */
+void pagecache_map_write(cached_page_t *page)
+{
+	acquire_spinlock(&pagecache_spl);
+	page->flags |= PAGE_MAPPED_WRITE;
+	pagecache_mark_dirty(page);
+	release_spinlock(&pagecache_spl);
+}
+/* Copies the data into the cache and marks the pages dirty, the flusher takes them to the disk later.
+ * The file has to be grown to fit beforehand, the write gets cut short at the end of it.
+*/
+size_t pagecache_write(page_cache_t *cache, size_t offset, size_t len, const void *buffer, vfsnode_t *node)
+{
+	if(offset >= node->size)
+		return 0;
+	if(len > node->size - offset)
+		len = node->size - offset;
+	const char *buf = buffer;
+	size_t done = 0;
+	int error = EIO;
+	while(done < len)
+	{
+		unsigned long index = (offset + done) / PAGE_SIZE;
+		size_t page_off = (offset + done) % PAGE_SIZE;
+		size_t to_copy = PAGE_SIZE - page_off;
+		if(to_copy > len - done)
+			to_copy = len - done;
+		size_t valid = node->size - index * PAGE_SIZE;
+		if(valid > PAGE_SIZE)
+			valid = PAGE_SIZE;
+		acquire_spinlock(&pagecache_spl);
+		cached_page_t *p = radix_tree_lookup(&cache->pages, index);
+		int fresh = 0;
+		if(!p && !page_off && to_copy == valid)
+		{
+			/* Every byte of it is about to be overwritten, so don't bother reading it.
+			 * It stays locked until it's filled in, so nobody sees it half-written.
+			*/
+			if(pagecache_fill_prepare(cache, index, 1, &p) != 1)
+			{
+				release_spinlock(&pagecache_spl);
+				error = ENOMEM;
+				break;
+			}
+			fresh = 1;
+		}
+		else
+			p = pagecache_grab_page(cache, node, index, 1);
+		release_spinlock(&pagecache_spl);
+		if(!p)
+		{
+			error = errno;
+			break;
+		}
+		/* Same as reads, the copy can fault, so it's done pinned and without the lock */
+		size_t left = __copy_user((char*) p->page + page_off, buf + done, to_copy);
+		acquire_spinlock(&pagecache_spl);
+		if(fresh)
+		{
+			p->flags &= ~PAGE_LOCKED;
+			p->size = valid;
+			memset((char*) p->page + valid, 0, PAGE_SIZE - valid);
+			/* A partial copy would leave zeroes where the file has data */
+			if(left)
+				pagecache_free_page(p);
+			wake_up(&pagecache_wq);
+		}
+		if(!left || !fresh)
+			pagecache_mark_dirty(p);
+		pagecache_put_locked(p);
+		release_spinlock(&pagecache_spl);
+		if(!fresh)
+			done += to_copy - left;
+		else if(!left)
+			done += to_copy;
+		if(left)
+		{
+			error = EFAULT;
+			break;
+		}
+	}
+	acquire_spinlock(&pagecache_spl);
+	int throttle = nr_dirty_pages > PAGECACHE_MAX_PAGES / 100 * pagecache_dirty_ratio;
+	release_spinlock(&pagecache_spl);
+	/* Past the dirty limit, whoever is dirtying pages pays for writing them back */
+	if(throttle)
+		pagecache_sync(cache);
+	if(!done && len)
+		return errno = error, (size_t) -1;
+	return done;
+}
+/* Brings the cached pages in line with a new file size. Pages past the new end get dropped,
+ * and the page the file ends in has the bytes past the end zeroed.
+*/
+void pagecache_resize(page_cache_t *cache, size_t old_size, size_t new_size)
+{
+	acquire_spinlock(&pagecache_spl);
+	if(new_size < old_size)
+	{
+		unsigned long first = (new_size + PAGE_SIZE - 1) / PAGE_SIZE;
+		cached_page_t *pages[16];
+		unsigned int found;
+		while((found = radix_tree_gang_lookup(&cache->pages, (void**) pages, first, 16)))
+		{
+			for(unsigned int i = 0; i < found; i++)
+			{
+				first = pages[i]->index + 1;
+				/* Mappings hang on to their frame until they're torn down, but there's nothing in it anymore */
+				if(pages[i]->flags & PAGE_MAPPED)
+				{
+					memset(pages[i]->page, 0, PAGE_SIZE);
+					pages[i]->size = 0;
+				}
+				pagecache_free_page(pages[i]);
+			}
+		}
+	}
+	/* Bytes past the end of a page's valid part are always zero, so growing only needs the size fixed */
+	size_t end = new_size < old_size ? new_size : old_size;
+	cached_page_t *p = radix_tree_lookup(&cache->pages, end / PAGE_SIZE);
+	if(p)
+	{
+		size_t valid = new_size - p->index * PAGE_SIZE;
+		if(new_size < p->index * PAGE_SIZE)
+			valid = 0;
+		if(valid > PAGE_SIZE)
+			valid = PAGE_SIZE;
+		if(valid < p->size)
+			memset((char*) p->page + valid, 0, PAGE_SIZE - valid);
+		p->size = valid;
+	}
+	release_spinlock(&pagecache_spl);
+}
+/* Frees every page of the file along with the cache, once the file is gone for good.
+ * Only for caches without writeback, the flusher counts on those sticking around.
+*/
+void pagecache_release(page_cache_t *cache)
+{
+	acquire_spinlock(&pagecache_spl);
+	cached_page_t *pages[16];
+	unsigned int found;
+	while((found = radix_tree_gang_lookup(&cache->pages, (void**) pages, 0, 16)))
+	{
+		for(unsigned int i = 0; i < found; i++)
+			pagecache_free_page(pages[i]);
+	}
+	page_cache_t **c = &cache_hash[pagecache_hash(cache->sb, cache->ino)];
+	while(*c && *c != cache)
+		c = &(*c)->next;
+	if(*c)
+		*c = cache->next;
+	release_spinlock(&pagecache_spl);
+	free(cache);
+}
+/* Writes back the dirty pages of a file, only the ones that have been dirty for longer than
+ * pagecache_dirty_expire_ms unless all is set. Adjacent dirty pages are handed to the filesystem
+ * together, so they can go out as one large sequential write.
+ * Called with the lock held, but drops it around the I/O.
+*/
+static int pagecache_flush_cache(page_cache_t *cache, int all)
+{
+	if(!cache->writeback)
+		return 0;
+	cached_page_t *pages[WRITEBACK_MAX_PAGES];
+	struct iovec vec[WRITEBACK_MAX_PAGES];
+	uint64_t now = get_tick_count();
+	unsigned long next = 0;
+	unsigned int found;
+	int ret = 0;
+	while(cache->nr_dirty && (found = radix_tree_gang_lookup(&cache->pages, (void**) pages, next, WRITEBACK_MAX_PAGES)))
+	{
+		/* Look for the first run of adjacent pages that need writing */
+		unsigned int start = found;
+		unsigned int nr = 0;
+		for(unsigned int i = 0; i < found; i++)
+		{
+			cached_page_t *p = pages[i];
+			int wanted = (p->flags & (PAGE_DIRTY | PAGE_WRITEBACK)) == PAGE_DIRTY &&
+				(all || now - p->dirtied_at >= pagecache_dirty_expire_ms);
+			if(start == found)
+			{
+				if(!wanted)
+					continue;
+				start = i;
+			}
+			else if(!wanted || p->index != pages[start]->index + nr)
+				break;
+			nr++;
+		}
+		if(!nr)
+		{
+			next = pages[found - 1]->index + 1;
+			continue;
+		}
+		cached_page_t **run = &pages[start];
+		for(unsigned int i = 0; i < nr; i++)
+		{
+			run[i]->flags &= ~PAGE_DIRTY;
+			run[i]->flags |= PAGE_WRITEBACK;
+			run[i]->refcount++;
+			cache->nr_dirty--;
+			nr_dirty_pages--;
+			vec[i].iov_base = run[i]->page;
+			vec[i].iov_len = PAGE_SIZE;
+		}
+		release_spinlock(&pagecache_spl);
+		size_t written = cache->writeback(cache, run[0]->index * PAGE_SIZE, vec, nr);
+		acquire_spinlock(&pagecache_spl);
+		for(unsigned int i = 0; i < nr; i++)
+		{
+			run[i]->flags &= ~PAGE_WRITEBACK;
+			/* Stores through a shared mapping don't go through us, so assume the page keeps changing */
+			if(written == (size_t) -1 || run[i]->flags & PAGE_MAPPED_WRITE)
+				pagecache_mark_dirty(run[i]);
+		}
+		if(written == (size_t) -1)
+			ret = -1;
+		next = run[nr - 1]->index + 1;
+		for(unsigned int i = 0; i < nr; i++)
+			pagecache_put_locked(run[i]);
+	}
+	return ret;
+}
+int pagecache_sync(page_cache_t *cache)
+{
+	acquire_spinlock(&pagecache_spl);
+	int ret = pagecache_flush_cache(cache, 1);
+	release_spinlock(&pagecache_spl);
+	return ret < 0 ? (errno = EIO, -1) : 0;
+}
+static int pagecache_flush_all(int all)
+{
+	int ret = 0;
+	acquire_spinlock(&pagecache_spl);
+	/* Caches are never freed, so the chains stay valid while the lock is dropped for I/O */
+	for(unsigned int i = 0; i < PAGECACHE_HASH_SIZE; i++)
+	{
+		for(page_cache_t *c = cache_hash[i]; c; c = c->next)
+		{
+			if(c->nr_dirty && pagecache_flush_cache(c, all) < 0)
+				ret = -1;
+		}
+	}
+	release_spinlock(&pagecache_spl);
+	return ret;
+}
+int pagecache_sync_all()
+{
+	return pagecache_flush_all(1) < 0 ? (errno = EIO, -1) : 0;
+}
+static void pagecache_flusher(void *arg)
+{
+	(void) arg;
+	for(;;)
+	{
+		ksleep(pagecache_flush_interval_ms);
+		/* Past the background threshold everything goes, otherwise just the expired pages */
+		int all = nr_dirty_pages > PAGECACHE_MAX_PAGES / 100 * pagecache_dirty_background_ratio;
+		pagecache_flush_all(all);
+		bcache_sync(NULL);
+	}
+}
+void pagecache_start_flusher()
+{
+	if(!sched_create_thread(pagecache_flusher, 1, NULL))
+		panic("pagecache: Could not create the flusher thread\n");
+}
+/* Issues the readahead queued by readers, so they only wait for the pages they asked for */
+static void pagecache_readahead_thread(void *arg)
+{
+	(void) arg;
+	for(;;)
+	{
+		wait_for_event(&ra_wq, ra_head != NULL);
+		acquire_spinlock(&pagecache_spl);
+		pagecache_ra_t *ra = ra_head;
+		if(ra)
+		{
+			ra_head = ra->next;
+			if(!ra_head)
+				ra_tail = NULL;
+			pagecache_fill(ra->cache, ra->node, ra->pages, ra->nr);
+		}
+		release_spinlock(&pagecache_spl);
+		if(ra)
+		{
+			put_vfs(ra->node);
+			free(ra);
+		}
+	}
+}
+void pagecache_start_readahead()
+{
+	if(!sched_create_thread(pagecache_readahead_thread, 1, NULL))
+		panic("pagecache: Could not create the readahead thread\n");
+	ra_running = 1;
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <kernel/spinlock.h>
 /* size of physical memory */
 static size_t pmm_memory_size = 0;
 static uint32_t pushed_blocks = 0;
@@ -37,6 +38,10 @@ size_t pmm_get_used_mem()
 {
 	return _used_mem;
 }
+size_t pmm_get_total_mem()
+{
+	return pmm_memory_size;
+}
 
 void pmm_push(uintptr_t base, size_t size, size_t kernel_space_size)
 {
@@ -77,11 +82,13 @@ void pmm_init(size_t memory_size, uintptr_t stack_space)
 	is_initialized = true;
 }
 
+static spinlock_t pmm_spl;
 void *pmalloc(size_t blocks)
 {
 	if (!is_initialized)
 		return (void *) 0xDEADDEADDEAD;
 	uintptr_t retAddr = 0;
+	unsigned long flags = spin_lock_irqsave(&pmm_spl);
 	for (unsigned int i = 0; i < pushed_blocks; i++)
 		if (stack->next[i].base != 0
 		    && stack->next[i].size != 0
@@ -93,19 +100,43 @@ void *pmalloc(size_t blocks)
 				stack->next[i].size -=
 				    PMM_BLOCK_SIZE * blocks;
 				_used_mem += PMM_BLOCK_SIZE * blocks;
-				return (void *) retAddr;
+				break;
 			}
 		}
-
+	spin_unlock_irqrestore(&pmm_spl, flags);
 	return (void *) retAddr;
 }
 
+/* Like pmalloc(), but only hands out memory that ends at or below limit, for devices
+ * that can't reach all of it */
+void *pmalloc_below(size_t blocks, uintptr_t limit)
+{
+	if (!is_initialized)
+		return NULL;
+	size_t len = PMM_BLOCK_SIZE * blocks;
+	uintptr_t ret = 0;
+	unsigned long flags = spin_lock_irqsave(&pmm_spl);
+	for (unsigned int i = 0; i < pushed_blocks; i++) {
+		uintptr_t base = stack->next[i].base;
+		if (base == 0 || stack->next[i].size < len || base + len - 1 > limit)
+			continue;
+		stack->next[i].base += len;
+		stack->next[i].size -= len;
+		_used_mem += len;
+		ret = base;
+		break;
+	}
+	spin_unlock_irqrestore(&pmm_spl, flags);
+	return (void *) ret;
+}
+
 void pfree(size_t blocks, void *p)
 {
 	if (!blocks)
 		return;
 	if (!p)
 		return;
+	unsigned long flags = spin_lock_irqsave(&pmm_spl);
 	memmove((void *) &stack->next[1], (void *) &stack->next[0],
 		sizeof(stack_entry_t) * pushed_blocks);
 	_used_mem -= PMM_BLOCK_SIZE * blocks;
@@ -113,4 +144,5 @@ void pfree(size_t blocks, void *p)
 	stack->next[0].size = PMM_BLOCK_SIZE * blocks;
 	stack->next[0].magic = 0xFDFDFDFD;
 	pushed_blocks++;
+	spin_unlock_irqrestore(&pmm_spl, flags);
 }
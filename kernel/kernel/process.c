@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <kernel/process.h>
+#include <kernel/fpu.h>
 process_t *first_process = NULL;
 process_t *current_process = NULL;
 uint64_t current_pid = 1;
@@ -26,7 +27,15 @@ process_t *process_create(const char *cmd_line, ioctx_t *ctx, process_t *parent)
 	proc->cmd_line = cmd_line;
 	// TODO: Setup proc->ctx
 	if(ctx)
+	{
 		memcpy(&proc->ctx, ctx, sizeof(ioctx_t));
+		/* The child shares the open file descriptions */
+		for(int i = 0; i < UINT8_MAX; i++)
+		{
+			if(proc->ctx.file_desc[i])
+				proc->ctx.file_desc[i]->refcount++;
+		}
+	}
 	if(parent)
 		proc->parent = parent;
 	if(!first_process)
@@ -65,6 +74,7 @@ void process_fork_thread(process_t *dest, process_t *src, int thread_index)
 {
 	dest->threads[thread_index] = malloc(sizeof(thread_t));
 	memcpy(dest->threads[thread_index], src->threads[thread_index], sizeof(thread_t));
+	fpu_fork_thread(dest->threads[thread_index], src->threads[thread_index]);
 	extern thread_t *last_thread;
 	last_thread->next = dest->threads[thread_index];
 	last_thread = last_thread->next;
@@ -0,0 +1,185 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: radix.c
+ *
+ * Description: Radix tree, used to index pages by their offset in a file. Every
+ * level consumes RADIX_TREE_MAP_SHIFT bits of the index, and the tree only grows
+ * as tall as the biggest index stored in it needs.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <kernel/radix.h>
+
+#define RADIX_TREE_MAX_HEIGHT ((sizeof(unsigned long) * 8 + RADIX_TREE_MAP_SHIFT - 1) / RADIX_TREE_MAP_SHIFT)
+
+static unsigned long radix_tree_maxindex(unsigned int height)
+{
+	if(height == 0)
+		return 0;
+	if(height * RADIX_TREE_MAP_SHIFT >= sizeof(unsigned long) * 8)
+		return ~0UL;
+	return (1UL << (height * RADIX_TREE_MAP_SHIFT)) - 1;
+}
+static radix_tree_node_t *radix_tree_node_alloc()
+{
+	radix_tree_node_t *node = malloc(sizeof(radix_tree_node_t));
+	if(!node)
+		return NULL;
+	memset(node, 0, sizeof(radix_tree_node_t));
+	return node;
+}
+void *radix_tree_lookup(radix_tree_t *tree, unsigned long index)
+{
+	if(!tree->root || index > radix_tree_maxindex(tree->height))
+		return NULL;
+	radix_tree_node_t *node = tree->root;
+	unsigned int shift = (tree->height - 1) * RADIX_TREE_MAP_SHIFT;
+	for(unsigned int h = tree->height; h > 1; h--)
+	{
+		node = node->slots[(index >> shift) & RADIX_TREE_MAP_MASK];
+		if(!node)
+			return NULL;
+		shift -= RADIX_TREE_MAP_SHIFT;
+	}
+	return node->slots[index & RADIX_TREE_MAP_MASK];
+}
+/* Adds levels on top of the root until index fits */
+static int radix_tree_extend(radix_tree_t *tree, unsigned long index)
+{
+	unsigned int height = tree->height ? tree->height : 1;
+	while(index > radix_tree_maxindex(height))
+		height++;
+	if(!tree->root)
+	{
+		tree->height = height;
+		return 0;
+	}
+	while(tree->height < height)
+	{
+		radix_tree_node_t *node = radix_tree_node_alloc();
+		if(!node)
+			return errno = ENOMEM, -1;
+		node->slots[0] = tree->root;
+		node->count = 1;
+		tree->root = node;
+		tree->height++;
+	}
+	return 0;
+}
+int radix_tree_insert(radix_tree_t *tree, unsigned long index, void *item)
+{
+	if(!item)
+		return errno = EINVAL, -1;
+	if(radix_tree_extend(tree, index) < 0)
+		return -1;
+	if(!tree->root)
+	{
+		tree->root = radix_tree_node_alloc();
+		if(!tree->root)
+			return errno = ENOMEM, -1;
+	}
+	radix_tree_node_t *node = tree->root;
+	unsigned int shift = (tree->height - 1) * RADIX_TREE_MAP_SHIFT;
+	for(unsigned int h = tree->height; h > 1; h--)
+	{
+		unsigned long slot = (index >> shift) & RADIX_TREE_MAP_MASK;
+		if(!node->slots[slot])
+		{
+			node->slots[slot] = radix_tree_node_alloc();
+			if(!node->slots[slot])
+				return errno = ENOMEM, -1;
+			node->count++;
+		}
+		node = node->slots[slot];
+		shift -= RADIX_TREE_MAP_SHIFT;
+	}
+	unsigned long slot = index & RADIX_TREE_MAP_MASK;
+	if(node->slots[slot])
+		return errno = EEXIST, -1;
+	node->slots[slot] = item;
+	node->count++;
+	return 0;
+}
+void *radix_tree_delete(radix_tree_t *tree, unsigned long index)
+{
+	if(!tree->root || index > radix_tree_maxindex(tree->height))
+		return NULL;
+	radix_tree_node_t *path[RADIX_TREE_MAX_HEIGHT];
+	unsigned long slots[RADIX_TREE_MAX_HEIGHT];
+	radix_tree_node_t *node = tree->root;
+	unsigned int shift = (tree->height - 1) * RADIX_TREE_MAP_SHIFT;
+	unsigned int depth = 0;
+	for(unsigned int h = tree->height; h > 0; h--)
+	{
+		path[depth] = node;
+		slots[depth] = (index >> shift) & RADIX_TREE_MAP_MASK;
+		if(h > 1)
+		{
+			node = node->slots[slots[depth]];
+			if(!node)
+				return NULL;
+			shift -= RADIX_TREE_MAP_SHIFT;
+		}
+		depth++;
+	}
+	void *item = path[depth-1]->slots[slots[depth-1]];
+	if(!item)
+		return NULL;
+	/* Clear the slot and free every node that became empty on the way up */
+	while(depth--)
+	{
+		path[depth]->slots[slots[depth]] = NULL;
+		if(--path[depth]->count)
+			break;
+		free(path[depth]);
+		if(depth == 0)
+		{
+			tree->root = NULL;
+			tree->height = 0;
+		}
+	}
+	return item;
+}
+static unsigned int radix_tree_gang_lookup_node(radix_tree_node_t *node, unsigned int height, unsigned long base,
+	void **results, unsigned long first, unsigned int max)
+{
+	unsigned int found = 0;
+	unsigned int shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+	for(unsigned long i = 0; i < RADIX_TREE_MAP_SIZE && found < max; i++)
+	{
+		if(!node->slots[i])
+			continue;
+		unsigned long start = base | (i << shift);
+		unsigned long last = start + radix_tree_maxindex(height - 1);
+		if(last < first)
+			continue;
+		if(height == 1)
+			results[found++] = node->slots[i];
+		else
+			found += radix_tree_gang_lookup_node(node->slots[i], height - 1, start, results + found, first, max - found);
+	}
+	return found;
+}
+/* Fills results with up to max items whose index is >= first, in ascending order of index */
+unsigned int radix_tree_gang_lookup(radix_tree_t *tree, void **results, unsigned long first, unsigned int max)
+{
+	if(!tree->root || first > radix_tree_maxindex(tree->height))
+		return 0;
+	return radix_tree_gang_lookup_node(tree->root, tree->height, 0, results, first, max);
+}
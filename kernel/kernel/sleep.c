@@ -0,0 +1,31 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#include <stdint.h>
+
+#include <kernel/sleep.h>
+#include <kernel/task_switching.h>
+
+/* The PIT ticks at 1000Hz, so a tick is a millisecond. The thread is blocked until a timer
+ * event wakes it up, other threads run meanwhile.
+*/
+void ksleep(uint32_t ms)
+{
+	uint64_t deadline = get_tick_count() + ms;
+	while(get_tick_count() < deadline)
+	{
+		if(!get_current_thread())
+		{
+			__asm__ __volatile__("hlt");
+			continue;
+		}
+		sched_block(deadline);
+	}
+}
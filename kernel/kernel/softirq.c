@@ -0,0 +1,79 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: softirq.c
+ *
+ * Description: Deferred interrupt work. Raised softirqs run in softirqd,
+ * a kernel thread like any other, so the interrupt handler that raised
+ * them can return right away. Every handler gets a budget per run; what
+ * it doesn't get to waits until softirqd has yielded to everyone else.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kernel/softirq.h>
+#include <kernel/wait_queue.h>
+#include <kernel/task_switching.h>
+
+static softirq_t softirqs[SOFTIRQ_MAX];
+static volatile uint32_t softirq_pending = 0;
+static volatile int softirqd_running = 0;
+static wait_queue_t softirq_wq;
+
+static void softirq_run(uint32_t pending)
+{
+	for(int i = 0; i < SOFTIRQ_MAX; i++)
+	{
+		if(!(pending & (1U << i)) || !softirqs[i])
+			continue;
+		if(softirqs[i](SOFTIRQ_BUDGET))
+			__sync_fetch_and_or(&softirq_pending, 1U << i);
+	}
+}
+static void softirqd(void *arg)
+{
+	/* From here on nothing runs the handlers from an interrupt, so they never overlap */
+	softirqd_running = 1;
+	for(;;)
+	{
+		wait_for_event(&softirq_wq, softirq_pending);
+		softirq_run(__sync_fetch_and_and(&softirq_pending, 0));
+		/* Whatever's left over goes to the back of the line */
+		if(softirq_pending)
+			sched_yield();
+	}
+}
+void softirq_register(int nr, softirq_t handler)
+{
+	softirqs[nr] = handler;
+}
+/* Callable from interrupt handlers */
+void softirq_raise(int nr)
+{
+	/* Before there's a thread to defer to, it runs right away, like it did before */
+	if(!softirqd_running)
+	{
+		if(softirqs[nr])
+			while(softirqs[nr](SOFTIRQ_BUDGET));
+		return;
+	}
+	__sync_fetch_and_or(&softirq_pending, 1U << nr);
+	wake_up(&softirq_wq);
+}
+void softirq_init()
+{
+	if(!sched_create_thread(softirqd, 1, NULL))
+		printf("softirq: couldn't create softirqd, bottom halves run from interrupts\n");
+}
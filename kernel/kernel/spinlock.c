@@ -27,3 +27,17 @@ void wait_spinlock(spinlock_t *lock)
 {
 	while (lock->lock == 1);
 }
+unsigned long spin_lock_irqsave(spinlock_t *lock)
+{
+	unsigned long flags;
+	__asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+	mutex_lock(&lock->lock);
+	return flags;
+}
+void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
+{
+	mutex_unlock(&lock->lock);
+	/* Only turn interrupts back on if they were on to begin with */
+	if(flags & 0x200)
+		__asm__ __volatile__("sti" ::: "memory");
+}
@@ -0,0 +1,82 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: timer.c
+ *
+ * Description: Timer events, kept sorted by deadline so every tick only
+ * has to look at the front of the list.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/timer.h>
+#include <kernel/spinlock.h>
+
+static timer_event_t *timers = NULL;
+static spinlock_t timers_spl;
+
+void timer_add(timer_event_t *ev, uint64_t deadline, timer_callback_t callback, void *arg)
+{
+	ev->deadline = deadline;
+	ev->callback = callback;
+	ev->arg = arg;
+	unsigned long flags = spin_lock_irqsave(&timers_spl);
+	timer_event_t **pp = &timers;
+	while(*pp && (*pp)->deadline <= deadline)
+		pp = &(*pp)->next;
+	ev->next = *pp;
+	*pp = ev;
+	ev->pending = 1;
+	spin_unlock_irqrestore(&timers_spl, flags);
+}
+/* Returns 1 if the event was taken off before it fired */
+int timer_cancel(timer_event_t *ev)
+{
+	int pending = 0;
+	unsigned long flags = spin_lock_irqsave(&timers_spl);
+	if(ev->pending)
+	{
+		for(timer_event_t **pp = &timers; *pp; pp = &(*pp)->next)
+		{
+			if(*pp == ev)
+			{
+				*pp = ev->next;
+				break;
+			}
+		}
+		ev->pending = 0;
+		pending = 1;
+	}
+	spin_unlock_irqrestore(&timers_spl, flags);
+	return pending;
+}
+/* Fires everything that's due, called by the timer interrupt. Callbacks can add events again. */
+void timer_run(uint64_t now)
+{
+	for(;;)
+	{
+		unsigned long flags = spin_lock_irqsave(&timers_spl);
+		timer_event_t *ev = timers;
+		if(!ev || ev->deadline > now)
+		{
+			spin_unlock_irqrestore(&timers_spl, flags);
+			return;
+		}
+		timers = ev->next;
+		ev->pending = 0;
+		spin_unlock_irqrestore(&timers_spl, flags);
+		ev->callback(ev->arg);
+	}
+}
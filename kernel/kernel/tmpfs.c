@@ -0,0 +1,277 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: tmpfs.c
+ *
+ * Description: In-memory filesystem. File data lives in the page cache, which
+ * is told it holds the only copy, so pages are never evicted or written back.
+ * Pages that aren't in the cache are holes and read as zeroes.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <kernel/tmpfs.h>
+#include <kernel/pagecache.h>
+#include <kernel/pmm.h>
+#include <kernel/paging.h>
+
+/* Each instance gets at most half of memory, like everyone else's tmpfs */
+#define TMPFS_DEFAULT_SHARE	2
+
+static inline tmpfs_inode_t *tmpfs_inode(vfsnode_t *node)
+{
+	return (tmpfs_inode_t *) node;
+}
+static inline size_t tmpfs_pages(size_t size)
+{
+	return (size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+/* Moves a file from size to new_size, if the filesystem has room for it. Called with fs->lock held. */
+static int tmpfs_resize(tmpfs_t *fs, vfsnode_t *this, size_t new_size)
+{
+	size_t old_pages = tmpfs_pages(this->size);
+	size_t new_pages = tmpfs_pages(new_size);
+	if(new_pages > old_pages && new_pages - old_pages > fs->max_pages - fs->nr_pages)
+		return errno = ENOSPC, -1;
+	fs->nr_pages = fs->nr_pages - old_pages + new_pages;
+	pagecache_resize(this->cache, this->size, new_size);
+	this->size = new_size;
+	return 0;
+}
+static tmpfs_inode_t *tmpfs_lookup(tmpfs_inode_t *dir, const char *name, size_t len)
+{
+	if(len == 1 && name[0] == '.')
+		return dir;
+	if(len == 2 && name[0] == '.' && name[1] == '.')
+		return dir->parent ? dir->parent : dir;
+	for(tmpfs_inode_t *i = dir->children; i; i = i->next_sibling)
+	{
+		if(strlen(i->name) == len && !memcmp(i->name, name, len))
+			return i;
+	}
+	return NULL;
+}
+/* Only ever called by the page cache, on pages it doesn't have. Those are holes. */
+static size_t tmpfs_read(size_t offset, size_t sizeofread, void *buffer, vfsnode_t *this)
+{
+	if(this->type & VFS_TYPE_DIR)
+		return errno = EISDIR, (size_t) -1;
+	if(offset >= this->size)
+		return 0;
+	if(sizeofread > this->size - offset)
+		sizeofread = this->size - offset;
+	memset(buffer, 0, sizeofread);
+	return sizeofread;
+}
+static size_t tmpfs_write(size_t offset, size_t sizeofwrite, void *buffer, vfsnode_t *this)
+{
+	if(this->type & VFS_TYPE_DIR)
+		return errno = EISDIR, (size_t) -1;
+	tmpfs_t *fs = tmpfs_inode(this)->fs;
+	if(offset + sizeofwrite < offset)
+		return errno = EFBIG, (size_t) -1;
+	acquire_spinlock(&fs->lock);
+	size_t old_size = this->size;
+	if(offset + sizeofwrite > old_size && tmpfs_resize(fs, this, offset + sizeofwrite) < 0)
+	{
+		release_spinlock(&fs->lock);
+		return (size_t) -1;
+	}
+	release_spinlock(&fs->lock);
+	size_t written = pagecache_write(this->cache, offset, sizeofwrite, buffer, this);
+	/* The file only grows as far as the data made it, unless someone moved the end since */
+	size_t end = offset + (written == (size_t) -1 ? 0 : written);
+	acquire_spinlock(&fs->lock);
+	if(this->size == offset + sizeofwrite && this->size > old_size && end < this->size)
+		tmpfs_resize(fs, this, end > old_size ? end : old_size);
+	release_spinlock(&fs->lock);
+	return written;
+}
+static int tmpfs_truncate(vfsnode_t *this, size_t length)
+{
+	if(this->type & VFS_TYPE_DIR)
+		return errno = EISDIR, -1;
+	tmpfs_t *fs = tmpfs_inode(this)->fs;
+	acquire_spinlock(&fs->lock);
+	int ret = tmpfs_resize(fs, this, length);
+	release_spinlock(&fs->lock);
+	return ret;
+}
+/* The last reference to an unlinked file is gone, give its pages back to the filesystem */
+static void tmpfs_release(vfsnode_t *this)
+{
+	tmpfs_t *fs = tmpfs_inode(this)->fs;
+	acquire_spinlock(&fs->lock);
+	fs->nr_pages -= tmpfs_pages(this->size);
+	release_spinlock(&fs->lock);
+}
+static unsigned int tmpfs_getdents(unsigned int count, struct dirent *dirp, vfsnode_t *this)
+{
+	tmpfs_inode_t *dir = tmpfs_inode(this);
+	unsigned int found = 0;
+	acquire_spinlock(&dir->fs->lock);
+	for(tmpfs_inode_t *i = dir->children; i && found < count; i = i->next_sibling)
+	{
+		dirp[found].d_ino = i->node.inode;
+		strcpy(dirp[found].d_name, i->name);
+		dirp[found].d_type = i->node.type & VFS_TYPE_DIR ? DT_DIR : DT_REG;
+		found++;
+	}
+	release_spinlock(&dir->fs->lock);
+	return found;
+}
+static vfsnode_t *tmpfs_open(vfsnode_t *this, const char *name)
+{
+	tmpfs_inode_t *i = tmpfs_inode(this);
+	acquire_spinlock(&i->fs->lock);
+	tmpfs_t *fs = i->fs;
+	while(*name && i)
+	{
+		while(*name == '/')
+			name++;
+		if(!*name)
+			break;
+		size_t len = 0;
+		while(name[len] && name[len] != '/')
+			len++;
+		i = tmpfs_lookup(i, name, len);
+		name += len;
+	}
+	if(i)
+		get_vfs(&i->node);
+	release_spinlock(&fs->lock);
+	return i ? &i->node : (errno = ENOENT, NULL);
+}
+static vfsnode_t *tmpfs_create(vfsnode_t *this, const char *name, int type);
+static int tmpfs_unlink(vfsnode_t *this, const char *name);
+static tmpfs_inode_t *tmpfs_alloc_inode(tmpfs_t *fs, const char *name, int type)
+{
+	size_t len = strlen(name);
+	tmpfs_inode_t *i = malloc(sizeof(tmpfs_inode_t) + len + 1);
+	if(!i)
+		return errno = ENOMEM, NULL;
+	memset(i, 0, sizeof(tmpfs_inode_t));
+	strcpy(i->name, name);
+	i->fs = fs;
+	vfsnode_t *node = &i->node;
+	node->name = i->name;
+	node->type = type;
+	node->inode = fs->next_ino++;
+	/* The reference the directory holds */
+	node->refcount = 1;
+	node->open = tmpfs_open;
+	node->read = tmpfs_read;
+	node->write = tmpfs_write;
+	node->getdents = tmpfs_getdents;
+	node->create = tmpfs_create;
+	node->unlink = tmpfs_unlink;
+	node->truncate = tmpfs_truncate;
+	node->release = tmpfs_release;
+	if(!(type & VFS_TYPE_DIR))
+	{
+		node->cache = pagecache_get(fs, node->inode);
+		if(!node->cache)
+		{
+			free(i);
+			return errno = ENOMEM, NULL;
+		}
+		node->cache->flags |= PAGECACHE_RAM;
+	}
+	return i;
+}
+static vfsnode_t *tmpfs_create(vfsnode_t *this, const char *name, int type)
+{
+	tmpfs_inode_t *dir = tmpfs_inode(this);
+	tmpfs_t *fs = dir->fs;
+	if(!*name || !strcmp((char*) name, ".") || !strcmp((char*) name, ".."))
+		return errno = EEXIST, NULL;
+	acquire_spinlock(&fs->lock);
+	/* Directories that were unlinked while open can't get new entries */
+	if(!dir->parent && dir != fs->root)
+	{
+		release_spinlock(&fs->lock);
+		return errno = ENOENT, NULL;
+	}
+	if(tmpfs_lookup(dir, name, strlen(name)))
+	{
+		release_spinlock(&fs->lock);
+		return errno = EEXIST, NULL;
+	}
+	tmpfs_inode_t *i = tmpfs_alloc_inode(fs, name, type == VFS_TYPE_DIR ? VFS_TYPE_DIR : VFS_TYPE_FILE);
+	if(!i)
+	{
+		release_spinlock(&fs->lock);
+		return NULL;
+	}
+	i->parent = dir;
+	i->next_sibling = dir->children;
+	dir->children = i;
+	/* And the caller's */
+	get_vfs(&i->node);
+	release_spinlock(&fs->lock);
+	return &i->node;
+}
+static int tmpfs_unlink(vfsnode_t *this, const char *name)
+{
+	tmpfs_inode_t *dir = tmpfs_inode(this);
+	tmpfs_t *fs = dir->fs;
+	acquire_spinlock(&fs->lock);
+	tmpfs_inode_t **p = &dir->children;
+	while(*p && strcmp((*p)->name, (char*) name))
+		p = &(*p)->next_sibling;
+	tmpfs_inode_t *i = *p;
+	if(!i)
+	{
+		release_spinlock(&fs->lock);
+		return errno = ENOENT, -1;
+	}
+	if(i->children)
+	{
+		release_spinlock(&fs->lock);
+		return errno = ENOTEMPTY, -1;
+	}
+	*p = i->next_sibling;
+	i->parent = NULL;
+	i->next_sibling = NULL;
+	release_spinlock(&fs->lock);
+	/* The data goes away once whoever still has it open lets go of it */
+	put_vfs(&i->node);
+	return 0;
+}
+tmpfs_t *tmpfs_mount(const char *mountpoint)
+{
+	tmpfs_t *fs = malloc(sizeof(tmpfs_t));
+	if(!fs)
+		return errno = ENOMEM, NULL;
+	memset(fs, 0, sizeof(tmpfs_t));
+	fs->next_ino = 1;
+	fs->max_pages = pmm_get_total_mem() / PAGE_SIZE / TMPFS_DEFAULT_SHARE;
+	fs->root = tmpfs_alloc_inode(fs, "", VFS_TYPE_DIR);
+	if(!fs->root)
+	{
+		free(fs);
+		return NULL;
+	}
+	if(mount_fs(&fs->root->node, mountpoint) < 0)
+	{
+		free(fs->root);
+		free(fs);
+		return NULL;
+	}
+	return fs;
+}
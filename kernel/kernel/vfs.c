@@ -13,9 +13,18 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include <kernel/panic.h>
 #include <kernel/vfs.h>
+#include <kernel/pagecache.h>
+#include <kernel/bcache.h>
+#include <kernel/dcache.h>
+#include <kernel/icache.h>
+#include <kernel/pmm.h>
+#include <kernel/paging.h>
+#include <kernel/usercopy.h>
 
 vfsnode_t *fs_root = NULL;
 vfsnode_t *mount_list = NULL;
@@ -32,19 +41,353 @@ int vfs_init()
 size_t read_vfs(size_t offset, size_t sizeofread, void* buffer, vfsnode_t* this)
 {
 	if(this->type & VFS_TYPE_MOUNTPOINT)
-		return this->link->read(offset,sizeofread,buffer,this->link);
+		return read_vfs(offset, sizeofread, buffer, this->link);
+	if(this->cache && !(this->type & VFS_TYPE_DIR))
+		return pagecache_read(this->cache, offset, sizeofread, buffer, this);
 	if(this->read != NULL)
 		return this->read(offset,sizeofread,buffer,this);
-	return errno = ENOSYS;
+	return errno = ENOSYS, (size_t) -1;
+}
+/* Writes to cached files only dirty the cache, the flusher writes them back later.
+ * A write past the end grows the file first, the filesystem gives the new part blocks
+ * when it gets written back. Whatever couldn't be copied in is cut off again, unless another
+ * write moved the end in the meantime.
+*/
+static size_t write_vfs_cached(size_t offset, size_t len, const void *buffer, vfsnode_t *this)
+{
+	size_t old_size = this->size;
+	if(offset + len < offset)
+		return errno = EFBIG, (size_t) -1;
+	if(offset + len > old_size && truncate_vfs(this, offset + len) < 0)
+		return (size_t) -1;
+	size_t written = pagecache_write(this->cache, offset, len, buffer, this);
+	size_t end = offset + (written == (size_t) -1 ? 0 : written);
+	if(this->size == offset + len && this->size > old_size && end < this->size)
+		truncate_vfs(this, end > old_size ? end : old_size);
+	return written;
+}
+static inline int write_through_cache(vfsnode_t *this)
+{
+	return this->cache && this->cache->writeback && !(this->type & VFS_TYPE_DIR);
 }
 size_t write_vfs(size_t offset, size_t sizeofwrite, void* buffer, vfsnode_t* this)
 {
 	if(this->type & VFS_TYPE_MOUNTPOINT)
-		return this->link->write(offset,sizeofwrite,buffer,this->link);
+		return write_vfs(offset, sizeofwrite, buffer, this->link);
+	if(write_through_cache(this))
+		return write_vfs_cached(offset, sizeofwrite, buffer, this);
 	if(this->write != NULL)
-		return this->write(offset,sizeofwrite,buffer,this);
+	{
+		size_t written = this->write(offset,sizeofwrite,buffer,this);
+		if(this->cache)
+			pagecache_invalidate(this->cache, offset, sizeofwrite);
+		return written;
+	}
 
-	return errno = ENOSYS;
+	return errno = ENOSYS, (size_t) -1;
+}
+/* read_vfs() and write_vfs() for buffers that live in userspace.
+ * The filesystems only deal with kernel memory, so the data goes through a kernel page
+ * and the copy helpers, which turn a bad pointer into EFAULT instead of a kernel fault.
+ * The page cache copies with the fixup-backed helpers itself, so cached files skip the bounce.
+*/
+ssize_t read_vfs_user(size_t offset, size_t len, void *ubuf, vfsnode_t *this)
+{
+	if(!access_ok(ubuf, len))
+		return errno = EFAULT, -1;
+	while(this->type & VFS_TYPE_MOUNTPOINT)
+		this = this->link;
+	if(this->cache && !(this->type & VFS_TYPE_DIR))
+	{
+		size_t read = pagecache_read(this->cache, offset, len, ubuf, this);
+		return read == (size_t) -1 ? -1 : (ssize_t) read;
+	}
+	void *phys = pmalloc(1);
+	if(!phys)
+		return errno = ENOMEM, -1;
+	char *page = (char*)((uintptr_t) phys + PHYS_BASE);
+	size_t done = 0;
+	int error = 0;
+	while(done < len)
+	{
+		size_t chunk = len - done;
+		if(chunk > PAGE_SIZE)
+			chunk = PAGE_SIZE;
+		size_t read = read_vfs(offset + done, chunk, page, this);
+		if(read == (size_t) -1 || copy_to_user((char*) ubuf + done, page, read) < 0)
+		{
+			error = 1;
+			break;
+		}
+		done += read;
+		if(read < chunk)
+			break;
+	}
+	pfree(1, phys);
+	if(!done && error)
+		return -1;
+	return done;
+}
+ssize_t write_vfs_user(size_t offset, size_t len, const void *ubuf, vfsnode_t *this)
+{
+	if(!access_ok(ubuf, len))
+		return errno = EFAULT, -1;
+	while(this->type & VFS_TYPE_MOUNTPOINT)
+		this = this->link;
+	if(write_through_cache(this))
+	{
+		size_t written = write_vfs_cached(offset, len, ubuf, this);
+		return written == (size_t) -1 ? -1 : (ssize_t) written;
+	}
+	void *phys = pmalloc(1);
+	if(!phys)
+		return errno = ENOMEM, -1;
+	char *page = (char*)((uintptr_t) phys + PHYS_BASE);
+	size_t done = 0;
+	int error = 0;
+	while(done < len)
+	{
+		size_t chunk = len - done;
+		if(chunk > PAGE_SIZE)
+			chunk = PAGE_SIZE;
+		size_t written;
+		if(copy_from_user(page, (const char*) ubuf + done, chunk) < 0 ||
+		(written = write_vfs(offset + done, chunk, page, this)) == (size_t) -1)
+		{
+			error = 1;
+			break;
+		}
+		done += written;
+		if(written < chunk)
+			break;
+	}
+	pfree(1, phys);
+	if(!done && error)
+		return -1;
+	return done;
+}
+/* Vectored I/O on user buffers. vec itself has already been copied in, but the
+ * buffers it points at haven't. The page cache copies with the fixup-backed helpers,
+ * so cached files take the vector as it is. Anything else has the data staged in a run
+ * of kernel pages and scattered or gathered with the copy helpers, and every batch goes
+ * down to the filesystem's readv or writev as a vector of its own.
+*/
+#define VFS_BOUNCE_PAGES	16
+ssize_t readv_vfs_user(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this)
+{
+	while(this->type & VFS_TYPE_MOUNTPOINT)
+		this = this->link;
+	if(this->cache && !(this->type & VFS_TYPE_DIR))
+	{
+		size_t read = readv_vfs(offset, vec, veccnt, this);
+		return read == (size_t) -1 ? -1 : (ssize_t) read;
+	}
+	void *phys = pmalloc(VFS_BOUNCE_PAGES);
+	if(!phys)
+		return errno = ENOMEM, -1;
+	char *bounce = (char*)((uintptr_t) phys + PHYS_BASE);
+	size_t total = 0;
+	size_t done = 0; /* Bytes already handed out of vec[i] */
+	int i = 0;
+	int error = 0;
+	while(i < veccnt)
+	{
+		/* Size the batch to what's left in the vector, up to the bounce buffer */
+		size_t want = 0;
+		for(int j = i; j < veccnt && want < VFS_BOUNCE_PAGES * PAGE_SIZE; j++)
+			want += vec[j].iov_len - (j == i ? done : 0);
+		if(want > VFS_BOUNCE_PAGES * PAGE_SIZE)
+			want = VFS_BOUNCE_PAGES * PAGE_SIZE;
+		if(!want)
+			break;
+		struct iovec batch = {bounce, want};
+		size_t read = readv_vfs(offset + total, &batch, 1, this);
+		if(read == (size_t) -1)
+		{
+			error = 1;
+			break;
+		}
+		size_t pos = 0;
+		while(pos < read)
+		{
+			size_t len = vec[i].iov_len - done;
+			if(len > read - pos)
+				len = read - pos;
+			if(copy_to_user((char*) vec[i].iov_base + done, bounce + pos, len) < 0)
+			{
+				error = 1;
+				break;
+			}
+			pos += len;
+			done += len;
+			if(done == vec[i].iov_len)
+			{
+				i++;
+				done = 0;
+			}
+		}
+		total += pos;
+		if(error || read < want)
+			break;
+	}
+	pfree(VFS_BOUNCE_PAGES, phys);
+	if(!total && error)
+		return -1;
+	return total;
+}
+ssize_t writev_vfs_user(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this)
+{
+	while(this->type & VFS_TYPE_MOUNTPOINT)
+		this = this->link;
+	if(write_through_cache(this))
+	{
+		size_t written = writev_vfs(offset, vec, veccnt, this);
+		return written == (size_t) -1 ? -1 : (ssize_t) written;
+	}
+	void *phys = pmalloc(VFS_BOUNCE_PAGES);
+	if(!phys)
+		return errno = ENOMEM, -1;
+	char *bounce = (char*)((uintptr_t) phys + PHYS_BASE);
+	size_t total = 0;
+	size_t done = 0;
+	int i = 0;
+	int error = 0;
+	while(i < veccnt)
+	{
+		size_t pos = 0;
+		while(i < veccnt && pos < VFS_BOUNCE_PAGES * PAGE_SIZE)
+		{
+			size_t len = vec[i].iov_len - done;
+			if(len > VFS_BOUNCE_PAGES * PAGE_SIZE - pos)
+				len = VFS_BOUNCE_PAGES * PAGE_SIZE - pos;
+			if(copy_from_user(bounce + pos, (const char*) vec[i].iov_base + done, len) < 0)
+			{
+				error = 1;
+				break;
+			}
+			pos += len;
+			done += len;
+			if(done == vec[i].iov_len)
+			{
+				i++;
+				done = 0;
+			}
+		}
+		if(!pos)
+			break;
+		struct iovec batch = {bounce, pos};
+		size_t written = writev_vfs(offset + total, &batch, 1, this);
+		if(written == (size_t) -1)
+		{
+			error = 1;
+			break;
+		}
+		total += written;
+		if(error || written < pos)
+			break;
+	}
+	pfree(VFS_BOUNCE_PAGES, phys);
+	if(!total && error)
+		return -1;
+	return total;
+}
+/* Services a vector one element at a time, for filesystems that can't do better.
+ * Stops at the first short transfer, like a regular read would.
+ * These call straight into the filesystem, bypassing the page cache.
+*/
+size_t readv_vfs_fallback(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this)
+{
+	size_t total = 0;
+	for(int i = 0; i < veccnt; i++)
+	{
+		size_t read = this->read(offset + total, vec[i].iov_len, vec[i].iov_base, this);
+		if(read == (size_t) -1)
+			return total ? total : (size_t) -1;
+		total += read;
+		if(read < vec[i].iov_len)
+			break;
+	}
+	return total;
+}
+size_t writev_vfs_fallback(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this)
+{
+	size_t total = 0;
+	for(int i = 0; i < veccnt; i++)
+	{
+		size_t written = this->write(offset + total, vec[i].iov_len, vec[i].iov_base, this);
+		if(written == (size_t) -1)
+			return total ? total : (size_t) -1;
+		total += written;
+		if(written < vec[i].iov_len)
+			break;
+	}
+	return total;
+}
+size_t readv_vfs(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this)
+{
+	if(this->type & VFS_TYPE_MOUNTPOINT)
+		return readv_vfs(offset, vec, veccnt, this->link);
+	if(this->cache && !(this->type & VFS_TYPE_DIR))
+	{
+		size_t total = 0;
+		for(int i = 0; i < veccnt; i++)
+		{
+			size_t read = pagecache_read(this->cache, offset + total, vec[i].iov_len, vec[i].iov_base, this);
+			if(read == (size_t) -1)
+				return total ? total : (size_t) -1;
+			total += read;
+			if(read < vec[i].iov_len)
+				break;
+		}
+		return total;
+	}
+	if(this->readv != NULL)
+		return this->readv(offset, vec, veccnt, this);
+	if(this->read != NULL)
+		return readv_vfs_fallback(offset, vec, veccnt, this);
+	return errno = ENOSYS, (size_t) -1;
+}
+size_t writev_vfs(size_t offset, const struct iovec *vec, int veccnt, vfsnode_t *this)
+{
+	if(this->type & VFS_TYPE_MOUNTPOINT)
+		return writev_vfs(offset, vec, veccnt, this->link);
+	if(write_through_cache(this))
+	{
+		size_t total = 0;
+		for(int i = 0; i < veccnt; i++)
+		{
+			size_t written = write_vfs_cached(offset + total, vec[i].iov_len, vec[i].iov_base, this);
+			if(written == (size_t) -1)
+				return total ? total : (size_t) -1;
+			total += written;
+			if(written < vec[i].iov_len)
+				break;
+		}
+		return total;
+	}
+	size_t written;
+	if(this->writev != NULL)
+		written = this->writev(offset, vec, veccnt, this);
+	else if(this->write != NULL)
+		written = writev_vfs_fallback(offset, vec, veccnt, this);
+	else
+		return errno = ENOSYS, (size_t) -1;
+	if(this->cache && written != (size_t) -1)
+		pagecache_invalidate(this->cache, offset, written);
+	return written;
+}
+/* Makes sure everything written to the file so far is on the disk */
+int fsync_vfs(vfsnode_t *this)
+{
+	if(this->type & VFS_TYPE_MOUNTPOINT)
+		return fsync_vfs(this->link);
+	int ret = 0;
+	if(this->cache && pagecache_sync(this->cache) < 0)
+		ret = -1;
+	/* The file's metadata might be sitting in the buffer cache too */
+	if(bcache_sync(NULL) < 0)
+		ret = -1;
+	return ret;
 }
 int ioctl_vfs(int request, va_list args, vfsnode_t *this)
 {
@@ -59,8 +402,55 @@ void close_vfs(vfsnode_t* this)
 	if(this->close != NULL)
 		this->close(this);
 }
+/* Nodes returned by open_vfs() come with a reference, which needs to be dropped with put_vfs() */
+void get_vfs(vfsnode_t *this)
+{
+	if(this->sb)
+		icache_grab(this);
+	else
+		this->refcount++;
+}
+void put_vfs(vfsnode_t *this)
+{
+	if(this->sb)
+		icache_put(this);
+	else if(--this->refcount == 0)
+	{
+		if(this->release)
+			this->release(this);
+		/* Nodes that aren't in the inode cache own their page cache */
+		if(this->cache)
+			pagecache_release(this->cache);
+		free(this);
+	}
+}
 vfsnode_t *open_vfs(vfsnode_t* this, const char *name)
 {
+	size_t len = strlen(name);
+	if(this == fs_root && name[0] == '/' && name[len - 1] != '/')
+		return dcache_open(name);
+	return open_vfs_uncached(this, name);
+}
+/* Finds the mount path lives under, the one with the longest matching mountpoint */
+static vfsnode_t *vfs_find_mount(const char *path)
+{
+	vfsnode_t *best = fs_root;
+	size_t best_len = 0;
+	for(vfsnode_t *m = fs_root->next; m; m = m->next)
+	{
+		size_t len = strlen(m->name);
+		if(len > best_len && !memcmp(path, m->name, len) && (path[len] == '/' || path[len] == '\0'))
+		{
+			best = m;
+			best_len = len;
+		}
+	}
+	return best;
+}
+vfsnode_t *open_vfs_uncached(vfsnode_t* this, const char *name)
+{
+	if(this == fs_root)
+		this = vfs_find_mount(name);
 	if(this->type & VFS_TYPE_MOUNTPOINT)
 	{
 		size_t s = strlen(this->link->mountpoint);
@@ -76,6 +466,8 @@ vfsnode_t *open_vfs(vfsnode_t* this, const char *name)
 int mount_fs(vfsnode_t *fsroot, const char *path)
 {
 	printf("Mountfs\n");
+	/* Whatever was cached under the mountpoint is hidden now */
+	dcache_purge();
 	if(!strcmp((char*)path, "/"))
 	{
 		printf("Mounting root\n");
@@ -88,19 +480,102 @@ int mount_fs(vfsnode_t *fsroot, const char *path)
 	}
 	else
 	{
-		vfsnode_t *node = mount_list;
-		while(node->name)
-		{
-			node = node->next;
-		}
+		/* Every other mount gets a node of its own, chained after the root's */
+		vfsnode_t *node = malloc(sizeof(vfsnode_t));
+		if(!node)
+			return errno = ENOMEM, -1;
+		memset(node, 0, sizeof(vfsnode_t));
 		node->link = fsroot;
 		node->type = VFS_TYPE_MOUNTPOINT | VFS_TYPE_DIR;
-		node->name = malloc(strlen(path));
+		node->name = malloc(strlen(path) + 1);
+		if(!node->name)
+		{
+			free(node);
+			return errno = ENOMEM, -1;
+		}
 		strcpy(node->name, path);
-		fsroot->mountpoint = (char*)path;
+		fsroot->mountpoint = node->name;
+		vfsnode_t *last = mount_list;
+		while(last->next)
+			last = last->next;
+		last->next = node;
 	}
 	return 0;
 }
+/* Opens the directory path lives in, and points name at the last component of path */
+static vfsnode_t *vfs_open_parent(const char *path, const char **name)
+{
+	const char *slash = NULL;
+	for(const char *p = path; *p; p++)
+	{
+		if(*p == '/')
+			slash = p;
+	}
+	if(!slash)
+		return errno = ENOENT, NULL;
+	*name = slash + 1;
+	if(!**name)
+		return errno = EINVAL, NULL;
+	size_t len = slash - path;
+	char *dir = malloc(len + 2);
+	if(!dir)
+		return errno = ENOMEM, NULL;
+	memcpy(dir, path, len);
+	if(!len)
+		dir[len++] = '/';
+	dir[len] = '\0';
+	vfsnode_t *node = open_vfs(fs_root, dir);
+	free(dir);
+	return node;
+}
+/* Creates a file or a directory, depending on type. Returns the new node with a reference. */
+vfsnode_t *create_vfs(const char *path, int type)
+{
+	const char *name;
+	vfsnode_t *dir = vfs_open_parent(path, &name);
+	if(!dir)
+		return NULL;
+	vfsnode_t *node = NULL;
+	if(!(dir->type & VFS_TYPE_DIR))
+		errno = ENOTDIR;
+	else if(!dir->create)
+		errno = EROFS;
+	else
+		node = dir->create(dir, name, type);
+	put_vfs(dir);
+	/* The path might be cached as not existing */
+	if(node)
+		dcache_invalidate(path);
+	return node;
+}
+int unlink_vfs(const char *path)
+{
+	const char *name;
+	vfsnode_t *dir = vfs_open_parent(path, &name);
+	if(!dir)
+		return -1;
+	int ret = -1;
+	if(!(dir->type & VFS_TYPE_DIR))
+		errno = ENOTDIR;
+	else if(!dir->unlink)
+		errno = EROFS;
+	else
+		ret = dir->unlink(dir, name);
+	put_vfs(dir);
+	if(ret == 0)
+		dcache_invalidate(path);
+	return ret;
+}
+int truncate_vfs(vfsnode_t *this, size_t length)
+{
+	if(this->type & VFS_TYPE_MOUNTPOINT)
+		return truncate_vfs(this->link, length);
+	if(this->type & VFS_TYPE_DIR)
+		return errno = EISDIR, -1;
+	if(!this->truncate)
+		return errno = EROFS, -1;
+	return this->truncate(this, length);
+}
 unsigned int getdents_vfs(unsigned int count, struct dirent* dirp, vfsnode_t *this)
 {
 	if(!(this->type & VFS_TYPE_DIR))
@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <kernel/panic.h>
+#include <kernel/vfs.h>
+#include <kernel/spinlock.h>
 _Bool isInitialized = false;
 _Bool is_spawning = 0;
 vmm_entry_t *old_entries = NULL;
@@ -53,6 +55,7 @@ void vmm_start_address_bookeeping(uintptr_t framebuffer_address, uintptr_t heap)
 	areas = malloc(num_areas * sizeof(vmm_entry_t));
 	if(!areas)
 		panic("Not enough memory\n");
+	memset(areas, 0, num_areas * sizeof(vmm_entry_t));
 	areas[0].base = KERNEL_VIRTUAL_BASE;
 	areas[0].pages = 524288; /* last 2 GB*/
 	areas[0].rwx = VMM_WRITE | VMM_GLOBAL; /* RWX */
@@ -99,22 +102,35 @@ void vmm_destroy_mappings(void *range, size_t pages)
 	{
 		if(areas[i].base == (uintptr_t)range && areas[i].pages == pages)
 		{
+			if(areas[i].file)
+				put_vfs(areas[i].file);
+			areas[i].file = NULL;
 			areas[i].base = 0xFFFFFFFFFFFFFFFF;
 			areas[i].pages = 0xFFFFFFF;
+			/* The dead entry sorts last, so sort before shrinking the array, or realloc cuts off a live one */
+			qsort(areas,num_areas,sizeof(vmm_entry_t),vmm_comp);
 			num_areas--;
-			break;
+			areas = realloc(areas, sizeof(vmm_entry_t) * num_areas);
+			return;
 		}
 		if(areas[i].base + areas[i].pages * PAGE_SIZE > (uintptr_t) range && areas[i].base < (uintptr_t) range)
 		{
 			if((uintptr_t) (range + pages * PAGE_SIZE) != areas[i].base + areas[i].pages * PAGE_SIZE)
 			{
 				size_t old_pages = areas[i].pages;
-				areas[i].pages -= ((uintptr_t) range - areas[i].base / 4096);
+				areas[i].pages = ((uintptr_t) range - areas[i].base) / PAGE_SIZE;
 				size_t second_half_pages = old_pages - pages - areas[i].pages;
 				num_areas++;
 				areas = realloc(areas, sizeof(vmm_entry_t) * num_areas);
+				memcpy(&areas[num_areas-1], &areas[i], sizeof(vmm_entry_t));
 				areas[num_areas-1].base = (uintptr_t)range + pages * PAGE_SIZE;
 				areas[num_areas-1].pages = second_half_pages;
+				/* Both halves of a file mapping keep the file open */
+				if(areas[i].file)
+				{
+					areas[num_areas-1].offset += areas[num_areas-1].base - areas[i].base;
+					get_vfs(areas[i].file);
+				}
 				qsort(areas,num_areas,sizeof(vmm_entry_t),vmm_comp);
 				return;
 			}
@@ -125,9 +141,22 @@ void vmm_destroy_mappings(void *range, size_t pages)
 			}
 		}
 	}
-	areas = realloc(areas, sizeof(vmm_entry_t) * num_areas);
-	qsort(areas,num_areas,sizeof(vmm_entry_t),vmm_comp);
 }
+/* Unmaps every file mapping of the current address space and drops its file, so the page cache
+ * stops counting those pages as mapped. For exit and exec, which are done with the old image.
+*/
+void vmm_unmap_files()
+{
+	for(size_t i = 0; i < num_areas; i++)
+	{
+		if(!areas[i].file || areas[i].base >= high_half)
+			continue;
+		vmm_unmap_range((void*) areas[i].base, areas[i].pages);
+		put_vfs(areas[i].file);
+		areas[i].file = NULL;
+	}
+}
+static spinlock_t vmm_spl;
 void *vmm_allocate_virt_address(uint64_t flags, size_t pages, uint32_t type, uint64_t prot)
 {
 	uintptr_t base_address = 0;
@@ -153,6 +182,7 @@ void *vmm_allocate_virt_address(uint64_t flags, size_t pages, uint32_t type, uin
 		}
 	}
 	uintptr_t best_address = base_address;
+	unsigned long irqs = spin_lock_irqsave(&vmm_spl);
 	for(size_t i = 0; i < num_areas; i++)
 	{
 		if(areas[i].base == best_address)
@@ -164,11 +194,13 @@ void *vmm_allocate_virt_address(uint64_t flags, size_t pages, uint32_t type, uin
 	areas = realloc(areas, num_areas * sizeof(vmm_entry_t));
 	if(!areas)
 		panic("Severe OOM!");
+	memset(&areas[num_areas-1], 0, sizeof(vmm_entry_t));
 	areas[num_areas-1].base = best_address;
 	areas[num_areas-1].pages = pages;
 	areas[num_areas-1].type = type;
 	areas[num_areas-1].rwx = prot;
 	qsort(areas,num_areas,sizeof(vmm_entry_t),vmm_comp);
+	spin_unlock_irqrestore(&vmm_spl, irqs);
 	return (void*)best_address;
 }
 void *vmm_reserve_address(void *addr, size_t pages, uint32_t type, uint64_t prot)
@@ -179,7 +211,7 @@ void *vmm_reserve_address(void *addr, size_t pages, uint32_t type, uint64_t prot
 	areas = realloc(areas, num_areas * sizeof(vmm_entry_t));
 	if(!areas)
 		panic("Severe OOM!");
-
+	memset(&areas[num_areas-1], 0, sizeof(vmm_entry_t));
 	areas[num_areas-1].base = (uintptr_t)addr;
 	areas[num_areas-1].pages = pages;
 	areas[num_areas-1].type = type;
@@ -214,6 +246,8 @@ PML4 *vmm_clone_as(vmm_entry_t **vmmstructs, size_t *num_are)
 		if(areas[i].base <= high_half)
 		{
 			memcpy(&entries[i], &areas[i], sizeof(vmm_entry_t));
+			if(entries[i].file)
+				get_vfs(entries[i].file);
 		}
 	}
 	is_spawning = 1;
@@ -231,6 +265,12 @@ PML4 *vmm_fork_as(vmm_entry_t **vmmstructs)
 	PML4 *pt = paging_fork_as();
 	vmm_entry_t *entries = malloc(sizeof(vmm_entry_t) * num_areas);
 	memcpy(entries, areas, sizeof(vmm_entry_t) * num_areas);
+	/* File mappings are inherited, and so is the reference to the file */
+	for(size_t i = 0; i < num_areas; i++)
+	{
+		if(entries[i].file)
+			get_vfs(entries[i].file);
+	}
 	is_spawning = 1;
 	old_entries = areas;
 	old_num_entries = num_areas;
@@ -249,6 +289,8 @@ void vmm_change_perms(void *range, size_t pages, int perms)
 {
 	for(size_t i = 0; i < pages; i++)
 	{
-		paging_change_perms(range, perms);
+		char *page = (char*) range + i * PAGE_SIZE;
+		paging_change_perms(page, perms);
+		asm volatile("invlpg %0"::"m"(*page));
 	}
 }
\ No newline at end of file
@@ -0,0 +1,70 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/**************************************************************************
+ *
+ *
+ * File: wait_queue.c
+ *
+ * Description: Wait queues. A waiter puts itself on the queue with
+ * interrupts off and keeps them off until it has checked what it's
+ * waiting for and blocked, so a wake up can't slip in between the two.
+ *
+ *
+ **************************************************************************/
+#include <stdint.h>
+
+#include <kernel/wait_queue.h>
+
+/* Queues the current thread. Interrupts stay off until wait_queue_finish(), which gets the flags back. */
+unsigned long wait_queue_prepare(wait_queue_t *wq, wait_token_t *token)
+{
+	unsigned long flags = spin_lock_irqsave(&wq->lock);
+	token->thread = get_current_thread();
+	if(!token->thread)
+	{
+		/* No threads yet, the waiter polls with interrupts left as they were */
+		spin_unlock_irqrestore(&wq->lock, flags);
+		return flags;
+	}
+	token->next = wq->waiters;
+	wq->waiters = token;
+	release_spinlock(&wq->lock);
+	return flags;
+}
+void wait_queue_finish(wait_queue_t *wq, wait_token_t *token, unsigned long flags)
+{
+	if(!token->thread)
+		return;
+	acquire_spinlock(&wq->lock);
+	for(wait_token_t **pp = &wq->waiters; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == token)
+		{
+			*pp = token->next;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
+/* Wakes up everyone on the queue, they take themselves off once they see what they waited for */
+void wake_up_locked(wait_queue_t *wq)
+{
+	for(wait_token_t *token = wq->waiters; token; token = token->next)
+	{
+		sched_wake(token->thread);
+	}
+}
+void wake_up(wait_queue_t *wq)
+{
+	unsigned long flags = spin_lock_irqsave(&wq->lock);
+	wake_up_locked(wq);
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
@@ -33,6 +33,11 @@
 #define LLONG_MAX	9223372036854775807
 #define ULONG_MAX	18446744073709551615
 
+/* POSIX <limits.h> */
+#define PATH_MAX	4096
+#define IOV_MAX		1024
+#define SSIZE_MAX	LLONG_MAX
+
 
 
 #endif
@@ -0,0 +1,111 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#ifndef _SYS_IORING_H
+#define _SYS_IORING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Operations that can be queued on a submission ring */
+#define IORING_OP_NOP		0
+#define IORING_OP_READ		1
+#define IORING_OP_WRITE		2
+#define IORING_OP_READV		3
+#define IORING_OP_OPEN		4
+#define IORING_OP_CLOSE		5
+#define IORING_OP_GETDENTS	6
+
+/* Use the file descriptor's current offset instead of io_sqe.off */
+#define IORING_OFF_CURRENT	((uint64_t) -1)
+#define IORING_MAX_ENTRIES	4096
+
+struct io_sqe
+{
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t reserved;
+	int32_t fd;
+	uint64_t off;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t op_flags;
+	uint64_t user_data;
+};
+struct io_cqe
+{
+	uint64_t user_data;
+	int64_t res;
+	uint32_t flags;
+	uint32_t reserved;
+};
+/* Header of the shared mapping returned by ioring_setup(2).
+ * Userspace owns sq_tail and cq_head, the kernel owns sq_head and cq_tail.
+ * The submission and completion arrays live at sq_off and cq_off bytes from the header.
+*/
+struct io_ring
+{
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	uint32_t cq_mask;
+	uint32_t cq_entries;
+	uint32_t sq_off;
+	uint32_t cq_off;
+	volatile uint32_t cq_overflow;
+	uint32_t flags;
+};
+
+#ifndef __is_spartix_kernel
+/* The kernel keeps its own copy of the geometry and never goes through these */
+#define IORING_SQES(ring) ((struct io_sqe*)((char*)(ring) + (ring)->sq_off))
+#define IORING_CQES(ring) ((struct io_cqe*)((char*)(ring) + (ring)->cq_off))
+
+struct io_ring *ioring_setup(unsigned int entries);
+int ioring_enter(struct io_ring *ring, unsigned int to_submit, unsigned int min_complete);
+
+/* Returns the next free submission slot, or NULL if the ring is full */
+static inline struct io_sqe *ioring_get_sqe(struct io_ring *ring)
+{
+	uint32_t tail = ring->sq_tail;
+	if(tail - ring->sq_head == ring->sq_entries)
+		return NULL;
+	return &IORING_SQES(ring)[tail & ring->sq_mask];
+}
+/* Publishes the slot handed out by ioring_get_sqe() to the kernel */
+static inline void ioring_queue_sqe(struct io_ring *ring)
+{
+	__asm__ __volatile__("" ::: "memory");
+	ring->sq_tail++;
+}
+static inline uint32_t ioring_sq_pending(struct io_ring *ring)
+{
+	return ring->sq_tail - ring->sq_head;
+}
+/* Returns the oldest completion without consuming it, or NULL if there's none */
+static inline struct io_cqe *ioring_peek_cqe(struct io_ring *ring)
+{
+	uint32_t head = ring->cq_head;
+	if(head == ring->cq_tail)
+		return NULL;
+	__asm__ __volatile__("" ::: "memory");
+	return &IORING_CQES(ring)[head & ring->cq_mask];
+}
+static inline void ioring_cqe_seen(struct io_ring *ring)
+{
+	__asm__ __volatile__("" ::: "memory");
+	ring->cq_head++;
+}
+#endif
+
+#endif
@@ -40,6 +40,16 @@
 #define SYS_writev	25
 #define SYS_preadv	26
 #define SYS_pwritev	27
+#define SYS_getdents	28
+#define SYS_ioctl	29
+#define SYS_ioring_setup 30
+#define SYS_ioring_enter 31
+#define SYS_sendfile	32
+#define SYS_fsync	33
+#define SYS_sync	34
+#define SYS_unlink	35
+#define SYS_mkdir	36
+#define SYS_ftruncate	37
 
 #define __syscall0(no) __asm__ __volatile__("int $0x80"::"a"(no):"memory")
 #define __syscall1(no, a) __asm__ __volatile__("int $0x80"::"a"(no), "D"(a) : "memory")
@@ -14,6 +14,7 @@
 typedef long pid_t;
 typedef unsigned int uid_t;
 typedef unsigned int gid_t;
+typedef unsigned int mode_t;
 typedef long long ssize_t;
 typedef long int off_t;
 typedef unsigned long int ino_t;
@@ -111,4 +111,8 @@ unsigned long lseek(int fd, unsigned long offset, int whence);
 int brk(void* addr);
 void* sbrk(unsigned long long inc);
 void _exit(int exit_code);
+int fsync(int fd);
+void sync();
+int unlink(const char *path);
+int ftruncate(int fd, off_t length);
 #endif
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <sys/stat.h>
 
 int open(const char *path, int flags)
 {
@@ -32,3 +33,27 @@ unsigned long lseek(int fd, unsigned long offset, int whence)
 	syscall(SYS_lseek, fd, offset, whence);
 	return rax;
 }
+int fsync(int fd)
+{
+	syscall(SYS_fsync, fd);
+	return rax;
+}
+void sync()
+{
+	syscall(SYS_sync);
+}
+int unlink(const char *path)
+{
+	syscall(SYS_unlink, path);
+	return rax;
+}
+int mkdir(const char *path, mode_t mode)
+{
+	syscall(SYS_mkdir, path, mode);
+	return rax;
+}
+int ftruncate(int fd, off_t length)
+{
+	syscall(SYS_ftruncate, fd, length);
+	return rax;
+}
@@ -0,0 +1,24 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/ioring.h>
+
+struct io_ring *ioring_setup(unsigned int entries)
+{
+	syscall(SYS_ioring_setup, entries);
+	return (struct io_ring *)rax;
+}
+int ioring_enter(struct io_ring *ring, unsigned int to_submit, unsigned int min_complete)
+{
+	syscall(SYS_ioring_enter, ring, to_submit, min_complete);
+	return (int)rax;
+}
@@ -0,0 +1,79 @@
+/*----------------------------------------------------------------------
+ * Copyright (C) 2016 Pedro Falcato
+ *
+ * This file is part of Spartix, and is made available under
+ * the terms of the GNU General Public License version 2.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 2 as published by the Free Software
+ * Foundation.
+ *----------------------------------------------------------------------*/
+/* Writes files on /tmp through write(2) and reads them back through the same descriptor.
+ * Covers writes that grow the file, writes past the end that leave a hole behind, and
+ * O_APPEND. Exits with 1 on the first mismatch.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TEST_FILE	"/tmp/tmpfstest"
+#define TEST_SIZE	(3 * 4096 + 123)
+#define HOLE_SIZE	5000
+
+static char wbuf[TEST_SIZE];
+static char rbuf[TEST_SIZE + HOLE_SIZE];
+
+static int fail(const char *what)
+{
+	printf("tmpfstest: %s\n", what);
+	unlink(TEST_FILE);
+	return 1;
+}
+static int read_back(int fd, size_t offset, size_t len)
+{
+	if(lseek(fd, offset, SEEK_SET) != offset)
+		return -1;
+	if(read(fd, rbuf, len) != (int) len)
+		return -1;
+	return 0;
+}
+int main(int argc, char **argv)
+{
+	for(size_t i = 0; i < TEST_SIZE; i++)
+		wbuf[i] = (char)(i * 7 + 3);
+	int fd = open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC);
+	if(fd < 0)
+		return fail("couldn't create " TEST_FILE);
+	/* Two writes, the second one starts in the middle of a page and grows the file */
+	if(write(fd, wbuf, 1000) != 1000 || write(fd, wbuf + 1000, TEST_SIZE - 1000) != TEST_SIZE - 1000)
+		return fail("short write");
+	if(lseek(fd, 0, SEEK_END) != TEST_SIZE)
+		return fail("wrong size after writing");
+	if(read_back(fd, 0, TEST_SIZE) < 0 || memcmp(rbuf, wbuf, TEST_SIZE))
+		return fail("data read back doesn't match what was written");
+	/* Writing past the end leaves a hole, which reads as zeroes */
+	if(lseek(fd, TEST_SIZE + HOLE_SIZE, SEEK_SET) != TEST_SIZE + HOLE_SIZE || write(fd, wbuf, 10) != 10)
+		return fail("write past the end failed");
+	if(read_back(fd, TEST_SIZE, HOLE_SIZE + 10) < 0)
+		return fail("couldn't read the hole back");
+	for(size_t i = 0; i < HOLE_SIZE; i++)
+	{
+		if(rbuf[i])
+			return fail("hole doesn't read as zeroes");
+	}
+	if(memcmp(rbuf + HOLE_SIZE, wbuf, 10))
+		return fail("data after the hole doesn't match");
+	/* O_APPEND writes land at the end, wherever the offset was */
+	int afd = open(TEST_FILE, O_WRONLY | O_APPEND);
+	if(afd < 0)
+		return fail("couldn't reopen " TEST_FILE);
+	if(write(afd, "tail", 4) != 4)
+		return fail("append failed");
+	if(read_back(fd, TEST_SIZE + HOLE_SIZE + 10, 4) < 0 || memcmp(rbuf, "tail", 4))
+		return fail("appended data doesn't match");
+	unlink(TEST_FILE);
+	printf("tmpfstest: all tests passed\n");
+	return 0;
+}